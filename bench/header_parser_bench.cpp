@@ -0,0 +1,701 @@
+/**
+ * Benchmark suite that tracks the throughput of the parser across releases. Microbenchmarks measure the BitReader
+ * primitives (readNBits(), readUnsignedInt32() at every bit offset, the Exp-Golomb decoders) and the SPS, PPS and slice
+ * header parsers over payloads that were recorded from a High profile stream. The slice headers are parsed for all
+ * syntax elements, for the header size and for the slice type only. The syntax elements of the recorded slice headers
+ * are also read once with BitReader and once with the per-bit reader of the releases before it, which gives the
+ * speedup of BitReader on the slice header path. End-to-end runs parse synthetic fragmented MP4
+ * files of several sizes, and optionally real videos, with several thread counts and report MB/s, NAL units/s and the
+ * peak RSS. Every end-to-end run happens in a child process, so the peak RSS belongs to that run alone.
+ *
+ * The results are printed and written to a JSON file.
+ *
+ * usage: header_parser_bench [--json <file>] [--label <label>] [--sizes <MB,...>] [--threads <n,...>]
+ *                            [--video <file>]... [--dir <dir>] [--keep] [--no-micro] [--no-e2e]
+ */
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include "BitReader.h"
+#include "BitWriter.h"
+#include "header_parse.h"
+#include "helper_functions.h"
+
+using std::cout;
+using std::cerr;
+
+/// Minimum duration of a measurement. The number of iterations is doubled until it is reached.
+static const double MIN_MEASURE_MS = 100;
+/// Number of measurements per benchmark, the fastest one is reported.
+static const uint32_t NUM_RUNS = 3;
+/// Size of the random data for the bit reader benchmarks.
+static const size_t BIT_DATA_SIZE = 1 << 20;
+/// Number of slices per fragment of the synthetic files, i.e., the GOP length.
+static const uint32_t SLICES_PER_FRAGMENT = 24;
+/// Size of every slice NAL unit of the synthetic files, including the length prefix.
+static const size_t SLICE_SIZE = 4096;
+
+// Payloads recorded from a High profile stream (1280x720, CABAC, B-frames): the SPS, the PPS and the beginning of an
+// IDR, a P and a B slice, each including the NAL unit header.
+static const uint8_t SPS_NAL[] = {0x67, 0x64, 0x00, 0x28, 0xAC, 0xD9, 0x00, 0x50, 0x05, 0xB9};
+static const uint8_t PPS_NAL[] = {0x68, 0xEB, 0xDF, 0x20};
+static const uint8_t IDR_SLICE_NAL[] = {0x65, 0x88, 0x84, 0x00, 0x6D, 0x38, 0xD8, 0xCD, 0xC3, 0x10, 0x41, 0x1E, 0x7E,
+                                        0xC2, 0x73, 0x78, 0xA6, 0x61, 0xC9, 0x35, 0x18, 0x7C, 0x07, 0xE4};
+static const uint8_t P_SLICE_NAL[] = {0x41, 0x9A, 0x63, 0x06, 0x34, 0x13, 0x04, 0xA2, 0x45, 0x04, 0x89, 0x20, 0x5E,
+                                      0x28, 0xE1, 0x01, 0x90, 0xE1, 0x67, 0x16, 0x59, 0x0F, 0xA7, 0x16};
+static const uint8_t B_SLICE_NAL[] = {0x01, 0x9E, 0x21, 0x41, 0x8D, 0x0C, 0x04, 0xE1, 0x01, 0x88, 0x6C, 0x11, 0x02,
+                                      0x78, 0xC3, 0x98, 0x4C, 0x50, 0xD8, 0xD2, 0xA5, 0x31, 0x48, 0xF4};
+
+/**
+ * Coding of a syntax element.
+ */
+enum ElementCoding {
+  /// Fixed number of bits, u(n).
+  CODING_BITS,
+  /// ue(v)
+  CODING_UE,
+  /// se(v)
+  CODING_SE
+};
+
+/**
+ * Syntax element of a recorded slice header.
+ */
+typedef struct {
+  ElementCoding coding;
+  /// Number of bits for CODING_BITS.
+  uint8_t bits;
+  const char *name;
+} SyntaxElement;
+
+// The syntax elements of the recorded slice headers in the order in which parseSliceHeader() reads them. The B slice
+// was recorded without the end of its header, so its last element, slice_beta_offset_div2, is missing.
+static const SyntaxElement IDR_SLICE_ELEMENTS[] = {
+    {CODING_UE, 0, "first_mb_in_slice"}, {CODING_UE, 0, "slice_type"}, {CODING_UE, 0, "pic_parameter_set_id"},
+    {CODING_BITS, 4, "frame_num"}, {CODING_UE, 0, "idr_pic_id"}, {CODING_BITS, 6, "pic_order_cnt_lsb"},
+    {CODING_BITS, 1, "no_output_of_prior_pics_flag"}, {CODING_BITS, 1, "long_term_reference_flag"},
+    {CODING_SE, 0, "slice_qp_delta"}, {CODING_UE, 0, "disable_deblocking_filter_idc"},
+    {CODING_SE, 0, "slice_alpha_c0_offset_div2"}, {CODING_SE, 0, "slice_beta_offset_div2"}};
+static const SyntaxElement P_SLICE_ELEMENTS[] = {
+    {CODING_UE, 0, "first_mb_in_slice"}, {CODING_UE, 0, "slice_type"}, {CODING_UE, 0, "pic_parameter_set_id"},
+    {CODING_BITS, 4, "frame_num"}, {CODING_BITS, 6, "pic_order_cnt_lsb"},
+    {CODING_BITS, 1, "num_ref_idx_active_override_flag"}, {CODING_BITS, 1, "ref_pic_list_modification_flag_l0"},
+    {CODING_UE, 0, "luma_log2_weight_denom"}, {CODING_UE, 0, "chroma_log2_weight_denom"},
+    {CODING_BITS, 1, "luma_weight_l0_flag"}, {CODING_SE, 0, "luma_weight_l0"}, {CODING_SE, 0, "luma_offset_l0"},
+    {CODING_BITS, 1, "chroma_weight_l0_flag"}, {CODING_SE, 0, "chroma_weight_l0"}, {CODING_SE, 0, "chroma_offset_l0"},
+    {CODING_SE, 0, "chroma_weight_l0"}, {CODING_SE, 0, "chroma_offset_l0"},
+    {CODING_BITS, 1, "luma_weight_l0_flag"}, {CODING_SE, 0, "luma_weight_l0"}, {CODING_SE, 0, "luma_offset_l0"},
+    {CODING_BITS, 1, "chroma_weight_l0_flag"}, {CODING_SE, 0, "chroma_weight_l0"}, {CODING_SE, 0, "chroma_offset_l0"},
+    {CODING_SE, 0, "chroma_weight_l0"}, {CODING_SE, 0, "chroma_offset_l0"},
+    {CODING_BITS, 1, "luma_weight_l0_flag"}, {CODING_SE, 0, "luma_weight_l0"}, {CODING_SE, 0, "luma_offset_l0"},
+    {CODING_BITS, 1, "chroma_weight_l0_flag"}, {CODING_SE, 0, "chroma_weight_l0"}, {CODING_SE, 0, "chroma_offset_l0"},
+    {CODING_SE, 0, "chroma_weight_l0"}, {CODING_SE, 0, "chroma_offset_l0"},
+    {CODING_BITS, 1, "adaptive_ref_pic_marking_mode_flag"}, {CODING_UE, 0, "cabac_init_idc"},
+    {CODING_SE, 0, "slice_qp_delta"}, {CODING_UE, 0, "disable_deblocking_filter_idc"},
+    {CODING_SE, 0, "slice_alpha_c0_offset_div2"}, {CODING_SE, 0, "slice_beta_offset_div2"}};
+static const SyntaxElement B_SLICE_ELEMENTS[] = {
+    {CODING_UE, 0, "first_mb_in_slice"}, {CODING_UE, 0, "slice_type"}, {CODING_UE, 0, "pic_parameter_set_id"},
+    {CODING_BITS, 4, "frame_num"}, {CODING_BITS, 6, "pic_order_cnt_lsb"},
+    {CODING_BITS, 1, "direct_spatial_mv_pred_flag"}, {CODING_BITS, 1, "num_ref_idx_active_override_flag"},
+    {CODING_BITS, 1, "ref_pic_list_modification_flag_l0"}, {CODING_BITS, 1, "ref_pic_list_modification_flag_l1"},
+    {CODING_UE, 0, "luma_log2_weight_denom"}, {CODING_UE, 0, "chroma_log2_weight_denom"},
+    {CODING_BITS, 1, "luma_weight_l0_flag"}, {CODING_SE, 0, "luma_weight_l0"}, {CODING_SE, 0, "luma_offset_l0"},
+    {CODING_BITS, 1, "chroma_weight_l0_flag"}, {CODING_SE, 0, "chroma_weight_l0"}, {CODING_SE, 0, "chroma_offset_l0"},
+    {CODING_SE, 0, "chroma_weight_l0"}, {CODING_SE, 0, "chroma_offset_l0"},
+    {CODING_BITS, 1, "luma_weight_l0_flag"}, {CODING_SE, 0, "luma_weight_l0"}, {CODING_SE, 0, "luma_offset_l0"},
+    {CODING_BITS, 1, "chroma_weight_l0_flag"}, {CODING_SE, 0, "chroma_weight_l0"}, {CODING_SE, 0, "chroma_offset_l0"},
+    {CODING_SE, 0, "chroma_weight_l0"}, {CODING_SE, 0, "chroma_offset_l0"},
+    {CODING_BITS, 1, "luma_weight_l0_flag"}, {CODING_SE, 0, "luma_weight_l0"}, {CODING_SE, 0, "luma_offset_l0"},
+    {CODING_BITS, 1, "chroma_weight_l0_flag"}, {CODING_SE, 0, "chroma_weight_l0"}, {CODING_SE, 0, "chroma_offset_l0"},
+    {CODING_SE, 0, "chroma_weight_l0"}, {CODING_SE, 0, "chroma_offset_l0"},
+    {CODING_BITS, 1, "luma_weight_l1_flag"}, {CODING_SE, 0, "luma_weight_l1"}, {CODING_SE, 0, "luma_offset_l1"},
+    {CODING_BITS, 1, "chroma_weight_l1_flag"}, {CODING_UE, 0, "cabac_init_idc"}, {CODING_SE, 0, "slice_qp_delta"},
+    {CODING_UE, 0, "disable_deblocking_filter_idc"}, {CODING_SE, 0, "slice_alpha_c0_offset_div2"}};
+
+/**
+ * Result of a microbenchmark.
+ */
+typedef struct {
+  std::string name;
+  double ns_per_op;
+} MicroResult;
+
+/**
+ * Result of an end-to-end run.
+ */
+typedef struct {
+  std::string file;
+  size_t file_size;
+  uint32_t num_threads;
+  size_t nal_units;
+  double best_ms;
+  double mb_per_s;
+  double nal_units_per_s;
+  long peak_rss_kb;
+} EndToEndResult;
+
+/// Keeps the compiler from removing the benchmarked code.
+static volatile uint64_t sink;
+
+/**
+ * Measures a benchmark body.
+ * @param body Function that is called repeatedly and returns the number of operations it performed.
+ * @return Nanoseconds per operation of the fastest measurement.
+ */
+template<class Body>
+static double measure(Body body) {
+  double best_ns_per_op = 0;
+  for (uint32_t run = 0; run < NUM_RUNS; run++) {
+    uint64_t iterations = 1;
+    while (true) {
+      uint64_t ops = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (uint64_t i = 0; i < iterations; i++) {
+        ops += body();
+      }
+      std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      if (elapsed.count() >= MIN_MEASURE_MS * 1e6) {
+        double ns_per_op = elapsed.count() / ops;
+        best_ns_per_op = run == 0 ? ns_per_op : std::min(best_ns_per_op, ns_per_op);
+        break;
+      }
+      iterations *= 2;
+    }
+  }
+  return best_ns_per_op;
+}
+
+/*
+ * The bit reader of the releases before BitReader, kept as the baseline of the slice header path. Every read loops over
+ * single bits and writes the position back through references, and the syntax element names are passed as
+ * std::string. The functions are not inlined, like the originals, which lived in another translation unit.
+ */
+__attribute__((noinline)) static uint8_t perBitReadBit(const uint8_t *addr, size_t &offset, uint8_t &bit_offset) {
+  uint8_t ret = (addr[offset] >> (7 - bit_offset)) & 0x01;
+  bit_offset++;
+  if (bit_offset == 8) {
+    bit_offset = 0;
+    offset++;
+  }
+  return ret;
+}
+
+__attribute__((noinline)) static uint32_t perBitReadNBits(const uint8_t *addr,
+                                                          size_t &offset,
+                                                          uint8_t &bit_offset,
+                                                          uint32_t n,
+                                                          const std::string &message) {
+  uint32_t ret = 0;
+  for (int32_t i = n; i > 0; i--) {
+    ret += perBitReadBit(addr, offset, bit_offset) << (i - 1);
+  }
+  return ret;
+}
+
+__attribute__((noinline)) static uint32_t perBitDecodeUnsignedExpGolomb(const uint8_t *addr,
+                                                                        size_t &offset,
+                                                                        uint8_t &bit_offset,
+                                                                        const std::string &message) {
+  uint32_t leading_zero_bits = 0;
+  while (!perBitReadBit(addr, offset, bit_offset)) {
+    leading_zero_bits++;
+  }
+  uint32_t code_num = 0;
+  for (int32_t i = leading_zero_bits; i > 0; i--) {
+    code_num += perBitReadBit(addr, offset, bit_offset) << (i - 1);
+  }
+  return code_num + ((1 << leading_zero_bits) - 1);
+}
+
+__attribute__((noinline)) static int32_t perBitDecodeSignedExpGolomb(const uint8_t *addr,
+                                                                     size_t &offset,
+                                                                     uint8_t &bit_offset,
+                                                                     const std::string &message) {
+  uint32_t code_num = perBitDecodeUnsignedExpGolomb(addr, offset, bit_offset, message);
+  auto syntax_element_value = static_cast<int32_t>(ceil(static_cast<double>(code_num) / 2.0));
+  if (code_num % 2 == 0) {
+    syntax_element_value *= -1;
+  }
+  return syntax_element_value;
+}
+
+/**
+ * Reads the syntax elements of a recorded slice header with BitReader and with the per-bit reader.
+ * @param name Name of the slice type.
+ * @param nal Slice NAL unit, starting with the NAL unit header.
+ * @param size Size of the NAL unit.
+ * @param elements Syntax elements of the slice header.
+ * @param count Number of syntax elements.
+ */
+static void runSliceHeaderReadBenchmarks(std::vector<MicroResult> &results,
+                                         const char *name,
+                                         const uint8_t *nal,
+                                         size_t size,
+                                         const SyntaxElement *elements,
+                                         size_t count) {
+  const uint64_t headers = 1024;
+  double bit_reader_ns = measure([&]() {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < headers; i++) {
+      BitReader reader(nal, 1, size, true);
+      for (size_t j = 0; j < count; j++) {
+        const SyntaxElement &element = elements[j];
+        if (element.coding == CODING_BITS) {
+          sum += reader.readNBits(element.bits, element.name);
+        } else if (element.coding == CODING_UE) {
+          sum += reader.decodeUnsignedExpGolomb(element.name);
+        } else {
+          sum += reader.decodeSignedExpGolomb(element.name);
+        }
+      }
+    }
+    sink = sink + sum;
+    return headers;
+  });
+  double per_bit_ns = measure([&]() {
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < headers; i++) {
+      size_t offset = 1;
+      uint8_t bit_offset = 0;
+      for (size_t j = 0; j < count; j++) {
+        const SyntaxElement &element = elements[j];
+        if (element.coding == CODING_BITS) {
+          sum += perBitReadNBits(nal, offset, bit_offset, element.bits, element.name);
+        } else if (element.coding == CODING_UE) {
+          sum += perBitDecodeUnsignedExpGolomb(nal, offset, bit_offset, element.name);
+        } else {
+          sum += perBitDecodeSignedExpGolomb(nal, offset, bit_offset, element.name);
+        }
+      }
+    }
+    sink = sink + sum;
+    return headers;
+  });
+  results.push_back({std::string("sliceHeaderReads(") + name + ")", bit_reader_ns});
+  results.push_back({std::string("sliceHeaderReads(") + name + ", per bit)", per_bit_ns});
+  cout << "BitReader speedup on the " << name << " slice header reads: " << per_bit_ns / bit_reader_ns << "x\n";
+}
+
+static void runBitReaderBenchmarks(std::vector<MicroResult> &results) {
+  std::mt19937 random(1);
+  std::vector<uint8_t> data(BIT_DATA_SIZE);
+  for (auto &byte : data) {
+    byte = static_cast<uint8_t>(random());
+  }
+  for (uint32_t n : {1, 3, 8, 13, 24, 32}) {
+    uint64_t reads = BIT_DATA_SIZE * 8 / n - 1;
+    double ns = measure([&]() {
+      BitReader reader(data.data(), 0, data.size());
+      uint64_t sum = 0;
+      for (uint64_t i = 0; i < reads; i++) {
+        sum += reader.readNBits(n);
+      }
+      sink = sink + sum;
+      return reads;
+    });
+    results.push_back({"readNBits(" + std::to_string(n) + ")", ns});
+  }
+  for (uint32_t bit_offset = 0; bit_offset < 8; bit_offset++) {
+    uint64_t reads = BIT_DATA_SIZE / 4 - 1;
+    double ns = measure([&]() {
+      BitReader reader(data.data(), 0, data.size());
+      reader.skipBits(bit_offset);
+      uint64_t sum = 0;
+      for (uint64_t i = 0; i < reads; i++) {
+        sum += reader.readUnsignedInt32();
+      }
+      sink = sink + sum;
+      return reads;
+    });
+    results.push_back({"readUnsignedInt32@" + std::to_string(bit_offset), ns});
+  }
+
+  // Mostly small values like in slice headers, with a tail of larger ones.
+  std::vector<uint8_t> codes_data;
+  BitWriter writer(codes_data);
+  uint64_t codes = 0;
+  std::geometric_distribution<uint32_t> small_values(0.3);
+  while (codes_data.size() < BIT_DATA_SIZE - 8) {
+    uint32_t value = codes % 16 == 15 ? random() % 100000 : small_values(random);
+    if (codes % 2 == 0) {
+      writer.encodeUnsignedExpGolomb(value);
+    } else {
+      writer.encodeSignedExpGolomb(codes % 4 == 1 ? static_cast<int32_t>(value) : -static_cast<int32_t>(value));
+    }
+    codes++;
+  }
+  writer.writeTrailingBits();
+  double ue_ns = measure([&]() {
+    BitReader reader(codes_data.data(), 0, codes_data.size());
+    uint64_t sum = 0;
+    for (uint64_t i = 0; i < codes; i += 2) {
+      sum += reader.decodeUnsignedExpGolomb();
+      sum += reader.decodeSignedExpGolomb();
+    }
+    sink = sink + sum;
+    return codes;
+  });
+  results.push_back({"decodeExpGolomb(ue+se)", ue_ns});
+  double skip_ns = measure([&]() {
+    BitReader reader(codes_data.data(), 0, codes_data.size());
+    for (uint64_t i = 0; i < codes; i++) {
+      reader.skipExpGolomb();
+    }
+    sink = sink + reader.getOffset();
+    return codes;
+  });
+  results.push_back({"skipExpGolomb", skip_ns});
+}
+
+/**
+ * Measures a NAL unit payload parser.
+ * @param ctx Context with the parameter sets and the NAL unit that the parser expects.
+ * @param nal NAL unit, starting with the NAL unit header.
+ * @param size Size of the NAL unit.
+ * @param parse Parser that is called with a RBSP reader positioned after the NAL unit header.
+ * @param reset Called after each parse to keep the context from growing.
+ */
+template<class Parse, class Reset>
+static double measurePayload(ParserContext &ctx, const uint8_t *nal, size_t size, Parse parse, Reset reset) {
+  const uint64_t parses = 1024;
+  return measure([&]() {
+    for (uint64_t i = 0; i < parses; i++) {
+      BitReader rbsp_reader(nal, 1, size, true);
+      parse(ctx, rbsp_reader);
+      reset(ctx);
+    }
+    return parses;
+  });
+}
+
+static void runPayloadBenchmarks(std::vector<MicroResult> &results) {
+  ParserContext ctx;
+  BitReader sps_reader(SPS_NAL, 1, sizeof(SPS_NAL), true);
+  parseSPS(ctx, sps_reader);
+  BitReader pps_reader(PPS_NAL, 1, sizeof(PPS_NAL), true);
+  parsePPS(ctx, pps_reader);
+  auto noReset = [](ParserContext &) {};
+  results.push_back({"parseSPS", measurePayload(ctx, SPS_NAL, sizeof(SPS_NAL), parseSPS, [](ParserContext &c) {
+    c.spss.pop_back();
+  })});
+  results.push_back({"parsePPS", measurePayload(ctx, PPS_NAL, sizeof(PPS_NAL), parsePPS, [](ParserContext &c) {
+    c.ppss.pop_back();
+  })});
+  struct SlicePayload {
+    const char *name;
+    const uint8_t *nal;
+    size_t size;
+  };
+  const SlicePayload slices[] = {{"I", IDR_SLICE_NAL, sizeof(IDR_SLICE_NAL)},
+                                 {"P", P_SLICE_NAL, sizeof(P_SLICE_NAL)},
+                                 {"B", B_SLICE_NAL, sizeof(B_SLICE_NAL)}};
+  // All syntax elements, only what the header size depends on, and only the slice type, see SliceField.
+  struct Projection {
+    const char *name;
+    uint32_t slice_fields;
+  };
+  const Projection projections[] = {{"", SLICE_FIELDS_ALL},
+                                    {", header size", SLICE_FIELD_TYPE | SLICE_FIELD_HEADER_SIZE},
+                                    {", type", SLICE_FIELD_TYPE}};
+  for (const Projection &projection : projections) {
+    ctx.slice_fields = projection.slice_fields;
+    for (const SlicePayload &slice : slices) {
+      NALUnit nal_unit{};
+      nal_unit.size = slice.size + 4;
+      nal_unit.prefix_size = 4;
+      nal_unit.nal_ref_idc = slice.nal[0] >> 5 & 0x3;
+      nal_unit.nal_unit_type = slice.nal[0] & 0x1f;
+      ctx.nal_units.push_back(nal_unit);
+      results.push_back({std::string("parseSliceHeader(") + slice.name + projection.name + ")",
+                         measurePayload(ctx, slice.nal, slice.size, parseSliceHeader, noReset)});
+    }
+  }
+  runSliceHeaderReadBenchmarks(results, "I", IDR_SLICE_NAL, sizeof(IDR_SLICE_NAL), IDR_SLICE_ELEMENTS,
+                               sizeof(IDR_SLICE_ELEMENTS) / sizeof(SyntaxElement));
+  runSliceHeaderReadBenchmarks(results, "P", P_SLICE_NAL, sizeof(P_SLICE_NAL), P_SLICE_ELEMENTS,
+                               sizeof(P_SLICE_ELEMENTS) / sizeof(SyntaxElement));
+  runSliceHeaderReadBenchmarks(results, "B", B_SLICE_NAL, sizeof(B_SLICE_NAL), B_SLICE_ELEMENTS,
+                               sizeof(B_SLICE_ELEMENTS) / sizeof(SyntaxElement));
+}
+
+static void appendUInt32(std::vector<uint8_t> &data, uint32_t value) {
+  for (int32_t shift = 24; shift >= 0; shift -= 8) {
+    data.push_back(static_cast<uint8_t>(value >> shift));
+  }
+}
+
+static void appendBox(std::vector<uint8_t> &data, const char (&name)[5], const std::vector<uint8_t> &payload) {
+  appendUInt32(data, static_cast<uint32_t>(8 + payload.size()));
+  data.insert(data.end(), name, name + 4);
+  data.insert(data.end(), payload.begin(), payload.end());
+}
+
+static void appendNALUnit(std::vector<uint8_t> &data, const uint8_t *nal, size_t nal_size, size_t size) {
+  appendUInt32(data, static_cast<uint32_t>(size - 4));
+  data.insert(data.end(), nal, nal + nal_size);
+  data.resize(data.size() + size - 4 - nal_size, 0xAA);
+}
+
+/**
+ * Writes a fragmented MP4 file of about the given size. Every fragment is a moof box and an mdat box with the
+ * parameter sets, an IDR slice and P and B slices.
+ * @return 0 on success. -1 if the file could not be written.
+ */
+static int32_t writeSyntheticFile(const std::string &path, size_t size) {
+  std::ofstream out(path, std::ofstream::binary | std::ofstream::trunc);
+  if (out.fail()) {
+    cerr << "could not open " << path << ": " << strerror(errno) << "\n";
+    return -1;
+  }
+  std::vector<uint8_t> data;
+  appendBox(data, "ftyp", {'i', 's', 'o', '6', 0, 0, 0, 0});
+  std::vector<uint8_t> mdat_payload;
+  appendNALUnit(mdat_payload, SPS_NAL, sizeof(SPS_NAL), 4 + sizeof(SPS_NAL));
+  appendNALUnit(mdat_payload, PPS_NAL, sizeof(PPS_NAL), 4 + sizeof(PPS_NAL));
+  appendNALUnit(mdat_payload, IDR_SLICE_NAL, sizeof(IDR_SLICE_NAL), SLICE_SIZE);
+  for (uint32_t i = 1; i < SLICES_PER_FRAGMENT; i++) {
+    if (i % 3 == 1) {
+      appendNALUnit(mdat_payload, P_SLICE_NAL, sizeof(P_SLICE_NAL), SLICE_SIZE);
+    } else {
+      appendNALUnit(mdat_payload, B_SLICE_NAL, sizeof(B_SLICE_NAL), SLICE_SIZE);
+    }
+  }
+  std::vector<uint8_t> fragment;
+  appendBox(fragment, "moof", {});
+  appendBox(fragment, "mdat", mdat_payload);
+  size_t written = data.size();
+  out.write(reinterpret_cast<const char *>(data.data()), data.size());
+  while (written < size && out.good()) {
+    out.write(reinterpret_cast<const char *>(fragment.data()), fragment.size());
+    written += fragment.size();
+  }
+  out.close();
+  if (out.fail()) {
+    cerr << "could not write " << path << ": " << strerror(errno) << "\n";
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Parses a video in a child process.
+ * @param path Path to the video.
+ * @param num_threads Number of threads for parseVideo().
+ * @param elapsed_ms Receives the parse time.
+ * @param nal_units Receives the number of NAL units.
+ * @param peak_rss_kb Receives the peak RSS of the child.
+ * @return 0 on success. -1 if the child failed.
+ */
+static int32_t runChild(const std::string &path,
+                        uint32_t num_threads,
+                        double &elapsed_ms,
+                        size_t &nal_units,
+                        long &peak_rss_kb) {
+  int32_t fds[2];
+  if (pipe(fds) < 0) {
+    cerr << "pipe: " << strerror(errno) << "\n";
+    return -1;
+  }
+  pid_t pid = fork();
+  if (pid < 0) {
+    cerr << "fork: " << strerror(errno) << "\n";
+    close(fds[0]);
+    close(fds[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    close(fds[0]);
+    ParserContext ctx;
+    auto start = std::chrono::steady_clock::now();
+    int32_t res = parseVideo(ctx, path, INPUT_MAP, num_threads);
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    double result[2] = {elapsed.count(), static_cast<double>(ctx.nal_units.size())};
+    bool write_ok = write(fds[1], result, sizeof(result)) == sizeof(result);
+    _exit(res == 0 && write_ok ? 0 : 1);
+  }
+  close(fds[1]);
+  double result[2];
+  bool read_ok = read(fds[0], result, sizeof(result)) == sizeof(result);
+  close(fds[0]);
+  int32_t status;
+  struct rusage usage{};
+  if (wait4(pid, &status, 0, &usage) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0 || !read_ok) {
+    cerr << "parsing " << path << " failed\n";
+    return -1;
+  }
+  elapsed_ms = result[0];
+  nal_units = static_cast<size_t>(result[1]);
+  peak_rss_kb = usage.ru_maxrss;
+  return 0;
+}
+
+static int32_t runEndToEnd(const std::string &path,
+                           const std::vector<uint32_t> &thread_counts,
+                           std::vector<EndToEndResult> &results) {
+  struct stat st{};
+  if (stat(path.c_str(), &st) < 0) {
+    cerr << "could not stat " << path << ": " << strerror(errno) << "\n";
+    return -1;
+  }
+  for (uint32_t num_threads : thread_counts) {
+    EndToEndResult result{path, static_cast<size_t>(st.st_size), num_threads, 0, 0, 0, 0, 0};
+    for (uint32_t run = 0; run < NUM_RUNS; run++) {
+      double elapsed_ms;
+      long peak_rss_kb;
+      if (runChild(path, num_threads, elapsed_ms, result.nal_units, peak_rss_kb) < 0) {
+        return -1;
+      }
+      result.best_ms = run == 0 ? elapsed_ms : std::min(result.best_ms, elapsed_ms);
+      result.peak_rss_kb = std::max(result.peak_rss_kb, peak_rss_kb);
+    }
+    result.mb_per_s = static_cast<double>(result.file_size) / (1 << 20) / (result.best_ms / 1000);
+    result.nal_units_per_s = result.nal_units / (result.best_ms / 1000);
+    cout << path << " (" << static_cast<double>(result.file_size) / (1 << 20) << " MB, " << num_threads
+         << " threads): " << result.best_ms << " ms, " << result.mb_per_s << " MB/s, " << result.nal_units_per_s
+         << " NAL units/s, " << result.peak_rss_kb << " KB peak RSS\n";
+    results.push_back(result);
+  }
+  return 0;
+}
+
+static std::string jsonString(const std::string &value) {
+  std::string ret = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      ret += '\\';
+    }
+    ret += c;
+  }
+  return ret + "\"";
+}
+
+static int32_t writeJSON(const std::string &path,
+                         const std::string &label,
+                         const std::vector<MicroResult> &micro_results,
+                         const std::vector<EndToEndResult> &end_to_end_results) {
+  std::ofstream out(path, std::ofstream::trunc);
+  if (out.fail()) {
+    cerr << "could not open " << path << ": " << strerror(errno) << "\n";
+    return -1;
+  }
+  out << "{\n  \"label\": " << jsonString(label) << ",\n  \"timestamp\": " << time(nullptr)
+      << ",\n  \"hardware_threads\": " << std::thread::hardware_concurrency() << ",\n  \"micro\": [";
+  for (size_t i = 0; i < micro_results.size(); i++) {
+    out << (i == 0 ? "\n" : ",\n") << "    {\"name\": " << jsonString(micro_results[i].name) << ", \"ns_per_op\": "
+        << micro_results[i].ns_per_op << "}";
+  }
+  out << "\n  ],\n  \"end_to_end\": [";
+  for (size_t i = 0; i < end_to_end_results.size(); i++) {
+    const EndToEndResult &result = end_to_end_results[i];
+    out << (i == 0 ? "\n" : ",\n") << "    {\"file\": " << jsonString(result.file) << ", \"bytes\": "
+        << result.file_size << ", \"threads\": " << result.num_threads << ", \"nal_units\": " << result.nal_units
+        << ", \"ms\": " << result.best_ms << ", \"mb_per_s\": " << result.mb_per_s << ", \"nal_units_per_s\": "
+        << result.nal_units_per_s << ", \"peak_rss_kb\": " << result.peak_rss_kb << "}";
+  }
+  out << "\n  ]\n}\n";
+  out.close();
+  if (out.fail()) {
+    cerr << "could not write " << path << ": " << strerror(errno) << "\n";
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Parses a comma separated list of numbers.
+ */
+static std::vector<uint32_t> parseList(const std::string &value) {
+  std::vector<uint32_t> ret;
+  std::istringstream tokens(value);
+  std::string token;
+  while (std::getline(tokens, token, ',')) {
+    ret.push_back(std::stoul(token));
+  }
+  return ret;
+}
+
+int main(int32_t argc, char **argv) {
+  std::string json_path = "header_parser_bench.json";
+  std::string label;
+  std::string dir = ".";
+  std::vector<uint32_t> sizes_mb{16, 128};
+  std::vector<uint32_t> thread_counts{1};
+  if (std::thread::hardware_concurrency() > 1) {
+    thread_counts.push_back(std::thread::hardware_concurrency());
+  }
+  std::vector<std::string> videos;
+  bool keep = false;
+  bool micro = true;
+  bool end_to_end = true;
+  for (int32_t i = 1; i < argc; i++) {
+    std::string next_arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (next_arg == "--json" && has_value) {
+      json_path = argv[++i];
+    } else if (next_arg == "--label" && has_value) {
+      label = argv[++i];
+    } else if (next_arg == "--sizes" && has_value) {
+      sizes_mb = parseList(argv[++i]);
+    } else if (next_arg == "--threads" && has_value) {
+      thread_counts = parseList(argv[++i]);
+    } else if (next_arg == "--video" && has_value) {
+      videos.emplace_back(argv[++i]);
+    } else if (next_arg == "--dir" && has_value) {
+      dir = argv[++i];
+    } else if (next_arg == "--keep") {
+      keep = true;
+    } else if (next_arg == "--no-micro") {
+      micro = false;
+    } else if (next_arg == "--no-e2e") {
+      end_to_end = false;
+    } else {
+      cerr << "Unknown parameter or missing argument: " << next_arg << "\n";
+      return 1;
+    }
+  }
+
+  std::vector<MicroResult> micro_results;
+  if (micro) {
+    runBitReaderBenchmarks(micro_results);
+    runPayloadBenchmarks(micro_results);
+    for (const MicroResult &result : micro_results) {
+      cout << result.name << ": " << result.ns_per_op << " ns\n";
+    }
+  }
+
+  bool ok = true;
+  std::vector<EndToEndResult> end_to_end_results;
+  if (end_to_end) {
+    for (uint32_t size_mb : sizes_mb) {
+      std::string path = dir + "/header_parser_bench_" + std::to_string(size_mb) + "MB.mp4";
+      if (writeSyntheticFile(path, static_cast<size_t>(size_mb) << 20) < 0) {
+        ok = false;
+        continue;
+      }
+      ok = runEndToEnd(path, thread_counts, end_to_end_results) == 0 && ok;
+      if (!keep) {
+        unlink(path.c_str());
+      }
+    }
+    for (const std::string &video : videos) {
+      ok = runEndToEnd(video, thread_counts, end_to_end_results) == 0 && ok;
+    }
+  }
+  ok = writeJSON(json_path, label, micro_results, end_to_end_results) == 0 && ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,311 @@
+/**
+ * Regression benchmark for videos that are larger than 4 GB. A sparse synthetic MP4 file is written whose boxes and
+ * NAL units lie beyond the 32 bit range: a free box and an mdat box with a 64 bit largesize and a trailing mdat box of
+ * size 0 that extends to the end of the file. The ftyp box in front of them is larger than 255 bytes, so the file
+ * starts with 00 00 01 like an Annex B byte stream. The file is parsed in every input mode, the parsed structure is checked
+ * against the written one and the fastest of a few runs per mode is printed.
+ *
+ * usage: large_file_bench [<file>] [--keep]
+ */
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include "header_parse.h"
+#include "helper_functions.h"
+
+using std::cout;
+using std::cerr;
+
+/// Size of the ftyp box. Between 256 and 511 bytes, so its size field starts with an Annex B start code.
+static const size_t FTYP_SIZE = 300;
+/// Size of the free box in front of the first mdat box. Pushes everything behind it beyond 4 GB.
+static const uint64_t GAP_SIZE = (1ULL << 32) + (1 << 20);
+/// Number of slices in the first mdat box.
+static const uint32_t NUM_SLICES = 1 << 16;
+/// Size of every slice NAL unit, including the length prefix.
+static const size_t SLICE_SIZE = 1024;
+/// Every IDR_PERIOD-th slice is an IDR slice.
+static const uint32_t IDR_PERIOD = 64;
+static const uint32_t NUM_RUNS = 3;
+
+// Baseline profile SPS (320x240, pic_order_cnt_type 2), PPS and the headers of an IDR and a P slice.
+static const uint8_t SPS_NAL[] = {0x67, 0x42, 0x00, 0x1E, 0xDA, 0x05, 0x07, 0xE4};
+static const uint8_t PPS_NAL[] = {0x68, 0xCE, 0x3C, 0x80};
+static const uint8_t IDR_SLICE_HEADER[] = {0x65, 0x88, 0x84, 0xA8};
+static const uint8_t P_SLICE_HEADER[] = {0x41, 0x9A, 0x22, 0xA0};
+
+/**
+ * Location, size and type of a written NAL unit.
+ */
+typedef struct {
+  size_t location;
+  size_t size;
+  uint8_t nal_unit_type;
+} ExpectedNALUnit;
+
+/**
+ * Structure of the written file.
+ */
+typedef struct {
+  std::vector<MP4Box> boxes;
+  std::vector<ExpectedNALUnit> nal_units;
+  size_t file_size;
+} ExpectedFile;
+
+static void appendUInt32(std::vector<uint8_t> &data, uint32_t value) {
+  for (int32_t shift = 24; shift >= 0; shift -= 8) {
+    data.push_back(static_cast<uint8_t>(value >> shift));
+  }
+}
+
+static void appendUInt64(std::vector<uint8_t> &data, uint64_t value) {
+  appendUInt32(data, static_cast<uint32_t>(value >> 32));
+  appendUInt32(data, static_cast<uint32_t>(value));
+}
+
+/**
+ * Appends a box header to the data.
+ * @param data Data of the file from location on.
+ * @param location Offset of the box in the file.
+ * @param size Size of the box.
+ * @param largesize Use a 64 bit largesize.
+ * @param name Name of the box.
+ * @param expected Receives the box.
+ */
+static void appendBoxHeader(std::vector<uint8_t> &data,
+                            size_t location,
+                            uint64_t size,
+                            bool largesize,
+                            const char (&name)[5],
+                            ExpectedFile &expected) {
+  appendUInt32(data, largesize ? 1 : static_cast<uint32_t>(size));
+  data.insert(data.end(), name, name + 4);
+  if (largesize) {
+    appendUInt64(data, size);
+  }
+  MP4Box box{};
+  box.location_relative = location;
+  box.size = size;
+  box.type = fourCC(name);
+  box.header_size = largesize ? 16 : 8;
+  expected.boxes.push_back(box);
+}
+
+/**
+ * Appends a length prefixed NAL unit to the data. The payload behind the header is filled with a constant.
+ * @param data Data of the file from base on.
+ * @param base Offset of data in the file.
+ * @param header NAL unit header and the following headers.
+ * @param header_size Size of header.
+ * @param size Size of the NAL unit, including the length prefix.
+ * @param expected Receives the NAL unit.
+ */
+static void appendNALUnit(std::vector<uint8_t> &data,
+                          size_t base,
+                          const uint8_t *header,
+                          size_t header_size,
+                          size_t size,
+                          ExpectedFile &expected) {
+  expected.nal_units.push_back({base + data.size(), size, static_cast<uint8_t>(header[0] & 0x1f)});
+  appendUInt32(data, static_cast<uint32_t>(size - 4));
+  data.insert(data.end(), header, header + header_size);
+  data.resize(data.size() + size - 4 - header_size, 0xAA);
+}
+
+/**
+ * Appends a SPS, a PPS and num_slices slices to the data.
+ */
+static void appendFrames(std::vector<uint8_t> &data, size_t base, uint32_t num_slices, ExpectedFile &expected) {
+  appendNALUnit(data, base, SPS_NAL, sizeof(SPS_NAL), 4 + sizeof(SPS_NAL), expected);
+  appendNALUnit(data, base, PPS_NAL, sizeof(PPS_NAL), 4 + sizeof(PPS_NAL), expected);
+  for (uint32_t i = 0; i < num_slices; i++) {
+    if (i % IDR_PERIOD == 0) {
+      appendNALUnit(data, base, IDR_SLICE_HEADER, sizeof(IDR_SLICE_HEADER), SLICE_SIZE, expected);
+    } else {
+      appendNALUnit(data, base, P_SLICE_HEADER, sizeof(P_SLICE_HEADER), SLICE_SIZE, expected);
+    }
+  }
+}
+
+static int32_t writeData(int32_t fd, const std::vector<uint8_t> &data, size_t offset) {
+  size_t written = 0;
+  while (written < data.size()) {
+    ssize_t res = pwrite(fd, data.data() + written, data.size() - written, static_cast<off_t>(offset + written));
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+    if (res < 0) {
+      cerr << "pwrite: " << strerror(errno) << "\n";
+      return -1;
+    }
+    written += res;
+  }
+  return 0;
+}
+
+/**
+ * Writes the synthetic file. The contents of the free box are never written, so the file is sparse and needs less than
+ * 100 MB of disk space.
+ * @param path Path of the file.
+ * @param expected Receives the structure of the file.
+ * @return 0 on success. -1 if the file could not be written.
+ */
+static int32_t writeFile(const std::string &path, ExpectedFile &expected) {
+  int32_t fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    cerr << "could not open " << path << ": " << strerror(errno) << "\n";
+    return -1;
+  }
+  std::vector<uint8_t> data;
+  appendBoxHeader(data, 0, FTYP_SIZE, false, "ftyp", expected);
+  const char brands[] = "isom\0\0\0\1isomavc1";
+  data.insert(data.end(), brands, brands + 16);
+  while (data.size() < FTYP_SIZE) {
+    data.insert(data.end(), brands + 8, brands + 12);
+  }
+  appendBoxHeader(data, data.size(), GAP_SIZE, true, "free", expected);
+  int32_t res = writeData(fd, data, 0);
+
+  // mdat with largesize behind the gap.
+  size_t offset = FTYP_SIZE + GAP_SIZE;
+  data.clear();
+  std::vector<uint8_t> payload;
+  appendFrames(payload, offset + 16, NUM_SLICES, expected);
+  appendBoxHeader(data, offset, 16 + payload.size(), true, "mdat", expected);
+  data.insert(data.end(), payload.begin(), payload.end());
+  if (res == 0) {
+    res = writeData(fd, data, offset);
+  }
+
+  // mdat of size 0 at the end of the file.
+  offset += data.size();
+  data.clear();
+  payload.clear();
+  appendFrames(payload, offset + 8, IDR_PERIOD, expected);
+  appendBoxHeader(data, offset, 8 + payload.size(), false, "mdat", expected);
+  // Size 0: the box extends to the end of the file.
+  std::fill(data.begin(), data.begin() + 4, 0);
+  data.insert(data.end(), payload.begin(), payload.end());
+  if (res == 0) {
+    res = writeData(fd, data, offset);
+  }
+  expected.file_size = offset + data.size();
+  close(fd);
+  return res;
+}
+
+/**
+ * Compares the parsed structure with the written one.
+ * @return true if all boxes, NAL units and slices were found.
+ */
+static bool checkContext(const ParserContext &ctx, const ExpectedFile &expected, const std::string &mode) {
+  if (ctx.mp4_boxes.size() != expected.boxes.size()) {
+    cerr << mode << ": " << ctx.mp4_boxes.size() << " MP4 boxes instead of " << expected.boxes.size() << "\n";
+    return false;
+  }
+  for (size_t i = 0; i < expected.boxes.size(); i++) {
+    const MP4Box &box = ctx.mp4_boxes[i];
+    const MP4Box &expected_box = expected.boxes[i];
+    if (box.location_relative != expected_box.location_relative || box.size != expected_box.size
+        || box.type != expected_box.type || box.header_size != expected_box.header_size) {
+      cerr << mode << ": box " << getNameString(box.type) << " at " << box.location_relative << " with size "
+           << box.size << " instead of " << getNameString(expected_box.type) << " at " << expected_box.location_relative << " with size "
+           << expected_box.size << "\n";
+      return false;
+    }
+  }
+  if (ctx.nal_units.size() != expected.nal_units.size()) {
+    cerr << mode << ": " << ctx.nal_units.size() << " NAL units instead of " << expected.nal_units.size() << "\n";
+    return false;
+  }
+  size_t num_slices = 0;
+  for (size_t i = 0; i < expected.nal_units.size(); i++) {
+    const NALUnit &nal_unit = ctx.nal_units[i];
+    const ExpectedNALUnit &expected_nal_unit = expected.nal_units[i];
+    if (nal_unit.location_relative != expected_nal_unit.location || nal_unit.size != expected_nal_unit.size
+        || nal_unit.nal_unit_type != expected_nal_unit.nal_unit_type) {
+      cerr << mode << ": NAL unit " << +nal_unit.nal_unit_type << " at " << nal_unit.location_relative
+           << " with size " << nal_unit.size << " instead of " << +expected_nal_unit.nal_unit_type << " at "
+           << expected_nal_unit.location << " with size " << expected_nal_unit.size << "\n";
+      return false;
+    }
+    if (nal_unit.nal_unit_type == 1 || nal_unit.nal_unit_type == 5) {
+      char slice_type = nal_unit.nal_unit_type == 5 ? 'I' : 'P';
+      if (nal_unit.slice_type != slice_type) {
+        cerr << mode << ": slice at " << nal_unit.location_relative << " has type " << nal_unit.slice_type << "\n";
+        return false;
+      }
+      num_slices++;
+    }
+  }
+  size_t num_slice_headers = ctx.keep_slice_headers ? num_slices : 0;
+  if (ctx.slices.size() != num_slice_headers) {
+    cerr << mode << ": " << ctx.slices.size() << " slice headers instead of " << num_slice_headers << "\n";
+    return false;
+  }
+  return true;
+}
+
+int main(int32_t argc, char **argv) {
+  std::string path = "large_file_bench.mp4";
+  bool keep = false;
+  for (int32_t i = 1; i < argc; i++) {
+    std::string next_arg = argv[i];
+    if (next_arg == "--keep") {
+      keep = true;
+    } else {
+      path = next_arg;
+    }
+  }
+  ExpectedFile expected;
+  if (writeFile(path, expected) < 0) {
+    unlink(path.c_str());
+    return 1;
+  }
+  cout << path << ": " << expected.file_size << " bytes, " << expected.boxes.size() << " MP4 boxes, "
+       << expected.nal_units.size() << " NAL units\n";
+
+  struct Mode {
+    const char *name;
+    InputMode input_mode;
+    uint32_t num_threads;
+    bool keep_slice_headers;
+  };
+  const Mode modes[] = {{"map", INPUT_MAP, 1, false}, {"map+headers", INPUT_MAP, 1, true},
+                        {"fragments", INPUT_MAP, 4, false}, {"stream", INPUT_STREAM, 1, false},
+                        {"sparse", INPUT_SPARSE, 1, false}};
+  bool ok = true;
+  for (const Mode &mode : modes) {
+    double best_ms = 0;
+    size_t memory_usage = 0;
+    bool mode_ok = true;
+    for (uint32_t run = 0; run < NUM_RUNS && mode_ok; run++) {
+      ParserContext ctx;
+      ctx.keep_slice_headers = mode.keep_slice_headers;
+      auto start = std::chrono::steady_clock::now();
+      int32_t res = parseVideo(ctx, path, mode.input_mode, mode.num_threads);
+      std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+      mode_ok = res == 0 && checkContext(ctx, expected, mode.name);
+      best_ms = run == 0 ? elapsed.count() : std::min(best_ms, elapsed.count());
+      memory_usage = ctx.nal_units.getMemoryUsage() + ctx.slices.capacity() * sizeof(SliceHeader *)
+          + ctx.arena.getBytesReserved();
+    }
+    if (mode_ok) {
+      cout << mode.name << ": " << best_ms << " ms, " << memory_usage / expected.nal_units.size()
+           << " bytes per NAL unit\n";
+    } else {
+      cout << mode.name << ": FAILED\n";
+    }
+    ok = ok && mode_ok;
+  }
+  if (!keep) {
+    unlink(path.c_str());
+  }
+  return ok ? 0 : 1;
+}
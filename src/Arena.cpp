@@ -0,0 +1,39 @@
+#include "Arena.h"
+#include <algorithm>
+#include <iterator>
+
+void Arena::reset() {
+  if (blocks.empty()) {
+    return;
+  }
+  // Keep the first block. A reset arena that gets the same allocations again fits into it if it is large enough.
+  blocks.erase(blocks.begin() + 1, blocks.end());
+  capacity = blocks[0].capacity;
+  bytes_reserved = capacity;
+  used = 0;
+}
+
+void Arena::adopt(Arena &other) {
+  if (other.blocks.empty()) {
+    return;
+  }
+  // The last block of the other arena becomes the current block, so its free space is used first.
+  blocks.reserve(blocks.size() + other.blocks.size());
+  std::move(other.blocks.begin(), other.blocks.end(), std::back_inserter(blocks));
+  capacity = other.capacity;
+  used = other.used;
+  bytes_reserved += other.bytes_reserved;
+  other.blocks.clear();
+  other.capacity = 0;
+  other.used = 0;
+  other.bytes_reserved = 0;
+}
+
+void *Arena::allocateSlow(size_t size) {
+  size_t new_capacity = std::max(size, block_size);
+  blocks.push_back({std::unique_ptr<uint8_t[]>(new uint8_t[new_capacity]), new_capacity});
+  capacity = new_capacity;
+  used = size;
+  bytes_reserved += new_capacity;
+  return blocks.back().data.get();
+}
@@ -0,0 +1,120 @@
+#ifndef HEADER_PARSER_SRC_ARENA_H_
+#define HEADER_PARSER_SRC_ARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <vector>
+
+/**
+ * Bump allocator for structures that live as long as the parsed video, e.g., the retained slice headers. Memory is
+ * taken from large blocks and only released as a whole when the arena is destroyed or reset, so a single allocation is
+ * a pointer increment and there is no per-allocation overhead. Destructors of objects in the arena are never called,
+ * so they must not own memory outside of it.
+ *
+ * An arena is not thread-safe. Every ParserContext has its own.
+ */
+class Arena {
+ public:
+  /**
+   * @param block_size_ Size of the blocks that are requested from the heap. Larger allocations get their own block.
+   */
+  explicit Arena(size_t block_size_ = 1 << 16) : block_size(block_size_) {}
+  Arena(const Arena &) = delete;
+  Arena &operator=(const Arena &) = delete;
+  Arena(Arena &&) = default;
+  Arena &operator=(Arena &&) = default;
+
+  /**
+   * Allocates uninitialized memory.
+   * @param size Number of bytes.
+   * @param alignment Alignment of the memory, a power of two of at most alignof(std::max_align_t).
+   * @return Pointer to the memory. Valid until the arena is destroyed or reset.
+   */
+  void *allocate(size_t size, size_t alignment) {
+    size_t offset = (used + alignment - 1) & ~(alignment - 1);
+    if (blocks.empty() || offset + size > capacity) {
+      return allocateSlow(size);
+    }
+    used = offset + size;
+    return blocks.back().data.get() + offset;
+  }
+  /**
+   * Constructs a value-initialized object in the arena.
+   * @return Pointer to the object.
+   */
+  template<class T>
+  T *create() {
+    return new(allocate(sizeof(T), alignof(T))) T();
+  }
+  /**
+   * Drops all allocations but keeps the first block, so an arena that is reset after every use stops allocating.
+   */
+  void reset();
+  /**
+   * Moves the blocks of another arena into this one. Pointers into the other arena stay valid.
+   * @param other Arena that is empty afterwards.
+   */
+  void adopt(Arena &other);
+  /// Number of bytes that were requested from the heap.
+  size_t getBytesReserved() const { return bytes_reserved; }
+ private:
+  struct Block {
+    std::unique_ptr<uint8_t[]> data;
+    size_t capacity;
+  };
+  /// Starts a new block that fits at least size bytes and allocates from it.
+  void *allocateSlow(size_t size);
+  size_t block_size;
+  std::vector<Block> blocks;
+  /// Capacity of the last block.
+  size_t capacity = 0;
+  /// Bytes used in the last block.
+  size_t used = 0;
+  size_t bytes_reserved = 0;
+};
+
+/**
+ * Allocator for standard containers that takes its memory from an Arena. Without an arena, i.e., default constructed,
+ * it falls back to the heap. Deallocation is a no-op for arena memory.
+ */
+template<class T>
+class ArenaAllocator {
+ public:
+  typedef T value_type;
+  typedef std::true_type propagate_on_container_move_assignment;
+  typedef std::true_type propagate_on_container_copy_assignment;
+  typedef std::true_type propagate_on_container_swap;
+
+  ArenaAllocator() = default;
+  explicit ArenaAllocator(Arena *arena_) : arena(arena_) {}
+  template<class U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.getArena()) {}
+
+  T *allocate(size_t n) {
+    if (arena == nullptr) {
+      return static_cast<T *>(::operator new(n * sizeof(T)));
+    }
+    return static_cast<T *>(arena->allocate(n * sizeof(T), alignof(T)));
+  }
+  void deallocate(T *p, size_t) {
+    if (arena == nullptr) {
+      ::operator delete(p);
+    }
+  }
+  Arena *getArena() const { return arena; }
+ private:
+  Arena *arena = nullptr;
+};
+
+template<class T, class U>
+bool operator==(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.getArena() == b.getArena(); }
+template<class T, class U>
+bool operator!=(const ArenaAllocator<T> &a, const ArenaAllocator<U> &b) { return a.getArena() != b.getArena(); }
+
+/// Vector whose elements live in an Arena.
+template<class T>
+using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+
+#endif //HEADER_PARSER_SRC_ARENA_H_
@@ -0,0 +1,225 @@
+#ifndef HEADER_PARSER_SRC_BINARYINDEX_H_
+#define HEADER_PARSER_SRC_BINARYINDEX_H_
+
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/**
+ * Binary index of a parsed video, written with --index. The file is meant to be mapped and used in place: it starts
+ * with an IndexHeader, followed by the tables of MP4 boxes, segments, frames and NAL units. Each table is an array of
+ * fixed-size little-endian records at an 8 byte aligned offset from the header. The frames of a segment are
+ * contiguous, so the frames for segment N are found with two lookups and without parsing.
+ *
+ * Segments start at the sidx boxes of the video like the --info output: the first segment starts at 0, every further
+ * segment at the second, third, ... sidx box. Without sidx boxes, the whole video is a single segment. Frames are the
+ * I, P and B slices in file order, with their weights if --weights was given.
+ *
+ * This header contains the format and a reader without further dependencies, so consumers only need this file.
+ */
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "The binary index is little-endian and is used in place, which requires a little-endian host."
+#endif
+
+/// "HPIX" in file order.
+static const char INDEX_MAGIC[4] = {'H', 'P', 'I', 'X'};
+/// Incremented on every incompatible change of the layout.
+static const uint16_t INDEX_VERSION = 1;
+/// Set if the frames carry weights.
+static const uint16_t INDEX_FLAG_WEIGHTS = 1 << 0;
+/// Set if the segments were found with sidx boxes.
+static const uint16_t INDEX_FLAG_SIDX_SEGMENTS = 1 << 1;
+
+struct IndexHeader {
+  char magic[4];
+  uint16_t version;
+  uint16_t flags;
+  /// Size of the video file.
+  uint64_t video_size;
+  uint64_t box_count;
+  uint64_t segment_count;
+  uint64_t frame_count;
+  uint64_t nal_unit_count;
+  /// Offsets of the tables from the beginning of the index.
+  uint64_t boxes_offset;
+  uint64_t segments_offset;
+  uint64_t frames_offset;
+  uint64_t nal_units_offset;
+};
+
+struct IndexBox {
+  uint64_t location;
+  uint64_t size;
+  /// FourCC of the box type, e.g., 0x6d646174 for mdat.
+  uint32_t type;
+  uint32_t header_size;
+};
+
+struct IndexSegment {
+  /// Byte range [start, end) of the segment in the video.
+  uint64_t start;
+  uint64_t end;
+  /// Range of the frames and NAL units of the segment in their tables.
+  uint32_t first_frame;
+  uint32_t frame_count;
+  uint32_t first_nal_unit;
+  uint32_t nal_unit_count;
+};
+
+struct IndexFrame {
+  uint64_t location;
+  uint32_t size;
+  /// Weight from the weight file of the segment, 0 without weights.
+  uint32_t weight;
+  /// 'I', 'P' or 'B'.
+  uint8_t type;
+  uint8_t nal_unit_type;
+  /// Size of the prefix, the NAL unit header and the slice header, i.e., the frame without its slice data.
+  uint16_t header_size;
+  uint32_t reserved;
+};
+
+struct IndexNALUnit {
+  uint64_t location;
+  /// Size of the NAL unit, saturated at UINT32_MAX. Larger NAL units only occur in corrupt Annex B byte streams.
+  uint32_t size;
+  /// Size of the slice header rounded to bytes, 0 if the NAL unit is not a slice. Also 0 in the in-memory indexes of
+  /// videos whose slices were only parsed up to the slice type, see ParserContext::slice_fields.
+  uint16_t slice_header_size;
+  /// nal_ref_idc (bits 5-6) and nal_unit_type (bits 0-4). Bit 7 is set for 3 byte Annex B start codes, otherwise the
+  /// prefix is 4 bytes.
+  uint8_t header;
+  /// slice_type syntax element of slices.
+  uint8_t slice_type;
+};
+
+static_assert(sizeof(IndexHeader) == 80, "IndexHeader layout");
+static_assert(sizeof(IndexBox) == 24, "IndexBox layout");
+static_assert(sizeof(IndexSegment) == 32, "IndexSegment layout");
+static_assert(sizeof(IndexFrame) == 24, "IndexFrame layout");
+static_assert(sizeof(IndexNALUnit) == 16, "IndexNALUnit layout");
+
+/**
+ * Read-only view on a binary index, either mapped from a file or in memory. All accessors return pointers into the
+ * index, nothing is copied.
+ */
+class IndexReader {
+ public:
+  IndexReader() = default;
+  IndexReader(const IndexReader &) = delete;
+  IndexReader &operator=(const IndexReader &) = delete;
+  ~IndexReader() { unmap(); }
+
+  /**
+   * Maps an index file.
+   * @param path Path to the index file.
+   * @return 0 on success. -1 if the file could not be mapped or is not a valid index.
+   */
+  int32_t open(const std::string &path) {
+    unmap();
+    int32_t fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      std::cerr << "could not open index " << path << ": " << strerror(errno) << "\n";
+      return -1;
+    }
+    struct stat st{};
+    if (fstat(fd, &st) < 0 || st.st_size < static_cast<off_t>(sizeof(IndexHeader))) {
+      close(fd);
+      std::cerr << "index " << path << " is too small\n";
+      return -1;
+    }
+    void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+      std::cerr << "could not mmap index " << path << ": " << strerror(errno) << "\n";
+      return -1;
+    }
+    mapping = addr;
+    mapping_size = st.st_size;
+    return setData(static_cast<const uint8_t *>(addr), mapping_size);
+  }
+  /**
+   * Uses an index in memory. The memory must stay valid and be 8 byte aligned.
+   * @param data_ Beginning of the index.
+   * @param size_ Size of the index.
+   * @return 0 on success. -1 if the data is not a valid index.
+   */
+  int32_t setData(const uint8_t *data_, size_t size_) {
+    data = data_;
+    size = size_;
+    if (size < sizeof(IndexHeader) || memcmp(getHeader().magic, INDEX_MAGIC, sizeof(INDEX_MAGIC)) != 0) {
+      std::cerr << "not a binary index\n";
+      return invalidate();
+    }
+    const IndexHeader &header = getHeader();
+    if (header.version != INDEX_VERSION) {
+      std::cerr << "unsupported binary index version " << header.version << "\n";
+      return invalidate();
+    }
+    if (!isTableValid(header.boxes_offset, header.box_count, sizeof(IndexBox))
+        || !isTableValid(header.segments_offset, header.segment_count, sizeof(IndexSegment))
+        || !isTableValid(header.frames_offset, header.frame_count, sizeof(IndexFrame))
+        || !isTableValid(header.nal_units_offset, header.nal_unit_count, sizeof(IndexNALUnit))) {
+      std::cerr << "binary index is truncated\n";
+      return invalidate();
+    }
+    for (uint64_t i = 0; i < header.segment_count; i++) {
+      const IndexSegment &segment = getSegments()[i];
+      if (static_cast<uint64_t>(segment.first_frame) + segment.frame_count > header.frame_count
+          || static_cast<uint64_t>(segment.first_nal_unit) + segment.nal_unit_count > header.nal_unit_count) {
+        std::cerr << "binary index segment " << i << " is out of range\n";
+        return invalidate();
+      }
+    }
+    return 0;
+  }
+
+  const IndexHeader &getHeader() const { return *reinterpret_cast<const IndexHeader *>(data); }
+  bool hasWeights() const { return getHeader().flags & INDEX_FLAG_WEIGHTS; }
+  size_t getBoxCount() const { return getHeader().box_count; }
+  const IndexBox *getBoxes() const { return table<IndexBox>(getHeader().boxes_offset); }
+  size_t getSegmentCount() const { return getHeader().segment_count; }
+  const IndexSegment *getSegments() const { return table<IndexSegment>(getHeader().segments_offset); }
+  size_t getFrameCount() const { return getHeader().frame_count; }
+  const IndexFrame *getFrames() const { return table<IndexFrame>(getHeader().frames_offset); }
+  /**
+   * Returns the frames of a segment. There are getSegments()[segment].frame_count of them.
+   * @param segment Index of the segment, starting at 0.
+   */
+  const IndexFrame *getFrames(size_t segment) const { return getFrames() + getSegments()[segment].first_frame; }
+  size_t getNALUnitCount() const { return getHeader().nal_unit_count; }
+  const IndexNALUnit *getNALUnits() const { return table<IndexNALUnit>(getHeader().nal_units_offset); }
+ private:
+  template<class T>
+  const T *table(uint64_t offset) const { return reinterpret_cast<const T *>(data + offset); }
+  bool isTableValid(uint64_t offset, uint64_t count, size_t record_size) const {
+    return offset % 8 == 0 && offset <= size && count <= (size - offset) / record_size;
+  }
+  int32_t invalidate() {
+    unmap();
+    data = nullptr;
+    size = 0;
+    return -1;
+  }
+  void unmap() {
+    if (mapping != nullptr) {
+      munmap(mapping, mapping_size);
+      mapping = nullptr;
+      mapping_size = 0;
+    }
+  }
+  const uint8_t *data = nullptr;
+  size_t size = 0;
+  void *mapping = nullptr;
+  size_t mapping_size = 0;
+};
+
+#endif //HEADER_PARSER_SRC_BINARYINDEX_H_
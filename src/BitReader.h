@@ -0,0 +1,435 @@
+#ifndef HEADER_PARSER_SRC_BITREADER_H_
+#define HEADER_PARSER_SRC_BITREADER_H_
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include "ByteScanner.h"
+#include "defines.h"
+
+/**
+ * Reads a bytestream MSB first. Instead of touching the bytestream for every bit, the reader keeps up to 64 bits in a
+ * cache word that is refilled with a single big-endian load, so any read of up to 32 bits is a shift and a mask.
+ *
+ * Like the old free read functions, all positions are byte offsets from a base address plus a bit offset inside that
+ * byte. The reader never touches memory at or beyond end. Bits that are read beyond end are 0.
+ *
+ * A reader for the payload of a NAL unit can additionally present the bytes as RBSP, i.e., it skips the emulation
+ * prevention bytes (0x03 in 0x000003) as specified in ISO/IEC 14496-10:2014 Chapter 7.4.1. The bytes are never copied.
+ * Instead, the reader scans ahead for the next emulation prevention byte in small windows, so only the prefix of the
+ * NAL unit that is actually read is scanned, and the cache is refilled with whole words as long as the next escape is
+ * not within reach. Positions are still reported in bytes of the original stream.
+ *
+ * The data does not have to start at the beginning of the stream. If only a window of the stream is resident, the
+ * reader is created with the stream offset of the window (base) and all offsets that are passed to and returned by the
+ * reader are still stream offsets.
+ */
+class BitReader {
+ public:
+  /**
+   * @param addr_ Base address.
+   * @param offset Byte offset from the base address at which reading starts.
+   * @param end_ Byte offset from the base address at which the readable data ends (exclusive).
+   * @param rbsp_ True if emulation prevention bytes should be skipped, i.e., if the data is a NAL unit payload.
+   * @param base_ Stream offset of the byte at the base address. All other offsets are stream offsets as well.
+   */
+  BitReader(const uint8_t *addr_, size_t offset, size_t end_, bool rbsp_ = false, size_t base_ = 0)
+      : addr(addr_), end(end_ - base_), base(base_), rbsp(rbsp_) { seek(offset); }
+  /**
+   * Moves the read position to the beginning of the byte at the given offset and empties the cache.
+   * @param offset Byte offset from the beginning of the stream.
+   */
+  void seek(size_t offset) {
+    assert(offset >= base);
+    offset -= base;
+    next = offset < end ? offset : end;
+    overrun_bits = (offset - next) * 8;
+    cache = 0;
+    cache_bits = 0;
+    // The escape scan starts lazily with the first refill.
+    clean_end = rbsp ? next : end;
+    clean_end_is_escape = false;
+    scan_from = next;
+    escapes = 0;
+  }
+  /// Pointer to the byte at the current read position. Only valid as long as the data is resident.
+  const uint8_t *getPointer() const { return addr + (getPosition() >> 3); }
+  size_t getEnd() const { return end + base; }
+  /// Byte offset of the current read position from the beginning of the stream.
+  size_t getOffset() const { return (getPosition() >> 3) + base; }
+  /// Bit offset of the current read position inside the current byte.
+  uint8_t getBitOffset() const { return static_cast<uint8_t>(getPosition() & 0x07); }
+  bool isByteAligned() const { return (getPosition() & 0x07) == 0; }
+  /// True if the read position reached or passed end.
+  bool isExhausted() const { return getPosition() >= end * 8; }
+  /**
+   * Checks if there is more data in front of the rbsp_trailing_bits(), i.e., more_rbsp_data() as specified in
+   * ISO/IEC 14496-10:2014 Chapter 7.2. The rbsp_stop_one_bit is the last 1 bit before end, so the reader has to end
+   * with the NAL unit. Trailing zero bytes are skipped.
+   * @return True if the rbsp_stop_one_bit is behind the read position.
+   */
+  bool moreRBSPData() const {
+    size_t position = getPosition();
+    size_t last = end;
+    while (last > (position >> 3) && addr[last - 1] == 0) {
+      last--;
+    }
+    if (last <= (position >> 3)) {
+      return false;
+    }
+    size_t stop_bit_position = last * 8 - 1 - __builtin_ctz(addr[last - 1]);
+    return position < stop_bit_position;
+  }
+
+  /**
+   * Reads a single bit.
+   * @return The read value.
+   */
+  uint8_t readBit() {
+    if (cache_bits == 0) {
+      refill();
+      if (cache_bits == 0) {
+        overrun_bits++;
+        return 0;
+      }
+    }
+    auto ret = static_cast<uint8_t>(cache >> 63);
+    cache <<= 1;
+    cache_bits--;
+    return ret;
+  }
+  /**
+   * Reads n bits.
+   *
+   * @warning Do not pass a n value greater than 32.
+   *
+   * @param n Number of bits to read.
+   * @return The read value.
+   */
+  uint32_t readNBits(uint32_t n) {
+    assert(n <= 32);
+    if (n == 0) {
+      return 0;
+    }
+    if (cache_bits < n) {
+      refill();
+      if (cache_bits < n) {
+        // Only possible at the end of the data. The missing bits are 0 in the cache.
+        overrun_bits += n - cache_bits;
+        cache_bits = n;
+      }
+    }
+    auto ret = static_cast<uint32_t>(cache >> (64 - n));
+    cache <<= n;
+    cache_bits -= n;
+    return ret;
+  }
+  /**
+   * Reads a byte. The read position does not need to be byte aligned.
+   * @return The read value.
+   */
+  uint8_t readByte() { return static_cast<uint8_t>(readNBits(8)); }
+  /**
+   * Reads four bytes and interprets them as a big-endian unsigned integer. The read position does not need to be byte
+   * aligned.
+   * @return The read value as an unsigned integer.
+   */
+  uint32_t readUnsignedInt32() { return readNBits(32); }
+  /**
+   * Reads eight bytes and interprets them as a big-endian unsigned integer, e.g., a 64 bit MP4 box field.
+   * @return The read value as an unsigned integer.
+   */
+  uint64_t readUnsignedInt64() {
+    uint64_t high = readNBits(32);
+    return (high << 32) | readNBits(32);
+  }
+  /**
+   * Skips n bits.
+   *
+   * @warning Do not pass a n value greater than 32.
+   *
+   * @param n Number of bits to skip.
+   */
+  void skipBits(uint32_t n) { readNBits(n); }
+  /**
+   * Reads a variable number of bits as a Exp-Golomb code. Details about the parsing process can be found in
+   * ISO/IEC 14496-10:2014 Chapter 9.1.
+   *
+   * The leading zero bits are counted with a single count-leading-zeros instruction on the cache word, so codes of up to
+   * 56 bits are decoded without a loop and with a single, well predicted branch. Codes with up to 32 leading zero bits
+   * (65 bits in total) are supported. Code numbers that do not fit into 32 bits as well as codes with more leading zero
+   * bits, which can only occur in broken streams, return UINT32_MAX.
+   *
+   * @return The code number.
+   */
+  uint32_t decodeUnsignedExpGolomb() {
+    if (cache_bits < 32) {
+      refill();
+    }
+    // A code with n leading zero bits is n zeros, a one and n info bits, so its value is 2^n + info = code_num + 1.
+    auto leading_zero_bits = static_cast<uint32_t>(__builtin_clzll(cache | 0x01));
+    uint32_t length = 2 * leading_zero_bits + 1;
+    if (length <= cache_bits) {
+      auto code_num = static_cast<uint32_t>((cache >> (64 - length)) - 1);
+      cache <<= length;
+      cache_bits -= length;
+      return code_num;
+    }
+    return decodeLongExpGolomb();
+  }
+  /**
+   * Skips a ue(v) or se(v) Exp-Golomb code. Like decodeUnsignedExpGolomb(), but the code number is not extracted.
+   */
+  void skipExpGolomb() {
+    if (cache_bits < 32) {
+      refill();
+    }
+    uint32_t length = 2 * static_cast<uint32_t>(__builtin_clzll(cache | 0x01)) + 1;
+    if (length <= cache_bits) {
+      cache <<= length;
+      cache_bits -= length;
+      return;
+    }
+    decodeLongExpGolomb();
+  }
+  /**
+   * Reads a variable number of bits as a Exp-Golomb code. The unsigned code number is then mapped to a signed syntax
+   * element value as specified in ISO/IEC 14496-10:2014 Chapter 9.1.1, i.e., 0, 1, -1, 2, -2, ... without branches or
+   * floating point operations.
+   * @return The read value.
+   */
+  int32_t decodeSignedExpGolomb() {
+    uint32_t code_num = decodeUnsignedExpGolomb();
+    uint32_t magnitude = (code_num >> 1) + (code_num & 0x01);
+    // All ones for even code numbers, which map to negative values. Zero for odd code numbers.
+    uint32_t sign_mask = (code_num & 0x01) - 1;
+    return static_cast<int32_t>((magnitude ^ sign_mask) - sign_mask);
+  }
+
+  /*
+   * The following overloads additionally print the parameter name together with the read value if the trace level is
+   * TRACE_DEBUG. The name is only used in that case, so passing a string literal costs nothing otherwise.
+   */
+  uint8_t readBit(const char *name) {
+    if (isTraceEnabled(TRACE_DEBUG)) {
+      size_t offset = getOffset();
+      uint8_t bit_offset = getBitOffset();
+      uint8_t ret = readBit();
+      traceElement(offset, bit_offset, name, static_cast<uint32_t>(ret));
+      return ret;
+    }
+    return readBit();
+  }
+  uint32_t readNBits(uint32_t n, const char *name) {
+    if (isTraceEnabled(TRACE_DEBUG)) {
+      size_t offset = getOffset();
+      uint8_t bit_offset = getBitOffset();
+      uint32_t ret = readNBits(n);
+      traceElement(offset, bit_offset, name, ret);
+      return ret;
+    }
+    return readNBits(n);
+  }
+  uint8_t readByte(const char *name) {
+    if (isTraceEnabled(TRACE_DEBUG)) {
+      size_t offset = getOffset();
+      uint8_t bit_offset = getBitOffset();
+      uint8_t ret = readByte();
+      traceElement(offset, bit_offset, name, static_cast<uint32_t>(ret));
+      return ret;
+    }
+    return readByte();
+  }
+  uint32_t readUnsignedInt32(const char *name) {
+    if (isTraceEnabled(TRACE_DEBUG)) {
+      size_t offset = getOffset();
+      uint8_t bit_offset = getBitOffset();
+      uint32_t ret = readUnsignedInt32();
+      traceElement(offset, bit_offset, name, ret);
+      return ret;
+    }
+    return readUnsignedInt32();
+  }
+  uint64_t readUnsignedInt64(const char *name) {
+    if (isTraceEnabled(TRACE_DEBUG)) {
+      size_t offset = getOffset();
+      uint8_t bit_offset = getBitOffset();
+      uint64_t ret = readUnsignedInt64();
+      traceElement(offset, bit_offset, name, ret);
+      return ret;
+    }
+    return readUnsignedInt64();
+  }
+  uint32_t decodeUnsignedExpGolomb(const char *name) {
+    if (isTraceEnabled(TRACE_DEBUG)) {
+      size_t offset = getOffset();
+      uint8_t bit_offset = getBitOffset();
+      uint32_t ret = decodeUnsignedExpGolomb();
+      traceElement(offset, bit_offset, name, ret);
+      return ret;
+    }
+    return decodeUnsignedExpGolomb();
+  }
+  int32_t decodeSignedExpGolomb(const char *name) {
+    if (isTraceEnabled(TRACE_DEBUG)) {
+      size_t offset = getOffset();
+      uint8_t bit_offset = getBitOffset();
+      int32_t ret = decodeSignedExpGolomb();
+      traceElement(offset, bit_offset, name, ret);
+      return ret;
+    }
+    return decodeSignedExpGolomb();
+  }
+
+ private:
+  const uint8_t *addr;
+  size_t end;
+  /// Offset of the next byte that is loaded into the cache.
+  size_t next;
+  /// Unread bits, left aligned. Bits below the cache_bits most significant ones are either 0 or the bits that follow.
+  uint64_t cache;
+  uint32_t cache_bits;
+  /// Number of bits that were read beyond end.
+  size_t overrun_bits;
+  /// Stream offset of the byte at addr. addr, end and all internal offsets are relative to it.
+  size_t base;
+  /// True if emulation prevention bytes are skipped.
+  bool rbsp;
+  /// The bytes in [next, clean_end) contain no emulation prevention byte. Always end if rbsp is false.
+  size_t clean_end;
+  /// True if clean_end is the offset of an emulation prevention byte.
+  bool clean_end_is_escape;
+  /// Offset at which the next escape scan starts.
+  size_t scan_from;
+  /// Number of emulation prevention bytes that were skipped.
+  size_t escapes;
+  /**
+   * RBSP offsets of the bytes that follow the most recently skipped emulation prevention bytes. The cache holds at most
+   * 8 bytes and an escape needs two zero bytes in front of it, so no more than 4 skipped escapes can lie ahead of the
+   * read position.
+   */
+  size_t escape_rbsp_offsets[8];
+
+  /**
+   * Returns the read position in bits from the base address, in the original stream, i.e., including the emulation
+   * prevention bytes that were skipped before the read position.
+   */
+  size_t getPosition() const {
+    size_t rbsp_position = (next - escapes) * 8 - cache_bits + overrun_bits;
+    // If the cache is drained right in front of an escape that is not skipped yet, the next bit read follows it.
+    size_t pending = cache_bits == 0 && clean_end_is_escape && next == clean_end ? 8 : 0;
+    if (escapes == 0) {
+      return rbsp_position + pending;
+    }
+    size_t rbsp_offset = rbsp_position >> 3;
+    size_t escapes_ahead = 0;
+    size_t last = escapes < 8 ? escapes : 8;
+    for (size_t i = 0; i < last; i++) {
+      if (escape_rbsp_offsets[i] > rbsp_offset) {
+        escapes_ahead++;
+      }
+    }
+    return rbsp_position + (escapes - escapes_ahead) * 8 + pending;
+  }
+
+  /**
+   * Slow path of decodeUnsignedExpGolomb() for codes that are longer than the cache or that reach beyond end.
+   */
+  uint32_t decodeLongExpGolomb() {
+    refill();
+    // At the end of the data the bits below cache_bits are 0, so they are counted as leading zero bits as well.
+    uint32_t leading_zero_bits = cache == 0 ? 64 : static_cast<uint32_t>(__builtin_clzll(cache));
+    if (leading_zero_bits > 32) {
+      skipBits(32);
+      skipBits(1);
+      return UINT32_MAX;
+    }
+    skipBits(leading_zero_bits);
+    skipBits(1);
+    uint64_t code_num = ((static_cast<uint64_t>(1) << leading_zero_bits) - 1) + readNBits(leading_zero_bits);
+    return code_num > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(code_num);
+  }
+
+  /**
+   * Fills the cache with at least 56 bits, if there is enough data left.
+   */
+  void refill() {
+    if (clean_end - next >= 8) {
+      loadWord();
+    } else {
+      refillSlow();
+    }
+  }
+
+  /**
+   * Refills the cache with a single 8 byte load. Expects that the 8 bytes at next are readable and contain no
+   * emulation prevention byte.
+   */
+  void loadWord() {
+    uint64_t word;
+    memcpy(&word, addr + next, sizeof(word));
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+    word = __builtin_bswap64(word);
+#endif
+    // Loads 8 bytes, but only the whole bytes that fit into the cache are consumed. The remaining low bits are the
+    // same ones that the next refill loads at the same position, so they do not have to be masked out.
+    cache |= word >> cache_bits;
+    next += (63 - cache_bits) >> 3;
+    cache_bits |= 56;
+  }
+
+  /**
+   * Refills the cache byte by byte close to end or to the next emulation prevention byte.
+   */
+  void refillSlow() {
+    if (rbsp && !clean_end_is_escape && clean_end < end) {
+      scanEscapes();
+      if (clean_end - next >= 8) {
+        loadWord();
+        return;
+      }
+    }
+    while (cache_bits <= 56 && next < end) {
+      if (next == clean_end) {
+        if (clean_end_is_escape) {
+          next++;
+          escape_rbsp_offsets[escapes % 8] = next - (escapes + 1);
+          escapes++;
+          scan_from = next;
+        }
+        scanEscapes();
+        if (clean_end - next >= 8) {
+          loadWord();
+          return;
+        }
+        continue;
+      }
+      cache |= static_cast<uint64_t>(addr[next]) << (56 - cache_bits);
+      next++;
+      cache_bits += 8;
+    }
+  }
+
+  /**
+   * Scans the next window of the stream for an emulation prevention byte and extends the clean range up to it or up
+   * to the end of the window.
+   */
+  void scanEscapes() {
+    const size_t window = 64;
+    size_t window_end = end - scan_from > window ? scan_from + window : end;
+    size_t found = findZeroZeroByte(addr, scan_from, window_end, 0x03);
+    if (found < window_end) {
+      clean_end = found + 2;
+      clean_end_is_escape = true;
+      scan_from = clean_end + 1;
+    } else {
+      clean_end = window_end;
+      clean_end_is_escape = false;
+      // A sequence can start in the last two bytes of the window.
+      scan_from = window_end - scan_from >= 2 ? window_end - 2 : scan_from;
+    }
+  }
+};
+
+#endif //HEADER_PARSER_SRC_BITREADER_H_
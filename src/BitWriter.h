@@ -0,0 +1,130 @@
+#ifndef HEADER_PARSER_SRC_BITWRITER_H_
+#define HEADER_PARSER_SRC_BITWRITER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Writes a bytestream MSB first, the counterpart of BitReader. Bits are collected in a cache word and complete bytes
+ * are appended to a byte vector, so data that was written before, e.g., a box header, can still be patched.
+ *
+ * A writer for the payload of a NAL unit can additionally present the written bits as RBSP, i.e., it inserts the
+ * emulation prevention bytes (0x03 in 0x000003) as specified in ISO/IEC 14496-10:2014 Chapter 7.4.1 while it writes.
+ */
+class BitWriter {
+ public:
+  /**
+   * @param data_ Vector that the bytes are appended to.
+   * @param rbsp_ True if emulation prevention bytes should be inserted, i.e., if the data is a NAL unit payload.
+   */
+  explicit BitWriter(std::vector<uint8_t> &data_, bool rbsp_ = false) : data(data_), rbsp(rbsp_) {}
+  /// Byte offset of the write position in the data vector. Only meaningful if the writer is byte aligned.
+  size_t getOffset() const { return data.size(); }
+  bool isByteAligned() const { return cache_bits == 0; }
+  /// Number of emulation prevention bytes that were inserted.
+  size_t getEscapes() const { return escapes; }
+
+  void writeBit(uint8_t value) { writeNBits(1, value); }
+  /**
+   * Writes the n least significant bits of a value.
+   * @param n Number of bits, at most 32.
+   * @param value The value.
+   */
+  void writeNBits(uint32_t n, uint32_t value) {
+    if (n == 0) {
+      return;
+    }
+    cache = (cache << n) | (value & (UINT64_MAX >> (64 - n)));
+    cache_bits += n;
+    while (cache_bits >= 8) {
+      cache_bits -= 8;
+      putByte(static_cast<uint8_t>(cache >> cache_bits));
+    }
+  }
+  void writeByte(uint8_t value) { writeNBits(8, value); }
+  void writeUnsignedInt32(uint32_t value) { writeNBits(32, value); }
+  void writeUnsignedInt64(uint64_t value) {
+    writeNBits(32, static_cast<uint32_t>(value >> 32));
+    writeNBits(32, static_cast<uint32_t>(value));
+  }
+  /**
+   * Writes a byte string. Emulation prevention bytes are inserted into it as well.
+   */
+  void writeBytes(const uint8_t *bytes, size_t size) {
+    if (cache_bits != 0) {
+      for (size_t i = 0; i < size; i++) {
+        writeByte(bytes[i]);
+      }
+      return;
+    }
+    for (size_t i = 0; i < size; i++) {
+      putByte(bytes[i]);
+    }
+  }
+  /**
+   * Writes a code number as Exp-Golomb code, see ISO/IEC 14496-10:2014 Chapter 9.1.
+   * @param code_num The code number.
+   */
+  void encodeUnsignedExpGolomb(uint32_t code_num) {
+    // code_num + 1 has n + 1 significant bits and is written after n leading zero bits.
+    uint64_t value = static_cast<uint64_t>(code_num) + 1;
+    auto leading_zero_bits = static_cast<uint32_t>(63 - __builtin_clzll(value));
+    if (leading_zero_bits < 16) {
+      writeNBits(2 * leading_zero_bits + 1, static_cast<uint32_t>(value));
+      return;
+    }
+    writeNBits(leading_zero_bits, 0);
+    writeNBits(1, 1);
+    writeNBits(leading_zero_bits, static_cast<uint32_t>(value));
+  }
+  /**
+   * Maps a signed syntax element value to a code number as specified in ISO/IEC 14496-10:2014 Chapter 9.1.1, i.e.,
+   * 0, 1, -1, 2, -2, ..., and writes it as Exp-Golomb code.
+   * @param value The value.
+   */
+  void encodeSignedExpGolomb(int32_t value) {
+    auto magnitude = static_cast<uint32_t>(value < 0 ? -static_cast<int64_t>(value) : value);
+    encodeUnsignedExpGolomb(value > 0 ? 2 * magnitude - 1 : 2 * magnitude);
+  }
+  /**
+   * Writes the given bit until the writer is byte aligned, e.g., cabac_alignment_one_bit.
+   */
+  void writeAlignmentBits(uint8_t bit) {
+    while (cache_bits != 0) {
+      writeBit(bit);
+    }
+  }
+  /**
+   * Writes rbsp_trailing_bits(), i.e., the rbsp_stop_one_bit and zero bits up to the next byte boundary.
+   */
+  void writeTrailingBits() {
+    writeBit(1);
+    writeAlignmentBits(0);
+  }
+
+ private:
+  std::vector<uint8_t> &data;
+  /// Bits that are not written yet, right aligned. Always less than 8 between calls.
+  uint64_t cache = 0;
+  uint32_t cache_bits = 0;
+  /// True if emulation prevention bytes are inserted.
+  bool rbsp;
+  /// Number of consecutive zero bytes at the end of the data, only counted in RBSP mode.
+  uint32_t zero_bytes = 0;
+  size_t escapes = 0;
+
+  void putByte(uint8_t byte) {
+    if (rbsp) {
+      if (zero_bytes >= 2 && byte <= 0x03) {
+        data.push_back(0x03);
+        escapes++;
+        zero_bytes = 0;
+      }
+      zero_bytes = byte == 0 ? zero_bytes + 1 : 0;
+    }
+    data.push_back(byte);
+  }
+};
+
+#endif //HEADER_PARSER_SRC_BITWRITER_H_
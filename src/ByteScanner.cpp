@@ -0,0 +1,82 @@
+#include "ByteScanner.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_SIMD
+#endif
+
+static size_t findZeroZeroByteScalar(const uint8_t *addr, size_t from, size_t to, uint8_t value) {
+  for (size_t i = from; i + 2 < to; i++) {
+    if (addr[i + 2] == value && addr[i + 1] == 0 && addr[i] == 0) {
+      return i;
+    }
+  }
+  return to;
+}
+
+#ifdef HAVE_X86_SIMD
+static size_t findZeroZeroByteSSE2(const uint8_t *addr, size_t from, size_t to, uint8_t value) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i third = _mm_set1_epi8(static_cast<char>(value));
+  size_t i = from;
+  // Compares the 16 positions i..i+15 at once. Each position needs two more bytes, so 18 bytes must be readable.
+  for (; i + 18 <= to; i += 16) {
+    __m128i b0 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(addr + i));
+    __m128i b1 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(addr + i + 1));
+    __m128i b2 = _mm_loadu_si128(reinterpret_cast<const __m128i *>(addr + i + 2));
+    __m128i match = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(b0, zero), _mm_cmpeq_epi8(b1, zero)),
+                                  _mm_cmpeq_epi8(b2, third));
+    auto mask = static_cast<uint32_t>(_mm_movemask_epi8(match));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  return findZeroZeroByteScalar(addr, i, to, value);
+}
+
+__attribute__((target("avx2")))
+static size_t findZeroZeroByteAVX2(const uint8_t *addr, size_t from, size_t to, uint8_t value) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i third = _mm256_set1_epi8(static_cast<char>(value));
+  size_t i = from;
+  for (; i + 34 <= to; i += 32) {
+    __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(addr + i));
+    __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(addr + i + 1));
+    __m256i b2 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(addr + i + 2));
+    __m256i match = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(b0, zero), _mm256_cmpeq_epi8(b1, zero)),
+                                     _mm256_cmpeq_epi8(b2, third));
+    auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(match));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+  // The SSE2 code is not VEX encoded. Running it with dirty upper halves of the ymm registers costs a state transition
+  // of up to a few hundred cycles, which is more than the whole escape scan of a slice header.
+  _mm256_zeroupper();
+  return findZeroZeroByteSSE2(addr, i, to, value);
+}
+
+static bool cpuSupportsAVX2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+
+size_t findZeroZeroByte(const uint8_t *addr, size_t from, size_t to, uint8_t value) {
+#ifdef HAVE_X86_SIMD
+  static const bool avx2 = cpuSupportsAVX2();
+  if (avx2) {
+    return findZeroZeroByteAVX2(addr, from, to, value);
+  }
+  return findZeroZeroByteSSE2(addr, from, to, value);
+#else
+  return findZeroZeroByteScalar(addr, from, to, value);
+#endif
+}
+
+size_t findStartCode(const uint8_t *addr, size_t from, size_t to) {
+  size_t found = findZeroZeroByte(addr, from, to, 0x01);
+  if (found < to && found > from && addr[found - 1] == 0) {
+    found--;
+  }
+  return found;
+}
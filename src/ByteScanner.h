@@ -0,0 +1,33 @@
+#ifndef HEADER_PARSER_SRC_BYTESCANNER_H_
+#define HEADER_PARSER_SRC_BYTESCANNER_H_
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Searches for the first occurrence of the three byte sequence 0x00 0x00 value that lies completely inside
+ * [addr + from, addr + to). This is the pattern of both the emulation prevention byte (0x000003) and the Annex B start
+ * code prefix (0x000001).
+ *
+ * The search compares 32 (AVX2, if the CPU supports it) or 16 (SSE2) positions at once and falls back to a scalar loop
+ * for the remaining bytes and on other architectures.
+ *
+ * @param addr Base address.
+ * @param from Byte offset from the base address at which the search starts.
+ * @param to Byte offset from the base address at which the search ends (exclusive).
+ * @param value Value of the third byte.
+ * @return Offset of the first 0x00 of the sequence. to if the sequence was not found.
+ */
+size_t findZeroZeroByte(const uint8_t *addr, size_t from, size_t to, uint8_t value);
+/**
+ * Searches for the first Annex B start code (0x000001 or 0x00000001) that lies completely inside [addr + from,
+ * addr + to).
+ * @param addr Base address.
+ * @param from Byte offset from the base address at which the search starts.
+ * @param to Byte offset from the base address at which the search ends (exclusive).
+ * @return Offset of the first byte of the start code, including the leading zero_byte of a 4 byte start code. to if no
+ * start code was found.
+ */
+size_t findStartCode(const uint8_t *addr, size_t from, size_t to);
+
+#endif //HEADER_PARSER_SRC_BYTESCANNER_H_
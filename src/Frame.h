@@ -5,6 +5,7 @@
 #include <cstddef>
 #include <string>
 #include <tuple>
+#include "helper_functions.h"
 
 class Frame {
  public:
@@ -13,8 +14,14 @@ class Frame {
   void setWeight(uint32_t weight_) { weight = weight_; }
   char getType() const { return type; }
   uint32_t getWeight() const { return weight; }
+  size_t getStart() const { return start; }
   size_t getSize() const { return end - start + 1; }
-  std::string getRange() const { return std::to_string(start) + '-' + std::to_string(end); }
+  /// Appends the byte range, i.e., <start>-<end>, to a string.
+  void appendRange(std::string &str) const {
+    appendUnsigned(str, start);
+    str += '-';
+    appendUnsigned(str, end);
+  }
   friend bool operator<(const Frame &l, const Frame &r) {
     if (l.weight > r.weight) {
       return true;
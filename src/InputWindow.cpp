@@ -0,0 +1,80 @@
+#include "InputWindow.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+InputWindow::InputWindow(int32_t fd_, size_t chunk_size_) : fd(fd_), chunk_size(chunk_size_), buffer(chunk_size_) {}
+
+size_t InputWindow::fill(size_t offset, size_t length) {
+  size_t resident_end = start + (tail - head);
+  if (offset > resident_end) {
+    discard(resident_end);
+    skip(offset - resident_end);
+  } else {
+    discard(offset);
+  }
+  while (tail - head < length && !eof) {
+    if (buffer.size() - tail < chunk_size) {
+      // Not enough room behind the resident bytes. Move them to the front and grow the buffer if a single range is
+      // larger than a chunk.
+      size_t resident = tail - head;
+      if (buffer.size() < resident + chunk_size) {
+        buffer.resize(resident + chunk_size);
+      }
+      memmove(buffer.data(), buffer.data() + head, resident);
+      head = 0;
+      tail = resident;
+    }
+    readChunk();
+  }
+  return std::min(length, tail - head);
+}
+
+void InputWindow::discard(size_t offset) {
+  head += offset - start;
+  start = offset;
+  if (head == tail) {
+    head = 0;
+    tail = 0;
+  }
+}
+
+void InputWindow::skip(size_t length) {
+  if (length == 0) {
+    return;
+  }
+  if (lseek(fd, static_cast<off_t>(length), SEEK_CUR) >= 0) {
+    start += length;
+    return;
+  }
+  // Pipes cannot seek, so read the data and drop it.
+  while (length > 0 && !eof) {
+    size_t read_bytes = readChunk();
+    size_t dropped = std::min(read_bytes, length);
+    discard(start + dropped);
+    length -= dropped;
+  }
+  // Skipping beyond the end of the stream still moves the window, so the returned sizes stay consistent.
+  start += length;
+}
+
+size_t InputWindow::readChunk() {
+  ssize_t res;
+  do {
+    res = read(fd, buffer.data() + tail, std::min(chunk_size, buffer.size() - tail));
+  } while (res < 0 && errno == EINTR);
+  if (res < 0) {
+    std::cerr << "read: " << strerror(errno) << "\n";
+    failed = true;
+    eof = true;
+    return 0;
+  }
+  if (res == 0) {
+    eof = true;
+    return 0;
+  }
+  tail += res;
+  return res;
+}
@@ -0,0 +1,68 @@
+#ifndef HEADER_PARSER_SRC_INPUTWINDOW_H_
+#define HEADER_PARSER_SRC_INPUTWINDOW_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Sequential view on a file descriptor that keeps only a small window of the stream resident. The stream is read in
+ * fixed-size chunks into a buffer. Requesting a range discards everything in front of it, so the parser can walk over
+ * arbitrarily large inputs, e.g., a pipe or stdin, with a memory footprint of about one chunk.
+ *
+ * Offsets are stream offsets, i.e., they count from the first byte read from the file descriptor. Requested offsets must
+ * never decrease. Skipped data is seeked over if the file descriptor supports it and read and dropped otherwise.
+ */
+class InputWindow {
+ public:
+  /**
+   * @param fd_ File descriptor to read from. It is not closed by the window.
+   * @param chunk_size_ Number of bytes that are requested with a single read.
+   */
+  InputWindow(int32_t fd_, size_t chunk_size_);
+  /**
+   * Makes the range [offset, offset + length) resident. The range may span chunk boundaries. Everything in front of
+   * offset can be dropped afterwards.
+   * @param offset Stream offset of the range. Must not be smaller than the offset of the previous call.
+   * @param length Length of the range.
+   * @return Number of resident bytes starting at offset. Less than length only at the end of the stream or after a
+   * read error.
+   */
+  size_t fill(size_t offset, size_t length);
+  /// Pointer to the resident byte at getStart(). Invalidated by fill().
+  const uint8_t *getData() const { return buffer.data() + head; }
+  /// Stream offset of the first resident byte.
+  size_t getStart() const { return start; }
+  /// True if reading from the file descriptor failed.
+  bool hasFailed() const { return failed; }
+ private:
+  /**
+   * Drops all resident bytes in front of offset.
+   * @param offset Stream offset, must not lie beyond the resident data.
+   */
+  void discard(size_t offset);
+  /**
+   * Skips length bytes that are not resident.
+   * @param length Number of bytes to skip.
+   */
+  void skip(size_t length);
+  /**
+   * Reads at most one chunk into the buffer.
+   * @return Number of bytes read. 0 at the end of the stream or on error.
+   */
+  size_t readChunk();
+
+  int32_t fd;
+  size_t chunk_size;
+  std::vector<uint8_t> buffer;
+  /// Index of the byte at start in buffer.
+  size_t head = 0;
+  /// Index after the last resident byte in buffer.
+  size_t tail = 0;
+  /// Stream offset of buffer[head].
+  size_t start = 0;
+  bool eof = false;
+  bool failed = false;
+};
+
+#endif //HEADER_PARSER_SRC_INPUTWINDOW_H_
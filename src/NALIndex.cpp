@@ -0,0 +1,88 @@
+#include "NALIndex.h"
+#include <algorithm>
+#include "helper_functions.h"
+
+void NALIndex::push_back(const NALUnit &nal_unit) {
+  size_t high = nal_unit.location_relative >> 32;
+  while (high_starts.size() < high) {
+    high_starts.push_back(locations.size());
+  }
+  locations.push_back(static_cast<uint32_t>(nal_unit.location_relative));
+  if (nal_unit.size < UINT32_MAX) {
+    sizes.push_back(static_cast<uint32_t>(nal_unit.size));
+  } else {
+    sizes.push_back(UINT32_MAX);
+    large_sizes.emplace_back(locations.size() - 1, nal_unit.size);
+  }
+  slice_header_sizes.push_back(0);
+  headers.push_back(static_cast<uint8_t>((nal_unit.prefix_size == 3 ? 0x80 : 0) | (nal_unit.nal_ref_idc & 0x3) << 5
+                                             | (nal_unit.nal_unit_type & 0x1f)));
+  slice_types.push_back(0);
+}
+
+void NALIndex::setSliceHeader(uint8_t raw_slice_type, size_t slice_header_size) {
+  slice_types.back() = static_cast<uint8_t>(std::min<uint8_t>(raw_slice_type, UINT8_MAX - 1) + 1);
+  slice_header_sizes.back() = static_cast<uint16_t>(std::min<size_t>(slice_header_size, UINT16_MAX));
+}
+
+void NALIndex::append(const NALIndex &other) {
+  size_t offset = size();
+  // The high words that this index already reached start in here, the others in other.
+  for (size_t i = high_starts.size(); i < other.high_starts.size(); i++) {
+    high_starts.push_back(offset + other.high_starts[i]);
+  }
+  locations.insert(locations.end(), other.locations.begin(), other.locations.end());
+  sizes.insert(sizes.end(), other.sizes.begin(), other.sizes.end());
+  for (const auto &large_size : other.large_sizes) {
+    large_sizes.emplace_back(offset + large_size.first, large_size.second);
+  }
+  slice_header_sizes.insert(slice_header_sizes.end(), other.slice_header_sizes.begin(), other.slice_header_sizes.end());
+  headers.insert(headers.end(), other.headers.begin(), other.headers.end());
+  slice_types.insert(slice_types.end(), other.slice_types.begin(), other.slice_types.end());
+}
+
+NALUnit NALIndex::operator[](size_t i) const {
+  NALUnit ret{};
+  size_t high = std::upper_bound(high_starts.begin(), high_starts.end(), i) - high_starts.begin();
+  ret.location_relative = high << 32 | locations[i];
+  ret.size = sizes[i];
+  if (ret.size == UINT32_MAX) {
+    auto it = std::lower_bound(large_sizes.begin(), large_sizes.end(), std::make_pair(i, static_cast<size_t>(0)));
+    if (it != large_sizes.end() && it->first == i) {
+      ret.size = it->second;
+    }
+  }
+  ret.prefix_size = headers[i] & 0x80 ? 3 : 4;
+  ret.nal_ref_idc = headers[i] >> 5 & 0x3;
+  ret.nal_unit_type = headers[i] & 0x1f;
+  ret.slice_header_size = slice_header_sizes[i];
+  if (slice_types[i] > 0) {
+    ret.raw_slice_type = slice_types[i] - 1;
+    ret.slice_type = getSliceTypeChar(ret.raw_slice_type);
+  }
+  return ret;
+}
+
+void NALIndex::reserve(size_t count) {
+  locations.reserve(count);
+  sizes.reserve(count);
+  slice_header_sizes.reserve(count);
+  headers.reserve(count);
+  slice_types.reserve(count);
+}
+
+void NALIndex::shrink_to_fit() {
+  locations.shrink_to_fit();
+  high_starts.shrink_to_fit();
+  sizes.shrink_to_fit();
+  large_sizes.shrink_to_fit();
+  slice_header_sizes.shrink_to_fit();
+  headers.shrink_to_fit();
+  slice_types.shrink_to_fit();
+}
+
+size_t NALIndex::getMemoryUsage() const {
+  return locations.capacity() * sizeof(uint32_t) + high_starts.capacity() * sizeof(size_t)
+      + sizes.capacity() * sizeof(uint32_t) + large_sizes.capacity() * sizeof(std::pair<size_t, size_t>)
+      + slice_header_sizes.capacity() * sizeof(uint16_t) + headers.capacity() + slice_types.capacity();
+}
@@ -0,0 +1,103 @@
+#ifndef HEADER_PARSER_SRC_NALINDEX_H_
+#define HEADER_PARSER_SRC_NALINDEX_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <utility>
+#include <vector>
+#include "structs.h"
+
+/**
+ * Compact index of the NAL units of a video, stored as a structure of arrays with 12 bytes per NAL unit: the low 32 bits
+ * of the location, the size, the slice header size, the NAL unit header and the slice type. NAL units are appended in
+ * file order, so the high bits of the locations only change every 4 GB and are stored once per change. Sizes that do
+ * not fit into 32 bits, which only happens in corrupt Annex B byte streams, are kept in a side table.
+ *
+ * Elements are unpacked into NALUnit values on access. The interface mimics a read-only vector, so the outputs can
+ * iterate over the index as before.
+ */
+class NALIndex {
+ public:
+  /**
+   * Iterator that unpacks the NAL units on dereference.
+   */
+  class const_iterator {
+   public:
+    typedef std::input_iterator_tag iterator_category;
+    typedef NALUnit value_type;
+    typedef std::ptrdiff_t difference_type;
+    typedef const NALUnit *pointer;
+    typedef NALUnit reference;
+    /// Holds the unpacked value for operator->().
+    struct ArrowProxy {
+      NALUnit value;
+      const NALUnit *operator->() const { return &value; }
+    };
+
+    const_iterator(const NALIndex *index_, size_t i_) : index(index_), i(i_) {}
+    NALUnit operator*() const { return (*index)[i]; }
+    ArrowProxy operator->() const { return ArrowProxy{(*index)[i]}; }
+    const_iterator &operator++() {
+      i++;
+      return *this;
+    }
+    const_iterator operator++(int) {
+      const_iterator ret = *this;
+      i++;
+      return ret;
+    }
+    bool operator==(const const_iterator &other) const { return i == other.i; }
+    bool operator!=(const const_iterator &other) const { return i != other.i; }
+   private:
+    const NALIndex *index;
+    size_t i;
+  };
+
+  /**
+   * Appends a NAL unit. Its location must not be smaller than the location of the previous one. The slice type and
+   * slice header size are set later with setSliceHeader().
+   * @param nal_unit NAL unit to append.
+   */
+  void push_back(const NALUnit &nal_unit);
+  /**
+   * Stores the slice type and the rounded slice header size of the last NAL unit. Header sizes above 64 KiB are
+   * saturated.
+   * @param raw_slice_type slice_type syntax element of the slice header.
+   * @param slice_header_size Size of the slice header in bytes, 0 if it was not determined.
+   */
+  void setSliceHeader(uint8_t raw_slice_type, size_t slice_header_size);
+  /**
+   * Appends all NAL units of another index.
+   * @param other Index whose NAL units follow the NAL units of this index in the file.
+   */
+  void append(const NALIndex &other);
+  NALUnit operator[](size_t i) const;
+  NALUnit back() const { return (*this)[size() - 1]; }
+  size_t size() const { return locations.size(); }
+  bool empty() const { return locations.empty(); }
+  void reserve(size_t count);
+  /// Releases the unused capacity.
+  void shrink_to_fit();
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, size()); }
+  /// Number of bytes allocated by the index.
+  size_t getMemoryUsage() const;
+ private:
+  /// Low 32 bits of the locations.
+  std::vector<uint32_t> locations;
+  /// high_starts[k] is the index of the first NAL unit whose location is at least (k + 1) << 32.
+  std::vector<size_t> high_starts;
+  /// Sizes, UINT32_MAX if the size is in large_sizes.
+  std::vector<uint32_t> sizes;
+  /// Index and size of the NAL units whose size does not fit into 32 bits.
+  std::vector<std::pair<size_t, size_t>> large_sizes;
+  std::vector<uint16_t> slice_header_sizes;
+  /// nal_ref_idc (bits 5-6) and nal_unit_type (bits 0-4) as in the NAL unit header. Bit 7, i.e., the
+  /// forbidden_zero_bit, is set for 3 byte start codes.
+  std::vector<uint8_t> headers;
+  /// slice_type + 1 for slices, 0 otherwise.
+  std::vector<uint8_t> slice_types;
+};
+
+#endif //HEADER_PARSER_SRC_NALINDEX_H_
@@ -0,0 +1,67 @@
+#include "OutputBuffer.h"
+#include <algorithm>
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include "Stats.h"
+
+OutputBuffer::OutputBuffer(size_t capacity_) : capacity(std::max(capacity_, MAX_NUMBER_LENGTH + 1)) {}
+
+OutputBuffer::~OutputBuffer() {
+  close();
+}
+
+int32_t OutputBuffer::open(const std::string &path) {
+  close();
+  fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+  buffer.resize(capacity);
+  used = 0;
+  write_error = 0;
+  return 0;
+}
+
+int32_t OutputBuffer::flush() {
+  if (used > 0) {
+    writeAll(buffer.data(), used);
+    used = 0;
+  }
+  if (write_error != 0) {
+    errno = write_error;
+    return -1;
+  }
+  return 0;
+}
+
+int32_t OutputBuffer::close() {
+  if (fd < 0) {
+    return 0;
+  }
+  int32_t res = flush();
+  if (::close(fd) < 0 && res == 0) {
+    res = -1;
+  } else if (res < 0) {
+    errno = write_error;
+  }
+  fd = -1;
+  return res;
+}
+
+void OutputBuffer::writeAll(const char *data, size_t length) {
+  StageTimer timer(STAGE_OUTPUT_WRITE);
+  timer.addBytes(length);
+  while (write_error == 0 && length > 0) {
+    ssize_t res = write(fd, data, length);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      write_error = res < 0 ? errno : EIO;
+      break;
+    }
+    data += res;
+    length -= res;
+  }
+}
@@ -0,0 +1,92 @@
+#ifndef HEADER_PARSER_SRC_OUTPUTBUFFER_H_
+#define HEADER_PARSER_SRC_OUTPUTBUFFER_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "helper_functions.h"
+
+/**
+ * Buffered writer for the text outputs. Strings and integers are formatted directly into one large buffer, which is
+ * written with a single write() whenever it is full, so writing a line needs neither allocations nor iostream calls.
+ * The buffer is kept when the writer is reopened for the next file. Data can only be appended while a file is open.
+ */
+class OutputBuffer {
+ public:
+  /**
+   * @param capacity_ Size of the buffer. It is allocated when the first file is opened.
+   */
+  explicit OutputBuffer(size_t capacity_ = 1 << 20);
+  ~OutputBuffer();
+  OutputBuffer(const OutputBuffer &) = delete;
+  OutputBuffer &operator=(const OutputBuffer &) = delete;
+  /**
+   * Creates or truncates a file. A file that is still open is closed first.
+   * @param path Path to the file.
+   * @return 0 on success. -1 if the file could not be opened, errno is set.
+   */
+  int32_t open(const std::string &path);
+  /// True if a file is open.
+  bool isOpen() const { return fd >= 0; }
+  OutputBuffer &append(const char *data, size_t length) {
+    if (capacity - used < length) {
+      flush();
+      if (length > capacity) {
+        writeAll(data, length);
+        return *this;
+      }
+    }
+    memcpy(buffer.data() + used, data, length);
+    used += length;
+    return *this;
+  }
+  OutputBuffer &append(const char *str) { return append(str, strlen(str)); }
+  OutputBuffer &append(const std::string &str) { return append(str.data(), str.size()); }
+  OutputBuffer &append(char c) {
+    if (used == capacity) {
+      flush();
+    }
+    buffer[used++] = c;
+    return *this;
+  }
+  OutputBuffer &appendUnsigned(uint64_t value) {
+    if (capacity - used < MAX_NUMBER_LENGTH) {
+      flush();
+    }
+    used += formatUnsigned(buffer.data() + used, value);
+    return *this;
+  }
+  OutputBuffer &appendSigned(int64_t value) {
+    if (capacity - used < MAX_NUMBER_LENGTH + 1) {
+      flush();
+    }
+    used += formatSigned(buffer.data() + used, value);
+    return *this;
+  }
+  /**
+   * Writes the buffered data to the file.
+   * @return 0 on success. -1 if writing failed now or before, errno is set.
+   */
+  int32_t flush();
+  /**
+   * Flushes and closes the file.
+   * @return 0 on success. -1 if writing or closing failed, errno is set.
+   */
+  int32_t close();
+ private:
+  std::vector<char> buffer;
+  size_t capacity;
+  /// Number of buffered bytes.
+  size_t used = 0;
+  int32_t fd = -1;
+  /// errno of the first failed write, 0 if all writes succeeded.
+  int32_t write_error = 0;
+  /**
+   * Writes data directly to the file, retrying short writes.
+   */
+  void writeAll(const char *data, size_t length);
+};
+
+#endif //HEADER_PARSER_SRC_OUTPUTBUFFER_H_
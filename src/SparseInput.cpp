@@ -0,0 +1,48 @@
+#include "SparseInput.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+SparseInput::SparseInput(int32_t fd_, size_t file_size_, size_t read_size_)
+    : fd(fd_), file_size(file_size_), read_size(read_size_) {}
+
+size_t SparseInput::fill(size_t offset, size_t length) {
+  if (offset >= file_size) {
+    return 0;
+  }
+  length = std::min(length, file_size - offset);
+  if (offset >= start && offset + length <= start + size) {
+    return length;
+  }
+  // Keep the part of the range that is already resident and read only the rest.
+  size_t kept = 0;
+  if (offset >= start && offset < start + size) {
+    kept = start + size - offset;
+    memmove(buffer.data(), buffer.data() + (offset - start), kept);
+  }
+  size_t read_length = std::min(std::max(length, read_size), file_size - offset);
+  if (buffer.size() < read_length) {
+    buffer.resize(read_length);
+  }
+  start = offset;
+  size = kept;
+  while (size < read_length) {
+    ssize_t res = pread(fd, buffer.data() + size, read_length - size, static_cast<off_t>(offset + size));
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      if (res < 0) {
+        std::cerr << "pread: " << strerror(errno) << "\n";
+      }
+      failed = true;
+      break;
+    }
+    read_count++;
+    bytes_read += res;
+    size += res;
+  }
+  return std::min(length, size);
+}
@@ -0,0 +1,56 @@
+#ifndef HEADER_PARSER_SRC_SPARSEINPUT_H_
+#define HEADER_PARSER_SRC_SPARSEINPUT_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/**
+ * Random access view on a file that fetches only the requested ranges with pread(). Every read fetches at least
+ * read_size bytes, so headers that lie close together, e.g., a SPS, a PPS and the first slice, are served by a single
+ * read, while the payload in between distant headers is never read. This is intended for network file systems, where
+ * the page cache read-ahead of a mapping would transfer the whole file.
+ *
+ * The interface matches InputWindow, but offsets can be requested in any order.
+ */
+class SparseInput {
+ public:
+  /**
+   * @param fd_ File descriptor of a regular file. It is not closed by the input.
+   * @param file_size_ Size of the file.
+   * @param read_size_ Minimum number of bytes per read.
+   */
+  SparseInput(int32_t fd_, size_t file_size_, size_t read_size_);
+  /**
+   * Makes the range [offset, offset + length) resident. Bytes that are already resident are not read again.
+   * @param offset File offset of the range.
+   * @param length Length of the range.
+   * @return Number of resident bytes starting at offset. Less than length only at the end of the file or after a read
+   * error.
+   */
+  size_t fill(size_t offset, size_t length);
+  /// Pointer to the resident byte at getStart(). Invalidated by fill().
+  const uint8_t *getData() const { return buffer.data(); }
+  /// File offset of the first resident byte.
+  size_t getStart() const { return start; }
+  /// True if reading from the file descriptor failed.
+  bool hasFailed() const { return failed; }
+  /// Number of pread() calls so far.
+  size_t getReadCount() const { return read_count; }
+  /// Number of bytes read so far.
+  size_t getBytesRead() const { return bytes_read; }
+ private:
+  int32_t fd;
+  size_t file_size;
+  size_t read_size;
+  std::vector<uint8_t> buffer;
+  /// File offset of buffer[0].
+  size_t start = 0;
+  /// Number of resident bytes.
+  size_t size = 0;
+  bool failed = false;
+  size_t read_count = 0;
+  size_t bytes_read = 0;
+};
+
+#endif //HEADER_PARSER_SRC_SPARSEINPUT_H_
@@ -0,0 +1,165 @@
+#include "Stats.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <vector>
+#include <sys/resource.h>
+
+bool stats_enabled = false;
+
+static const char *const STAGE_NAMES[NUM_STAGES] = {
+    "box_walk", "nal_walk", "sps", "pps", "slice_header", "parse", "cache", "build_index", "csv", "mpd", "mpd_save",
+    "weight_load", "assign_weights", "info", "ranges", "index_file", "samples", "params", "output_write"};
+static const char *const UNIMPLEMENTED_NAMES[NUM_UNIMPLEMENTED] = {"ref_pic_list_mvc_modification"};
+/// Slice types modulo 5.
+static const char *const SLICE_TYPE_NAMES[5] = {"P", "B", "I", "SP", "SI"};
+
+/**
+ * A parsed video, listed in the order in which parsing finished.
+ */
+typedef struct {
+  std::string path;
+  size_t input_size;
+  uint64_t parse_ns;
+  size_t nal_units;
+} VideoStats;
+
+/// Guards all global counters. Only stages and videos take the lock, never single NAL units.
+static std::mutex stats_mutex;
+static StageCounters stage_counters[NUM_STAGES];
+static uint64_t unimplemented_counters[NUM_UNIMPLEMENTED];
+static uint64_t broken_slice_header_counter;
+static uint64_t nal_unit_counters[32];
+static uint64_t slice_counters[5];
+static std::vector<VideoStats> videos;
+static const uint64_t start_ns = getStatsClockNs();
+
+void ParseStats::add(const ParseStats &other) {
+  for (size_t i = 0; i < NUM_PARSE_STAGES; i++) {
+    stages[i].calls += other.stages[i].calls;
+    stages[i].ns += other.stages[i].ns;
+    stages[i].bytes += other.stages[i].bytes;
+  }
+  for (size_t i = 0; i < NUM_UNIMPLEMENTED; i++) {
+    unimplemented[i] += other.unimplemented[i];
+  }
+  broken_slice_headers += other.broken_slice_headers;
+}
+
+void recordStage(Stage stage, uint64_t ns, uint64_t bytes) {
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  stage_counters[stage].calls++;
+  stage_counters[stage].ns += ns;
+  stage_counters[stage].bytes += bytes;
+}
+
+void recordVideo(const std::string &video_file_path,
+                 size_t input_size,
+                 uint64_t parse_ns,
+                 const ParseStats &stats,
+                 const NALIndex &nal_units) {
+  // Counted outside of the lock, parallel batch jobs only serialize on the sums.
+  uint64_t nal_unit_types[32] = {};
+  uint64_t slice_types[5] = {};
+  for (const NALUnit &nal_unit : nal_units) {
+    nal_unit_types[nal_unit.nal_unit_type]++;
+    if (nal_unit.nal_unit_type == 1 || nal_unit.nal_unit_type == 5) {
+      slice_types[nal_unit.raw_slice_type % 5]++;
+    }
+  }
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  stage_counters[STAGE_PARSE].calls++;
+  stage_counters[STAGE_PARSE].ns += parse_ns;
+  stage_counters[STAGE_PARSE].bytes += input_size == SIZE_MAX ? 0 : input_size;
+  for (size_t i = 0; i < NUM_PARSE_STAGES; i++) {
+    stage_counters[i].calls += stats.stages[i].calls;
+    stage_counters[i].ns += stats.stages[i].ns;
+    stage_counters[i].bytes += stats.stages[i].bytes;
+  }
+  for (size_t i = 0; i < NUM_UNIMPLEMENTED; i++) {
+    unimplemented_counters[i] += stats.unimplemented[i];
+  }
+  broken_slice_header_counter += stats.broken_slice_headers;
+  for (size_t i = 0; i < 32; i++) {
+    nal_unit_counters[i] += nal_unit_types[i];
+  }
+  for (size_t i = 0; i < 5; i++) {
+    slice_counters[i] += slice_types[i];
+  }
+  videos.push_back({video_file_path, input_size == SIZE_MAX ? 0 : input_size, parse_ns, nal_units.size()});
+}
+
+static std::string toJSONString(const std::string &value) {
+  std::string ret = "\"";
+  for (char c : value) {
+    if (c == '"' || c == '\\') {
+      ret += '\\';
+      ret += c;
+    } else if (static_cast<unsigned char>(c) < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      ret += escaped;
+    } else {
+      ret += c;
+    }
+  }
+  return ret + "\"";
+}
+
+int32_t writeStats(const std::string &path) {
+  std::ostringstream json;
+  std::lock_guard<std::mutex> lock(stats_mutex);
+  uint64_t wall_ns = getStatsClockNs() - start_ns;
+  struct rusage usage{};
+  getrusage(RUSAGE_SELF, &usage);
+  json << "{\n  \"wall_ns\": " << wall_ns << ",\n  \"peak_rss_kb\": " << usage.ru_maxrss
+       << ",\n  \"stages\": {";
+  for (size_t i = 0; i < NUM_STAGES; i++) {
+    json << (i == 0 ? "\n" : ",\n") << "    \"" << STAGE_NAMES[i] << "\": {\"calls\": " << stage_counters[i].calls
+         << ", \"ns\": " << stage_counters[i].ns << ", \"bytes\": " << stage_counters[i].bytes << "}";
+  }
+  uint64_t total_nal_units = 0;
+  for (uint64_t count : nal_unit_counters) {
+    total_nal_units += count;
+  }
+  json << "\n  },\n  \"nal_units\": {\n    \"total\": " << total_nal_units << ",\n    \"by_type\": {";
+  bool first = true;
+  for (size_t i = 0; i < 32; i++) {
+    if (nal_unit_counters[i] > 0) {
+      json << (first ? "" : ", ") << "\"" << i << "\": " << nal_unit_counters[i];
+      first = false;
+    }
+  }
+  json << "}\n  },\n  \"slices\": {";
+  for (size_t i = 0; i < 5; i++) {
+    json << (i == 0 ? "" : ", ") << "\"" << SLICE_TYPE_NAMES[i] << "\": " << slice_counters[i];
+  }
+  json << "},\n  \"unimplemented\": {";
+  for (size_t i = 0; i < NUM_UNIMPLEMENTED; i++) {
+    json << (i == 0 ? "" : ", ") << "\"" << UNIMPLEMENTED_NAMES[i] << "\": " << unimplemented_counters[i];
+  }
+  json << "},\n  \"broken_slice_headers\": " << broken_slice_header_counter << ",\n  \"videos\": [";
+  for (size_t i = 0; i < videos.size(); i++) {
+    json << (i == 0 ? "\n" : ",\n") << "    {\"file\": " << toJSONString(videos[i].path) << ", \"bytes\": "
+         << videos[i].input_size << ", \"parse_ns\": " << videos[i].parse_ns << ", \"nal_units\": "
+         << videos[i].nal_units << "}";
+  }
+  json << (videos.empty() ? "]\n}\n" : "\n  ]\n}\n");
+  if (path.empty()) {
+    std::cout << json.str();
+    std::cout.flush();
+    return 0;
+  }
+  std::ofstream out(path, std::ofstream::trunc);
+  out << json.str();
+  out.close();
+  if (out.fail()) {
+    std::cerr << "could not write stats to " << path << ": " << strerror(errno) << "\n";
+    return -1;
+  }
+  return 0;
+}
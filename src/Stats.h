@@ -0,0 +1,156 @@
+#ifndef HEADER_PARSER_SRC_STATS_H_
+#define HEADER_PARSER_SRC_STATS_H_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "NALIndex.h"
+
+/**
+ * Stages whose calls, time and bytes are counted if --stats is given. Stages can be nested, e.g., mpd includes
+ * mpd_save and assign_weights, and parse includes the parse stages.
+ */
+enum Stage : uint8_t {
+  /// Top level MP4 boxes and the moov and moof box trees.
+  STAGE_BOX_WALK,
+  /// NAL unit headers, i.e., the length field or start code and the NAL unit header byte.
+  STAGE_NAL_WALK,
+  STAGE_SPS,
+  STAGE_PPS,
+  STAGE_SLICE_HEADER,
+  /// The stages above are counted per context, see ParseStats.
+  NUM_PARSE_STAGES,
+  /// parseVideo() or the parse rounds of parseFollow(), see recordVideo().
+  STAGE_PARSE = NUM_PARSE_STAGES,
+  STAGE_CACHE,
+  STAGE_BUILD_INDEX,
+  STAGE_CSV,
+  /// flushMPDFile() and runMPDAll() annotations.
+  STAGE_MPD,
+  /// Copying the rest of the MPD and replacing the file, see XmlHandler::save().
+  STAGE_MPD_SAVE,
+  /// Reading or mapping the weights, see WeightFile::open().
+  STAGE_WEIGHT_LOAD,
+  STAGE_ASSIGN_WEIGHTS,
+  STAGE_INFO,
+  STAGE_RANGES,
+  STAGE_INDEX_FILE,
+  STAGE_SAMPLES,
+  /// The parameter set CSV files, see flushParameterSets().
+  STAGE_PARAMS,
+  /// The write() calls of all OutputBuffers.
+  STAGE_OUTPUT_WRITE,
+  NUM_STAGES
+};
+
+/**
+ * Syntax that the parsers recognize but skip. The parse result of the rest of the NAL unit is wrong in that case.
+ */
+enum UnimplementedBranch : uint8_t {
+  /// ref_pic_list_mvc_modification() of a slice header.
+  UNIMPLEMENTED_MVC_MODIFICATION,
+  NUM_UNIMPLEMENTED
+};
+
+typedef struct {
+  uint64_t calls;
+  uint64_t ns;
+  uint64_t bytes;
+} StageCounters;
+
+/**
+ * Counters of the parse stages of a context. A context is only used by one thread at a time, so the counters need no
+ * synchronization. They are added to the global counters with recordVideo() when the video is parsed.
+ */
+struct ParseStats {
+  StageCounters stages[NUM_PARSE_STAGES] = {};
+  uint64_t unimplemented[NUM_UNIMPLEMENTED] = {};
+  /// Slice headers that were cut off or had out of range values, see setBrokenSliceHeader().
+  uint64_t broken_slice_headers = 0;
+  void add(const ParseStats &other);
+};
+
+/// True if --stats is given. Set before anything is parsed and not changed afterwards.
+extern bool stats_enabled;
+
+/**
+ * Checks if the stages should be counted. Like isTraceEnabled(), this is a single, well predicted branch.
+ */
+inline bool isStatsEnabled() { return __builtin_expect(stats_enabled, 0); }
+
+/**
+ * Reads the monotonic clock that all stages are measured with.
+ * @return Nanoseconds since an arbitrary, fixed point in time.
+ */
+inline uint64_t getStatsClockNs() {
+  auto since_epoch = std::chrono::steady_clock::now().time_since_epoch();
+  return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(since_epoch).count());
+}
+
+/**
+ * Adds the time, calls and bytes of a stage to the global counters. Thread-safe.
+ */
+void recordStage(Stage stage, uint64_t ns, uint64_t bytes);
+/**
+ * Adds the counters of a parsed video to the global counters: the parse stage, the stages of its context, its NAL units
+ * by type and its slices by type. The video is also listed with its size and parse time, so slow files can be found in
+ * batch runs. Thread-safe.
+ * @param video_file_path Path to the video.
+ * @param input_size Size of the video.
+ * @param parse_ns Time that parsing took.
+ * @param stats Parse stage counters of the context.
+ * @param nal_units The NAL units of the video.
+ */
+void recordVideo(const std::string &video_file_path,
+                 size_t input_size,
+                 uint64_t parse_ns,
+                 const ParseStats &stats,
+                 const NALIndex &nal_units);
+/**
+ * Writes the global counters, the wall time since the start of the program and the peak RSS as JSON.
+ * @param path Path to the JSON file. Empty for stdout.
+ * @return 0 on success. -1 if the file could not be written.
+ */
+int32_t writeStats(const std::string &path);
+
+/**
+ * Measures a stage from construction to destruction if stats are enabled. Parse stages are added to the counters of a
+ * context, all other stages to the global counters.
+ */
+class StageTimer {
+ public:
+  StageTimer(ParseStats &stats_, Stage stage_) : stats(&stats_), stage(stage_) { start(); }
+  explicit StageTimer(Stage stage_) : stats(nullptr), stage(stage_) { start(); }
+  ~StageTimer() {
+    if (isStatsEnabled()) {
+      uint64_t ns = getStatsClockNs() - start_ns;
+      if (stats != nullptr) {
+        StageCounters &counters = stats->stages[stage];
+        counters.calls++;
+        counters.ns += ns;
+        counters.bytes += bytes;
+      } else {
+        recordStage(stage, ns, bytes);
+      }
+    }
+  }
+  StageTimer(const StageTimer &) = delete;
+  StageTimer &operator=(const StageTimer &) = delete;
+  /// Adds to the bytes that the stage touched.
+  void addBytes(uint64_t bytes_) { bytes += bytes_; }
+
+ private:
+  ParseStats *stats;
+  Stage stage;
+  uint64_t bytes = 0;
+  uint64_t start_ns = 0;
+
+  void start() {
+    if (isStatsEnabled()) {
+      start_ns = getStatsClockNs();
+    }
+  }
+};
+
+#endif //HEADER_PARSER_SRC_STATS_H_
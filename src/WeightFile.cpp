@@ -0,0 +1,196 @@
+#include "WeightFile.h"
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "helper_functions.h"
+#include "Stats.h"
+
+WeightFile::~WeightFile() {
+  unmap();
+}
+
+int32_t WeightFile::open(const std::string &weight_source) {
+  StageTimer timer(STAGE_WEIGHT_LOAD);
+  unmap();
+  data.clear();
+  source = weight_source;
+  int32_t fd = ::open(weight_source.c_str(), O_RDONLY);
+  struct stat st{};
+  char magic[sizeof(WEIGHT_FILE_MAGIC)];
+  packed = fd >= 0 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && pread(fd, magic, sizeof(magic), 0) == sizeof(magic)
+      && memcmp(magic, WEIGHT_FILE_MAGIC, sizeof(magic)) == 0;
+  if (!packed) {
+    if (fd >= 0) {
+      close(fd);
+    }
+    readTextFiles();
+    return setData(reinterpret_cast<const uint8_t *>(data.data()), data.size() * sizeof(uint64_t));
+  }
+  void *addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED) {
+    std::cerr << "could not mmap weight file " << weight_source << ": " << strerror(errno) << "\n";
+    return -1;
+  }
+  mapping = addr;
+  mapping_size = st.st_size;
+  // The weights are needed after parsing the video, so the kernel can read them in the meantime.
+  madvise(mapping, mapping_size, MADV_WILLNEED);
+  if (setData(static_cast<const uint8_t *>(addr), mapping_size) < 0) {
+    std::cerr << "weight file " << weight_source << " is invalid\n";
+    unmap();
+    return -1;
+  }
+  return 0;
+}
+
+int32_t WeightFile::pack(const std::string &path) const {
+  return writeFileAtomically(path, {{bytes, size}});
+}
+
+const uint32_t *WeightFile::getWeights(uint32_t segment_no, size_t &count) const {
+  bool in_range = segment_no != 0 && segment_no <= getSegmentCount();
+  if (!in_range || (!packed && missing_errnos[segment_no - 1] != 0)) {
+    if (packed) {
+      std::cerr << "No weights for segment " << segment_no << " in " << source << "\n";
+    } else {
+      int32_t error = in_range ? missing_errnos[segment_no - 1] : missing_errno;
+      std::cerr << "Failed to open weight file " << getSegmentName(segment_no) << ": " << strerror(error) << "\n";
+    }
+    count = 0;
+    return nullptr;
+  }
+  count = offsets[segment_no] - offsets[segment_no - 1];
+  return weights + offsets[segment_no - 1];
+}
+
+std::string WeightFile::getSegmentName(uint32_t segment_no) const {
+  if (packed) {
+    return source + " segment " + std::to_string(segment_no);
+  }
+  return source + "-" + std::to_string(segment_no) + ".dat";
+}
+
+int32_t WeightFile::setData(const uint8_t *data_, size_t size_) {
+  bytes = data_;
+  size = size_;
+  header = reinterpret_cast<const WeightFileHeader *>(bytes);
+  if (size < sizeof(WeightFileHeader) || memcmp(header->magic, WEIGHT_FILE_MAGIC, sizeof(WEIGHT_FILE_MAGIC)) != 0
+      || header->version != WEIGHT_FILE_VERSION
+      || header->segment_count >= (size - sizeof(WeightFileHeader)) / sizeof(uint64_t)) {
+    header = nullptr;
+    return -1;
+  }
+  offsets = reinterpret_cast<const uint64_t *>(bytes + sizeof(WeightFileHeader));
+  size_t weights_offset = sizeof(WeightFileHeader) + (header->segment_count + 1) * sizeof(uint64_t);
+  weights = reinterpret_cast<const uint32_t *>(bytes + weights_offset);
+  uint64_t weight_count = (size - weights_offset) / sizeof(uint32_t);
+  for (uint64_t i = 0; i < header->segment_count; i++) {
+    if (offsets[i] > offsets[i + 1] || offsets[i + 1] > weight_count) {
+      header = nullptr;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * Finds the highest segment number of the text weight files <prefix>-<segment>.dat in the directory of the prefix.
+ * @param prefix Prefix of the text files.
+ * @return The segment number, or 0 if there are no files or the directory cannot be read.
+ */
+static uint32_t findLastSegment(const std::string &prefix) {
+  size_t slash = prefix.rfind('/');
+  std::string dir_name = slash == std::string::npos ? "." : prefix.substr(0, slash + 1);
+  std::string file_prefix = (slash == std::string::npos ? prefix : prefix.substr(slash + 1)) + "-";
+  DIR *dir = opendir(dir_name.c_str());
+  if (dir == nullptr) {
+    return 0;
+  }
+  uint32_t last_segment = 0;
+  while (const struct dirent *entry = readdir(dir)) {
+    const char *name = entry->d_name;
+    if (strncmp(name, file_prefix.c_str(), file_prefix.size()) != 0) {
+      continue;
+    }
+    const char *number = name + file_prefix.size();
+    char *end;
+    errno = 0;
+    unsigned long segment_no = strtoul(number, &end, 10);
+    if (end != number && *number != '-' && *number != '+' && errno == 0 && segment_no <= UINT32_MAX
+        && strcmp(end, ".dat") == 0 && segment_no > last_segment) {
+      last_segment = static_cast<uint32_t>(segment_no);
+    }
+  }
+  closedir(dir);
+  return last_segment;
+}
+
+void WeightFile::readTextFiles() {
+  std::vector<uint64_t> segment_offsets{0};
+  std::vector<uint32_t> segment_weights;
+  std::string content;
+  missing_errno = 0;
+  missing_errnos.clear();
+  // A missing file in between leaves its segment without weights, but the segments after it keep theirs.
+  uint32_t last_segment = findLastSegment(source);
+  for (uint32_t segment_no = 1;; segment_no++) {
+    std::ifstream in(getSegmentName(segment_no));
+    if (in.fail() && segment_no > last_segment) {
+      missing_errno = errno;
+      break;
+    }
+    missing_errnos.push_back(in.fail() ? errno : 0);
+    if (in.fail()) {
+      segment_offsets.push_back(segment_weights.size());
+      continue;
+    }
+    content.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    // Pairs of <poc> <weight>, up to the first one that is incomplete or not a number.
+    const char *pos = content.c_str();
+    while (true) {
+      char *end;
+      errno = 0;
+      strtoul(pos, &end, 10);
+      if (end == pos || errno != 0) {
+        break;
+      }
+      pos = end;
+      unsigned long weight = strtoul(pos, &end, 10);
+      if (end == pos || errno != 0 || weight > UINT32_MAX) {
+        break;
+      }
+      pos = end;
+      segment_weights.push_back(static_cast<uint32_t>(weight));
+    }
+    segment_offsets.push_back(segment_weights.size());
+  }
+  WeightFileHeader text_header{};
+  memcpy(text_header.magic, WEIGHT_FILE_MAGIC, sizeof(WEIGHT_FILE_MAGIC));
+  text_header.version = WEIGHT_FILE_VERSION;
+  text_header.segment_count = segment_offsets.size() - 1;
+  size_t offsets_size = segment_offsets.size() * sizeof(uint64_t);
+  size_t weights_size = segment_weights.size() * sizeof(uint32_t);
+  data.assign((sizeof(WeightFileHeader) + offsets_size + weights_size + 7) / 8, 0);
+  auto *dst = reinterpret_cast<uint8_t *>(data.data());
+  memcpy(dst, &text_header, sizeof(WeightFileHeader));
+  memcpy(dst + sizeof(WeightFileHeader), segment_offsets.data(), offsets_size);
+  memcpy(dst + sizeof(WeightFileHeader) + offsets_size, segment_weights.data(), weights_size);
+}
+
+void WeightFile::unmap() {
+  if (mapping != nullptr) {
+    munmap(mapping, mapping_size);
+    mapping = nullptr;
+    mapping_size = 0;
+  }
+  header = nullptr;
+}
@@ -0,0 +1,95 @@
+#ifndef HEADER_PARSER_SRC_WEIGHTFILE_H_
+#define HEADER_PARSER_SRC_WEIGHTFILE_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/// "HPWT" in file order.
+static const char WEIGHT_FILE_MAGIC[4] = {'H', 'P', 'W', 'T'};
+/// Incremented on every incompatible change of the layout.
+static const uint32_t WEIGHT_FILE_VERSION = 1;
+
+/**
+ * Header of a packed weight file. It is followed by segment_count + 1 uint64_t offsets, where the weights of segment N
+ * (starting at 1) are the uint32_t weights [offsets[N - 1], offsets[N]), and then by the weights of all segments. All
+ * values are little-endian.
+ */
+struct WeightFileHeader {
+  char magic[4];
+  uint32_t version;
+  uint64_t segment_count;
+};
+
+/**
+ * Frame weights of all segments of a video. The weights come either from a packed weight file, which is mapped and
+ * used in place, or from the text files <prefix>-<segment>.dat with one "<poc> <weight>" line per frame, which are read
+ * into memory in the packed layout. In both cases, the weights of a segment are found by its number without opening
+ * or parsing anything.
+ */
+class WeightFile {
+ public:
+  WeightFile() = default;
+  WeightFile(const WeightFile &) = delete;
+  WeightFile &operator=(const WeightFile &) = delete;
+  ~WeightFile();
+  /**
+   * Loads the weights. If weight_source is a packed weight file, it is mapped. Otherwise, it is the prefix of the text
+   * files, which are read from segment 1 up to the highest segment in the directory of the prefix. Segments whose
+   * file is missing have no weights.
+   * @param weight_source Path to a packed weight file or prefix of the text files.
+   * @return 0 on success. -1 if a packed weight file is invalid.
+   */
+  int32_t open(const std::string &weight_source);
+  /**
+   * Writes the loaded weights as a packed weight file.
+   * @param path Path to the packed weight file.
+   * @return 0 on success. -1 if the file could not be written.
+   */
+  int32_t pack(const std::string &path) const;
+  /// Number of segments with weights.
+  uint64_t getSegmentCount() const { return header == nullptr ? 0 : header->segment_count; }
+  /**
+   * Returns the weights of a segment in file order, including the weight of the I-frame. Prints an error if the
+   * segment has no weights.
+   * @param segment_no Number of the segment, starting at 1.
+   * @param count Receives the number of weights.
+   * @return The weights or nullptr if the segment has no weights.
+   */
+  const uint32_t *getWeights(uint32_t segment_no, size_t &count) const;
+  /**
+   * Returns a name for the weights of a segment in messages, i.e., the text file or the packed file and the segment.
+   * @param segment_no Number of the segment, starting at 1.
+   */
+  std::string getSegmentName(uint32_t segment_no) const;
+ private:
+  /**
+   * Checks the layout of the data and sets the table pointers.
+   * @return 0 on success. -1 if the data is not a valid weight file.
+   */
+  int32_t setData(const uint8_t *data_, size_t size_);
+  /**
+   * Reads the text files of weight_source into data.
+   */
+  void readTextFiles();
+  void unmap();
+  std::string source;
+  /// True if source is a packed weight file.
+  bool packed = false;
+  /// errno of the text file after the last segment.
+  int32_t missing_errno = 0;
+  /// errno of the text file of every segment, 0 if it was read.
+  std::vector<int32_t> missing_errnos;
+  /// Packed layout of the text files, stored in 64 bit words so the offsets are aligned.
+  std::vector<uint64_t> data;
+  const uint8_t *bytes = nullptr;
+  size_t size = 0;
+  const WeightFileHeader *header = nullptr;
+  const uint64_t *offsets = nullptr;
+  const uint32_t *weights = nullptr;
+  void *mapping = nullptr;
+  size_t mapping_size = 0;
+};
+
+#endif //HEADER_PARSER_SRC_WEIGHTFILE_H_
@@ -1,148 +1,358 @@
 #include "XmlHandler.h"
 #include <sys/stat.h>
 #include <iostream>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
-#include <libxml/xpath.h>
-#include <libxml/xpathInternals.h>
-#include <regex>
+#include <sstream>
+#include <unistd.h>
+#include "Stats.h"
 
 XmlHandler::XmlHandler() {
+  // Initialization is idempotent. Cleanup is left to the application, because xmlCleanupParser() would tear down the
+  // library for other handlers that are still in use on different threads.
   xmlInitParser();
   LIBXML_TEST_VERSION
-  xmlKeepBlanksDefault(0);
-  doc = nullptr;
-  segment_url_node = nullptr;
+  reader = nullptr;
+  writer = nullptr;
+  state = SEARCH_BASE_URL;
+  write_failed = false;
+  read_failed = false;
+  at_end = false;
+  base_url_depth = -1;
+  segment_list_depth = -1;
+  has_segment_url = false;
+  segment_url_empty = true;
   curr_range_start = 0;
   curr_range_end = 0;
 }
 
 XmlHandler::~XmlHandler() {
-  if (doc != nullptr) {
-    xmlFreeDoc(doc);
-  }
-  xmlCleanupParser();
+  discard();
 }
 
 int32_t XmlHandler::setFile(const std::string &xml_file, const std::string &video_file) {
-  std::regex regex(".*dash");
-  std::smatch regex_match;
-  if (!std::regex_search(video_file, regex_match, regex)) {
+  // The prefix ends with the last occurrence of dash.
+  size_t dash_pos = video_file.rfind("dash");
+  if (dash_pos == std::string::npos) {
     std::cerr << "Failed to find prefix .*dash in video file name. Can not locate BaseURL.\n";
     return -1;
   }
-  std::string base_url_prefix = regex_match[0];
-  location = xml_file;
-  struct stat st{};
-  int32_t res = stat(xml_file.c_str(), &st);
-  if (res < 0) {
-    std::cerr << "Something is wrong with the xml file: " << strerror(errno) << "\n";
+  if (openFile(xml_file) < 0) {
     return -1;
   }
-  doc = xmlParseFile(xml_file.c_str());
-  if (doc == nullptr) {
-    std::cerr << "Unable to parse xml file\n";
+  base_url_prefix = video_file.substr(0, dash_pos + 4);
+  if (!copyUntilSegmentURL()) {
+    if (state == SEARCH_BASE_URL) {
+      std::cerr << "Could not find BaseURL node with matching value: " << base_url_prefix << "\n";
+    } else if (segment_list_depth < 0) {
+      std::cerr << "Could not find SegmentList node\n";
+    } else {
+      std::cerr << "Could not find SegmentURL node\n";
+    }
+    discard();
     return -1;
   }
-  xmlXPathContextPtr xpath_ctx = xmlXPathNewContext(doc);
-  if (xpath_ctx == nullptr) {
-    std::cerr << "Unable to create xpath context\n";
+  updateCurrentRange();
+  return 0;
+}
+
+int32_t XmlHandler::setFile(const std::string &xml_file) {
+  if (openFile(xml_file) < 0) {
     return -1;
   }
-  if (xmlXPathRegisterNs(xpath_ctx, BAD_CAST "mpd", BAD_CAST "urn:mpeg:dash:schema:mpd:2011") < 0) {
-    std::cerr << "Failed to register namespace\n";
-    xmlXPathFreeContext(xpath_ctx);
-    return -1;
+  base_url_prefix.clear();
+  state = COPY_REST;
+  return 0;
+}
+
+bool XmlHandler::nextRepresentation() {
+  if (writer == nullptr) {
+    return false;
   }
-  std::string xpath_expr = "//mpd:BaseURL";
-  xmlXPathObjectPtr xpath_obj = xmlXPathEval(BAD_CAST xpath_expr.c_str(), xpath_ctx);
-  if (xpath_obj == nullptr) {
-    std::cerr << "Unable to evaluate xpath expression\n";
-    xmlXPathFreeContext(xpath_ctx);
-    return -1;
+  while (nextSegment()) {
   }
-  if (xpath_obj->nodesetval->nodeNr == 0) {
-    std::cerr << "Unable to find BaseURL nodes\n";
-    xmlXPathFreeObject(xpath_obj);
-    xmlXPathFreeContext(xpath_ctx);
+  while (!at_end) {
+    state = SEARCH_BASE_URL;
+    base_url_depth = -1;
+    segment_list_depth = -1;
+    if (copyUntilSegmentURL()) {
+      updateCurrentRange();
+      return true;
+    }
+  }
+  return false;
+}
+
+int32_t XmlHandler::getBaseURLs(const std::string &xml_file, std::vector<std::string> &base_urls) {
+  xmlInitParser();
+  xmlTextReaderPtr list_reader = xmlReaderForFile(xml_file.c_str(), nullptr, XML_PARSE_NOBLANKS);
+  if (list_reader == nullptr) {
+    std::cerr << "Unable to parse xml file\n";
     return -1;
   }
-  xmlNodePtr navigation_node = nullptr;
-  for (int32_t i = 0; i < xpath_obj->nodesetval->nodeNr; i++) {
-    xmlNodePtr next = xpath_obj->nodesetval->nodeTab[i];
-    auto *value = (char *) (xmlNodeGetContent(next));
-    if (strncmp(base_url_prefix.c_str(), value, base_url_prefix.size()) == 0) {
-      navigation_node = next;
-      break;
+  int32_t base_url_depth = -1;
+  int32_t res;
+  while ((res = xmlTextReaderRead(list_reader)) == 1) {
+    int32_t type = xmlTextReaderNodeType(list_reader);
+    if (type == XML_READER_TYPE_ELEMENT
+        && strcmp(reinterpret_cast<const char *>(xmlTextReaderConstLocalName(list_reader)), "BaseURL") == 0) {
+      base_url_depth = xmlTextReaderDepth(list_reader);
+    } else if (type == XML_READER_TYPE_TEXT && base_url_depth >= 0
+        && xmlTextReaderDepth(list_reader) == base_url_depth + 1) {
+      base_urls.emplace_back(reinterpret_cast<const char *>(xmlTextReaderConstValue(list_reader)));
+      base_url_depth = -1;
     }
   }
-  xmlXPathFreeObject(xpath_obj);
-  xmlXPathFreeContext(xpath_ctx);
-  if (navigation_node == nullptr) {
-    std::cerr << "Could not find BaseURL node with matching value: " << base_url_prefix << "\n";
+  xmlFreeTextReader(list_reader);
+  if (res < 0) {
+    std::cerr << "Unable to parse xml file\n";
     return -1;
   }
-  iterateSiblingsUntil(navigation_node, "SegmentList");
-  if (navigation_node == nullptr) {
-    std::cerr << "Could not find SegmentList node\n";
+  return 0;
+}
+
+int32_t XmlHandler::openFile(const std::string &xml_file) {
+  location = xml_file;
+  struct stat st{};
+  int32_t res = stat(xml_file.c_str(), &st);
+  if (res < 0) {
+    std::cerr << "Something is wrong with the xml file: " << strerror(errno) << "\n";
     return -1;
   }
-  if (navigation_node->children == nullptr) {
-    std::cerr << "SegmentList node has no child\n";
+  // XML_PARSE_NOBLANKS drops the whitespace between elements, the writer indents the output instead.
+  reader = xmlReaderForFile(xml_file.c_str(), nullptr, XML_PARSE_NOBLANKS);
+  if (reader == nullptr) {
+    std::cerr << "Unable to parse xml file\n";
     return -1;
   }
-  navigation_node = navigation_node->children;
-  iterateSiblingsUntil(navigation_node, "SegmentURL");
-  if (navigation_node == nullptr) {
-    std::cerr << "Could not find SegmentURL node\n";
+  tmp_location = xml_file + ".XXXXXX";
+  int32_t tmp_fd = mkstemp(&tmp_location[0]);
+  if (tmp_fd < 0) {
+    std::cerr << "Unable to create temporary xml file: " << strerror(errno) << "\n";
+    tmp_location.clear();
+    discard();
     return -1;
   }
-  segment_url_node = navigation_node;
-  updateCurrentRange();
+  // The rewritten file replaces the MPD, so it gets the same permissions.
+  fchmod(tmp_fd, st.st_mode & 07777);
+  close(tmp_fd);
+  writer = xmlNewTextWriterFilename(tmp_location.c_str(), 0);
+  if (writer == nullptr) {
+    std::cerr << "Unable to create xml writer\n";
+    discard();
+    return -1;
+  }
+  xmlTextWriterSetIndent(writer, 1);
+  xmlTextWriterSetIndentString(writer, BAD_CAST "  ");
+  if (xmlTextWriterStartDocument(writer, nullptr, "UTF-8", nullptr) < 0) {
+    write_failed = true;
+  }
   return 0;
 }
 
 int32_t XmlHandler::save() {
-  if (doc == nullptr) {
+  StageTimer timer(STAGE_MPD_SAVE);
+  if (writer == nullptr) {
     std::cerr << "save called on invalid file or before setFile was called\n";
     return -1;
   }
-  return xmlSaveFormatFileEnc(location.c_str(), doc, "UTF-8", 1);
+  if (has_segment_url) {
+    writeSegmentURL();
+  }
+  state = COPY_REST;
+  copyUntilSegmentURL();
+  if (xmlTextWriterEndDocument(writer) < 0) {
+    write_failed = true;
+  }
+  xmlFreeTextWriter(writer);
+  writer = nullptr;
+  if (read_failed) {
+    std::cerr << "Unable to parse xml file " << location << ", it is left unchanged\n";
+    discard();
+    return -1;
+  }
+  if (write_failed || rename(tmp_location.c_str(), location.c_str()) < 0) {
+    std::cerr << "Unable to write xml file " << location << "\n";
+    discard();
+    return -1;
+  }
+  tmp_location.clear();
+  discard();
+  return 0;
 }
 
 bool XmlHandler::nextSegment() {
-  if (segment_url_node->next == nullptr) {
+  if (!has_segment_url) {
+    return false;
+  }
+  writeSegmentURL();
+  if (!copyUntilSegmentURL()) {
     return false;
   }
-  segment_url_node = segment_url_node->next;
   updateCurrentRange();
   return true;
 }
 
 void XmlHandler::addAttribute(const std::string &name, const std::string &value) {
-  if (xmlHasProp(segment_url_node, BAD_CAST name.c_str()) != nullptr) {
-    std::cerr << "Warning: overwriting existing attribute\n";
-    xmlSetProp(segment_url_node, BAD_CAST name.c_str(), BAD_CAST value.c_str());
-  } else {
-    xmlNewProp(segment_url_node, BAD_CAST name.c_str(), BAD_CAST value.c_str());
+  if (!has_segment_url) {
+    std::cerr << "Warning: no SegmentURL element left for attribute " << name << "\n";
+    return;
+  }
+  for (auto &attribute : segment_url_attributes) {
+    if (attribute.first == name) {
+      std::cerr << "Warning: overwriting existing attribute\n";
+      attribute.second = value;
+      return;
+    }
   }
+  segment_url_attributes.emplace_back(name, value);
 }
 
-void XmlHandler::iterateSiblingsUntil(xmlNodePtr &start, const std::string &until_name) {
-  while (start != nullptr) {
-    if (strcmp((char *) start->name, until_name.c_str()) == 0) {
-      return;
+bool XmlHandler::copyUntilSegmentURL() {
+  if (reader == nullptr) {
+    return false;
+  }
+  while (!at_end) {
+    int32_t res = xmlTextReaderRead(reader);
+    if (res != 1) {
+      // -1 is a parse error. The rest of the MPD is missing from the copy, so it must not replace the MPD.
+      read_failed = res < 0;
+      at_end = true;
+      break;
+    }
+    int32_t type = xmlTextReaderNodeType(reader);
+    int32_t depth = xmlTextReaderDepth(reader);
+    const char *local_name = reinterpret_cast<const char *>(xmlTextReaderConstLocalName(reader));
+    bool is_element = type == XML_READER_TYPE_ELEMENT;
+    bool is_end_element = type == XML_READER_TYPE_END_ELEMENT;
+    if (state == SEARCH_SEGMENT_LIST && is_element && strcmp(local_name, "BaseURL") == 0) {
+      // Another BaseURL before a SegmentList, e.g., after the BaseURL of the MPD or Period. Start over with it.
+      state = SEARCH_BASE_URL;
+    }
+    if (state == SEARCH_BASE_URL) {
+      if (is_element && strcmp(local_name, "BaseURL") == 0) {
+        base_url_depth = depth;
+      } else if (is_end_element && depth == base_url_depth) {
+        base_url_depth = -1;
+      } else if (type == XML_READER_TYPE_TEXT && base_url_depth >= 0 && depth == base_url_depth + 1) {
+        const char *value = reinterpret_cast<const char *>(xmlTextReaderConstValue(reader));
+        if (strncmp(base_url_prefix.c_str(), value, base_url_prefix.size()) == 0) {
+          base_url = value;
+          state = SEARCH_SEGMENT_LIST;
+        }
+      }
+    } else if (state == SEARCH_SEGMENT_LIST) {
+      if (is_element && depth == base_url_depth && strcmp(local_name, "SegmentList") == 0) {
+        segment_list_depth = depth;
+        if (xmlTextReaderIsEmptyElement(reader)) {
+          state = COPY_REST;
+          copyNode();
+          return false;
+        }
+        state = IN_SEGMENT_LIST;
+      } else if (is_end_element && depth < base_url_depth) {
+        // The parent of the BaseURL ended without a SegmentList.
+        state = COPY_REST;
+        copyNode();
+        return false;
+      }
+    } else if (state == IN_SEGMENT_LIST) {
+      if (is_element && depth == segment_list_depth + 1 && strcmp(local_name, "SegmentURL") == 0) {
+        segment_url_name = reinterpret_cast<const char *>(xmlTextReaderConstName(reader));
+        segment_url_empty = xmlTextReaderIsEmptyElement(reader);
+        segment_url_attributes.clear();
+        while (xmlTextReaderMoveToNextAttribute(reader) == 1) {
+          segment_url_attributes.emplace_back(reinterpret_cast<const char *>(xmlTextReaderConstName(reader)),
+                                              reinterpret_cast<const char *>(xmlTextReaderConstValue(reader)));
+        }
+        xmlTextReaderMoveToElement(reader);
+        has_segment_url = true;
+        return true;
+      } else if (is_end_element && depth == segment_list_depth) {
+        state = COPY_REST;
+        copyNode();
+        return false;
+      }
+    }
+    copyNode();
+  }
+  return false;
+}
+
+void XmlHandler::copyNode() {
+  int32_t res = 0;
+  switch (xmlTextReaderNodeType(reader)) {
+    case XML_READER_TYPE_ELEMENT: {
+      res = xmlTextWriterStartElement(writer, xmlTextReaderConstName(reader));
+      bool is_empty = xmlTextReaderIsEmptyElement(reader);
+      while (res >= 0 && xmlTextReaderMoveToNextAttribute(reader) == 1) {
+        res = xmlTextWriterWriteAttribute(writer, xmlTextReaderConstName(reader), xmlTextReaderConstValue(reader));
+      }
+      xmlTextReaderMoveToElement(reader);
+      if (res >= 0 && is_empty) {
+        res = xmlTextWriterEndElement(writer);
+      }
+      break;
+    }
+    case XML_READER_TYPE_END_ELEMENT: {
+      res = xmlTextWriterEndElement(writer);
+      break;
+    }
+    case XML_READER_TYPE_TEXT: {
+      res = xmlTextWriterWriteString(writer, xmlTextReaderConstValue(reader));
+      break;
+    }
+    case XML_READER_TYPE_CDATA: {
+      res = xmlTextWriterWriteCDATA(writer, xmlTextReaderConstValue(reader));
+      break;
+    }
+    case XML_READER_TYPE_COMMENT: {
+      res = xmlTextWriterWriteComment(writer, xmlTextReaderConstValue(reader));
+      break;
+    }
+    case XML_READER_TYPE_PROCESSING_INSTRUCTION: {
+      res = xmlTextWriterWritePI(writer, xmlTextReaderConstName(reader), xmlTextReaderConstValue(reader));
+      break;
+    }
+    default: {
+      // Whitespace between elements is replaced by the indentation. MPDs have no document type declarations.
+      break;
     }
-    start = start->next;
+  }
+  if (res < 0) {
+    write_failed = true;
   }
 }
 
+void XmlHandler::writeSegmentURL() {
+  int32_t res = xmlTextWriterStartElement(writer, BAD_CAST segment_url_name.c_str());
+  for (const auto &attribute : segment_url_attributes) {
+    if (res >= 0) {
+      res = xmlTextWriterWriteAttribute(writer, BAD_CAST attribute.first.c_str(), BAD_CAST attribute.second.c_str());
+    }
+  }
+  if (res >= 0 && segment_url_empty) {
+    res = xmlTextWriterEndElement(writer);
+  }
+  if (res < 0) {
+    write_failed = true;
+  }
+  has_segment_url = false;
+}
+
 void XmlHandler::updateCurrentRange() {
-  xmlChar *media_range = xmlGetProp(segment_url_node, BAD_CAST "mediaRange");
+  const std::string *media_range = nullptr;
+  for (const auto &attribute : segment_url_attributes) {
+    if (attribute.first == "mediaRange") {
+      media_range = &attribute.second;
+    }
+  }
   if (media_range == nullptr) {
     std::cerr << "SegmentURL node does not have mediaRange property. Should not happen.\n";
     return;
   }
-  std::stringstream ss(std::string((char *) media_range));
+  std::stringstream ss(*media_range);
   std::string start_token;
   std::string end_token;
   if (!getline(ss, start_token, '-')) {
@@ -153,6 +363,22 @@ void XmlHandler::updateCurrentRange() {
     std::cerr << "Could not read range end\n";
     return;
   }
-  curr_range_start = stoul(start_token);
-  curr_range_end = stoul(end_token);
+  curr_range_start = stoull(start_token);
+  curr_range_end = stoull(end_token);
+}
+
+void XmlHandler::discard() {
+  if (writer != nullptr) {
+    xmlFreeTextWriter(writer);
+    writer = nullptr;
+  }
+  if (reader != nullptr) {
+    xmlFreeTextReader(reader);
+    reader = nullptr;
+  }
+  if (!tmp_location.empty()) {
+    unlink(tmp_location.c_str());
+    tmp_location.clear();
+  }
+  has_segment_url = false;
 }
@@ -1,37 +1,73 @@
 #ifndef XMLHANDLER_H_
 #define XMLHANDLER_H_
 
-#include <libxml/tree.h>
+#include <libxml/xmlreader.h>
+#include <libxml/xmlwriter.h>
 #include <string>
+#include <utility>
 #include <vector>
 #include <cstdint>
 
 /**
  * Helper class that handles all the annoying libxml details for the user. This class is specialized to our use case,
- * i.e., finding a specific BaseURL element and iterating over the SegmentList of that element.
+ * i.e., finding a specific BaseURL element and iterating over the SegmentList of that element, or visiting the
+ * SegmentLists of all BaseURL elements in turn with nextRepresentation().
+ *
+ * The MPD is rewritten in a single streaming pass: an xmlTextReader copies every node to an xmlTextWriter on a temporary
+ * file, except for the SegmentURL elements of the selected SegmentList, which are held back until their attributes are
+ * complete. save() copies the rest and replaces the MPD. Only the current node is in memory, independent of the size
+ * of the MPD, and segments can only be visited in order.
  */
 class XmlHandler {
  public:
   XmlHandler();
   ~XmlHandler();
+  XmlHandler(const XmlHandler &) = delete;
+  XmlHandler &operator=(const XmlHandler &) = delete;
   /**
    * Sets the MPD file and the video name. This function tries to open the MPD file and locate the corresponding BaseURL
    * element. See also flushMPDFile() on how the correct BaseURL element is located. When the BaseURL element is found,
-   * the function tries to navigate to the SegmentList element of the current Representation set. When it is successful,
-   * the class can be used to add attributes to the SegmentURL elements.
+   * the function copies the MPD up to the first SegmentURL element of the SegmentList of the current Representation
+   * set. When it is successful, the class can be used to add attributes to the SegmentURL elements.
    * @param xml_file Path to the MPD file.
    * @param video_file Name (or prefix) of the video.
-   * @return 0 on success. -1 in case an error occurred.
+   * @return 0 on success. -1 in case an error occurred. The MPD file is not modified in that case.
    */
   int32_t setFile(const std::string &xml_file, const std::string &video_file);
   /**
-   * Writes the attributes that were added to the MPD file.
+   * Sets the MPD file without selecting a representation. The representations are visited in document order with
+   * nextRepresentation().
+   * @param xml_file Path to the MPD file.
+   * @return 0 on success. -1 in case an error occurred.
+   */
+  int32_t setFile(const std::string &xml_file);
+  /**
+   * Copies the rest of the current SegmentList without further attributes and moves to the first SegmentURL element of
+   * the next BaseURL element that has a SegmentList.
+   * @return true if there is a next representation. False if the end of the MPD is reached.
+   */
+  bool nextRepresentation();
+  /**
+   * Returns the value of the BaseURL element of the current representation.
+   * @return BaseURL value.
+   */
+  const std::string &getBaseURL() const { return base_url; }
+  /**
+   * Reads the values of all BaseURL elements of an MPD file, in document order.
+   * @param xml_file Path to the MPD file.
+   * @param base_urls Vector that receives the values.
+   * @return 0 on success. -1 if the file could not be parsed.
+   */
+  static int32_t getBaseURLs(const std::string &xml_file, std::vector<std::string> &base_urls);
+  /**
+   * Copies the rest of the MPD and replaces the MPD file with the rewritten one. If the MPD could not be parsed to its
+   * end or the copy could not be written, the MPD is left unchanged.
    * @return 0 on success. -1 in case an error occurred.
    */
   int32_t save();
   /**
-   * Set the internal pointer to the next SegmentURL element, if possible.
-   * @return true if pointer was moved. False if end of the SegmentList is reached.
+   * Writes the current SegmentURL element and moves to the next one of the SegmentList, if possible.
+   * @return true if there is a next element. False if end of the SegmentList is reached.
    */
   bool nextSegment();
   /**
@@ -45,33 +81,86 @@ class XmlHandler {
    * Returns the start value of the mediaRange attribute for the current SegmentURL element.
    * @return Range start value.
    */
-  uint32_t getRangeStart() { return curr_range_start; }
+  size_t getRangeStart() { return curr_range_start; }
   /**
    * Returns the end value of the mediaRange attribute for the current SegmentURL element.
    * @return Range end value.
    */
-  uint32_t getRangeEnd() { return curr_range_end; }
+  size_t getRangeEnd() { return curr_range_end; }
 
  private:
-  xmlDocPtr doc;
-  /// Pointer to the currently selected SegmentURL element. Calls to addAttribute modify this element.
-  xmlNodePtr segment_url_node;
+  /**
+   * Progress of the pass through the MPD.
+   */
+  enum State {
+    /// Looking for a BaseURL element whose value starts with base_url_prefix.
+    SEARCH_BASE_URL,
+    /// Looking for the SegmentList sibling of the matching BaseURL element.
+    SEARCH_SEGMENT_LIST,
+    /// Inside the SegmentList.
+    IN_SEGMENT_LIST,
+    /// The SegmentList is done or there is none, the rest is only copied.
+    COPY_REST
+  };
+  xmlTextReaderPtr reader;
+  xmlTextWriterPtr writer;
+  State state;
+  /// True if writing failed.
+  bool write_failed;
+  /// True if the MPD could not be parsed to its end.
+  bool read_failed;
+  /// True once the reader reached the end of the MPD.
+  bool at_end;
+  /// Prefix of the video name that the BaseURL has to start with. Empty to match every BaseURL.
+  std::string base_url_prefix;
+  /// Value of the matching BaseURL element.
+  std::string base_url;
+  /// Depth of the current BaseURL element in SEARCH_BASE_URL, of the matching one in SEARCH_SEGMENT_LIST, -1 otherwise.
+  int32_t base_url_depth;
+  /// Depth of the SegmentList element.
+  int32_t segment_list_depth;
+  /// True if the current SegmentURL element is held back, i.e., read but not written yet.
+  bool has_segment_url;
+  /// Qualified name of the current SegmentURL element.
+  std::string segment_url_name;
+  /// Attributes of the current SegmentURL element, including the added ones.
+  std::vector<std::pair<std::string, std::string>> segment_url_attributes;
+  /// True if the current SegmentURL element has no children.
+  bool segment_url_empty;
   /// MPD file location.
   std::string location;
-  uint32_t curr_range_start;
-  uint32_t curr_range_end;
+  /// Location of the rewritten MPD until save() renames it.
+  std::string tmp_location;
+  size_t curr_range_start;
+  size_t curr_range_end;
+  /**
+   * Opens the reader on the MPD file and the writer on a temporary file.
+   * @return 0 on success. -1 in case an error occurred.
+   */
+  int32_t openFile(const std::string &xml_file);
+  /**
+   * Copies nodes from the reader to the writer until the next SegmentURL element of the selected SegmentList, which is
+   * held back. Stops at the end of the SegmentList, or if the BaseURL has no SegmentList.
+   * @return true if a SegmentURL element was found.
+   */
+  bool copyUntilSegmentURL();
+  /**
+   * Copies the current node of the reader to the writer. Whitespace between elements is dropped and the output is
+   * indented instead.
+   */
+  void copyNode();
   /**
-   * Iterates through the siblings of a given node until either a sibling with a matching name is found or until there
-   * are no siblings left.
-   * @param start Pointer to the node whose siblings should be iterated.
-   * @param until_name Name of the node that is searched for.
+   * Writes the held back SegmentURL element with its attributes. Its children, if any, are copied afterwards.
    */
-  void iterateSiblingsUntil(xmlNodePtr &start, const std::string &until_name);
+  void writeSegmentURL();
   /**
-   * Reads the mediaRange attribute of the current SegmentURL node and updates the internal range fields.
+   * Reads the mediaRange attribute of the current SegmentURL element and updates the internal range fields.
    */
   void updateCurrentRange();
-
+  /**
+   * Releases the reader and the writer and removes the temporary file.
+   */
+  void discard();
 };
 
 #endif //XMLHANDLER_H_
@@ -0,0 +1,428 @@
+#include "box_parse.h"
+#include <algorithm>
+#include <iostream>
+#include <utility>
+#include <vector>
+#include "defines.h"
+#include "helper_functions.h"
+
+using std::cout;
+using std::cerr;
+
+/// sample_is_non_sync_sample in the sample flags of a track fragment (ISO/IEC 14496-12 Chapter 8.8.3.1).
+static const uint32_t SAMPLE_IS_NON_SYNC = 0x00010000;
+/// Maximum nesting depth of the box tree. The deepest parsed boxes (moov/trak/mdia/minf/stbl) are at depth 5.
+static const uint32_t MAX_BOX_DEPTH = 16;
+/// Maximum number of samples of a run or track that cannot be bounded by the size of the input, i.e., samples of size 0
+/// or inputs of unknown size.
+static const uint32_t MAX_UNBOUNDED_SAMPLE_COUNT = 1 << 20;
+
+/**
+ * Sample tables of the trak box that is currently parsed. The samples are built from them when the trak box is
+ * complete, because the order of the boxes inside stbl is not fixed.
+ */
+struct SampleTables {
+  /// Constant sample size from stsz. 0 if the sizes are listed in sample_sizes.
+  uint32_t sample_size = 0;
+  uint32_t sample_count = 0;
+  std::vector<uint32_t> sample_sizes;
+  /// From stco or co64.
+  std::vector<uint64_t> chunk_offsets;
+  /// stsc entries: first_chunk, samples_per_chunk.
+  std::vector<std::pair<uint32_t, uint32_t>> sample_to_chunk;
+  /// stts entries: sample_count, sample_delta.
+  std::vector<std::pair<uint32_t, uint32_t>> time_to_sample;
+  /// ctts entries: sample_count, sample_offset.
+  std::vector<std::pair<uint32_t, int32_t>> composition_offsets;
+  /// stss entries. If there is no stss box, every sample is a sync sample.
+  bool has_sync_samples = false;
+  std::vector<uint32_t> sync_samples;
+};
+
+/**
+ * State of the box tree that is currently parsed.
+ */
+struct BoxTreeState {
+  /// Index of the current track in the tracks vector of the context. Set by tkhd and tfhd.
+  size_t track_index = SIZE_MAX;
+  SampleTables tables;
+  /// Location of the current moof box.
+  size_t moof_offset = 0;
+  /// True until the first traf box of the moof box is complete.
+  bool first_traf = true;
+  /// Base data offset of the current track fragment.
+  size_t base_data_offset = 0;
+  /// Offset of the data of the next sample in the current track fragment.
+  size_t next_data_offset = 0;
+  /// tfhd values of the current track fragment.
+  uint32_t default_sample_duration = 0;
+  uint32_t default_sample_size = 0;
+  uint32_t default_sample_flags = 0;
+  uint64_t decode_time = 0;
+};
+
+bool isBoxTreeRoot(uint32_t type) { return type == fourCC("moov") || type == fourCC("moof"); }
+
+/**
+ * Checks if the box only contains other boxes that are parsed.
+ * @param type Type of the box.
+ * @return true if the children of the box are parsed.
+ */
+static bool isContainerBox(uint32_t type) {
+  return type == fourCC("trak") || type == fourCC("mdia") || type == fourCC("minf") || type == fourCC("stbl")
+      || type == fourCC("mvex") || type == fourCC("traf");
+}
+
+/**
+ * Returns the track with the specified ID. The track is created if it is unknown, e.g., for a tfhd box without moov.
+ * @param ctx Context that holds the tracks.
+ * @param track_id ID of the track.
+ * @return Index of the track.
+ */
+static size_t findTrack(ParserContext &ctx, uint32_t track_id) {
+  for (size_t i = 0; i < ctx.tracks.size(); i++) {
+    if (ctx.tracks[i].track_id == track_id) {
+      return i;
+    }
+  }
+  MP4Track track{};
+  track.track_id = track_id;
+  ctx.tracks.push_back(track);
+  return ctx.tracks.size() - 1;
+}
+
+/**
+ * Reads the header of the box at the read position. A size of 1 means that a 64 bit largesize follows, a size of 0
+ * that the box extends to the end of its parent.
+ * @param reader Reader positioned at the box.
+ * @param end End of the parent box.
+ * @param box Receives the location, size and type of the box.
+ * @return 0 on success. -1 if the box exceeds its parent.
+ */
+static int32_t readBoxHeader(BitReader &reader, size_t end, MP4Box &box) {
+  box.location_relative = reader.getOffset();
+  uint64_t size = reader.readUnsignedInt32("size");
+  box.type = reader.readUnsignedInt32();
+  if (isTraceEnabled(TRACE_DEBUG)) {
+    traceElement(box.location_relative + 4, 0, "name", getNameString(box.type));
+  }
+  if (size == 1) {
+    size = reader.readUnsignedInt64("largesize");
+  } else if (size == 0) {
+    size = end - box.location_relative;
+  }
+  if (size < reader.getOffset() - box.location_relative || size > end - box.location_relative) {
+    cerr << "Box " << getNameString(box.type) << " at " << box.location_relative << " exceeds its parent\n";
+    return -1;
+  }
+  box.size = size;
+  box.header_size = static_cast<uint8_t>(reader.getOffset() - box.location_relative);
+  return 0;
+}
+
+/**
+ * Limits the entry count of a table to the number of entries that fit into the rest of the box, so a corrupt count
+ * cannot cause huge allocations.
+ */
+static uint32_t clampEntryCount(const BitReader &reader, size_t end, uint32_t entry_count, size_t entry_size) {
+  size_t offset = reader.getOffset();
+  size_t max_count = offset < end ? (end - offset) / entry_size : 0;
+  return entry_count < max_count ? entry_count : static_cast<uint32_t>(max_count);
+}
+
+/**
+ * Limits the number of samples of constant size that start at an offset to the number that fits into the rest of the
+ * input, so a corrupt count in a box without per-sample entries cannot cause huge allocations.
+ */
+static uint32_t clampSampleCount(const ParserContext &ctx, uint64_t offset, uint32_t sample_count,
+                                 uint32_t sample_size) {
+  uint64_t max_count = MAX_UNBOUNDED_SAMPLE_COUNT;
+  if (sample_size > 0 && ctx.input_size != SIZE_MAX) {
+    max_count = offset < ctx.input_size ? (ctx.input_size - offset) / sample_size : 0;
+  }
+  return sample_count < max_count ? sample_count : static_cast<uint32_t>(max_count);
+}
+
+/**
+ * Appends the samples that are described by the sample tables of the current trak box to the context.
+ */
+static void buildTrackSamples(ParserContext &ctx, BoxTreeState &state) {
+  const SampleTables &tables = state.tables;
+  if (state.track_index == SIZE_MAX) {
+    return;
+  }
+  MP4Track &track = ctx.tracks[state.track_index];
+  uint32_t sample_number = 1;
+  uint64_t decode_time = 0;
+  size_t stsc_index = 0;
+  size_t stts_index = 0;
+  uint32_t stts_used = 0;
+  size_t ctts_index = 0;
+  uint32_t ctts_used = 0;
+  size_t stss_index = 0;
+  // Samples without a size do not exist. Without sample_sizes, the count is only limited by the input.
+  uint32_t sample_count = tables.sample_size == 0
+      ? std::min<uint32_t>(tables.sample_count, tables.sample_sizes.size())
+      : clampSampleCount(ctx, 0, tables.sample_count, tables.sample_size);
+  for (uint32_t chunk = 1; chunk <= tables.chunk_offsets.size() && sample_number <= sample_count; chunk++) {
+    while (stsc_index + 1 < tables.sample_to_chunk.size() && tables.sample_to_chunk[stsc_index + 1].first <= chunk) {
+      stsc_index++;
+    }
+    if (tables.sample_to_chunk.empty()) {
+      break;
+    }
+    uint32_t samples_per_chunk = tables.sample_to_chunk[stsc_index].second;
+    uint64_t offset = tables.chunk_offsets[chunk - 1];
+    for (uint32_t i = 0; i < samples_per_chunk && sample_number <= sample_count; i++, sample_number++) {
+      MP4Sample sample{};
+      sample.track_id = track.track_id;
+      sample.location_relative = offset;
+      sample.size = tables.sample_size != 0 ? tables.sample_size : tables.sample_sizes[sample_number - 1];
+      sample.decode_time = decode_time;
+      while (stts_index < tables.time_to_sample.size() && stts_used == tables.time_to_sample[stts_index].first) {
+        stts_index++;
+        stts_used = 0;
+      }
+      if (stts_index < tables.time_to_sample.size()) {
+        decode_time += tables.time_to_sample[stts_index].second;
+        stts_used++;
+      }
+      while (ctts_index < tables.composition_offsets.size()
+          && ctts_used == tables.composition_offsets[ctts_index].first) {
+        ctts_index++;
+        ctts_used = 0;
+      }
+      if (ctts_index < tables.composition_offsets.size()) {
+        sample.composition_offset = tables.composition_offsets[ctts_index].second;
+        ctts_used++;
+      }
+      if (tables.has_sync_samples) {
+        while (stss_index < tables.sync_samples.size() && tables.sync_samples[stss_index] < sample_number) {
+          stss_index++;
+        }
+        sample.sync = stss_index < tables.sync_samples.size() && tables.sync_samples[stss_index] == sample_number;
+      } else {
+        sample.sync = true;
+      }
+      ctx.samples.push_back(sample);
+      offset += sample.size;
+    }
+  }
+  track.next_decode_time = decode_time;
+}
+
+/**
+ * Parses a trun box and appends its samples to the context.
+ */
+static void parseTrackRun(ParserContext &ctx, BitReader &reader, size_t end, BoxTreeState &state) {
+  // The version only changes the signedness of the composition offsets.
+  reader.skipBits(8);
+  uint32_t flags = reader.readNBits(24, "flags");
+  uint32_t sample_count = reader.readUnsignedInt32("sample_count");
+  // Without a data offset, the data of the run follows the previous run.
+  size_t data_offset = state.next_data_offset;
+  if (flags & 0x000001) {
+    auto relative_offset = static_cast<int32_t>(reader.readUnsignedInt32("data_offset"));
+    data_offset = state.base_data_offset + relative_offset;
+  }
+  bool has_first_sample_flags = flags & 0x000004;
+  uint32_t first_sample_flags = has_first_sample_flags ? reader.readUnsignedInt32("first_sample_flags") : 0;
+  size_t entry_size = 4 * (((flags >> 8) & 1) + ((flags >> 9) & 1) + ((flags >> 10) & 1) + ((flags >> 11) & 1));
+  if (entry_size > 0) {
+    sample_count = clampEntryCount(reader, end, sample_count, entry_size);
+  }
+  if (!(flags & 0x000200)) {
+    sample_count = clampSampleCount(ctx, data_offset, sample_count, state.default_sample_size);
+  }
+  uint32_t track_id = state.track_index == SIZE_MAX ? 0 : ctx.tracks[state.track_index].track_id;
+  for (uint32_t i = 0; i < sample_count; i++) {
+    uint32_t duration = flags & 0x000100 ? reader.readUnsignedInt32() : state.default_sample_duration;
+    MP4Sample sample{};
+    sample.track_id = track_id;
+    sample.location_relative = data_offset;
+    sample.size = flags & 0x000200 ? reader.readUnsignedInt32() : state.default_sample_size;
+    uint32_t sample_flags = state.default_sample_flags;
+    if (flags & 0x000400) {
+      sample_flags = reader.readUnsignedInt32();
+    } else if (i == 0 && has_first_sample_flags) {
+      sample_flags = first_sample_flags;
+    }
+    if (flags & 0x000800) {
+      // Unsigned in version 0, but values above INT32_MAX do not occur in practice.
+      sample.composition_offset = static_cast<int32_t>(reader.readUnsignedInt32());
+    }
+    sample.decode_time = state.decode_time;
+    sample.sync = !(sample_flags & SAMPLE_IS_NON_SYNC);
+    ctx.samples.push_back(sample);
+    data_offset += sample.size;
+    state.decode_time += duration;
+  }
+  state.next_data_offset = data_offset;
+}
+
+/**
+ * Parses the children of a box. Calls itself for container boxes.
+ * @param ctx Context that receives the tracks and samples.
+ * @param reader Reader positioned at the first child.
+ * @param end End of the parent box.
+ * @param state State of the box tree.
+ * @param depth Nesting depth of the children.
+ * @return 0 on success. -1 if a box exceeds its parent or the boxes are nested too deeply.
+ */
+static int32_t parseChildren(ParserContext &ctx, BitReader &reader, size_t end, BoxTreeState &state, uint32_t depth) {
+  // A box header needs at least 8 bytes. Anything less is padding.
+  while (reader.getOffset() + 8 <= end) {
+    MP4Box box{};
+    if (readBoxHeader(reader, end, box) < 0) {
+      return -1;
+    }
+    size_t box_end = box.location_relative + box.size;
+    if (isTraceEnabled(TRACE_INFO)) {
+      cout << std::string(2 * depth, ' ') << getNameString(box.type) << " size: " << box.size << "\n";
+    }
+    if (isContainerBox(box.type)) {
+      if (depth >= MAX_BOX_DEPTH) {
+        cerr << "Box " << getNameString(box.type) << " at " << box.location_relative << " is nested too deeply\n";
+        return -1;
+      }
+      if (box.type == fourCC("trak")) {
+        state.tables = SampleTables();
+        state.track_index = SIZE_MAX;
+      } else if (box.type == fourCC("traf")) {
+        state.track_index = SIZE_MAX;
+      }
+      if (parseChildren(ctx, reader, box_end, state, depth + 1) < 0) {
+        return -1;
+      }
+      if (box.type == fourCC("trak")) {
+        buildTrackSamples(ctx, state);
+        state.tables = SampleTables();
+      } else if (box.type == fourCC("traf")) {
+        // Without an explicit base data offset, the data of the next track fragment follows this one.
+        state.first_traf = false;
+        if (state.track_index != SIZE_MAX) {
+          ctx.tracks[state.track_index].next_decode_time = state.decode_time;
+        }
+      }
+    } else if (box.type == fourCC("tkhd")) {
+      uint8_t version = reader.readByte("version");
+      reader.skipBits(24);
+      // creation_time and modification_time
+      reader.seek(reader.getOffset() + (version == 1 ? 16 : 8));
+      state.track_index = findTrack(ctx, reader.readUnsignedInt32("track_ID"));
+    } else if (box.type == fourCC("mdhd") && state.track_index != SIZE_MAX) {
+      uint8_t version = reader.readByte("version");
+      reader.skipBits(24);
+      reader.seek(reader.getOffset() + (version == 1 ? 16 : 8));
+      ctx.tracks[state.track_index].timescale = reader.readUnsignedInt32("timescale");
+    } else if (box.type == fourCC("hdlr") && state.track_index != SIZE_MAX) {
+      reader.skipBits(32);
+      reader.skipBits(32);
+      ctx.tracks[state.track_index].handler_type = reader.readUnsignedInt32("handler_type");
+    } else if (box.type == fourCC("trex")) {
+      reader.skipBits(32);
+      MP4Track &track = ctx.tracks[findTrack(ctx, reader.readUnsignedInt32("track_ID"))];
+      reader.skipBits(32);
+      track.default_sample_duration = reader.readUnsignedInt32("default_sample_duration");
+      track.default_sample_size = reader.readUnsignedInt32("default_sample_size");
+      track.default_sample_flags = reader.readUnsignedInt32("default_sample_flags");
+    } else if (box.type == fourCC("stsz")) {
+      reader.skipBits(32);
+      state.tables.sample_size = reader.readUnsignedInt32("sample_size");
+      state.tables.sample_count = reader.readUnsignedInt32("sample_count");
+      if (state.tables.sample_size == 0) {
+        uint32_t count = clampEntryCount(reader, box_end, state.tables.sample_count, 4);
+        state.tables.sample_sizes.resize(count);
+        for (uint32_t i = 0; i < count; i++) {
+          state.tables.sample_sizes[i] = reader.readUnsignedInt32();
+        }
+      }
+    } else if (box.type == fourCC("stco") || box.type == fourCC("co64")) {
+      reader.skipBits(32);
+      bool large = box.type == fourCC("co64");
+      uint32_t count = clampEntryCount(reader, box_end, reader.readUnsignedInt32("entry_count"), large ? 8 : 4);
+      state.tables.chunk_offsets.resize(count);
+      for (uint32_t i = 0; i < count; i++) {
+        state.tables.chunk_offsets[i] = large ? reader.readUnsignedInt64() : reader.readUnsignedInt32();
+      }
+    } else if (box.type == fourCC("stsc")) {
+      reader.skipBits(32);
+      uint32_t count = clampEntryCount(reader, box_end, reader.readUnsignedInt32("entry_count"), 12);
+      state.tables.sample_to_chunk.resize(count);
+      for (uint32_t i = 0; i < count; i++) {
+        state.tables.sample_to_chunk[i].first = reader.readUnsignedInt32();
+        state.tables.sample_to_chunk[i].second = reader.readUnsignedInt32();
+        // sample_description_index
+        reader.skipBits(32);
+      }
+    } else if (box.type == fourCC("stts")) {
+      reader.skipBits(32);
+      uint32_t count = clampEntryCount(reader, box_end, reader.readUnsignedInt32("entry_count"), 8);
+      state.tables.time_to_sample.resize(count);
+      for (uint32_t i = 0; i < count; i++) {
+        state.tables.time_to_sample[i].first = reader.readUnsignedInt32();
+        state.tables.time_to_sample[i].second = reader.readUnsignedInt32();
+      }
+    } else if (box.type == fourCC("ctts")) {
+      reader.skipBits(32);
+      uint32_t count = clampEntryCount(reader, box_end, reader.readUnsignedInt32("entry_count"), 8);
+      state.tables.composition_offsets.resize(count);
+      for (uint32_t i = 0; i < count; i++) {
+        state.tables.composition_offsets[i].first = reader.readUnsignedInt32();
+        // Unsigned in version 0, but values above INT32_MAX do not occur in practice.
+        state.tables.composition_offsets[i].second = static_cast<int32_t>(reader.readUnsignedInt32());
+      }
+    } else if (box.type == fourCC("stss")) {
+      reader.skipBits(32);
+      uint32_t count = clampEntryCount(reader, box_end, reader.readUnsignedInt32("entry_count"), 4);
+      state.tables.has_sync_samples = true;
+      state.tables.sync_samples.resize(count);
+      for (uint32_t i = 0; i < count; i++) {
+        state.tables.sync_samples[i] = reader.readUnsignedInt32();
+      }
+    } else if (box.type == fourCC("tfhd")) {
+      reader.skipBits(8);
+      uint32_t flags = reader.readNBits(24, "flags");
+      state.track_index = findTrack(ctx, reader.readUnsignedInt32("track_ID"));
+      const MP4Track &track = ctx.tracks[state.track_index];
+      if (flags & 0x000001) {
+        state.base_data_offset = reader.readUnsignedInt64("base_data_offset");
+      } else if ((flags & 0x020000) || state.first_traf) {
+        // default-base-is-moof, or the first track fragment of the moof box.
+        state.base_data_offset = state.moof_offset;
+      } else {
+        // The data follows the data of the previous track fragment.
+        state.base_data_offset = state.next_data_offset;
+      }
+      state.next_data_offset = state.base_data_offset;
+      if (flags & 0x000002) {
+        reader.skipBits(32);
+      }
+      state.default_sample_duration =
+          flags & 0x000008 ? reader.readUnsignedInt32("default_sample_duration") : track.default_sample_duration;
+      state.default_sample_size =
+          flags & 0x000010 ? reader.readUnsignedInt32("default_sample_size") : track.default_sample_size;
+      state.default_sample_flags =
+          flags & 0x000020 ? reader.readUnsignedInt32("default_sample_flags") : track.default_sample_flags;
+      state.decode_time = track.next_decode_time;
+    } else if (box.type == fourCC("tfdt")) {
+      uint8_t version = reader.readByte("version");
+      reader.skipBits(24);
+      state.decode_time = version == 1 ? reader.readUnsignedInt64("baseMediaDecodeTime")
+                                       : reader.readUnsignedInt32("baseMediaDecodeTime");
+    } else if (box.type == fourCC("trun")) {
+      parseTrackRun(ctx, reader, box_end, state);
+    }
+    reader.seek(box_end);
+  }
+  return 0;
+}
+
+int32_t parseBoxTree(ParserContext &ctx, BitReader &reader, const MP4Box &box) {
+  StageTimer timer(ctx.stats, STAGE_BOX_WALK);
+  timer.addBytes(box.size - box.header_size);
+  BoxTreeState state;
+  state.moof_offset = box.location_relative;
+  reader.seek(box.location_relative + box.header_size);
+  return parseChildren(ctx, reader, box.location_relative + box.size, state, 1);
+}
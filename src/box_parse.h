@@ -0,0 +1,27 @@
+#ifndef BOX_PARSE_H_
+#define BOX_PARSE_H_
+
+#include <cstdint>
+#include "BitReader.h"
+#include "header_parse.h"
+#include "structs.h"
+
+/**
+ * Checks if a top-level MP4 box contains metadata that is parsed by parseBoxTree().
+ * @param type Type of the box.
+ * @return true for moov and moof boxes.
+ */
+bool isBoxTreeRoot(uint32_t type);
+/**
+ * Parses the box tree of a top-level moov or moof box (ISO/IEC 14496-12). From moov, the tracks (tkhd, mdhd, hdlr),
+ * the fragment defaults (mvex/trex) and the sample tables (stsz, stco/co64, stsc, stts, stss, ctts) are read. From
+ * moof, the track fragments (tfhd, tfdt, trun) are read. The samples that are described by either of them are appended
+ * to the samples vector of the context, as many as fit into the input. All other boxes are skipped.
+ * @param ctx Context that receives the tracks and samples.
+ * @param reader Reader on the data. The whole box has to be readable.
+ * @param box Top-level box that was parsed with parseMP4Box().
+ * @return 0 on success. -1 if a box exceeds its parent or the boxes are nested too deeply.
+ */
+int32_t parseBoxTree(ParserContext &ctx, BitReader &reader, const MP4Box &box);
+
+#endif //BOX_PARSE_H_
@@ -1,16 +1,47 @@
 #ifndef DEFINES_H_
 #define DEFINES_H_
 
-/*
- * If this flag is defined, very detailed output is printed to stdout. For each parameter that is read, a message of the
- * form:
- *   offset+bit_offset: prameter_name: parameter_value
- * is printed.
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/**
+ * Verbosity of the output on stdout. By default, nothing is printed. The level is selected at runtime with
+ * --trace=info|debug and must not be changed while videos are parsed.
  */
-//#define DEBUG
+enum TraceLevel : uint8_t {
+  TRACE_NONE = 0,
+  /// Basic information as well as the file structure.
+  TRACE_INFO = 1,
+  /**
+   * Very detailed output. For each parameter that is read, a message of the form:
+   *   offset+bit_offset: prameter_name: parameter_value
+   * is printed in addition to the info output.
+   */
+  TRACE_DEBUG = 2
+};
+
+extern TraceLevel trace_level;
 
-// Use this flag to get only basic information as well as the file structure printed to stdout.
-//#define INFO
+/**
+ * Checks if output for the level should be printed. The check is a single, well predicted branch, so traces can stay
+ * in the hot paths.
+ * @param level Level of the output.
+ * @return True if the selected trace level includes the level.
+ */
+inline bool isTraceEnabled(TraceLevel level) { return __builtin_expect(trace_level >= level, 0); }
+
+/**
+ * Prints a parsed parameter in the debug output format. Only call this if isTraceEnabled(TRACE_DEBUG) is true.
+ * @param offset Byte offset of the parameter.
+ * @param bit_offset Bit offset of the parameter inside the byte.
+ * @param name Parameter name.
+ * @param value Parameter value.
+ */
+void traceElement(size_t offset, uint8_t bit_offset, const char *name, uint32_t value);
+void traceElement(size_t offset, uint8_t bit_offset, const char *name, int32_t value);
+void traceElement(size_t offset, uint8_t bit_offset, const char *name, uint64_t value);
+void traceElement(size_t offset, uint8_t bit_offset, const char *name, const std::string &value);
 
 // This macro specifies how the position for the debug message is formatted.
 #include <iomanip>
@@ -1,21 +1,34 @@
 /**
- * This program analyses a given MP4/H.264 video and outputs the frame and header information into a csv file. DEBUG and
- * INFO flags can be defined to get even more detailed output in stdout.
+ * Parses the MP4 boxes and H.264 headers of a video and writes the gathered information into the output files.
  */
 #include "header_parse.h"
 #include <iostream>
 #include <sys/stat.h>
 #include <sys/mman.h>
 #include <cstring>
+#include <csignal>
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/inotify.h>
 #include <unistd.h>
 #include <utility>
 #include <vector>
 #include <fstream>
-#include <iomanip>
 #include <cmath>
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <sstream>
+#include <thread>
+#include "BitReader.h"
+#include "ByteScanner.h"
+#include "box_parse.h"
 #include "helper_functions.h"
+#include "index_cache.h"
+#include "index_writer.h"
+#include "InputWindow.h"
+#include "SparseInput.h"
 #include "structs.h"
 #include "defines.h"
 #include "XmlHandler.h"
@@ -24,343 +37,648 @@ using std::cout;
 using std::cerr;
 using std::endl;
 
-std::vector<MP4Box> mp4_boxes;
-std::vector<NALUnit> nal_units;
-std::vector<SPS> spss;
-std::vector<PPS> ppss;
-std::vector<SliceHeader> slices;
-std::ofstream csv_file;
-uint32_t frame_num = 1;
-
-void parseNALUnit(const uint8_t *addr, size_t &offset) {
-#if defined(DEBUG) || defined(INFO)
-  cout << "  NAL\n";
-#endif
-  uint8_t bit_offset = 0;
+/// Number of bytes that are read at once in streaming mode.
+static const size_t STREAM_CHUNK_SIZE = 1 << 20;
+/// Upper bound for the size of the parsed part of a MP4 box or NAL unit, i.e., everything up to the end of the slice
+/// header. Only this prefix has to be resident in streaming mode.
+static const size_t MAX_HEADER_SIZE = 1 << 12;
+/// Minimum size of a read in sparse mode. Most headers fit, so usually a NAL unit costs at most one read.
+static const size_t SPARSE_READ_SIZE = 256;
+/// Maximum time in milliseconds between two checks of a followed file, see parseFollow().
+static const int32_t FOLLOW_POLL_INTERVAL_MS = 100;
+
+void parseNALUnit(ParserContext &ctx, BitReader &reader) {
+  StageTimer timer(ctx.stats, STAGE_NAL_WALK);
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << "  NAL\n";
+  }
   NALUnit ret{};
-  ret.location = addr + offset;
-  ret.location_relative = offset;
+  ret.location_relative = reader.getOffset();
   // We manually add 4 because the size in the bytestream is excluding itself.
-  ret.size = readUnsignedInt32(addr, offset, bit_offset, "size") + 4;
-#ifdef INFO
-  cout << "  size: " << ret.size << "\n";
-#endif
-  uint8_t forbidden_zero_bit = readBit(addr, offset, bit_offset, "forbidden_zero_bit");
+  ret.size = reader.readUnsignedInt32("size") + 4;
+  ret.prefix_size = 4;
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << "  size: " << ret.size << "\n";
+  }
+  uint8_t forbidden_zero_bit = reader.readBit("forbidden_zero_bit");
+  if (forbidden_zero_bit != 0) {
+    cerr << "forbidden_zero_bit != 0\n";
+  }
+  ret.nal_ref_idc = reader.readNBits(2, "nal_ref_idc");
+  ret.nal_unit_type = reader.readNBits(5, "nal_unit_type");
+  ctx.nal_units.push_back(ret);
+  timer.addBytes(reader.getOffset() - ret.location_relative);
+}
+
+void parseAnnexBNALUnit(ParserContext &ctx, BitReader &reader, size_t nal_end) {
+  StageTimer timer(ctx.stats, STAGE_NAL_WALK);
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << "  NAL\n";
+  }
+  NALUnit ret{};
+  ret.location_relative = reader.getOffset();
+  ret.size = nal_end - ret.location_relative;
+  if (reader.getPointer()[2] == 0) {
+    reader.readByte("zero_byte");
+    ret.prefix_size = 4;
+  } else {
+    ret.prefix_size = 3;
+  }
+  reader.readNBits(24, "start_code_prefix_one_3bytes");
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << "  size: " << ret.size << "\n";
+  }
+  uint8_t forbidden_zero_bit = reader.readBit("forbidden_zero_bit");
   if (forbidden_zero_bit != 0) {
     cerr << "forbidden_zero_bit != 0\n";
   }
-  ret.nal_ref_idc = readNBits(addr, offset, bit_offset, 2, "nal_ref_idc");
-  ret.nal_unit_type = readNBits(addr, offset, bit_offset, 5, "nal_unit_type");
-  nal_units.push_back(ret);
+  ret.nal_ref_idc = reader.readNBits(2, "nal_ref_idc");
+  ret.nal_unit_type = reader.readNBits(5, "nal_unit_type");
+  ctx.nal_units.push_back(ret);
+  timer.addBytes(reader.getOffset() - ret.location_relative);
+}
+
+/// Maximum value of cpb_cnt_minus1, see ISO/IEC 14496-10:2014 Chapter E.2.2.
+static const uint32_t MAX_CPB_CNT_MINUS1 = 31;
+/// Maximum value of num_ref_frames_in_pic_order_cnt_cycle, see ISO/IEC 14496-10:2014 Chapter 7.4.2.1.1.
+static const uint32_t MAX_NUM_REF_FRAMES_IN_PIC_ORDER_CNT_CYCLE = 255;
+/// Maximum value of num_ref_idx_l0_active_minus1 and num_ref_idx_l1_active_minus1, see ISO/IEC 14496-10:2014 Chapter
+/// 7.4.3.
+static const uint32_t MAX_NUM_REF_IDX_ACTIVE_MINUS1 = 31;
+
+/**
+ * Parses a scaling_list() as specified in ISO/IEC 14496-10:2014 Chapter 7.3.2.1.1.1.
+ * @param reader RBSP reader positioned at the first delta_scale.
+ * @param scaling_list The list, 16 or 64 entries.
+ * @param size Size of the list.
+ * @param use_default_scaling_matrix_flag Set to UseDefaultScalingMatrix4x4Flag or UseDefaultScalingMatrix8x8Flag.
+ */
+static void parseScalingList(BitReader &reader,
+                             uint8_t *scaling_list,
+                             uint32_t size,
+                             bool &use_default_scaling_matrix_flag) {
+  int32_t last_scale = 8;
+  int32_t next_scale = 8;
+  use_default_scaling_matrix_flag = false;
+  for (uint32_t j = 0; j < size; j++) {
+    if (next_scale != 0) {
+      int32_t delta_scale = reader.decodeSignedExpGolomb("delta_scale");
+      next_scale = (last_scale + delta_scale + 256) % 256;
+      use_default_scaling_matrix_flag = j == 0 && next_scale == 0;
+    }
+    scaling_list[j] = static_cast<uint8_t>(next_scale == 0 ? last_scale : next_scale);
+    last_scale = scaling_list[j];
+  }
+}
+
+/**
+ * Parses the scaling lists of an SPS or PPS, i.e., the scaling_list_present_flag loop.
+ * @param reader RBSP reader positioned at the first scaling_list_present_flag.
+ * @param matrix The scaling matrix.
+ * @param num_lists Number of lists, the first 6 of which are 4x4 lists.
+ * @param flag_name Name of the present flags for the trace.
+ */
+static void parseScalingMatrix(BitReader &reader, ScalingMatrix &matrix, uint32_t num_lists, const char *flag_name) {
+  for (uint32_t i = 0; i < num_lists; i++) {
+    matrix.scaling_list_present_flag[i] = reader.readBit(flag_name);
+    if (!matrix.scaling_list_present_flag[i]) {
+      continue;
+    }
+    if (i < 6) {
+      parseScalingList(reader, matrix.scaling_list_4x4[i], 16, matrix.use_default_scaling_matrix_flag[i]);
+    } else {
+      parseScalingList(reader, matrix.scaling_list_8x8[i - 6], 64, matrix.use_default_scaling_matrix_flag[i]);
+    }
+  }
 }
 
-void parseSPS(const uint8_t *addr, size_t &offset) {
-#if defined(DEBUG) || defined(INFO)
-  cout << "    SPS\n";
-#endif
-  uint8_t bit_offset = 0;
+/**
+ * Parses hrd_parameters() as specified in ISO/IEC 14496-10:2014 Chapter E.1.2.
+ * @param reader RBSP reader positioned at cpb_cnt_minus1.
+ * @param hrd The HRD parameters.
+ */
+static void parseHRDParameters(BitReader &reader, HRDParameters &hrd) {
+  hrd.cpb_cnt_minus1 = reader.decodeUnsignedExpGolomb("cpb_cnt_minus1");
+  if (hrd.cpb_cnt_minus1 > MAX_CPB_CNT_MINUS1) {
+    cerr << "hrd: cpb_cnt_minus1 > " << MAX_CPB_CNT_MINUS1 << "\n";
+    hrd.cpb_cnt_minus1 = MAX_CPB_CNT_MINUS1;
+  }
+  hrd.bit_rate_scale = static_cast<uint8_t>(reader.readNBits(4, "bit_rate_scale"));
+  hrd.cpb_size_scale = static_cast<uint8_t>(reader.readNBits(4, "cpb_size_scale"));
+  for (uint32_t sched_sel_idx = 0; sched_sel_idx <= hrd.cpb_cnt_minus1; sched_sel_idx++) {
+    hrd.bit_rate_value_minus1.push_back(reader.decodeUnsignedExpGolomb("bit_rate_value_minus1"));
+    hrd.cpb_size_value_minus1.push_back(reader.decodeUnsignedExpGolomb("cpb_size_value_minus1"));
+    hrd.cbr_flag.push_back(reader.readBit("cbr_flag"));
+  }
+  hrd.initial_cpb_removal_delay_length_minus1 =
+      static_cast<uint8_t>(reader.readNBits(5, "initial_cpb_removal_delay_length_minus1"));
+  hrd.cpb_removal_delay_length_minus1 = static_cast<uint8_t>(reader.readNBits(5, "cpb_removal_delay_length_minus1"));
+  hrd.dpb_output_delay_length_minus1 = static_cast<uint8_t>(reader.readNBits(5, "dpb_output_delay_length_minus1"));
+  hrd.time_offset_length = static_cast<uint8_t>(reader.readNBits(5, "time_offset_length"));
+}
+
+/**
+ * Parses vui_parameters() as specified in ISO/IEC 14496-10:2014 Chapter E.1.1.
+ * @param reader RBSP reader positioned at aspect_ratio_info_present_flag.
+ * @param vui The VUI parameters.
+ */
+static void parseVUIParameters(BitReader &reader, VUIParameters &vui) {
+  vui.aspect_ratio_info_present_flag = reader.readBit("aspect_ratio_info_present_flag");
+  if (vui.aspect_ratio_info_present_flag) {
+    vui.aspect_ratio_idc = reader.readByte("aspect_ratio_idc");
+    // Extended_SAR
+    if (vui.aspect_ratio_idc == 255) {
+      vui.sar_width = static_cast<uint16_t>(reader.readNBits(16, "sar_width"));
+      vui.sar_height = static_cast<uint16_t>(reader.readNBits(16, "sar_height"));
+    }
+  }
+  vui.overscan_info_present_flag = reader.readBit("overscan_info_present_flag");
+  if (vui.overscan_info_present_flag) {
+    vui.overscan_appropriate_flag = reader.readBit("overscan_appropriate_flag");
+  }
+  vui.video_signal_type_present_flag = reader.readBit("video_signal_type_present_flag");
+  if (vui.video_signal_type_present_flag) {
+    vui.video_format = static_cast<uint8_t>(reader.readNBits(3, "video_format"));
+    vui.video_full_range_flag = reader.readBit("video_full_range_flag");
+    vui.colour_description_present_flag = reader.readBit("colour_description_present_flag");
+    if (vui.colour_description_present_flag) {
+      vui.colour_primaries = reader.readByte("colour_primaries");
+      vui.transfer_characteristics = reader.readByte("transfer_characteristics");
+      vui.matrix_coefficients = reader.readByte("matrix_coefficients");
+    }
+  }
+  vui.chroma_loc_info_present_flag = reader.readBit("chroma_loc_info_present_flag");
+  if (vui.chroma_loc_info_present_flag) {
+    vui.chroma_sample_loc_type_top_field = reader.decodeUnsignedExpGolomb("chroma_sample_loc_type_top_field");
+    vui.chroma_sample_loc_type_bottom_field = reader.decodeUnsignedExpGolomb("chroma_sample_loc_type_bottom_field");
+  }
+  vui.timing_info_present_flag = reader.readBit("timing_info_present_flag");
+  if (vui.timing_info_present_flag) {
+    vui.num_units_in_tick = reader.readUnsignedInt32("num_units_in_tick");
+    vui.time_scale = reader.readUnsignedInt32("time_scale");
+    vui.fixed_frame_rate_flag = reader.readBit("fixed_frame_rate_flag");
+  }
+  vui.nal_hrd_parameters_present_flag = reader.readBit("nal_hrd_parameters_present_flag");
+  if (vui.nal_hrd_parameters_present_flag) {
+    parseHRDParameters(reader, vui.nal_hrd_parameters);
+  }
+  vui.vcl_hrd_parameters_present_flag = reader.readBit("vcl_hrd_parameters_present_flag");
+  if (vui.vcl_hrd_parameters_present_flag) {
+    parseHRDParameters(reader, vui.vcl_hrd_parameters);
+  }
+  if (vui.nal_hrd_parameters_present_flag || vui.vcl_hrd_parameters_present_flag) {
+    vui.low_delay_hrd_flag = reader.readBit("low_delay_hrd_flag");
+  }
+  vui.pic_struct_present_flag = reader.readBit("pic_struct_present_flag");
+  vui.bitstream_restriction_flag = reader.readBit("bitstream_restriction_flag");
+  if (vui.bitstream_restriction_flag) {
+    vui.motion_vectors_over_pic_boundaries_flag = reader.readBit("motion_vectors_over_pic_boundaries_flag");
+    vui.max_bytes_per_pic_denom = reader.decodeUnsignedExpGolomb("max_bytes_per_pic_denom");
+    vui.max_bits_per_mb_denom = reader.decodeUnsignedExpGolomb("max_bits_per_mb_denom");
+    vui.log2_max_mv_length_horizontal = reader.decodeUnsignedExpGolomb("log2_max_mv_length_horizontal");
+    vui.log2_max_mv_length_vertical = reader.decodeUnsignedExpGolomb("log2_max_mv_length_vertical");
+    vui.max_num_reorder_frames = reader.decodeUnsignedExpGolomb("max_num_reorder_frames");
+    vui.max_dec_frame_buffering = reader.decodeUnsignedExpGolomb("max_dec_frame_buffering");
+  }
+}
+
+void parseSPS(ParserContext &ctx, BitReader &reader) {
+  StageTimer timer(ctx.stats, STAGE_SPS);
+  size_t offset_start = reader.getOffset();
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << "    SPS\n";
+  }
   SPS ret{};
-  ret.profile_idc = readByte(addr, offset, bit_offset, "profile_idc");
-  ret.constraint_set0_flag = readBit(addr, offset, bit_offset, "constraint_set0_flag");
-  ret.constraint_set1_flag = readBit(addr, offset, bit_offset, "constraint_set1_flag");
-  ret.constraint_set2_flag = readBit(addr, offset, bit_offset, "constraint_set2_flag");
-  ret.constraint_set3_flag = readBit(addr, offset, bit_offset, "constraint_set3_flag");
-  ret.constraint_set4_flag = readBit(addr, offset, bit_offset, "constraint_set4_flag");
-  ret.constraint_set5_flag = readBit(addr, offset, bit_offset, "constraint_set5_flag");
-  uint8_t reserved_zero_2bits = readNBits(addr, offset, bit_offset, 2, "reserved_zero_2bits");
+  ret.profile_idc = reader.readByte("profile_idc");
+  ret.constraint_set0_flag = reader.readBit("constraint_set0_flag");
+  ret.constraint_set1_flag = reader.readBit("constraint_set1_flag");
+  ret.constraint_set2_flag = reader.readBit("constraint_set2_flag");
+  ret.constraint_set3_flag = reader.readBit("constraint_set3_flag");
+  ret.constraint_set4_flag = reader.readBit("constraint_set4_flag");
+  ret.constraint_set5_flag = reader.readBit("constraint_set5_flag");
+  uint8_t reserved_zero_2bits = reader.readNBits(2, "reserved_zero_2bits");
   if (reserved_zero_2bits != 0) {
     cerr << "sps: reserved_zero_2bits != 0\n";
   }
 
-  ret.level_idc = readByte(addr, offset, bit_offset, "level_idc");
-  ret.seq_parameter_set_id = decodeUnsignedExpGolomb(addr, offset, bit_offset, "seq_parameter_set_id");
+  ret.level_idc = reader.readByte("level_idc");
+  ret.seq_parameter_set_id = reader.decodeUnsignedExpGolomb("seq_parameter_set_id");
   // See semantic note for this field as well as parset.c:117 in reference software.
   ret.chroma_format_idc = 1;
   if (ret.profile_idc == 100 || ret.profile_idc == 110 || ret.profile_idc == 122 || ret.profile_idc == 244
       || ret.profile_idc == 44 || ret.profile_idc == 83 || ret.profile_idc == 86 || ret.profile_idc == 118
       || ret.profile_idc == 128 || ret.profile_idc == 138 || ret.profile_idc == 139 || ret.profile_idc == 134) {
-    ret.chroma_format_idc = decodeUnsignedExpGolomb(addr, offset, bit_offset, "chroma_format_idc");
+    ret.chroma_format_idc = reader.decodeUnsignedExpGolomb("chroma_format_idc");
     if (ret.chroma_format_idc == 3) {
-      ret.separate_colour_plane_flag = readBit(addr, offset, bit_offset, "separate_colour_plane_flag");
-    }
-    ret.bit_depth_luma_minus8 = decodeUnsignedExpGolomb(addr, offset, bit_offset, "bit_depth_luma_minus8");
-    ret.bit_depth_chroma_minus8 = decodeUnsignedExpGolomb(addr, offset, bit_offset, "bit_depth_chroma_minus8");
-    ret.qpprime_y_zero_transform_bypass_flag = readBit(addr,
-                                                       offset,
-                                                       bit_offset,
-                                                       "qpprime_y_zero_transform_bypass_flag");
-    ret.seq_scaling_matrix_present_flag = readBit(addr, offset, bit_offset, "seq_scaling_matrix_present_flag");
+      ret.separate_colour_plane_flag = reader.readBit("separate_colour_plane_flag");
+    }
+    ret.bit_depth_luma_minus8 = reader.decodeUnsignedExpGolomb("bit_depth_luma_minus8");
+    ret.bit_depth_chroma_minus8 = reader.decodeUnsignedExpGolomb("bit_depth_chroma_minus8");
+    ret.qpprime_y_zero_transform_bypass_flag = reader.readBit("qpprime_y_zero_transform_bypass_flag");
+    ret.seq_scaling_matrix_present_flag = reader.readBit("seq_scaling_matrix_present_flag");
     if (ret.seq_scaling_matrix_present_flag) {
-      // TODO if (ret.seq_scaling_matrix_present_flag)...
-      cerr << "WARNING: UNIMPLEMENTED CODE REACHED\n";
+      parseScalingMatrix(reader, ret.seq_scaling_matrix, ret.chroma_format_idc != 3 ? 8 : 12,
+                         "seq_scaling_list_present_flag");
     }
   }
-  ret.log2_max_frame_num_minus4 = decodeUnsignedExpGolomb(addr, offset, bit_offset, "log2_max_frame_num_minus4");
-  ret.pic_order_cnt_type = decodeUnsignedExpGolomb(addr, offset, bit_offset, "pic_order_cnt_type");
+  ret.log2_max_frame_num_minus4 = reader.decodeUnsignedExpGolomb("log2_max_frame_num_minus4");
+  ret.pic_order_cnt_type = reader.decodeUnsignedExpGolomb("pic_order_cnt_type");
   if (ret.pic_order_cnt_type == 0) {
-    ret.log2_max_pic_order_cnt_lsb_minus4 = decodeUnsignedExpGolomb(addr,
-                                                                    offset,
-                                                                    bit_offset,
-                                                                    "log2_max_pic_order_cnt_lsb_minus4");
+    ret.log2_max_pic_order_cnt_lsb_minus4 = reader.decodeUnsignedExpGolomb("log2_max_pic_order_cnt_lsb_minus4");
   } else if (ret.pic_order_cnt_type == 1) {
-    // TODO
-    cerr << "WARNING: UNIMPLEMENTED CODE REACHED\n";
+    ret.delta_pic_order_always_zero_flag = reader.readBit("delta_pic_order_always_zero_flag");
+    ret.offset_for_non_ref_pic = reader.decodeSignedExpGolomb("offset_for_non_ref_pic");
+    ret.offset_for_top_to_bottom_field = reader.decodeSignedExpGolomb("offset_for_top_to_bottom_field");
+    ret.num_ref_frames_in_pic_order_cnt_cycle = reader.decodeUnsignedExpGolomb("num_ref_frames_in_pic_order_cnt_cycle");
+    if (ret.num_ref_frames_in_pic_order_cnt_cycle > MAX_NUM_REF_FRAMES_IN_PIC_ORDER_CNT_CYCLE) {
+      cerr << "sps: num_ref_frames_in_pic_order_cnt_cycle > " << MAX_NUM_REF_FRAMES_IN_PIC_ORDER_CNT_CYCLE << "\n";
+      ret.num_ref_frames_in_pic_order_cnt_cycle = MAX_NUM_REF_FRAMES_IN_PIC_ORDER_CNT_CYCLE;
+    }
+    for (uint32_t i = 0; i < ret.num_ref_frames_in_pic_order_cnt_cycle; i++) {
+      ret.offset_for_ref_frame.push_back(reader.decodeSignedExpGolomb("offset_for_ref_frame"));
+    }
   }
-  ret.max_num_ref_frames = decodeUnsignedExpGolomb(addr, offset, bit_offset, "max_num_ref_frames");
-  ret.gaps_in_frame_num_value_allowed_flag = readBit(addr, offset, bit_offset, "gaps_in_frame_num_value_allowed_flag");
-  ret.pic_width_in_mbs_minus1 = decodeUnsignedExpGolomb(addr, offset, bit_offset, "pic_width_in_mbs_minus1");
-  ret.pic_height_in_map_units_minus1 = decodeUnsignedExpGolomb(addr,
-                                                               offset,
-                                                               bit_offset,
-                                                               "pic_height_in_map_units_minus1");
-  ret.frame_mbs_only_flag = readBit(addr, offset, bit_offset, "frame_mbs_only_flag");
+  ret.max_num_ref_frames = reader.decodeUnsignedExpGolomb("max_num_ref_frames");
+  ret.gaps_in_frame_num_value_allowed_flag = reader.readBit("gaps_in_frame_num_value_allowed_flag");
+  ret.pic_width_in_mbs_minus1 = reader.decodeUnsignedExpGolomb("pic_width_in_mbs_minus1");
+  ret.pic_height_in_map_units_minus1 = reader.decodeUnsignedExpGolomb("pic_height_in_map_units_minus1");
+  ret.frame_mbs_only_flag = reader.readBit("frame_mbs_only_flag");
   if (!ret.frame_mbs_only_flag) {
-    ret.mb_adaptive_frame_field_flag = readBit(addr, offset, bit_offset, "mb_adaptive_frame_field_flag");
+    ret.mb_adaptive_frame_field_flag = reader.readBit("mb_adaptive_frame_field_flag");
   }
-  ret.direct_8x8_inference_flag = readBit(addr, offset, bit_offset, "direct_8x8_inference_flag");
-  ret.frame_cropping_flag = readBit(addr, offset, bit_offset, "frame_cropping_flag");
+  ret.direct_8x8_inference_flag = reader.readBit("direct_8x8_inference_flag");
+  ret.frame_cropping_flag = reader.readBit("frame_cropping_flag");
   if (ret.frame_cropping_flag) {
-    ret.frame_crop_left_offset = decodeUnsignedExpGolomb(addr, offset, bit_offset, "frame_crop_left_offset");
-    ret.frame_crop_right_offset = decodeUnsignedExpGolomb(addr, offset, bit_offset, "frame_crop_right_offset");
-    ret.frame_crop_top_offset = decodeUnsignedExpGolomb(addr, offset, bit_offset, "frame_crop_top_offset");
-    ret.frame_crop_bottom_offset = decodeUnsignedExpGolomb(addr, offset, bit_offset, "frame_crop_bottom_offset");
+    ret.frame_crop_left_offset = reader.decodeUnsignedExpGolomb("frame_crop_left_offset");
+    ret.frame_crop_right_offset = reader.decodeUnsignedExpGolomb("frame_crop_right_offset");
+    ret.frame_crop_top_offset = reader.decodeUnsignedExpGolomb("frame_crop_top_offset");
+    ret.frame_crop_bottom_offset = reader.decodeUnsignedExpGolomb("frame_crop_bottom_offset");
+  }
+  ret.vui_parameters_present_flag = reader.readBit("vui_parameters_present_flag");
+  if (ret.vui_parameters_present_flag) {
+    parseVUIParameters(reader, ret.vui_parameters);
+  }
+  ctx.spss.push_back(std::move(ret));
+  timer.addBytes(reader.getOffset() - offset_start);
+}
+
+/**
+ * Returns the last SPS with the ID in a range of parameter sets.
+ * @return The SPS or nullptr if there is none.
+ */
+static const SPS *findSPS(const SPS *begin, const SPS *end, uint32_t seq_parameter_set_id) {
+  for (const SPS *sps = end; sps != begin; sps--) {
+    if (sps[-1].seq_parameter_set_id == seq_parameter_set_id) {
+      return sps - 1;
+    }
+  }
+  return nullptr;
+}
+
+/**
+ * Returns the last PPS with the ID in a range of parameter sets.
+ * @return The PPS or nullptr if there is none.
+ */
+static const PPS *findPPS(const PPS *begin, const PPS *end, uint32_t pic_parameter_set_id) {
+  for (const PPS *pps = end; pps != begin; pps--) {
+    if (pps[-1].pic_parameter_set_id == pic_parameter_set_id) {
+      return pps - 1;
+    }
   }
-  ret.vui_parameters_present_flag = readBit(addr, offset, bit_offset, "vui_parameters_present_flag");
-  // TODO if (ret.vui_parameters_present_flag) {
-  spss.push_back(ret);
+  return nullptr;
 }
 
-void parsePPS(const uint8_t *addr, size_t &offset) {
-#if defined(DEBUG) || defined(INFO)
-  cout << "    PPS\n";
-#endif
-  uint8_t bit_offset = 0;
+void parsePPS(ParserContext &ctx, BitReader &reader) {
+  StageTimer timer(ctx.stats, STAGE_PPS);
+  size_t offset_start = reader.getOffset();
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << "    PPS\n";
+  }
   PPS ret{};
-  ret.pic_parameter_set_id = decodeUnsignedExpGolomb(addr, offset, bit_offset, "pic_parameter_set_id");
-  ret.seq_parameter_set_id = decodeUnsignedExpGolomb(addr, offset, bit_offset, "seq_parameter_set_id");
-  ret.entropy_coding_mode_flag = readBit(addr, offset, bit_offset, "entropy_coding_mode_flag");
-  ret.bottom_field_pic_order_in_frame_present_flag = readBit(addr,
-                                                             offset,
-                                                             bit_offset,
-                                                             "bottom_field_pic_order_in_frame_present_flag");
-  ret.num_slice_groups_minus1 = decodeUnsignedExpGolomb(addr, offset, bit_offset, "num_slice_groups_minus1");
+  ret.pic_parameter_set_id = reader.decodeUnsignedExpGolomb("pic_parameter_set_id");
+  ret.seq_parameter_set_id = reader.decodeUnsignedExpGolomb("seq_parameter_set_id");
+  ret.entropy_coding_mode_flag = reader.readBit("entropy_coding_mode_flag");
+  ret.bottom_field_pic_order_in_frame_present_flag = reader.readBit("bottom_field_pic_order_in_frame_present_flag");
+  ret.num_slice_groups_minus1 = reader.decodeUnsignedExpGolomb("num_slice_groups_minus1");
   if (ret.num_slice_groups_minus1 > 0) {
-    ret.slice_group_map_type = decodeUnsignedExpGolomb(addr, offset, bit_offset, "slice_group_map_type");
+    ret.slice_group_map_type = reader.decodeUnsignedExpGolomb("slice_group_map_type");
     if (ret.slice_group_map_type == 0) {
       for (uint32_t iGroup = 0; iGroup <= ret.num_slice_groups_minus1; iGroup++) {
-        ret.run_length_minus1.push_back(decodeUnsignedExpGolomb(addr, offset, bit_offset, "run_length_minus1"));
+        ret.run_length_minus1.push_back(reader.decodeUnsignedExpGolomb("run_length_minus1"));
       }
     } else if (ret.slice_group_map_type == 2) {
       for (uint32_t iGroup = 0; iGroup <= ret.num_slice_groups_minus1; iGroup++) {
-        ret.top_left.push_back(decodeUnsignedExpGolomb(addr, offset, bit_offset, "top_left"));
-        ret.bottom_right.push_back(decodeUnsignedExpGolomb(addr, offset, bit_offset, "top_right"));
+        ret.top_left.push_back(reader.decodeUnsignedExpGolomb("top_left"));
+        ret.bottom_right.push_back(reader.decodeUnsignedExpGolomb("top_right"));
       }
     } else if (ret.slice_group_map_type == 3 || ret.slice_group_map_type == 4 || ret.slice_group_map_type == 5) {
-      ret.slice_group_change_direction_flag = readBit(addr, offset, bit_offset, "slice_group_change_direction_flag");
-      ret.slice_group_change_rate_minus1 = decodeUnsignedExpGolomb(addr,
-                                                                   offset,
-                                                                   bit_offset,
-                                                                   "slice_group_change_rate_minus1");
+      ret.slice_group_change_direction_flag = reader.readBit("slice_group_change_direction_flag");
+      ret.slice_group_change_rate_minus1 = reader.decodeUnsignedExpGolomb("slice_group_change_rate_minus1");
     } else if (ret.slice_group_map_type == 6) {
-      ret.pic_size_in_map_units_minus1 = decodeUnsignedExpGolomb(addr,
-                                                                 offset,
-                                                                 bit_offset,
-                                                                 "pic_size_in_map_units_minus1");
+      ret.pic_size_in_map_units_minus1 = reader.decodeUnsignedExpGolomb("pic_size_in_map_units_minus1");
       uint32_t length = ceil(log2(ret.num_slice_groups_minus1 + 1));
-      for (uint32_t i = 0; i < ret.pic_size_in_map_units_minus1; i++) {
-        ret.slice_group_id.push_back(readNBits(addr, offset, bit_offset, length, "slice_group_id"));
-      }
-    }
-  }
-  ret.num_ref_idx_l0_default_active_minus1 = decodeUnsignedExpGolomb(addr,
-                                                                     offset,
-                                                                     bit_offset,
-                                                                     "num_ref_idx_l0_default_active_minus1");
-  ret.num_ref_idx_l1_default_active_minus1 = decodeUnsignedExpGolomb(addr,
-                                                                     offset,
-                                                                     bit_offset,
-                                                                     "num_ref_idx_l1_default_active_minus1");
-  ret.weighted_pred_flag = readBit(addr, offset, bit_offset, "weighted_pred_flag");
-  ret.weighted_bipred_idc = static_cast<uint8_t>(readNBits(addr, offset, bit_offset, 2, "weighted_bipred_idc"));
-  ret.pic_init_qp_minus26 = decodeSignedExpGolomb(addr, offset, bit_offset, "pic_init_qp_minus26");
-  ret.pic_init_qs_minus26 = decodeSignedExpGolomb(addr, offset, bit_offset, "pic_init_qs_minus26");
-  ret.chroma_qp_index_offset = decodeSignedExpGolomb(addr, offset, bit_offset, "chroma_qp_index_offset");
-  ret.deblocking_filter_control_present_flag = readBit(addr,
-                                                       offset,
-                                                       bit_offset,
-                                                       "deblocking_filter_control_present_flag");
-  ret.constrained_intra_pred_flag = readBit(addr, offset, bit_offset, "constrained_intra_pred_flag");
-  ret.redundant_pic_cnt_present_flag = readBit(addr, offset, bit_offset, "redundant_pic_cnt_present_flag");
-  // TODO if(more_rbsp_data())
-  ppss.push_back(ret);
-}
-
-void parseSliceHeader(const uint8_t *addr, size_t &offset) {
-  size_t offset_start = offset;
-#ifdef DEBUG
-  cout << "    Slice\n";
-#endif
-  uint8_t bit_offset = 0;
-  SliceHeader ret{};
-  SPS &curr_sps = spss.back();
-  PPS &curr_pps = ppss.back();
-  NALUnit &curr_nal_unit = nal_units.back();
+      for (uint32_t i = 0; i <= ret.pic_size_in_map_units_minus1; i++) {
+        ret.slice_group_id.push_back(reader.readNBits(length, "slice_group_id"));
+      }
+    }
+  }
+  ret.num_ref_idx_l0_default_active_minus1 = reader.decodeUnsignedExpGolomb("num_ref_idx_l0_default_active_minus1");
+  ret.num_ref_idx_l1_default_active_minus1 = reader.decodeUnsignedExpGolomb("num_ref_idx_l1_default_active_minus1");
+  ret.weighted_pred_flag = reader.readBit("weighted_pred_flag");
+  ret.weighted_bipred_idc = static_cast<uint8_t>(reader.readNBits(2, "weighted_bipred_idc"));
+  ret.pic_init_qp_minus26 = reader.decodeSignedExpGolomb("pic_init_qp_minus26");
+  ret.pic_init_qs_minus26 = reader.decodeSignedExpGolomb("pic_init_qs_minus26");
+  ret.chroma_qp_index_offset = reader.decodeSignedExpGolomb("chroma_qp_index_offset");
+  ret.deblocking_filter_control_present_flag = reader.readBit("deblocking_filter_control_present_flag");
+  ret.constrained_intra_pred_flag = reader.readBit("constrained_intra_pred_flag");
+  ret.redundant_pic_cnt_present_flag = reader.readBit("redundant_pic_cnt_present_flag");
+  ret.second_chroma_qp_index_offset = ret.chroma_qp_index_offset;
+  if (reader.moreRBSPData()) {
+    ret.transform_8x8_mode_flag = reader.readBit("transform_8x8_mode_flag");
+    ret.pic_scaling_matrix_present_flag = reader.readBit("pic_scaling_matrix_present_flag");
+    if (ret.pic_scaling_matrix_present_flag) {
+      // The number of 8x8 lists depends on the SPS. If it is not in this context, e.g., in a fragment that is parsed
+      // in parallel, 4:2:0 is assumed. parseFragments() parses these PPSs again once the SPS is known.
+      const SPS *sps = findSPS(ctx.spss.data(), ctx.spss.data() + ctx.spss.size(), ret.seq_parameter_set_id);
+      uint32_t chroma_format_idc = sps == nullptr ? 1 : sps->chroma_format_idc;
+      parseScalingMatrix(reader, ret.pic_scaling_matrix,
+                         6 + (chroma_format_idc != 3 ? 2 : 6) * ret.transform_8x8_mode_flag,
+                         "pic_scaling_list_present_flag");
+    }
+    ret.second_chroma_qp_index_offset = reader.decodeSignedExpGolomb("second_chroma_qp_index_offset");
+  }
+  ctx.ppss.push_back(std::move(ret));
+  timer.addBytes(reader.getOffset() - offset_start);
+}
+
+/**
+ * Decodes a ue(v) syntax element into the field if the syntax elements are requested and skips it otherwise.
+ */
+template <bool ELEMENTS, typename T>
+static inline void readUnsignedExpGolomb(BitReader &reader, T &field, const char *name) {
+  if (ELEMENTS) {
+    field = static_cast<T>(reader.decodeUnsignedExpGolomb(name));
+  } else {
+    reader.skipExpGolomb();
+  }
+}
+
+/**
+ * Decodes a se(v) syntax element into the field if the syntax elements are requested and skips it otherwise.
+ */
+template <bool ELEMENTS>
+static inline void readSignedExpGolomb(BitReader &reader, int32_t &field, const char *name) {
+  if (ELEMENTS) {
+    field = reader.decodeSignedExpGolomb(name);
+  } else {
+    reader.skipExpGolomb();
+  }
+}
+
+/**
+ * Stores the slice type of a slice header that ends in the middle of a loop, has an out of range value, e.g., because
+ * the NAL unit is cut off, or refers to a parameter set that is unknown. The header size is unknown and stored as 0.
+ * @param name Syntax element at which parsing stopped.
+ */
+static void setBrokenSliceHeader(ParserContext &ctx, uint32_t raw_slice_type, const char *name) {
+  ctx.stats.broken_slice_headers++;
+  ctx.nal_units.setSliceHeader(raw_slice_type, 0);
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << "    Broken slice header at " << name << "\n";
+  }
+}
+
+/**
+ * Parses a slice header for a fixed set of SliceField bits, so the compiler drops everything that is not needed. See
+ * parseSliceHeader().
+ */
+template <uint32_t FIELDS>
+static void parseSliceHeaderFields(ParserContext &ctx, BitReader &reader) {
+  const bool ELEMENTS = (FIELDS & SLICE_FIELD_ELEMENTS) != 0;
+  StageTimer timer(ctx.stats, STAGE_SLICE_HEADER);
+  size_t offset_start = reader.getOffset();
+  if (isTraceEnabled(TRACE_DEBUG)) {
+    cout << "    Slice\n";
+  }
+  NALUnit curr_nal_unit = ctx.nal_units.back();
+  uint32_t mb_address = 0;
+  readUnsignedExpGolomb<ELEMENTS>(reader, mb_address, "first_mb_in_slice");
+  uint32_t raw_slice_type = reader.decodeUnsignedExpGolomb("slice_type");
+  if (!(FIELDS & SLICE_FIELD_HEADER_SIZE)) {
+    timer.addBytes(reader.getOffset() - offset_start + (reader.getBitOffset() > 0 ? 1 : 0));
+    ctx.nal_units.setSliceHeader(raw_slice_type, 0);
+    return;
+  }
+  // Headers that are not kept are parsed into a local and their pred_weight_table() goes to the scratch arena, so
+  // parsing does not allocate.
+  SliceHeader local{};
+  SliceHeader *header = &local;
+  if (ELEMENTS) {
+    Arena *arena = &ctx.scratch_arena;
+    if (ctx.keep_slice_headers) {
+      header = ctx.arena.create<SliceHeader>();
+      arena = &ctx.arena;
+      ctx.slices.push_back(header);
+    } else {
+      ctx.scratch_arena.reset();
+    }
+    header->luma_weight_l0 = ArenaVector<int32_t>(ArenaAllocator<int32_t>(arena));
+    header->luma_offset_l0 = ArenaVector<int32_t>(ArenaAllocator<int32_t>(arena));
+    header->chroma_weight_l0 =
+        ArenaVector<std::pair<int32_t, int32_t>>(ArenaAllocator<std::pair<int32_t, int32_t>>(arena));
+    header->chroma_offset_l0 =
+        ArenaVector<std::pair<int32_t, int32_t>>(ArenaAllocator<std::pair<int32_t, int32_t>>(arena));
+    header->luma_weight_l1 = ArenaVector<int32_t>(ArenaAllocator<int32_t>(arena));
+    header->luma_offset_l1 = ArenaVector<int32_t>(ArenaAllocator<int32_t>(arena));
+    header->chroma_weight_l1 =
+        ArenaVector<std::pair<int32_t, int32_t>>(ArenaAllocator<std::pair<int32_t, int32_t>>(arena));
+    header->chroma_offset_l1 =
+        ArenaVector<std::pair<int32_t, int32_t>>(ArenaAllocator<std::pair<int32_t, int32_t>>(arena));
+  }
+  SliceHeader &ret = *header;
   // Don't know if this works, but we are not really interested in the value anyways.
-  uint32_t mb_address = decodeUnsignedExpGolomb(addr, offset, bit_offset, "first_mb_in_slice");
   uint8_t *ptr = nullptr;
   ret.first_mb_in_slice = ptr + mb_address;
-  ret.slice_type = decodeUnsignedExpGolomb(addr, offset, bit_offset, "slice_type");
-  std::string slice_type_string = getSliceTypeString(ret.slice_type);
-  curr_nal_unit.slice_type = slice_type_string.c_str()[0];
-#ifdef INFO
-  cout << "    " << slice_type_string << " Slice";
-  if (curr_nal_unit.nal_unit_type == 5) {
-    cout << " (IDR)";
-  }
-  cout << "\n";
-#endif
-  if (csv_file.is_open()) {
-    csv_file << slice_type_string;
+  ret.slice_type = raw_slice_type;
+  auto slice_type = static_cast<SliceType>(ret.slice_type % 5);
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << "    " << getSliceTypeString(ret.slice_type) << " Slice";
     if (curr_nal_unit.nal_unit_type == 5) {
-      csv_file << "(IDR)";
+      cout << " (IDR)";
     }
-    csv_file << "," << frame_num++ << "," << curr_nal_unit.size << "\n";
+    cout << "\n";
+  }
+  // The rest of the header depends on the parameter sets. A stream that was joined in the middle can start with slices
+  // whose PPS or SPS was never seen.
+  ret.pic_parameter_set_id = reader.decodeUnsignedExpGolomb("pic_parameter_set_id");
+  const PPS *pps = findPPS(ctx.ppss.data(), ctx.ppss.data() + ctx.ppss.size(), ret.pic_parameter_set_id);
+  const SPS *sps =
+      pps == nullptr ? nullptr : findSPS(ctx.spss.data(), ctx.spss.data() + ctx.spss.size(), pps->seq_parameter_set_id);
+  if (sps == nullptr) {
+    setBrokenSliceHeader(ctx, raw_slice_type, "pic_parameter_set_id");
+    return;
   }
-  ret.pic_parameter_set_id = decodeUnsignedExpGolomb(addr, offset, bit_offset, "pic_parameter_set_id");
+  const SPS &curr_sps = *sps;
+  const PPS &curr_pps = *pps;
   if (curr_sps.separate_colour_plane_flag) {
-    ret.colour_plane_id = static_cast<uint8_t>(readNBits(addr, offset, bit_offset, 2, "colour_plane_id"));
+    ret.colour_plane_id = static_cast<uint8_t>(reader.readNBits(2, "colour_plane_id"));
   }
-  ret.frame_num = readNBits(addr, offset, bit_offset, curr_sps.log2_max_frame_num_minus4 + 4, "frame_num");
+  ret.frame_num = reader.readNBits(curr_sps.log2_max_frame_num_minus4 + 4, "frame_num");
   if (!curr_sps.frame_mbs_only_flag) {
-    ret.field_pic_flag = readBit(addr, offset, bit_offset, "field_pic_flag");
+    ret.field_pic_flag = reader.readBit("field_pic_flag");
     if (ret.field_pic_flag) {
-      ret.bottom_field_flag = readBit(addr, offset, bit_offset, "bottom_field_flag");
+      ret.bottom_field_flag = reader.readBit("bottom_field_flag");
     }
   }
   // IdrPicFlag
   if (curr_nal_unit.nal_unit_type == 5) {
-    ret.idr_pic_id = decodeUnsignedExpGolomb(addr, offset, bit_offset, "idr_pic_id");
+    readUnsignedExpGolomb<ELEMENTS>(reader, ret.idr_pic_id, "idr_pic_id");
   }
   if (curr_sps.pic_order_cnt_type == 0) {
-    ret.pic_order_cnt_lsb = readNBits(addr,
-                                      offset,
-                                      bit_offset,
-                                      curr_sps.log2_max_pic_order_cnt_lsb_minus4 + 4,
+    ret.pic_order_cnt_lsb = reader.readNBits(curr_sps.log2_max_pic_order_cnt_lsb_minus4 + 4,
                                       "pic_order_cnt_lsb");
     if (curr_pps.bottom_field_pic_order_in_frame_present_flag && !ret.field_pic_flag) {
-      ret.delta_pic_order_cnt_bottom = decodeSignedExpGolomb(addr, offset, bit_offset, "delta_pic_order_cnt_bottom");
+      readSignedExpGolomb<ELEMENTS>(reader, ret.delta_pic_order_cnt_bottom, "delta_pic_order_cnt_bottom");
     }
   }
   if (curr_sps.pic_order_cnt_type == 1 && !curr_sps.delta_pic_order_always_zero_flag) {
-    ret.delta_pic_order_cnt_0 = decodeSignedExpGolomb(addr, offset, bit_offset, "delta_pic_order_cnt_0");
+    readSignedExpGolomb<ELEMENTS>(reader, ret.delta_pic_order_cnt_0, "delta_pic_order_cnt_0");
     if (curr_pps.bottom_field_pic_order_in_frame_present_flag && !ret.field_pic_flag) {
-      ret.delta_pic_order_cnt_1 = decodeSignedExpGolomb(addr, offset, bit_offset, "delta_pic_order_cnt_1");
+      readSignedExpGolomb<ELEMENTS>(reader, ret.delta_pic_order_cnt_1, "delta_pic_order_cnt_1");
     }
   }
   if (curr_pps.redundant_pic_cnt_present_flag) {
-    ret.redundant_pic_cnt = decodeUnsignedExpGolomb(addr, offset, bit_offset, "redundant_pic_cnt");
+    readUnsignedExpGolomb<ELEMENTS>(reader, ret.redundant_pic_cnt, "redundant_pic_cnt");
   }
-  if (slice_type_string == "B") {
-    ret.direct_spatial_mv_pred_flag = readBit(addr, offset, bit_offset, "direct_spatial_mv_pred_flag");
+  if (slice_type == SLICE_B) {
+    ret.direct_spatial_mv_pred_flag = reader.readBit("direct_spatial_mv_pred_flag");
   }
-  if (slice_type_string == "P" || slice_type_string == "SP" || slice_type_string == "B") {
-    ret.num_ref_idx_active_override_flag = readBit(addr, offset, bit_offset, "num_ref_idx_active_override_flag");
+  // Inferred from the PPS unless overridden, see ISO/IEC 14496-10:2014 Chapter 7.4.3.
+  ret.num_ref_idx_l0_active_minus1 = curr_pps.num_ref_idx_l0_default_active_minus1;
+  ret.num_ref_idx_l1_active_minus1 = curr_pps.num_ref_idx_l1_default_active_minus1;
+  if (slice_type == SLICE_P || slice_type == SLICE_SP || slice_type == SLICE_B) {
+    ret.num_ref_idx_active_override_flag = reader.readBit("num_ref_idx_active_override_flag");
     if (ret.num_ref_idx_active_override_flag) {
-      ret.num_ref_idx_l0_active_minus1 = decodeUnsignedExpGolomb(addr,
-                                                                 offset,
-                                                                 bit_offset,
-                                                                 "num_ref_idx_l0_active_minus1");
-      if (slice_type_string == "B") {
-        ret.num_ref_idx_l1_active_minus1 = decodeUnsignedExpGolomb(addr,
-                                                                   offset,
-                                                                   bit_offset,
-                                                                   "num_ref_idx_l1_active_minus1");
+      ret.num_ref_idx_l0_active_minus1 = reader.decodeUnsignedExpGolomb("num_ref_idx_l0_active_minus1");
+      if (slice_type == SLICE_B) {
+        ret.num_ref_idx_l1_active_minus1 = reader.decodeUnsignedExpGolomb("num_ref_idx_l1_active_minus1");
       }
     }
   }
+  // The pred_weight_table() loops run up to these values.
+  if (ret.num_ref_idx_l0_active_minus1 > MAX_NUM_REF_IDX_ACTIVE_MINUS1
+      || ret.num_ref_idx_l1_active_minus1 > MAX_NUM_REF_IDX_ACTIVE_MINUS1) {
+    setBrokenSliceHeader(ctx, raw_slice_type, "num_ref_idx_active_minus1");
+    return;
+  }
   if (curr_nal_unit.nal_unit_type == 20 || curr_nal_unit.nal_unit_type == 21) {
     // TODO ref_pic_list_mvc_modification()
+    ctx.stats.unimplemented[UNIMPLEMENTED_MVC_MODIFICATION]++;
     cerr << "WARNING: UNIMPLEMENTED CODE REACHED\n";
   } else {
     // ref_pic_list_modification()
-    if (ret.slice_type % 5 != 2 && ret.slice_type % 5 != 4) {
-      ret.ref_pic_list_modification_flag_l0 = readBit(addr, offset, bit_offset, "ref_pic_list_modification_flag_l0");
+    if (slice_type != SLICE_I && slice_type != SLICE_SI) {
+      ret.ref_pic_list_modification_flag_l0 = reader.readBit("ref_pic_list_modification_flag_l0");
       if (ret.ref_pic_list_modification_flag_l0) {
         do {
-          ret.modification_of_pic_nums_idc = decodeUnsignedExpGolomb(addr,
-                                                                     offset,
-                                                                     bit_offset,
-                                                                     "modification_of_pic_nums_idc");
+          ret.modification_of_pic_nums_idc = reader.decodeUnsignedExpGolomb("modification_of_pic_nums_idc");
+          // Past the end of the data, the value saturates and never terminates the loop.
+          if (ret.modification_of_pic_nums_idc > 5
+              || (ret.modification_of_pic_nums_idc != 3 && reader.isExhausted())) {
+            setBrokenSliceHeader(ctx, raw_slice_type, "modification_of_pic_nums_idc");
+            return;
+          }
           if (ret.modification_of_pic_nums_idc == 0 || ret.modification_of_pic_nums_idc == 1) {
-            ret.abs_diff_pic_num_minus1 = decodeUnsignedExpGolomb(addr, offset, bit_offset, "abs_diff_pic_num_minus1");
+            readUnsignedExpGolomb<ELEMENTS>(reader, ret.abs_diff_pic_num_minus1, "abs_diff_pic_num_minus1");
           } else if (ret.modification_of_pic_nums_idc == 2) {
-            ret.long_term_pic_num = decodeUnsignedExpGolomb(addr, offset, bit_offset, "long_term_pic_num");
+            readUnsignedExpGolomb<ELEMENTS>(reader, ret.long_term_pic_num, "long_term_pic_num");
           }
         } while (ret.modification_of_pic_nums_idc != 3);
       }
     }
-    if (ret.slice_type % 5 == 1) {
-      ret.ref_pic_list_modification_flag_l1 = readBit(addr, offset, bit_offset, "ref_pic_list_modification_flag_l1");
+    if (slice_type == SLICE_B) {
+      ret.ref_pic_list_modification_flag_l1 = reader.readBit("ref_pic_list_modification_flag_l1");
       if (ret.ref_pic_list_modification_flag_l1) {
         do {
-          ret.modification_of_pic_nums_idc = decodeUnsignedExpGolomb(addr,
-                                                                     offset,
-                                                                     bit_offset,
-                                                                     "modification_of_pic_nums_idc");
+          ret.modification_of_pic_nums_idc = reader.decodeUnsignedExpGolomb("modification_of_pic_nums_idc");
+          // Past the end of the data, the value saturates and never terminates the loop.
+          if (ret.modification_of_pic_nums_idc > 5
+              || (ret.modification_of_pic_nums_idc != 3 && reader.isExhausted())) {
+            setBrokenSliceHeader(ctx, raw_slice_type, "modification_of_pic_nums_idc");
+            return;
+          }
           if (ret.modification_of_pic_nums_idc == 0 || ret.modification_of_pic_nums_idc == 1) {
-            ret.abs_diff_pic_num_minus1 = decodeUnsignedExpGolomb(addr, offset, bit_offset, "abs_diff_pic_num_minus1");
+            readUnsignedExpGolomb<ELEMENTS>(reader, ret.abs_diff_pic_num_minus1, "abs_diff_pic_num_minus1");
           } else if (ret.modification_of_pic_nums_idc == 2) {
-            ret.long_term_pic_num = decodeUnsignedExpGolomb(addr, offset, bit_offset, "long_term_pic_num");
+            readUnsignedExpGolomb<ELEMENTS>(reader, ret.long_term_pic_num, "long_term_pic_num");
           }
         } while (ret.modification_of_pic_nums_idc != 3);
       }
     }
   }
-  if ((curr_pps.weighted_pred_flag && (slice_type_string == "P" || slice_type_string == "SP"))
-      || (curr_pps.weighted_bipred_idc == 1 && slice_type_string == "B")) {
+  if ((curr_pps.weighted_pred_flag && (slice_type == SLICE_P || slice_type == SLICE_SP))
+      || (curr_pps.weighted_bipred_idc == 1 && slice_type == SLICE_B)) {
     // pred_weight_table()
-    ret.luma_log2_weight_denom = decodeUnsignedExpGolomb(addr, offset, bit_offset, "luma_log2_weight_denom");
+    readUnsignedExpGolomb<ELEMENTS>(reader, ret.luma_log2_weight_denom, "luma_log2_weight_denom");
     if (getChromaArrayType(curr_sps) != 0) {
-      ret.chroma_log2_weight_denom = decodeUnsignedExpGolomb(addr, offset, bit_offset, "chroma_log2_weight_denom");
+      readUnsignedExpGolomb<ELEMENTS>(reader, ret.chroma_log2_weight_denom, "chroma_log2_weight_denom");
     }
     for (uint32_t i = 0; i <= ret.num_ref_idx_l0_active_minus1; i++) {
-      ret.luma_weight_l0_flag = readBit(addr, offset, bit_offset, "luma_weight_l0_flag");
+      ret.luma_weight_l0_flag = reader.readBit("luma_weight_l0_flag");
       if (ret.luma_weight_l0_flag) {
-        ret.luma_weight_l0.push_back(decodeSignedExpGolomb(addr, offset, bit_offset, "luma_weight_l0"));
-        ret.luma_offset_l0.push_back(decodeSignedExpGolomb(addr, offset, bit_offset, "luma_offset_l0"));
+        if (ELEMENTS) {
+          ret.luma_weight_l0.push_back(reader.decodeSignedExpGolomb("luma_weight_l0"));
+          ret.luma_offset_l0.push_back(reader.decodeSignedExpGolomb("luma_offset_l0"));
+        } else {
+          reader.skipExpGolomb();
+          reader.skipExpGolomb();
+        }
       }
       if (getChromaArrayType(curr_sps) != 0) {
-        ret.chroma_weight_l0_flag = readBit(addr, offset, bit_offset, "chroma_weight_l0_flag");
-        if (ret.chroma_weight_l0_flag) {
+        ret.chroma_weight_l0_flag = reader.readBit("chroma_weight_l0_flag");
+        if (ret.chroma_weight_l0_flag && ELEMENTS) {
           std::pair<int32_t, int32_t> chroma_weight_pair;
           std::pair<int32_t, int32_t> chroma_offset_pair;
-          chroma_weight_pair.first = decodeSignedExpGolomb(addr, offset, bit_offset, "chroma_weight_l0");
-          chroma_offset_pair.first = decodeSignedExpGolomb(addr, offset, bit_offset, "chroma_offset_l0");
-          chroma_weight_pair.second = decodeSignedExpGolomb(addr, offset, bit_offset, "chroma_weight_l0");
-          chroma_offset_pair.second = decodeSignedExpGolomb(addr, offset, bit_offset, "chroma_offset_l0");
+          chroma_weight_pair.first = reader.decodeSignedExpGolomb("chroma_weight_l0");
+          chroma_offset_pair.first = reader.decodeSignedExpGolomb("chroma_offset_l0");
+          chroma_weight_pair.second = reader.decodeSignedExpGolomb("chroma_weight_l0");
+          chroma_offset_pair.second = reader.decodeSignedExpGolomb("chroma_offset_l0");
           ret.chroma_weight_l0.push_back(chroma_weight_pair);
           ret.chroma_offset_l0.push_back(chroma_offset_pair);
+        } else if (ret.chroma_weight_l0_flag) {
+          for (uint32_t j = 0; j < 4; j++) {
+            reader.skipExpGolomb();
+          }
         }
       }
     }
-    if (ret.slice_type % 5 == 1) {
+    if (slice_type == SLICE_B) {
       for (uint32_t i = 0; i <= ret.num_ref_idx_l1_active_minus1; i++) {
-        ret.luma_weight_l1_flag = readBit(addr, offset, bit_offset, "luma_weight_l1_flag");
+        ret.luma_weight_l1_flag = reader.readBit("luma_weight_l1_flag");
         if (ret.luma_weight_l1_flag) {
-          ret.luma_weight_l1.push_back(decodeSignedExpGolomb(addr, offset, bit_offset, "luma_weight_l1"));
-          ret.luma_offset_l1.push_back(decodeSignedExpGolomb(addr, offset, bit_offset, "luma_offset_l1"));
+          if (ELEMENTS) {
+            ret.luma_weight_l1.push_back(reader.decodeSignedExpGolomb("luma_weight_l1"));
+            ret.luma_offset_l1.push_back(reader.decodeSignedExpGolomb("luma_offset_l1"));
+          } else {
+            reader.skipExpGolomb();
+            reader.skipExpGolomb();
+          }
         }
         if (getChromaArrayType(curr_sps) != 0) {
-          ret.chroma_weight_l1_flag = readBit(addr, offset, bit_offset, "");
-          if (ret.chroma_weight_l1_flag) {
+          ret.chroma_weight_l1_flag = reader.readBit("chroma_weight_l1_flag");
+          if (ret.chroma_weight_l1_flag && ELEMENTS) {
             std::pair<int32_t, int32_t> chroma_weight_pair;
             std::pair<int32_t, int32_t> chroma_offset_pair;
-            chroma_weight_pair.first = decodeSignedExpGolomb(addr, offset, bit_offset, "chroma_weight_l1");
-            chroma_offset_pair.first = decodeSignedExpGolomb(addr, offset, bit_offset, "chroma_offset_l1");
-            chroma_weight_pair.second = decodeSignedExpGolomb(addr, offset, bit_offset, "chroma_weight_l1");
-            chroma_offset_pair.second = decodeSignedExpGolomb(addr, offset, bit_offset, "chroma_offset_l1");
+            chroma_weight_pair.first = reader.decodeSignedExpGolomb("chroma_weight_l1");
+            chroma_offset_pair.first = reader.decodeSignedExpGolomb("chroma_offset_l1");
+            chroma_weight_pair.second = reader.decodeSignedExpGolomb("chroma_weight_l1");
+            chroma_offset_pair.second = reader.decodeSignedExpGolomb("chroma_offset_l1");
             ret.chroma_weight_l1.push_back(chroma_weight_pair);
             ret.chroma_offset_l1.push_back(chroma_offset_pair);
+          } else if (ret.chroma_weight_l1_flag) {
+            for (uint32_t j = 0; j < 4; j++) {
+              reader.skipExpGolomb();
+            }
           }
         }
       }
@@ -370,56 +688,50 @@ void parseSliceHeader(const uint8_t *addr, size_t &offset) {
     // dec_ref_pic_marking()
     // IdrPicFlag
     if (curr_nal_unit.nal_unit_type == 5) {
-      ret.no_output_of_prior_pics_flag = readBit(addr, offset, bit_offset, "no_output_of_prior_pics_flag");
-      ret.long_term_reference_flag = readBit(addr, offset, bit_offset, "long_term_reference_flag");
+      ret.no_output_of_prior_pics_flag = reader.readBit("no_output_of_prior_pics_flag");
+      ret.long_term_reference_flag = reader.readBit("long_term_reference_flag");
     } else {
-      ret.adaptive_ref_pic_marking_mode_flag = readBit(addr, offset, bit_offset, "adaptive_ref_pic_marking_mode_flag");
+      ret.adaptive_ref_pic_marking_mode_flag = reader.readBit("adaptive_ref_pic_marking_mode_flag");
       if (ret.adaptive_ref_pic_marking_mode_flag) {
         do {
-          ret.memory_management_control_operation = decodeUnsignedExpGolomb(addr,
-                                                                            offset,
-                                                                            bit_offset,
-                                                                            "memory_management_control_operation");
+          ret.memory_management_control_operation = reader.decodeUnsignedExpGolomb("memory_management_control_operation");
+          if (ret.memory_management_control_operation > 6
+              || (ret.memory_management_control_operation != 0 && reader.isExhausted())) {
+            setBrokenSliceHeader(ctx, raw_slice_type, "memory_management_control_operation");
+            return;
+          }
           if (ret.memory_management_control_operation == 1 || ret.memory_management_control_operation == 3) {
-            ret.difference_of_pic_nums_minus1 = decodeUnsignedExpGolomb(addr,
-                                                                        offset,
-                                                                        bit_offset,
-                                                                        "difference_of_pic_nums_minus1");
+            readUnsignedExpGolomb<ELEMENTS>(reader, ret.difference_of_pic_nums_minus1, "difference_of_pic_nums_minus1");
           }
           if (ret.memory_management_control_operation == 2) {
-            ret.long_term_pic_num = decodeUnsignedExpGolomb(addr, offset, bit_offset, "long_term_pic_num");
+            readUnsignedExpGolomb<ELEMENTS>(reader, ret.long_term_pic_num, "long_term_pic_num");
           }
           if (ret.memory_management_control_operation == 3 || ret.memory_management_control_operation == 6) {
-            ret.long_term_frame_idx = decodeUnsignedExpGolomb(addr, offset, bit_offset, "long_term_frame_idx");
+            readUnsignedExpGolomb<ELEMENTS>(reader, ret.long_term_frame_idx, "long_term_frame_idx");
           }
           if (ret.memory_management_control_operation == 4) {
-            ret.max_long_term_frame_idx_plus1 = decodeUnsignedExpGolomb(addr,
-                                                                        offset,
-                                                                        bit_offset,
-                                                                        "max_long_term_frame_idx_plus1");
+            readUnsignedExpGolomb<ELEMENTS>(reader, ret.max_long_term_frame_idx_plus1,
+                                            "max_long_term_frame_idx_plus1");
           }
         } while (ret.memory_management_control_operation != 0);
       }
     }
   }
-  if (curr_pps.entropy_coding_mode_flag && slice_type_string != "I" && slice_type_string != "SI") {
-    ret.cabac_init_idc = decodeUnsignedExpGolomb(addr, offset, bit_offset, "cabac_init_idc");
+  if (curr_pps.entropy_coding_mode_flag && slice_type != SLICE_I && slice_type != SLICE_SI) {
+    readUnsignedExpGolomb<ELEMENTS>(reader, ret.cabac_init_idc, "cabac_init_idc");
   }
-  ret.slice_qp_delta = decodeSignedExpGolomb(addr, offset, bit_offset, "slice_qp_delta");
-  if (slice_type_string == "SP" || slice_type_string == "SI") {
-    if (slice_type_string == "SP") {
-      ret.sp_for_switch_flag = readBit(addr, offset, bit_offset, "sp_for_switch_flag");
+  readSignedExpGolomb<ELEMENTS>(reader, ret.slice_qp_delta, "slice_qp_delta");
+  if (slice_type == SLICE_SP || slice_type == SLICE_SI) {
+    if (slice_type == SLICE_SP) {
+      ret.sp_for_switch_flag = reader.readBit("sp_for_switch_flag");
     }
-    ret.slice_qs_delta = decodeSignedExpGolomb(addr, offset, bit_offset, "slice_qs_delta");
+    readSignedExpGolomb<ELEMENTS>(reader, ret.slice_qs_delta, "slice_qs_delta");
   }
   if (curr_pps.deblocking_filter_control_present_flag) {
-    ret.disable_deblocking_filter_idc = decodeUnsignedExpGolomb(addr,
-                                                                offset,
-                                                                bit_offset,
-                                                                "disable_deblocking_filter_idc");
+    ret.disable_deblocking_filter_idc = reader.decodeUnsignedExpGolomb("disable_deblocking_filter_idc");
     if (ret.disable_deblocking_filter_idc != 1) {
-      ret.slice_alpha_c0_offset_div2 = decodeSignedExpGolomb(addr, offset, bit_offset, "slice_alpha_c0_offset_div2");
-      ret.slice_beta_offset_div2 = decodeSignedExpGolomb(addr, offset, bit_offset, "slice_beta_offset_div2");
+      readSignedExpGolomb<ELEMENTS>(reader, ret.slice_alpha_c0_offset_div2, "slice_alpha_c0_offset_div2");
+      readSignedExpGolomb<ELEMENTS>(reader, ret.slice_beta_offset_div2, "slice_beta_offset_div2");
     }
   }
   if (curr_pps.num_slice_groups_minus1 > 0 && curr_pps.slice_group_map_type >= 3
@@ -427,131 +739,151 @@ void parseSliceHeader(const uint8_t *addr, size_t &offset) {
     double pic_size_in_map_units = curr_pps.pic_size_in_map_units_minus1 + 1;
     double slice_group_change_rate = curr_pps.slice_group_change_rate_minus1 + 1;
     uint32_t length = ceil(log2(pic_size_in_map_units / slice_group_change_rate + 1));
-    ret.slice_group_change_cycle = readNBits(addr, offset, bit_offset, length, "slice_group_change_cycle");
+    ret.slice_group_change_cycle = reader.readNBits(length, "slice_group_change_cycle");
   }
-  slices.push_back(ret);
   // Round slice header size to full bytes.
+  size_t offset = reader.getOffset();
+  uint8_t bit_offset = reader.getBitOffset();
+  timer.addBytes(offset - offset_start + (bit_offset > 0 ? 1 : 0));
   if (bit_offset > 0) {
-    curr_nal_unit.slice_header_size = (offset - offset_start) + 1;
+    ctx.nal_units.setSliceHeader(ret.slice_type, (offset - offset_start) + 1);
+  } else {
+    ctx.nal_units.setSliceHeader(ret.slice_type, offset - offset_start);
+  }
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << "    Slice header length: " << offset - offset_start << " bytes " << +bit_offset << " bits" << "\n";
+    printf("    Slice data @ %zX+%u\n", offset, bit_offset);
+  }
+}
+
+void parseSliceHeader(ParserContext &ctx, BitReader &reader) {
+  // The trace prints every syntax element, so it needs all of them.
+  if (ctx.keep_slice_headers || (ctx.slice_fields & SLICE_FIELD_ELEMENTS) || isTraceEnabled(TRACE_INFO)) {
+    parseSliceHeaderFields<SLICE_FIELDS_ALL>(ctx, reader);
+  } else if (ctx.slice_fields & SLICE_FIELD_HEADER_SIZE) {
+    parseSliceHeaderFields<SLICE_FIELD_TYPE | SLICE_FIELD_HEADER_SIZE>(ctx, reader);
   } else {
-    curr_nal_unit.slice_header_size = offset - offset_start;
+    parseSliceHeaderFields<SLICE_FIELD_TYPE>(ctx, reader);
   }
-#if defined(DEBUG) || defined(INFO)
-  cout << "    Slice header length: " << offset - offset_start << " bytes " << +bit_offset << " bits" << "\n";
-  printf("    Slice data @ %X+%u\n", offset, bit_offset);
-#endif
 }
 
-int32_t parseMP4Box(const uint8_t *addr, size_t &offset) {
-#if defined(DEBUG) || defined(INFO)
-  cout << "MP4\n";
-#endif
-  uint8_t bit_offset = 0;
+int32_t parseMP4Box(ParserContext &ctx, BitReader &reader) {
+  StageTimer timer(ctx.stats, STAGE_BOX_WALK);
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << "MP4\n";
+  }
   MP4Box ret{};
-  ret.location = addr + offset;
-  ret.location_relative = offset;
-  ret.size = readUnsignedInt32(addr, offset, bit_offset, "size");
-#ifdef DEBUG
-  // Need to print this manually, because we would print the integer representation, which is not useful.
-  std::cout << POSITION << "name: ";
-#endif
-  uint32_t box_type = readUnsignedInt32(addr, offset, bit_offset);
-  ret.name = getNameString(box_type);
-#if defined(DEBUG)
-  std::cout << ret.name << "\n";
-#endif
-#ifdef INFO
-  cout << ret.name << " size: " << ret.size << "\n";
-#endif
-  if (ret.size <= 1) {
-    //TODO
-    cerr << "largesize or eof\n";
-    return -1;
+  ret.location_relative = reader.getOffset();
+  uint64_t size = reader.readUnsignedInt32("size");
+  ret.type = reader.readUnsignedInt32();
+  if (isTraceEnabled(TRACE_DEBUG)) {
+    // Need to print this manually, because we would print the integer representation, which is not useful.
+    traceElement(ret.location_relative + 4, 0, "name", getNameString(ret.type));
   }
-  if (ret.name != "mdat") {
-    if (csv_file.is_open()) {
-      csv_file << ret.name << ",0," << ret.size << "\n";
+  if (size == 1) {
+    size = reader.readUnsignedInt64("largesize");
+  } else if (size == 0) {
+    // The box extends to the end of the input, usually a trailing mdat of a recording that was never finalized.
+    size = ctx.input_size - ret.location_relative;
+  }
+  ret.header_size = static_cast<uint8_t>(reader.getOffset() - ret.location_relative);
+  timer.addBytes(ret.header_size);
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << getNameString(ret.type) << " size: ";
+    if (ctx.input_size == SIZE_MAX && ret.location_relative + size == SIZE_MAX) {
+      cout << "to the end of the input\n";
+    } else {
+      cout << size << "\n";
     }
+  }
+  if (size < ret.header_size || size > SIZE_MAX - ret.location_relative) {
+    cerr << "Box " << getNameString(ret.type) << " at " << ret.location_relative << " has invalid size " << size << "\n";
+    return -1;
+  }
+  ret.size = size;
+  if (ret.type != fourCC("mdat")) {
     // Skip the actual contents of this box
-    offset += ret.size - 8;
-  } else {
-    // The output in the csv for the NAL units only includes their own size, so we need to add the size of the mdat
-    // header manually to get a byte count w/o gaps.
-    if (csv_file.is_open()) {
-      csv_file << "mdat(header),0,8\n";
-    }
+    reader.seek(ret.location_relative + ret.size);
   }
-  mp4_boxes.push_back(ret);
+  ctx.mp4_boxes.push_back(ret);
   return 0;
 }
 
-void flushMPDFile(const std::string &file_name, std::string video_name) {
-  flushMPDFile(file_name, std::move(video_name), "");
+int32_t flushMPDFile(const ParserContext &ctx, const std::string &file_name, std::string video_name) {
+  return flushMPDFile(ctx, file_name, std::move(video_name), nullptr);
 }
 
-void flushMPDFile(const std::string &file_name, std::string video_name, const std::string &weight_file_prefix) {
-  // Get filename from path
-  size_t last_slash = video_name.find_last_of('/');
-  if (last_slash != video_name.size()) {
-    video_name = video_name.substr(last_slash + 1, video_name.size() - last_slash);
-  }
-  XmlHandler xml_handler;
-  if (xml_handler.setFile(file_name, video_name) < 0) {
-    return;
-  }
+/**
+ * Adds the attributes of every segment of a video to the SegmentURL elements of its representation, starting at the
+ * current SegmentURL element of the handler.
+ * @param ctx Context of the parsed video.
+ * @param xml_handler Handler positioned at the first SegmentURL element of the representation.
+ * @param weights Weights of the frames or nullptr.
+ * @param top_frames Number of frames per segment that are ordered by weight, 0 for all.
+ * @return 0 on success. -1 if the MP4 boxes do not match the segments.
+ */
+static int32_t annotateSegments(const ParserContext &ctx,
+                                XmlHandler &xml_handler,
+                                const WeightFile *weights,
+                                size_t top_frames) {
   // Skip MP4 headers that are already contained in the Initialization segment of the mpd file.
-  uint32_t curr_segment_start = xml_handler.getRangeStart();
-  auto mp4box_it = mp4_boxes.begin();
-  while (mp4box_it != mp4_boxes.end() && mp4box_it->location_relative < curr_segment_start) {
-#ifdef INFO
-    std::cout << "Skipping init header " << mp4box_it->name << "\n";
-#endif
+  size_t curr_segment_start = xml_handler.getRangeStart();
+  auto mp4box_it = ctx.mp4_boxes.begin();
+  while (mp4box_it != ctx.mp4_boxes.end() && mp4box_it->location_relative < curr_segment_start) {
+    if (isTraceEnabled(TRACE_INFO)) {
+      std::cout << "Skipping init header " << getNameString(mp4box_it->type) << "\n";
+    }
     mp4box_it++;
   }
   uint32_t segment_no = 1;
-  auto nal_unit_it = nal_units.begin();
+  auto nal_unit_it = ctx.nal_units.begin();
+  // Reused for all segments, so building the attributes does not allocate once they have grown.
+  std::string range_list;
+  std::string frame_ranges;
+  std::vector<std::pair<size_t, size_t>> non_frame_ranges;
+  std::vector<Frame> frame_list;
   // Segments
-  while (mp4box_it != mp4_boxes.end()) {
+  while (mp4box_it != ctx.mp4_boxes.end()) {
     // MP4 headers
     curr_segment_start = xml_handler.getRangeStart();
-    uint32_t curr_segment_end = xml_handler.getRangeEnd();
-    uint32_t header_block_start = mp4box_it->location_relative;
-    uint32_t current_block_start = mp4box_it->location_relative;
-    uint32_t expected_next_block = current_block_start + mp4box_it->size;
+    size_t curr_segment_end = xml_handler.getRangeEnd();
+    size_t header_block_start = mp4box_it->location_relative;
+    size_t current_block_start = mp4box_it->location_relative;
+    size_t expected_next_block = current_block_start + mp4box_it->size;
     // Iterate until we find a mdat box or a gap in the byte stream.
-    while (mp4box_it != mp4_boxes.end() && mp4box_it->location_relative < curr_segment_end) {
+    while (mp4box_it != ctx.mp4_boxes.end() && mp4box_it->location_relative < curr_segment_end) {
       mp4box_it++;
-      if (mp4box_it->location_relative != expected_next_block || mp4box_it->name == "mdat") {
+      if (mp4box_it->location_relative != expected_next_block || mp4box_it->type == fourCC("mdat")) {
         break;
       }
       current_block_start = mp4box_it->location_relative;
       expected_next_block = current_block_start + mp4box_it->size;
     }
-    if (mp4box_it->name != "mdat") {
+    if (mp4box_it->type != fourCC("mdat")) {
       std::cerr << "Gap in bytestream before mdat. Should not happen.\n";
-      return;
+      return -1;
     }
-    // If we reach this point, mp4box_it points to the current mdat box that contains H.264 data. Add the 8 byte header
-    // to the size, set the iterator to the next MP4 box (in the next segment) and start iterating over the H.264
-    // headers.
-    uint32_t header_block_end = mp4box_it->location_relative + 8;
+    // If we reach this point, mp4box_it points to the current mdat box that contains H.264 data. Add the mdat header to
+    // the size, set the iterator to the next MP4 box (in the next segment) and start iterating over the H.264 headers.
+    size_t header_block_end = mp4box_it->location_relative + mp4box_it->header_size;
     /*xml_handler.addAttribute("mp4Header",
                              std::to_string(header_block_start - curr_segment_start) + "-"
                                  + std::to_string(header_block_end - curr_segment_start - 1));*/
     mp4box_it++;
 
     // H.264 headers
-    std::string range_list;
-    std::string frame_ranges;
+    range_list.clear();
+    frame_ranges.clear();
+    non_frame_ranges.clear();
     size_t i_frame_end = 0;
-    std::vector<Frame> frame_list;
+    frame_list.clear();
     // We need two nested while loops, because we can have multiple NAL units in a single MP4 segment.
-    while (nal_unit_it != nal_units.end() && nal_unit_it->location_relative < curr_segment_end) {
+    while (nal_unit_it != ctx.nal_units.end() && nal_unit_it->location_relative < curr_segment_end) {
       header_block_start = nal_unit_it->location_relative;
       current_block_start = nal_unit_it->location_relative;
       expected_next_block = current_block_start + nal_unit_it->size;
       // Iterate until we find a NAL unit containing a slice or a gap in the bytestream.
-      while (nal_unit_it != nal_units.end()) {
+      while (nal_unit_it != ctx.nal_units.end()) {
         if (nal_unit_it->nal_unit_type == 1 || nal_unit_it->nal_unit_type == 5) {
           if (nal_unit_it->slice_type == 'I') {
             i_frame_end = nal_unit_it->location_relative + nal_unit_it->size - 1;
@@ -561,17 +893,17 @@ void flushMPDFile(const std::string &file_name, std::string video_name, const st
                                     nal_unit_it->location_relative,
                                     nal_unit_it->location_relative + nal_unit_it->size - 1);
           }
-          // Slice. Add the 5 byte NAL unit header to the slice header size. Slice header size is byte aligned (by us).
-          header_block_end = nal_unit_it->location_relative + 5 + nal_unit_it->slice_header_size;
+          // Slice. Add the NAL unit prefix and header to the slice header size. Slice header size is byte aligned (by us).
+          header_block_end = nal_unit_it->location_relative + nal_unit_it->prefix_size + 1
+              + nal_unit_it->slice_header_size;
           nal_unit_it++;
           break;
         } else {
           if (i_frame_end > 0 && nal_unit_it->location_relative > i_frame_end) {
             // TODO H.264 structures that are not frames (PPS/SPS) that occur after the I-frame are currently prepended to
-            // the P-frame list.
-            frame_ranges = std::to_string(nal_unit_it->location_relative).append("-").append(
-                std::to_string(nal_unit_it->location_relative + nal_unit_it->size - 1)).append(",").append(
-                frame_ranges);
+            // the P-frame list, in reverse order.
+            non_frame_ranges.emplace_back(nal_unit_it->location_relative,
+                                          nal_unit_it->location_relative + nal_unit_it->size - 1);
           }
           header_block_end = expected_next_block;
           nal_unit_it++;
@@ -586,309 +918,1490 @@ void flushMPDFile(const std::string &file_name, std::string video_name, const st
       // After this loop, nal_unit_it points to the next NAL unit, either in the same segment, i.e., we skip slice data
       // or in the next segment, i.e., the current segment is done and we need to start iterating over MP4 headers
       // again.
-      range_list += std::to_string(header_block_start - curr_segment_start) + "-"
-          + std::to_string(header_block_end - curr_segment_start - 1) + ",";
+      appendUnsigned(range_list, header_block_start - curr_segment_start);
+      range_list += '-';
+      appendUnsigned(range_list, header_block_end - curr_segment_start - 1);
+      range_list += ',';
     }
 
-    if (!weight_file_prefix.empty()) {
-      assignWeights(weight_file_prefix, segment_no, frame_list, true);
+    if (weights != nullptr && assignWeights(*weights, segment_no, frame_list, true) == 0) {
+      orderFrames(frame_list, top_frames);
     }
 
+    for (auto range_it = non_frame_ranges.rbegin(); range_it != non_frame_ranges.rend(); range_it++) {
+      appendUnsigned(frame_ranges, range_it->first);
+      frame_ranges += '-';
+      appendUnsigned(frame_ranges, range_it->second);
+      frame_ranges += ',';
+    }
     for (auto &frame : frame_list) {
-      frame_ranges += frame.getRange() + ',';
+      frame.appendRange(frame_ranges);
+      frame_ranges += ',';
     }
 
     // Strip the last comma from the ranges strings.
-    range_list = range_list.substr(0, range_list.size() - 1);
-    frame_ranges = frame_ranges.substr(0, frame_ranges.size() - 1);
+    if (!range_list.empty()) {
+      range_list.pop_back();
+    }
+    if (!frame_ranges.empty()) {
+      frame_ranges.pop_back();
+    }
     //xml_handler.addAttribute("h264Header", range_list);
     xml_handler.addAttribute("frames", frame_ranges);
     xml_handler.nextSegment();
     segment_no++;
   }
-  xml_handler.save();
+  return 0;
+}
+
+int32_t flushMPDFile(const ParserContext &ctx,
+                     const std::string &file_name,
+                     std::string video_name,
+                     const WeightFile *weights,
+                     size_t top_frames) {
+  StageTimer timer(STAGE_MPD);
+  // Get filename from path
+  size_t last_slash = video_name.find_last_of('/');
+  if (last_slash != video_name.size()) {
+    video_name = video_name.substr(last_slash + 1, video_name.size() - last_slash);
+  }
+  XmlHandler xml_handler;
+  if (xml_handler.setFile(file_name, video_name) < 0) {
+    return -1;
+  }
+  if (annotateSegments(ctx, xml_handler, weights, top_frames) < 0) {
+    return -1;
+  }
+  return xml_handler.save();
 }
 
-void flushRanges(const std::string &video_name) {
-  std::ofstream range_file;
-  range_file.open(video_name.substr(0, video_name.length() - 3) + "-ranges.csv", std::ofstream::trunc);
-  if (range_file.fail()) {
+uint32_t flushCSV(const IndexReader &index, OutputBuffer &csv_file, uint32_t frame_num) {
+  StageTimer timer(STAGE_CSV);
+  size_t nal_unit_i = 0;
+  auto flushNALUnits = [&](size_t end) {
+    for (; nal_unit_i < index.getNALUnitCount() && index.getNALUnits()[nal_unit_i].location < end; nal_unit_i++) {
+      NALUnit nal_unit = toNALUnit(index.getNALUnits()[nal_unit_i]);
+      if (nal_unit.nal_unit_type == 1 || nal_unit.nal_unit_type == 5) {
+        csv_file.append(getSliceTypeString(nal_unit.raw_slice_type));
+        if (nal_unit.nal_unit_type == 5) {
+          csv_file.append("(IDR)");
+        }
+        csv_file.append(',').appendUnsigned(frame_num++).append(',').appendUnsigned(nal_unit.size).append('\n');
+      } else {
+        csv_file.append(getShortNALUnitTypeString(nal_unit.nal_unit_type)).append(",0,").appendUnsigned(nal_unit.size)
+            .append('\n');
+      }
+    }
+  };
+  for (size_t i = 0; i < index.getBoxCount(); i++) {
+    MP4Box mp4_box = toMP4Box(index.getBoxes()[i]);
+    // NAL units always follow the header of their mdat box.
+    flushNALUnits(mp4_box.location_relative);
+    if (mp4_box.type == fourCC("mdat")) {
+      // The output in the csv for the NAL units only includes their own size, so we need to add the size of the mdat
+      // header manually to get a byte count w/o gaps.
+      csv_file.append("mdat(header),0,").appendUnsigned(mp4_box.header_size).append('\n');
+    } else {
+      csv_file.append(getNameString(mp4_box.type)).append(",0,").appendUnsigned(mp4_box.size).append('\n');
+    }
+  }
+  flushNALUnits(SIZE_MAX);
+  return frame_num;
+}
+
+/**
+ * Appends a line of the range file.
+ */
+static void appendRangeLine(OutputBuffer &range_file,
+                            const char *category,
+                            const std::string &type,
+                            const char *type_suffix,
+                            size_t start,
+                            size_t end) {
+  range_file.append(category).append(',').append(type).append(type_suffix).append(',').appendUnsigned(start)
+      .append(',').appendUnsigned(end).append('\n');
+}
+
+void flushRanges(const IndexReader &index, const std::string &video_name) {
+  StageTimer timer(STAGE_RANGES);
+  OutputBuffer range_file;
+  if (range_file.open(video_name.substr(0, video_name.length() - 3) + "-ranges.csv") < 0) {
     cerr << "Failed to open range file: " << strerror(errno) << "\n";
     return;
   }
-  range_file << "category,type,start,end\n";
-  for (auto &mp4_box : mp4_boxes) {
-    range_file << "mp4," << mp4_box.name << "," << mp4_box.location_relative << ","
-               << mp4_box.location_relative + mp4_box.size - 1 << "\n";
+  range_file.append("category,type,start,end\n");
+  for (size_t i = 0; i < index.getBoxCount(); i++) {
+    MP4Box mp4_box = toMP4Box(index.getBoxes()[i]);
+    appendRangeLine(range_file, "mp4", getNameString(mp4_box.type), "", mp4_box.location_relative,
+                    mp4_box.location_relative + mp4_box.size - 1);
   }
-  for (auto &nal_unit : nal_units) {
-    range_file << "h264,";
+  std::string slice_type(1, ' ');
+  for (size_t i = 0; i < index.getNALUnitCount(); i++) {
+    NALUnit nal_unit = toNALUnit(index.getNALUnits()[i]);
     if (nal_unit.nal_unit_type == 0 || nal_unit.nal_unit_type > 5) {
-      range_file << getShortNALUnitTypeString(nal_unit.nal_unit_type) << "," << nal_unit.location_relative << ","
-                 << nal_unit.location_relative + nal_unit.size - 1 << "\n";
+      appendRangeLine(range_file, "h264", getShortNALUnitTypeString(nal_unit.nal_unit_type), "",
+                      nal_unit.location_relative, nal_unit.location_relative + nal_unit.size - 1);
     } else if (nal_unit.nal_unit_type > 1 && nal_unit.nal_unit_type < 5) {
       cerr << "Slice partitions are not supported.\n";
-      range_file << getShortNALUnitTypeString(nal_unit.nal_unit_type) << "," << nal_unit.location_relative << ","
-                 << nal_unit.location_relative + nal_unit.size - 1 << "\n";
+      appendRangeLine(range_file, "h264", getShortNALUnitTypeString(nal_unit.nal_unit_type), "",
+                      nal_unit.location_relative, nal_unit.location_relative + nal_unit.size - 1);
     } else {
-      uint32_t header_end = nal_unit.location_relative + nal_unit.slice_header_size + 4;
-      range_file << nal_unit.slice_type << "_header," << nal_unit.location_relative << "," << header_end << "\n";
-      range_file << "h264," << nal_unit.slice_type << "_content," << header_end + 1 << ","
-                 << nal_unit.location_relative + nal_unit.size - 1 << "\n";
+      size_t header_end = nal_unit.location_relative + nal_unit.prefix_size + nal_unit.slice_header_size;
+      slice_type[0] = nal_unit.slice_type;
+      appendRangeLine(range_file, "h264", slice_type, "_header", nal_unit.location_relative, header_end);
+      appendRangeLine(range_file, "h264", slice_type, "_content", header_end + 1,
+                      nal_unit.location_relative + nal_unit.size - 1);
     }
   }
-  range_file.close();
+  if (range_file.close() < 0) {
+    cerr << "Failed to write range file: " << strerror(errno) << "\n";
+  }
 }
 
-void assignWeights(const std::string &weight_file_prefix,
-                   uint32_t segment_no,
-                   std::vector<Frame> &frame_list,
-                   bool skip_i_frame) {
-  size_t frame_count = 0;
-  std::string weight_file = weight_file_prefix + "-" + std::to_string(segment_no) + ".dat";
-  std::ifstream in(weight_file);
-  if (in.fail()) {
-    cerr << "Failed to open weight file " << weight_file << ": " << strerror(errno) << "\n";
+void flushSamples(const ParserContext &ctx, const std::string &samples_file_path) {
+  StageTimer timer(STAGE_SAMPLES);
+  OutputBuffer samples_file;
+  if (samples_file.open(samples_file_path) < 0) {
+    cerr << "Failed to open samples file: " << strerror(errno) << "\n";
     return;
   }
-  auto frame_list_it = frame_list.begin();
-  uint32_t poc;
-  uint32_t weight;
-  if (skip_i_frame) {
-    // Skip I-Frame weight.
-    in >> poc >> weight;
-    frame_count++;
-  }
-  while (in >> poc >> weight) {
-    frame_list_it->setWeight(weight);
-    frame_count++;
-#ifdef DEBUG
-    cout << "segment: " << segment_no << " frame: " << frame_count << " type: " << frame_list_it->getType() << " weight: " << weight << "\n";
-#endif
-    if (frame_list_it == frame_list.end()) {
-      break;
+  samples_file.append("track,start,end,decode_time,composition_time,sync\n");
+  for (auto &sample : ctx.samples) {
+    samples_file.appendUnsigned(sample.track_id).append(',').appendUnsigned(sample.location_relative).append(',')
+        .appendUnsigned(sample.location_relative + sample.size - 1).append(',').appendUnsigned(sample.decode_time)
+        .append(',').appendSigned(static_cast<int64_t>(sample.decode_time) + sample.composition_offset).append(',')
+        .appendUnsigned(sample.sync).append('\n');
+  }
+  if (samples_file.close() < 0) {
+    cerr << "Failed to write samples file: " << strerror(errno) << "\n";
+  }
+}
+
+/// Sample aspect ratios of aspect_ratio_idc 1 to 16, see ISO/IEC 14496-10:2014 Table E-1.
+static const uint16_t SAMPLE_ASPECT_RATIOS[16][2] = {
+    {1, 1}, {12, 11}, {10, 11}, {16, 11}, {40, 33}, {24, 11}, {20, 11}, {32, 11}, {80, 33}, {18, 11}, {15, 11},
+    {64, 33}, {160, 99}, {4, 3}, {3, 2}, {2, 1}};
+
+/**
+ * Appends the bit rate and CPB size in bits and the cbr_flag of the first CPB specification of HRD parameters to a CSV
+ * row, see ISO/IEC 14496-10:2014 Chapter E.2.2.
+ */
+static void appendHRDColumns(std::string &row, bool present, const HRDParameters &hrd) {
+  row += ',';
+  if (present) {
+    appendUnsigned(row, (static_cast<uint64_t>(hrd.bit_rate_value_minus1[0]) + 1) << (6 + hrd.bit_rate_scale));
+    row += ',';
+    appendUnsigned(row, (static_cast<uint64_t>(hrd.cpb_size_value_minus1[0]) + 1) << (4 + hrd.cpb_size_scale));
+    row += hrd.cbr_flag[0] ? ",1" : ",0";
+  } else {
+    row += ",,";
+  }
+}
+
+static std::string formatSPSRow(const SPS &sps) {
+  std::string row;
+  appendUnsigned(row, sps.seq_parameter_set_id);
+  row += ',';
+  appendUnsigned(row, sps.profile_idc);
+  row += ',';
+  // The byte that follows profile_idc, as in the codecs parameter of an MPD.
+  appendUnsigned(row, sps.constraint_set0_flag << 7 | sps.constraint_set1_flag << 6 | sps.constraint_set2_flag << 5
+      | sps.constraint_set3_flag << 4 | sps.constraint_set4_flag << 3 | sps.constraint_set5_flag << 2);
+  row += ',';
+  appendUnsigned(row, sps.level_idc);
+  row += ',';
+  appendUnsigned(row, sps.chroma_format_idc);
+  row += ',';
+  appendUnsigned(row, sps.bit_depth_luma_minus8 + 8);
+  row += ',';
+  appendUnsigned(row, sps.bit_depth_chroma_minus8 + 8);
+  row += ',';
+  appendUnsigned(row, getFrameWidth(sps));
+  row += ',';
+  appendUnsigned(row, getFrameHeight(sps));
+  row += sps.frame_mbs_only_flag ? ",1," : ",0,";
+  appendUnsigned(row, sps.pic_order_cnt_type);
+  row += ',';
+  appendUnsigned(row, sps.max_num_ref_frames);
+  row += sps.seq_scaling_matrix_present_flag ? ",1," : ",0,";
+  const VUIParameters &vui = sps.vui_parameters;
+  bool present = sps.vui_parameters_present_flag;
+  if (present && vui.aspect_ratio_info_present_flag
+      && ((vui.aspect_ratio_idc >= 1 && vui.aspect_ratio_idc <= 16) || vui.aspect_ratio_idc == 255)) {
+    bool extended_sar = vui.aspect_ratio_idc == 255;
+    appendUnsigned(row, extended_sar ? vui.sar_width : SAMPLE_ASPECT_RATIOS[vui.aspect_ratio_idc - 1][0]);
+    row += ':';
+    appendUnsigned(row, extended_sar ? vui.sar_height : SAMPLE_ASPECT_RATIOS[vui.aspect_ratio_idc - 1][1]);
+  }
+  row += ',';
+  if (present && vui.video_signal_type_present_flag) {
+    row += vui.video_full_range_flag ? '1' : '0';
+  }
+  row += ',';
+  if (present && vui.video_signal_type_present_flag && vui.colour_description_present_flag) {
+    appendUnsigned(row, vui.colour_primaries);
+    row += ',';
+    appendUnsigned(row, vui.transfer_characteristics);
+    row += ',';
+    appendUnsigned(row, vui.matrix_coefficients);
+  } else {
+    row += ",,";
+  }
+  row += ',';
+  if (present && vui.timing_info_present_flag && vui.num_units_in_tick > 0 && vui.time_scale > 0) {
+    // A frame lasts two ticks, see E.2.1. The rate is reduced like the frameRate attribute of an MPD.
+    uint64_t numerator = vui.time_scale;
+    uint64_t denominator = 2 * static_cast<uint64_t>(vui.num_units_in_tick);
+    uint64_t a = numerator;
+    uint64_t b = denominator;
+    while (b != 0) {
+      uint64_t r = a % b;
+      a = b;
+      b = r;
     }
-    frame_list_it++;
+    appendUnsigned(row, numerator / a);
+    row += '/';
+    appendUnsigned(row, denominator / a);
+    row += vui.fixed_frame_rate_flag ? ",1" : ",0";
+  } else {
+    row += ',';
   }
-  if ((skip_i_frame && (frame_count != frame_list.size() + 1))
-      || (!skip_i_frame && (frame_count != frame_list.size()))) {
-    cerr << "Number of frames in weight files and segment does not match. weight file: " << frame_count << " segment: "
-         << frame_list.size() + 1 << "\n";
-    cerr << "In file: " << weight_file << "\n";
+  appendHRDColumns(row, present && vui.nal_hrd_parameters_present_flag, vui.nal_hrd_parameters);
+  appendHRDColumns(row, present && vui.vcl_hrd_parameters_present_flag, vui.vcl_hrd_parameters);
+  row += ',';
+  if (present && vui.bitstream_restriction_flag) {
+    appendUnsigned(row, vui.max_num_reorder_frames);
+    row += ',';
+    appendUnsigned(row, vui.max_dec_frame_buffering);
+  } else {
+    row += ',';
+  }
+  row += '\n';
+  return row;
+}
+
+static std::string formatPPSRow(const PPS &pps) {
+  std::string row;
+  appendUnsigned(row, pps.pic_parameter_set_id);
+  row += ',';
+  appendUnsigned(row, pps.seq_parameter_set_id);
+  row += pps.entropy_coding_mode_flag ? ",1" : ",0";
+  row += pps.bottom_field_pic_order_in_frame_present_flag ? ",1," : ",0,";
+  appendUnsigned(row, pps.num_slice_groups_minus1 + 1);
+  row += ',';
+  appendUnsigned(row, pps.num_ref_idx_l0_default_active_minus1 + 1);
+  row += ',';
+  appendUnsigned(row, pps.num_ref_idx_l1_default_active_minus1 + 1);
+  row += pps.weighted_pred_flag ? ",1," : ",0,";
+  appendUnsigned(row, pps.weighted_bipred_idc);
+  row += ',';
+  appendSigned(row, 26 + pps.pic_init_qp_minus26);
+  row += ',';
+  appendSigned(row, 26 + pps.pic_init_qs_minus26);
+  row += ',';
+  appendSigned(row, pps.chroma_qp_index_offset);
+  row += ',';
+  appendSigned(row, pps.second_chroma_qp_index_offset);
+  row += pps.deblocking_filter_control_present_flag ? ",1" : ",0";
+  row += pps.constrained_intra_pred_flag ? ",1" : ",0";
+  row += pps.redundant_pic_cnt_present_flag ? ",1" : ",0";
+  row += pps.transform_8x8_mode_flag ? ",1" : ",0";
+  row += pps.pic_scaling_matrix_present_flag ? ",1\n" : ",0\n";
+  return row;
+}
+
+/**
+ * Writes a CSV file with a header line and the distinct rows in the order of their first occurrence.
+ */
+static void writeDistinctRows(const std::string &file_path, const char *header, const std::vector<std::string> &rows) {
+  OutputBuffer csv_file;
+  if (csv_file.open(file_path) < 0) {
+    cerr << "Failed to open parameter set file: " << strerror(errno) << "\n";
     return;
   }
-  std::sort(frame_list.begin(), frame_list.end());
+  csv_file.append(header);
+  // Parameter sets are usually repeated in every segment, but there are only a few distinct ones.
+  std::vector<const std::string *> written;
+  for (const std::string &row : rows) {
+    if (std::find_if(written.begin(), written.end(), [&row](const std::string *other) {
+      return *other == row;
+    }) == written.end()) {
+      csv_file.append(row);
+      written.push_back(&row);
+    }
+  }
+  if (csv_file.close() < 0) {
+    cerr << "Failed to write parameter set file: " << strerror(errno) << "\n";
+  }
+}
+
+void flushParameterSets(const ParserContext &ctx, const std::string &params_file_prefix) {
+  StageTimer timer(STAGE_PARAMS);
+  std::vector<std::string> rows;
+  rows.reserve(ctx.spss.size());
+  for (const SPS &sps : ctx.spss) {
+    rows.push_back(formatSPSRow(sps));
+  }
+  writeDistinctRows(params_file_prefix + "-sps.csv",
+                    "id,profile_idc,constraint_flags,level_idc,chroma_format_idc,bit_depth_luma,bit_depth_chroma,width,"
+                    "height,frame_mbs_only,poc_type,max_num_ref_frames,scaling_matrix,sar,full_range,colour_primaries,"
+                    "transfer_characteristics,matrix_coefficients,frame_rate,fixed_frame_rate,nal_bit_rate,"
+                    "nal_cpb_size,nal_cbr,vcl_bit_rate,vcl_cpb_size,vcl_cbr,max_num_reorder_frames,"
+                    "max_dec_frame_buffering\n",
+                    rows);
+  rows.clear();
+  for (const PPS &pps : ctx.ppss) {
+    rows.push_back(formatPPSRow(pps));
+  }
+  writeDistinctRows(params_file_prefix + "-pps.csv",
+                    "id,sps_id,entropy_coding_mode,bottom_field_pic_order,num_slice_groups,num_ref_idx_l0_default,"
+                    "num_ref_idx_l1_default,weighted_pred,weighted_bipred_idc,pic_init_qp,pic_init_qs,"
+                    "chroma_qp_index_offset,second_chroma_qp_index_offset,deblocking_filter_control,"
+                    "constrained_intra_pred,redundant_pic_cnt,transform_8x8_mode,scaling_matrix\n",
+                    rows);
+}
+
+int32_t assignWeights(const WeightFile &weights,
+                      uint32_t segment_no,
+                      std::vector<Frame> &frame_list,
+                      bool skip_i_frame) {
+  StageTimer timer(STAGE_ASSIGN_WEIGHTS);
+  size_t weight_count;
+  const uint32_t *segment_weights = weights.getWeights(segment_no, weight_count);
+  if (segment_weights == nullptr) {
+    return -1;
+  }
+  // The I-Frame weight is skipped.
+  size_t first_weight = skip_i_frame ? 1 : 0;
+  for (size_t i = first_weight; i < weight_count && i - first_weight < frame_list.size(); i++) {
+    Frame &frame = frame_list[i - first_weight];
+    frame.setWeight(segment_weights[i]);
+    if (isTraceEnabled(TRACE_DEBUG)) {
+      cout << "segment: " << segment_no << " frame: " << i + 1 << " type: " << frame.getType() << " weight: "
+           << segment_weights[i] << "\n";
+    }
+  }
+  if (std::max(weight_count, first_weight) != frame_list.size() + first_weight) {
+    cerr << "Number of frames in weight files and segment does not match. weight file: "
+         << std::max(weight_count, first_weight) << " segment: " << frame_list.size() + 1 << "\n";
+    cerr << "In file: " << weights.getSegmentName(segment_no) << "\n";
+    return -1;
+  }
+  return 0;
+}
+
+void orderFrames(std::vector<Frame> &frame_list, size_t top_frames) {
+  if (top_frames == 0 || top_frames >= frame_list.size()) {
+    std::sort(frame_list.begin(), frame_list.end());
+  } else {
+    std::partial_sort(frame_list.begin(), frame_list.begin() + top_frames, frame_list.end());
+  }
 }
 
-void writeFrameData(const std::string &file_name, const std::vector<Frame> &frame_list) {
-  std::ofstream frame_file;
-  frame_file.open(file_name, std::ofstream::trunc);
-  if (frame_file.fail()) {
+/**
+ * Writes the frames of a segment into a file, one line per frame with its index, type, weight and size.
+ * @param frame_file Writer that is reused for all segments.
+ * @param file_name Path to the file.
+ * @param frame_list Frames in output order.
+ */
+static void writeFrameData(OutputBuffer &frame_file,
+                           const std::string &file_name,
+                           const std::vector<Frame> &frame_list) {
+  if (frame_file.open(file_name) < 0) {
     cerr << "Failed to open frame file " << file_name << ": " << strerror(errno) << "\n";
     return;
   }
   uint32_t index = 1;
   for (auto &frame : frame_list) {
-    frame_file << index << " " << frame.getType() << " " << frame.getWeight() << " " << frame.getSize() << "\n";
+    frame_file.appendUnsigned(index).append(' ').append(frame.getType()).append(' ').appendUnsigned(frame.getWeight())
+        .append(' ').appendUnsigned(frame.getSize()).append('\n');
     index++;
   }
+  if (frame_file.close() < 0) {
+    cerr << "Failed to write frame file " << file_name << ": " << strerror(errno) << "\n";
+  }
 }
 
-void flushInfoData(const std::string &info_file_prefix, const std::string &weight_file_prefix) {
-  std::vector<Frame> frame_list;
-  uint32_t segment_no = 1;
-  bool last_segment = false;
-  size_t next_segment_start = 0;
-  auto mp4_box_it = mp4_boxes.begin();
-  bool first_found = false;
-  while (mp4_box_it != mp4_boxes.end() && mp4_box_it->name != "sidx") {
-    mp4_box_it++;
-    if (mp4_box_it != mp4_boxes.end() && mp4_box_it->name == "sidx" && !first_found) {
-      first_found = true;
-      mp4_box_it++;
-    }
-  }
-  if (!first_found) {
+void flushInfoData(const IndexReader &index, const std::string &info_file_prefix, size_t top_frames) {
+  StageTimer timer(STAGE_INFO);
+  if (!(index.getHeader().flags & INDEX_FLAG_SIDX_SEGMENTS)) {
     cerr << "Failed to flush info data. No sidx box found.\n";
     return;
-  } else if (mp4_box_it == mp4_boxes.end()) {
-    // We have found only one sidx box.
-    last_segment = true;
+  }
+  std::vector<Frame> frame_list;
+  OutputBuffer frame_file(1 << 16);
+  for (size_t i = 0; i < index.getSegmentCount(); i++) {
+    const IndexSegment &segment = index.getSegments()[i];
+    // Segments without frames get an empty file, except for the last one.
+    if (segment.frame_count == 0 && i + 1 == index.getSegmentCount()) {
+      break;
+    }
+    frame_list.clear();
+    const IndexFrame *frames = index.getFrames(i);
+    for (uint32_t j = 0; j < segment.frame_count; j++) {
+      frame_list.emplace_back(static_cast<char>(frames[j].type),
+                              frames[j].location,
+                              frames[j].location + frames[j].size - 1);
+      frame_list.back().setWeight(frames[j].weight);
+    }
+    if (index.hasWeights()) {
+      orderFrames(frame_list, top_frames);
+    }
+    writeFrameData(frame_file, info_file_prefix + "-" + std::to_string(i + 1) + ".dat", frame_list);
+  }
+}
+
+/**
+ * Parses the payload of the last NAL unit in the context, i.e., the SPS, PPS or slice header.
+ * @param ctx Context whose last NAL unit is parsed.
+ * @param rbsp_reader RBSP reader positioned after the NAL unit header and limited to the NAL unit.
+ */
+void parseNALUnitPayload(ParserContext &ctx, BitReader &rbsp_reader) {
+  NALUnit last_nal = ctx.nal_units.back();
+  if (last_nal.nal_unit_type == 7) {
+    parseSPS(ctx, rbsp_reader);
+  } else if (last_nal.nal_unit_type == 8) {
+    parsePPS(ctx, rbsp_reader);
+  } else if (last_nal.nal_unit_type == 1 || last_nal.nal_unit_type == 5) {
+    parseSliceHeader(ctx, rbsp_reader);
+  } else if (isTraceEnabled(TRACE_INFO)) {
+    cout << "    Other\n";
+  }
+}
+
+bool isAnnexB(const uint8_t *addr, size_t size) {
+  // Offset of the NAL unit header behind the start code.
+  size_t header_offset;
+  if (size >= 4 && addr[0] == 0 && addr[1] == 0 && addr[2] == 1) {
+    header_offset = 3;
+  } else if (size >= 5 && addr[0] == 0 && addr[1] == 0 && addr[2] == 0 && addr[3] == 1) {
+    header_offset = 4;
   } else {
-    // We found two sidx boxes and mp4_box_it points to the second box.
-    next_segment_start = mp4_box_it->location_relative;
-    mp4_box_it++;
-  }
-  for (auto &nal_unit : nal_units) {
-    if (!last_segment && nal_unit.location_relative >= next_segment_start) {
-      if (!weight_file_prefix.empty()) {
-        assignWeights(weight_file_prefix, segment_no, frame_list, false);
-        std::sort(frame_list.begin(), frame_list.end());
-      }
-      std::string frame_file_name = info_file_prefix + "-" + std::to_string(segment_no) + ".dat";
-      writeFrameData(frame_file_name, frame_list);
-      segment_no++;
-      frame_list.clear();
-      while (mp4_box_it != mp4_boxes.end() && mp4_box_it->name != "sidx") {
-        mp4_box_it++;
-      }
-      if (mp4_box_it == mp4_boxes.end()) {
-        last_segment = true;
-      } else {
-        next_segment_start = mp4_box_it->location_relative;
-        mp4_box_it++;
+    return false;
+  }
+  // forbidden_zero_bit
+  if (addr[header_offset] & 0x80) {
+    return false;
+  }
+  // 0x000001xx is also the size of an MP4 box of 256 to 511 bytes, e.g., a short moof or sidx segment, and 0x00000001
+  // the size of an MP4 box with a 64 bit largesize. Both are followed by a printable box type.
+  if (size >= 8 && std::all_of(addr + 4, addr + 8, [](uint8_t c) { return isalnum(c) || c == ' '; })) {
+    return false;
+  }
+  return true;
+}
+
+int32_t parseAnnexB(ParserContext &ctx, const uint8_t *addr, size_t size) {
+  BitReader reader(addr, 0, size);
+  size_t nal_start = findStartCode(addr, 0, size);
+  while (nal_start < size) {
+    // The next search starts after the start code, otherwise it finds the current one again.
+    size_t header_offset = nal_start + (addr[nal_start + 2] == 0 ? 4 : 3);
+    size_t nal_end = findStartCode(addr, header_offset, size);
+    reader.seek(nal_start);
+    parseAnnexBNALUnit(ctx, reader, nal_end);
+    BitReader rbsp_reader(addr, reader.getOffset(), nal_end, true);
+    parseNALUnitPayload(ctx, rbsp_reader);
+    nal_start = nal_end;
+  }
+  return 0;
+}
+
+int32_t parseAnnexBStream(ParserContext &ctx, InputWindow &window) {
+  std::vector<uint8_t> header;
+  size_t available = window.fill(0, STREAM_CHUNK_SIZE);
+  size_t nal_start = window.getStart() + findStartCode(window.getData(), 0, available);
+  while (window.fill(nal_start, 4) >= 3) {
+    // The end of the NAL unit is only known after its payload has been scanned, which can be much larger than the
+    // window. Keep a copy of the beginning, which contains all headers.
+    available = window.fill(nal_start, MAX_HEADER_SIZE);
+    header.assign(window.getData(), window.getData() + available);
+    size_t header_offset = nal_start + (header[2] == 0 ? 4 : 3);
+    // The next search starts after the start code, otherwise it finds the current one again. Consecutive searches
+    // overlap by 3 bytes, so a start code at the end of a chunk is still found.
+    size_t nal_end;
+    size_t scan_from = header_offset;
+    while (true) {
+      available = window.fill(scan_from, STREAM_CHUNK_SIZE);
+      size_t found = findStartCode(window.getData(), 0, available);
+      if (found < available) {
+        nal_end = scan_from + found;
+        break;
+      }
+      if (available < STREAM_CHUNK_SIZE) {
+        nal_end = scan_from + available;
+        break;
+      }
+      scan_from += available - 3;
+    }
+    BitReader reader(header.data(), nal_start, nal_start + header.size(), false, nal_start);
+    parseAnnexBNALUnit(ctx, reader, nal_end);
+    BitReader rbsp_reader(header.data(), reader.getOffset(), std::min(nal_end, nal_start + header.size()), true,
+                          nal_start);
+    parseNALUnitPayload(ctx, rbsp_reader);
+    nal_start = nal_end;
+  }
+  return window.hasFailed() ? -1 : 0;
+}
+
+/**
+ * Parses the MP4 boxes and NAL units of a file that is only partially resident in a window, i.e., an InputWindow or a
+ * SparseInput. For every MP4 box and NAL unit, only the first header_size bytes are requested. If a header turns out
+ * to be longer, it is parsed again with MAX_HEADER_SIZE bytes.
+ * @param ctx Context that receives the parsed structure.
+ * @param window Window on the file.
+ * @param header_size Number of bytes that are requested for every header.
+ * @param offset Offset of the first MP4 box.
+ * @return 0 on success. -1 if reading failed.
+ */
+template<class Window>
+int32_t parseMP4Window(ParserContext &ctx, Window &window, size_t header_size, size_t offset = 0) {
+  size_t available;
+  while ((available = window.fill(offset, header_size)) > 0) {
+    BitReader reader(window.getData(), offset, offset + available, false, window.getStart());
+    int32_t res = parseMP4Box(ctx, reader);
+    if (res < 0) {
+      cerr << "ERRR\n";
+      break;
+    }
+    MP4Box &last_mp4 = ctx.mp4_boxes.back();
+    size_t box_end = last_mp4.location_relative + last_mp4.size;
+    // A box of size 0 in an input of unknown size, see parseMP4Box(). Its size is known once the end is reached.
+    bool to_end = box_end == SIZE_MAX;
+    if (isBoxTreeRoot(last_mp4.type) && ctx.parse_samples) {
+      available = window.fill(last_mp4.location_relative, last_mp4.size);
+      if (to_end) {
+        last_mp4.size = available;
+        box_end = last_mp4.location_relative + available;
+      }
+      BitReader tree_reader(window.getData(), last_mp4.location_relative, last_mp4.location_relative + available,
+                            false, window.getStart());
+      parseBoxTree(ctx, tree_reader, last_mp4);
+    } else if (last_mp4.type == fourCC("mdat") && ctx.parse_nal_units) {
+      offset = reader.getOffset();
+      while (offset < box_end && (available = window.fill(offset, std::min(box_end - offset, header_size))) > 0) {
+        // A single fill per NAL unit is enough for almost all headers. The fill also moves the headers that straddle
+        // a chunk boundary into one piece.
+        BitReader nal_reader(window.getData(), offset, offset + available, false, window.getStart());
+        parseNALUnit(ctx, nal_reader);
+        NALUnit last_nal = ctx.nal_units.back();
+        size_t after_offset = last_nal.location_relative + last_nal.size;
+        size_t payload_offset = nal_reader.getOffset();
+        BitReader rbsp_reader(window.getData(), payload_offset, std::min(after_offset, offset + available), true,
+                              window.getStart());
+        uint64_t broken_slice_headers = ctx.stats.broken_slice_headers;
+        parseNALUnitPayload(ctx, rbsp_reader);
+        if (rbsp_reader.isExhausted() && offset + available < after_offset && header_size < MAX_HEADER_SIZE) {
+          // The header did not fit. Drop the parsed structure and parse it again with more data.
+          ctx.stats.broken_slice_headers = broken_slice_headers;
+          if (last_nal.nal_unit_type == 7) {
+            ctx.spss.pop_back();
+          } else if (last_nal.nal_unit_type == 8) {
+            ctx.ppss.pop_back();
+          } else if ((last_nal.nal_unit_type == 1 || last_nal.nal_unit_type == 5) && ctx.keep_slice_headers) {
+            ctx.slices.pop_back();
+          }
+          available = window.fill(offset, std::min(after_offset - offset, MAX_HEADER_SIZE));
+          BitReader long_reader(window.getData(), payload_offset, std::min(after_offset, offset + available), true,
+                                window.getStart());
+          parseNALUnitPayload(ctx, long_reader);
+        }
+        offset = after_offset;
+      }
+      if (to_end) {
+        last_mp4.size = offset - last_mp4.location_relative;
+        box_end = offset;
+      }
+    } else if (to_end) {
+      // Count the remaining bytes.
+      box_end = last_mp4.location_relative + last_mp4.header_size;
+      while ((available = window.fill(box_end, STREAM_CHUNK_SIZE)) > 0) {
+        box_end += available;
+      }
+      last_mp4.size = box_end - last_mp4.location_relative;
+    }
+    offset = box_end;
+  }
+  return window.hasFailed() ? -1 : 0;
+}
+
+int32_t parseStream(ParserContext &ctx, int32_t fd) {
+  InputWindow window(fd, STREAM_CHUNK_SIZE);
+  size_t available = window.fill(0, 8);
+  if (isAnnexB(window.getData(), available)) {
+    return parseAnnexBStream(ctx, window);
+  }
+  return parseMP4Window(ctx, window, MAX_HEADER_SIZE);
+}
+
+int32_t parseSparse(ParserContext &ctx, int32_t fd, size_t file_size) {
+  ctx.input_size = file_size;
+  SparseInput input(fd, file_size, SPARSE_READ_SIZE);
+  size_t available = input.fill(0, 8);
+  if (isAnnexB(input.getData(), available)) {
+    // The NAL units of an Annex B byte stream can only be found by scanning all bytes.
+    if (lseek(fd, 0, SEEK_SET) < 0) {
+      cerr << "lseek: " << strerror(errno) << "\n";
+      return -1;
+    }
+    return parseStream(ctx, fd);
+  }
+  int32_t res = parseMP4Window(ctx, input, SPARSE_READ_SIZE);
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << "Sparse input: " << input.getBytesRead() << " of " << file_size << " bytes in " << input.getReadCount()
+         << " reads\n";
+  }
+  return res;
+}
+
+/// Set by the SIGINT and SIGTERM handlers of parseFollow().
+static volatile sig_atomic_t follow_stop_requested = 0;
+
+static void requestFollowStop(int) {
+  follow_stop_requested = 1;
+}
+
+/**
+ * Finds the end of the last complete top-level MP4 box of a growing file.
+ * @param fd File descriptor of the file.
+ * @param offset Offset of the first box that was not parsed yet.
+ * @param file_size Current size of the file.
+ * @param complete_end Receives the end of the last complete box, offset if there is none.
+ * @return 0 on success. -1 if a box header is invalid or reading failed.
+ */
+static int32_t findCompleteBoxes(int32_t fd, size_t offset, size_t file_size, size_t &complete_end) {
+  complete_end = offset;
+  uint8_t header[16];
+  while (complete_end + 8 <= file_size) {
+    if (pread(fd, header, sizeof(header), complete_end) < 8) {
+      cerr << "pread: " << strerror(errno) << "\n";
+      return -1;
+    }
+    size_t size = BitReader(header, 0, 8).readUnsignedInt32();
+    size_t header_size = 8;
+    if (size == 1) {
+      if (complete_end + 16 > file_size) {
+        break;
+      }
+      size = BitReader(header, 8, 16).readUnsignedInt64();
+      header_size = 16;
+    } else if (size == 0) {
+      // The box extends to the end of a file that is still growing.
+      break;
+    }
+    if (size < header_size) {
+      cerr << "Invalid size " << size << " of the MP4 box at " << complete_end << "\n";
+      return -1;
+    }
+    if (size > file_size - complete_end) {
+      break;
+    }
+    complete_end += size;
+  }
+  return 0;
+}
+
+int32_t parseFollow(ParserContext &ctx,
+                    const std::string &video_file_path,
+                    OutputBuffer *csv_file,
+                    const std::string &index_file_path) {
+  int32_t fd = open(video_file_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    cerr << "could not open fd: " << strerror(errno) << "\n";
+    return -1;
+  }
+  int32_t inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (inotify_fd < 0
+      || inotify_add_watch(inotify_fd, video_file_path.c_str(), IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF) < 0) {
+    cerr << "inotify: " << strerror(errno) << ", polling " << video_file_path << " instead\n";
+  }
+  struct sigaction stop_action{};
+  struct sigaction old_int_action{};
+  struct sigaction old_term_action{};
+  stop_action.sa_handler = requestFollowStop;
+  sigemptyset(&stop_action.sa_mask);
+  follow_stop_requested = 0;
+  sigaction(SIGINT, &stop_action, &old_int_action);
+  sigaction(SIGTERM, &stop_action, &old_term_action);
+
+  int32_t res = 0;
+  size_t offset = 0;
+  uint32_t frame_num = 1;
+  uint64_t parse_ns = 0;
+  bool format_checked = false;
+  bool last_round = false;
+  while (res == 0) {
+    struct stat st{};
+    if (fstat(fd, &st) < 0) {
+      cerr << "fstat: " << strerror(errno) << "\n";
+      res = -1;
+      break;
+    }
+    // The file was deleted. Whatever was written before is still parsed.
+    last_round = last_round || st.st_nlink == 0;
+    size_t file_size = st.st_size;
+    if (!format_checked && file_size >= 8) {
+      uint8_t start[8];
+      if (pread(fd, start, sizeof(start), 0) == sizeof(start) && isAnnexB(start, sizeof(start))) {
+        cerr << "--follow needs an MP4 file\n";
+        res = -1;
+        break;
+      }
+      format_checked = true;
+    }
+    size_t complete_end;
+    if (format_checked && (res = findCompleteBoxes(fd, offset, file_size, complete_end)) == 0 && complete_end > offset) {
+      size_t first_box = ctx.mp4_boxes.size();
+      size_t first_nal_unit = ctx.nal_units.size();
+      ctx.input_size = complete_end;
+      SparseInput input(fd, complete_end, SPARSE_READ_SIZE);
+      uint64_t start_ns = isStatsEnabled() ? getStatsClockNs() : 0;
+      res = parseMP4Window(ctx, input, SPARSE_READ_SIZE, offset);
+      parse_ns += isStatsEnabled() ? getStatsClockNs() - start_ns : 0;
+      offset = complete_end;
+      if (csv_file != nullptr) {
+        std::vector<uint64_t> index = buildIndex(ctx, first_box, first_nal_unit);
+        IndexReader index_reader;
+        index_reader.setData(reinterpret_cast<const uint8_t *>(index.data()), index.size() * sizeof(uint64_t));
+        frame_num = flushCSV(index_reader, *csv_file, frame_num);
+        // Readers of the CSV see complete batches.
+        csv_file->flush();
+      }
+      if (!index_file_path.empty()) {
+        writeIndex(buildIndex(ctx), index_file_path);
+      }
+      if (isTraceEnabled(TRACE_INFO)) {
+        cout << "Followed " << video_file_path << " up to " << offset << "\n";
+      }
+    }
+    if (res < 0 || last_round || follow_stop_requested) {
+      break;
+    }
+    // The timeout covers file systems without inotify support and signals that arrive before poll() is entered.
+    struct pollfd poll_fd{inotify_fd, POLLIN, 0};
+    if (poll(&poll_fd, inotify_fd < 0 ? 0 : 1, FOLLOW_POLL_INTERVAL_MS) > 0) {
+      alignas(struct inotify_event) char events[4096];
+      ssize_t length;
+      while ((length = read(inotify_fd, events, sizeof(events))) > 0) {
+        for (ssize_t i = 0; i < length;) {
+          const auto *event = reinterpret_cast<const struct inotify_event *>(events + i);
+          // The file was renamed, e.g., rotated by the packager.
+          last_round = last_round || (event->mask & IN_MOVE_SELF);
+          i += sizeof(struct inotify_event) + event->len;
+        }
+      }
+    }
+  }
+  sigaction(SIGINT, &old_int_action, nullptr);
+  sigaction(SIGTERM, &old_term_action, nullptr);
+  if (isStatsEnabled()) {
+    recordVideo(video_file_path, offset, parse_ns, ctx.stats, ctx.nal_units);
+  }
+  if (inotify_fd >= 0) {
+    close(inotify_fd);
+  }
+  close(fd);
+  return res;
+}
+
+/**
+ * Runs task(0), ..., task(count - 1) on a pool of worker threads. The tasks are handed out in index order.
+ * @param count Number of tasks.
+ * @param num_threads Maximum number of worker threads.
+ * @param task Function that is called with the index of each task.
+ */
+void runParallel(size_t count, uint32_t num_threads, const std::function<void(size_t)> &task) {
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  if (num_threads > count) {
+    num_threads = std::max<size_t>(count, 1);
+  }
+  std::atomic<size_t> next_task(0);
+  auto worker = [&]() {
+    size_t i;
+    while ((i = next_task.fetch_add(1)) < count) {
+      task(i);
+    }
+  };
+  std::vector<std::thread> workers;
+  for (uint32_t t = 0; t < num_threads; t++) {
+    workers.emplace_back(worker);
+  }
+  for (auto &t : workers) {
+    t.join();
+  }
+}
+
+int32_t parseFragments(ParserContext &ctx, const uint8_t *addr, size_t size, uint32_t num_threads) {
+  ctx.input_size = size;
+  // Phase 1: Top-level MP4 boxes. Only the box headers and the moov and moof box trees are touched.
+  std::vector<size_t> mdat_indices;
+  BitReader reader(addr, 0, size);
+  while (reader.getOffset() < size) {
+    if (parseMP4Box(ctx, reader) < 0) {
+      cerr << "ERRR\n";
+      break;
+    }
+    const MP4Box &last_mp4 = ctx.mp4_boxes.back();
+    if (isBoxTreeRoot(last_mp4.type) && ctx.parse_samples) {
+      BitReader tree_reader(addr, last_mp4.location_relative, std::min(last_mp4.location_relative + last_mp4.size, size));
+      parseBoxTree(ctx, tree_reader, last_mp4);
+    } else if (last_mp4.type == fourCC("mdat")) {
+      if (ctx.parse_nal_units) {
+        mdat_indices.push_back(ctx.mp4_boxes.size() - 1);
+      }
+      reader.seek(last_mp4.location_relative + last_mp4.size);
+    }
+  }
+
+  // Phase 2: NAL units and parameter sets of every fragment.
+  std::vector<ParserContext> fragments(mdat_indices.size());
+  runParallel(fragments.size(), num_threads, [&](size_t i) {
+    const MP4Box &mdat = ctx.mp4_boxes[mdat_indices[i]];
+    ParserContext &fragment = fragments[i];
+    // The mdat box of a cut off file ends with the file.
+    size_t mdat_end = std::min(mdat.location_relative + mdat.size, size);
+    BitReader nal_reader(addr, mdat.location_relative + mdat.header_size, size);
+    while (nal_reader.getOffset() < mdat_end) {
+      parseNALUnit(fragment, nal_reader);
+      const NALUnit &last_nal = fragment.nal_units.back();
+      size_t after_offset = last_nal.location_relative + last_nal.size;
+      if (last_nal.nal_unit_type == 7 || last_nal.nal_unit_type == 8) {
+        BitReader rbsp_reader(addr, nal_reader.getOffset(), std::min(after_offset, size), true);
+        parseNALUnitPayload(fragment, rbsp_reader);
+      }
+      nal_reader.seek(after_offset);
+    }
+  });
+
+  // The parameter sets that are active at the beginning of each fragment are the last ones of every ID in the fragments
+  // before. Phase 2 did not know them and assumed 4:2:0 for a PPS whose SPS is not in the same fragment, but a 4:4:4
+  // PPS has more scaling lists. Such a PPS is parsed again with its SPS.
+  std::vector<std::vector<const SPS *>> first_spss(fragments.size());
+  std::vector<std::vector<const PPS *>> first_ppss(fragments.size());
+  std::map<uint32_t, const SPS *> last_spss;
+  std::map<uint32_t, const PPS *> last_ppss;
+  for (size_t i = 0; i < fragments.size(); i++) {
+    ParserContext &fragment = fragments[i];
+    for (const auto &entry : last_spss) {
+      first_spss[i].push_back(entry.second);
+    }
+    for (const auto &entry : last_ppss) {
+      first_ppss[i].push_back(entry.second);
+    }
+    bool has_8x8_scaling_lists = std::any_of(fragment.ppss.begin(), fragment.ppss.end(), [](const PPS &pps) {
+      return pps.pic_scaling_matrix_present_flag && pps.transform_8x8_mode_flag;
+    });
+    // Number of SPSs of the fragment before the current NAL unit.
+    size_t num_spss = 0;
+    auto pps_it = fragment.ppss.begin();
+    for (size_t j = 0; has_8x8_scaling_lists && j < fragment.nal_units.size(); j++) {
+      NALUnit nal_unit = fragment.nal_units[j];
+      if (nal_unit.nal_unit_type == 7) {
+        num_spss++;
+      } else if (nal_unit.nal_unit_type == 8) {
+        PPS &pps = *pps_it++;
+        uint32_t sps_id = pps.seq_parameter_set_id;
+        if (!pps.pic_scaling_matrix_present_flag || !pps.transform_8x8_mode_flag
+            || findSPS(fragment.spss.data(), fragment.spss.data() + num_spss, sps_id) != nullptr) {
+          continue;
+        }
+        auto previous_sps = last_spss.find(sps_id);
+        if (previous_sps != last_spss.end() && previous_sps->second->chroma_format_idc == 3) {
+          ParserContext pps_ctx;
+          pps_ctx.spss.push_back(*previous_sps->second);
+          BitReader rbsp_reader(addr,
+                                nal_unit.location_relative + nal_unit.prefix_size + 1,
+                                std::min(nal_unit.location_relative + nal_unit.size, size),
+                                true);
+          parsePPS(pps_ctx, rbsp_reader);
+          pps = std::move(pps_ctx.ppss.back());
+        }
       }
     }
-    if (nal_unit.slice_type == 'I' || nal_unit.slice_type == 'P' || nal_unit.slice_type == 'B') {
-      frame_list.emplace_back(nal_unit.slice_type,
-                              nal_unit.location_relative,
-                              nal_unit.location_relative + nal_unit.size - 1);
+    for (const SPS &sps : fragment.spss) {
+      last_spss[sps.seq_parameter_set_id] = &sps;
+    }
+    for (const PPS &pps : fragment.ppss) {
+      last_ppss[pps.pic_parameter_set_id] = &pps;
     }
   }
-  if (!frame_list.empty()) {
-    // Flush last segment
-    if (!weight_file_prefix.empty()) {
-      assignWeights(weight_file_prefix, segment_no, frame_list, false);
-      std::sort(frame_list.begin(), frame_list.end());
+
+  // Phase 3: Slice headers. The parsers work on the back of the NAL index and look up the parameter sets that were
+  // parsed before, so the NAL units and parameter sets are replayed in file order.
+  runParallel(fragments.size(), num_threads, [&](size_t i) {
+    ParserContext &fragment = fragments[i];
+    ParserContext replay;
+    replay.keep_slice_headers = ctx.keep_slice_headers;
+    replay.slice_fields = ctx.slice_fields;
+    for (const SPS *sps : first_spss[i]) {
+      replay.spss.push_back(*sps);
+    }
+    for (const PPS *pps : first_ppss[i]) {
+      replay.ppss.push_back(*pps);
+    }
+    auto sps_it = fragment.spss.begin();
+    auto pps_it = fragment.ppss.begin();
+    replay.nal_units.reserve(fragment.nal_units.size());
+    for (const NALUnit &nal_unit : fragment.nal_units) {
+      replay.nal_units.push_back(nal_unit);
+      if (nal_unit.nal_unit_type == 7) {
+        replay.spss.push_back(*sps_it++);
+      } else if (nal_unit.nal_unit_type == 8) {
+        replay.ppss.push_back(*pps_it++);
+      } else if (nal_unit.nal_unit_type == 1 || nal_unit.nal_unit_type == 5) {
+        BitReader rbsp_reader(addr,
+                              nal_unit.location_relative + nal_unit.prefix_size + 1,
+                              std::min(nal_unit.location_relative + nal_unit.size, size),
+                              true);
+        parseSliceHeader(replay, rbsp_reader);
+      }
+    }
+    fragment.nal_units = std::move(replay.nal_units);
+    fragment.slices = std::move(replay.slices);
+    fragment.arena = std::move(replay.arena);
+    fragment.stats.add(replay.stats);
+  });
+
+  // Ordered merge.
+  size_t num_nal_units = ctx.nal_units.size();
+  size_t num_slices = ctx.slices.size();
+  for (const ParserContext &fragment : fragments) {
+    num_nal_units += fragment.nal_units.size();
+    num_slices += fragment.slices.size();
+  }
+  ctx.nal_units.reserve(num_nal_units);
+  ctx.slices.reserve(num_slices);
+  for (ParserContext &fragment : fragments) {
+    ctx.nal_units.append(fragment.nal_units);
+    std::move(fragment.spss.begin(), fragment.spss.end(), std::back_inserter(ctx.spss));
+    std::move(fragment.ppss.begin(), fragment.ppss.end(), std::back_inserter(ctx.ppss));
+    ctx.slices.insert(ctx.slices.end(), fragment.slices.begin(), fragment.slices.end());
+    ctx.arena.adopt(fragment.arena);
+    ctx.stats.add(fragment.stats);
+    fragment = ParserContext();
+  }
+  return 0;
+}
+
+/**
+ * Opens the video file and parses it with the method that fits the input, see parseVideo().
+ */
+static int32_t parseVideoFile(ParserContext &ctx,
+                              const std::string &video_file_path,
+                              InputMode input_mode,
+                              uint32_t num_threads) {
+  if (video_file_path == "-") {
+    return parseStream(ctx, STDIN_FILENO);
+  }
+  int32_t file_fd = open(video_file_path.c_str(), O_RDONLY);
+  if (file_fd < 0) {
+    cerr << "could not open fd: " << strerror(errno) << "\n";
+    return -1;
+  }
+  struct stat st{};
+  if (fstat(file_fd, &st) < 0) {
+    close(file_fd);
+    cerr << "error while getting file size: " << strerror(errno) << "\n";
+    return -1;
+  }
+  if (S_ISREG(st.st_mode)) {
+    ctx.input_size = st.st_size;
+  }
+  if (input_mode == INPUT_STREAM || !S_ISREG(st.st_mode)) {
+    // Pipes and FIFOs cannot be mapped.
+    int32_t res = parseStream(ctx, file_fd);
+    close(file_fd);
+    return res;
+  }
+  if (input_mode == INPUT_SPARSE) {
+    int32_t res = parseSparse(ctx, file_fd, st.st_size);
+    close(file_fd);
+    return res;
+  }
+  size_t file_size = st.st_size;
+  // No MAP_POPULATE: the file is read once front to back, so faulting it in up front only delays the start and inflates
+  // the RSS. MADV_SEQUENTIAL takes care of the read-ahead.
+  auto *file_mmap = static_cast<uint8_t *>(mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, file_fd, 0));
+  if (file_mmap == MAP_FAILED) {
+    close(file_fd);
+    cerr << "could not mmap file: " << strerror(errno) << "\n";
+    return -1;
+  }
+  close(file_fd);
+  if (madvise(file_mmap, file_size, MADV_SEQUENTIAL) < 0) {
+    cerr << "madvise: " << strerror(errno) << "\n";
+  }
+
+  if (isAnnexB(file_mmap, file_size)) {
+    parseAnnexB(ctx, file_mmap, file_size);
+  } else if (num_threads > 1 && !isTraceEnabled(TRACE_INFO)) {
+    parseFragments(ctx, file_mmap, file_size, num_threads);
+  } else {
+    BitReader reader(file_mmap, 0, file_size);
+    while (reader.getOffset() < file_size) {
+      int32_t res = parseMP4Box(ctx, reader);
+      if (res < 0) {
+        cerr << "ERRR\n";
+        break;
+      }
+      MP4Box &last_mp4 = ctx.mp4_boxes.back();
+      if (isBoxTreeRoot(last_mp4.type) && ctx.parse_samples) {
+        BitReader tree_reader(file_mmap, last_mp4.location_relative,
+                              std::min(last_mp4.location_relative + last_mp4.size, file_size));
+        parseBoxTree(ctx, tree_reader, last_mp4);
+      } else if (last_mp4.type == fourCC("mdat") && !ctx.parse_nal_units) {
+        reader.seek(last_mp4.location_relative + last_mp4.size);
+      } else if (last_mp4.type == fourCC("mdat")) {
+        // The mdat box of a cut off file ends with the file.
+        size_t mdat_end = std::min(last_mp4.location_relative + last_mp4.size, file_size);
+        while (reader.getOffset() < mdat_end) {
+          parseNALUnit(ctx, reader);
+          NALUnit last_nal = ctx.nal_units.back();
+          // We need this to position the offset correctly, because we do not parse all parts of the NAL unit, e.g.,
+          // the macro blocks of a slice.
+          size_t after_offset = last_nal.location_relative + last_nal.size;
+          // The payload parsers get their own reader that is limited to the NAL unit and skips emulation prevention
+          // bytes.
+          BitReader rbsp_reader(file_mmap, reader.getOffset(), std::min(after_offset, file_size), true);
+          parseNALUnitPayload(ctx, rbsp_reader);
+          reader.seek(after_offset);
+        }
+      }
     }
-    std::string frame_file_name = info_file_prefix + "-" + std::to_string(segment_no) + ".dat";
-    writeFrameData(frame_file_name, frame_list);
   }
+
+  if (munmap(file_mmap, file_size) < 0) {
+    cerr << "munmap: " << strerror(errno) << "\n";
+  }
+  return 0;
+}
+
+int32_t parseVideo(ParserContext &ctx, const std::string &video_file_path, InputMode input_mode, uint32_t num_threads) {
+  uint64_t start_ns = isStatsEnabled() ? getStatsClockNs() : 0;
+  int32_t res = parseVideoFile(ctx, video_file_path, input_mode, num_threads);
+  // The index grows by doubling, so up to half of it would stay unused.
+  ctx.nal_units.shrink_to_fit();
+  if (isStatsEnabled()) {
+    recordVideo(video_file_path, ctx.input_size, getStatsClockNs() - start_ns, ctx.stats, ctx.nal_units);
+  }
+  return res;
 }
 
-int main(int32_t argc, char **argv) {
-  std::string csv_file_path;
-  std::string mpd_file_path;
-  std::string weight_file_prefix;
-  std::string info_file_prefix;
-  bool flush_ranges = false;
+int32_t parseArguments(const std::vector<std::string> &args, ParseJob &job) {
   std::string csv_parameter = "--csv";
   std::string mpd_parameter = "--mpd";
   std::string ranges_parameter = "--ranges";
   std::string weight_parameter = "--weights";
+  std::string top_frames_parameter = "--top-frames";
   std::string info_parameter = "--info";
-  if (argc < 2) {
-    cout << "usage: " << argv[0]
-         << " <video> [--csv <csv-file>] [--mpd <MPD-File>] [--weights <weight-file-prefix>] [--info <info-data-prefix>] [--ranges]"
-         << endl;
-    return 1;
-  }
-  std::string video_file_path = argv[1];
-  for (int32_t i = 2; i < argc; i++) {
-    std::string next_arg = argv[i];
-    if (!next_arg.compare(0, next_arg.size(), csv_parameter) && i + 1 < argc) {
-      csv_file_path = argv[i + 1];
+  std::string samples_parameter = "--samples";
+  std::string params_parameter = "--params";
+  std::string index_parameter = "--index";
+  std::string cache_parameter = "--cache";
+  std::string cache_hash_parameter = "--cache-hash";
+  std::string follow_parameter = "--follow";
+  std::string stream_parameter = "--stream";
+  std::string sparse_parameter = "--sparse";
+  std::string threads_parameter = "-j";
+  if (args.empty()) {
+    cerr << "Missing video file\n";
+    return -1;
+  }
+  job.video_file_path = args[0];
+  for (size_t i = 1; i < args.size(); i++) {
+    const std::string &next_arg = args[i];
+    if (!next_arg.compare(0, next_arg.size(), csv_parameter) && i + 1 < args.size()) {
+      job.csv_file_path = args[i + 1];
+      i++;
+    } else if (!next_arg.compare(0, next_arg.size(), mpd_parameter) && i + 1 < args.size()) {
+      job.mpd_file_path = args[i + 1];
+      i++;
+    } else if (!next_arg.compare(0, next_arg.size(), weight_parameter) && i + 1 < args.size()) {
+      job.weight_file_prefix = args[i + 1];
       i++;
-    } else if (!next_arg.compare(0, next_arg.size(), mpd_parameter) && i + 1 < argc) {
-      mpd_file_path = argv[i + 1];
+    } else if (!next_arg.compare(0, next_arg.size(), info_parameter) && i + 1 < args.size()) {
+      job.info_file_prefix = args[i + 1];
       i++;
-    } else if (!next_arg.compare(0, next_arg.size(), weight_parameter) && i + 1 < argc) {
-      weight_file_prefix = argv[i + 1];
+    } else if (!next_arg.compare(0, next_arg.size(), samples_parameter) && i + 1 < args.size()) {
+      job.samples_file_path = args[i + 1];
       i++;
-    } else if (!next_arg.compare(0, next_arg.size(), info_parameter) && i + 1 < argc) {
-      info_file_prefix = argv[i + 1];
+    } else if (!next_arg.compare(0, next_arg.size(), params_parameter) && i + 1 < args.size()) {
+      job.params_file_prefix = args[i + 1];
       i++;
+    } else if (!next_arg.compare(0, next_arg.size(), index_parameter) && i + 1 < args.size()) {
+      job.index_file_path = args[i + 1];
+      i++;
+    } else if (!next_arg.compare(0, next_arg.size(), cache_parameter) && i + 1 < args.size()) {
+      job.cache_dir = args[i + 1];
+      i++;
+    } else if (!next_arg.compare(0, next_arg.size(), top_frames_parameter) && i + 1 < args.size()) {
+      uint64_t top_frames;
+      if (parseNumber(args[i + 1], 0, SIZE_MAX, top_frames) < 0) {
+        cerr << "Invalid number of top frames: " << args[i + 1] << "\n";
+        return -1;
+      }
+      job.top_frames = top_frames;
+      i++;
+    } else if (!next_arg.compare(0, next_arg.size(), cache_hash_parameter)) {
+      job.cache_hash = true;
+    } else if (!next_arg.compare(0, next_arg.size(), follow_parameter)) {
+      job.follow = true;
     } else if (!next_arg.compare(0, next_arg.size(), ranges_parameter)) {
-      flush_ranges = true;
+      job.flush_ranges = true;
+    } else if (!next_arg.compare(0, next_arg.size(), stream_parameter)) {
+      job.input_mode = INPUT_STREAM;
+    } else if (!next_arg.compare(0, next_arg.size(), sparse_parameter)) {
+      job.input_mode = INPUT_SPARSE;
+    } else if (!next_arg.compare(0, next_arg.size(), threads_parameter) && i + 1 < args.size()) {
+      uint64_t num_threads;
+      if (parseNumber(args[i + 1], 1, UINT32_MAX, num_threads) < 0) {
+        cerr << "Invalid number of threads: " << args[i + 1] << "\n";
+        return -1;
+      }
+      job.num_threads = static_cast<uint32_t>(num_threads);
+      i++;
     } else {
-      cerr << "Unknown parameter or missing argument: " << argv[i] << "\n";
-      return 1;
+      cerr << "Unknown parameter or missing argument: " << next_arg << "\n";
+      return -1;
     }
   }
-  if (!csv_file_path.empty()) {
+  if (job.video_file_path == "-" && (job.flush_ranges || !job.mpd_file_path.empty())) {
+    cerr << "--ranges and --mpd need the name of the video and cannot be used with stdin\n";
+    return -1;
+  }
+  if (job.video_file_path == "-" && job.follow) {
+    cerr << "--follow needs a file and cannot be used with stdin\n";
+    return -1;
+  }
+  return 0;
+}
 
-    csv_file.open(csv_file_path, std::ofstream::trunc);
-    if (csv_file.fail()) {
+int32_t runJob(const ParseJob &job) {
+  ParserContext ctx;
+  // The samples come from the MP4 metadata. If nothing else is requested, the NAL units in mdat are not needed.
+  ctx.parse_nal_units = job.samples_file_path.empty() || !job.csv_file_path.empty() || !job.mpd_file_path.empty()
+      || !job.info_file_prefix.empty() || job.flush_ranges || !job.index_file_path.empty()
+      || !job.params_file_prefix.empty();
+  // The box trees are also walked for the file structure in the trace output.
+  ctx.parse_samples = !job.samples_file_path.empty() || isTraceEnabled(TRACE_INFO);
+  // The CSV rows and frame lists only need the slice types. The MPD, the ranges and the index files, which are also
+  // written to the cache, need the slice header sizes.
+  bool types_only = job.mpd_file_path.empty() && !job.flush_ranges && job.index_file_path.empty()
+      && job.cache_dir.empty() && !job.follow;
+  ctx.slice_fields = types_only ? SLICE_FIELD_TYPE : SLICE_FIELD_TYPE | SLICE_FIELD_HEADER_SIZE;
+  OutputBuffer csv_file;
+  if (!job.csv_file_path.empty()) {
+    if (csv_file.open(job.csv_file_path) < 0) {
       cerr << "failed to open csv-file: " << strerror(errno) << "\n";
-      return 1;
+      return -1;
     }
-    csv_file << "type,num,size\n";
+    csv_file.append("type,num,size\n");
   }
-  struct stat st{};
-  if (stat(video_file_path.c_str(), &st) < 0) {
-    cerr << "error while getting file size: " << strerror(errno) << "\n";
-    return 1;
+  // The weights are loaded while the video is parsed.
+  WeightFile weights;
+  int32_t weights_res = -1;
+  std::thread weight_loader;
+  if (!job.weight_file_prefix.empty()
+      && (!job.mpd_file_path.empty() || !job.info_file_prefix.empty() || !job.index_file_path.empty())) {
+    weight_loader = std::thread([&]() {
+      weights_res = weights.open(job.weight_file_prefix);
+    });
   }
-  size_t file_size = st.st_size;
-  int32_t file_fd = open(video_file_path.c_str(), O_RDONLY);
-  if (file_fd < 0) {
-    cerr << "could not open fd: " << strerror(errno) << "\n";
-    return 1;
+  auto joinWeightLoader = [&]() {
+    if (weight_loader.joinable()) {
+      weight_loader.join();
+    }
+  };
+  // The text outputs are conversions of the binary index.
+  std::vector<uint64_t> index;
+  IndexReader index_reader;
+  // The cache only has the index, which does not contain the samples and parameter sets.
+  CacheKey cache_key{};
+  bool use_cache = !job.cache_dir.empty() && job.samples_file_path.empty() && job.params_file_prefix.empty()
+      && !job.follow && getCacheKey(job.video_file_path, job.cache_hash, cache_key) == 0;
+  if (job.follow) {
+    // The CSV rows and index snapshots are written while following.
+    if (parseFollow(ctx, job.video_file_path, csv_file.isOpen() ? &csv_file : nullptr, job.index_file_path) < 0) {
+      joinWeightLoader();
+      return -1;
+    }
+    if (!job.info_file_prefix.empty() || job.flush_ranges || !job.index_file_path.empty()) {
+      index = buildIndex(ctx);
+      index_reader.setData(reinterpret_cast<const uint8_t *>(index.data()), index.size() * sizeof(uint64_t));
+    }
+  } else if (use_cache && loadCachedIndex(job.cache_dir, cache_key, index) == 0) {
+    index_reader.setData(reinterpret_cast<const uint8_t *>(index.data()), index.size() * sizeof(uint64_t));
+    restoreContext(index_reader, ctx);
+  } else {
+    if (parseVideo(ctx, job.video_file_path, job.input_mode, job.num_threads) < 0) {
+      joinWeightLoader();
+      return -1;
+    }
+    if (use_cache || csv_file.isOpen() || !job.info_file_prefix.empty() || job.flush_ranges
+        || !job.index_file_path.empty()) {
+      index = buildIndex(ctx);
+      index_reader.setData(reinterpret_cast<const uint8_t *>(index.data()), index.size() * sizeof(uint64_t));
+    }
+    if (use_cache) {
+      storeCachedIndex(job.cache_dir, cache_key, index);
+    }
   }
-  auto *file_mmap = static_cast<uint8_t *>(mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, file_fd, 0));
-  if (file_mmap == MAP_FAILED) {
-    close(file_fd);
-    cerr << "could not mmap file: " << strerror(errno) << "\n";
-    return 1;
+
+  if (csv_file.isOpen()) {
+    if (!job.follow) {
+      flushCSV(index_reader, csv_file);
+    }
+    if (csv_file.close() < 0) {
+      cerr << "csv-file close: " << strerror(errno) << "\n";
+    }
   }
-  close(file_fd);
-  if (madvise(file_mmap, file_size, MADV_SEQUENTIAL) < 0) {
-    cerr << "madvise: " << strerror(errno) << "\n";
+
+  joinWeightLoader();
+  // The other outputs are still written if the MPD fails.
+  int32_t ret = 0;
+  if (!job.mpd_file_path.empty()
+      && flushMPDFile(ctx, job.mpd_file_path, job.video_file_path, weights_res == 0 ? &weights : nullptr,
+                      job.top_frames) < 0) {
+    ret = -1;
+  }
+  if (weights_res == 0 && (!job.info_file_prefix.empty() || !job.index_file_path.empty())) {
+    assignIndexWeights(index, weights);
+  }
+  if (!job.info_file_prefix.empty()) {
+    flushInfoData(index_reader, job.info_file_prefix, job.top_frames);
+  }
+  if (job.flush_ranges) {
+    flushRanges(index_reader, job.video_file_path);
   }
+  if (!job.index_file_path.empty()) {
+    writeIndex(index, job.index_file_path);
+  }
+  if (!job.samples_file_path.empty()) {
+    flushSamples(ctx, job.samples_file_path);
+  }
+  if (!job.params_file_prefix.empty()) {
+    flushParameterSets(ctx, job.params_file_prefix);
+  }
+  return ret;
+}
 
-  size_t offset = 0;
-  while (file_mmap + offset < file_mmap + file_size) {
-    int32_t res = parseMP4Box(file_mmap, offset);
-    if (res < 0) {
-      cerr << "ERRR\n";
-      break;
+/**
+ * Returns the files that a job writes. Outputs with a prefix are represented by the prefix and the pattern of their
+ * names.
+ * @param job Job whose outputs are returned.
+ * @return Paths as given on the command line, so the same file under different names is not detected.
+ */
+static std::vector<std::string> getOutputFiles(const ParseJob &job) {
+  std::vector<std::string> ret;
+  for (const std::string *path : {&job.csv_file_path, &job.mpd_file_path, &job.samples_file_path,
+                                  &job.index_file_path}) {
+    if (!path->empty()) {
+      ret.push_back(*path);
     }
-    MP4Box &last_mp4 = mp4_boxes.back();
-    if (last_mp4.name == "mdat") {
-      const uint8_t *mdat_end = last_mp4.location + last_mp4.size;
-      while (file_mmap + offset < mdat_end) {
-        parseNALUnit(file_mmap, offset);
-        NALUnit &last_nal = nal_units.back();
-        // We need this to position the offset correctly, because we do not parse all parts of the NAL unit, e.g., the
-        // macro blocks of a slice.
-        uint32_t after_offset = offset + last_nal.size - 5;
-        if (last_nal.nal_unit_type == 7) {
-          if (csv_file.is_open()) {
-            csv_file << "SPS,0," << last_nal.size << "\n";
-          }
-          parseSPS(file_mmap, offset);
-#ifdef DEBUG
-          cout << "Skipping " << after_offset - offset << " bytes of vui_parameters()\n";
-#endif
-        } else if (last_nal.nal_unit_type == 8) {
-          if (csv_file.is_open()) {
-            csv_file << "PPS,0," << last_nal.size << "\n";
-          }
-          parsePPS(file_mmap, offset);
-        } else if (last_nal.nal_unit_type == 1 || last_nal.nal_unit_type == 5) {
-          parseSliceHeader(file_mmap, offset);
-        } else {
-          if (csv_file.is_open()) {
-            csv_file << getShortNALUnitTypeString(last_nal.nal_unit_type) << ",0," << last_nal.size << "\n";
-          }
-#if defined(DEBUG) || defined(INFO)
-          cout << "    Other\n";
-#endif
-        }
-        offset = after_offset;
-      }
+  }
+  if (!job.info_file_prefix.empty()) {
+    ret.push_back(job.info_file_prefix + "-<segment>.dat");
+  }
+  if (!job.params_file_prefix.empty()) {
+    ret.push_back(job.params_file_prefix + "-sps.csv");
+    ret.push_back(job.params_file_prefix + "-pps.csv");
+  }
+  if (job.flush_ranges) {
+    ret.push_back(job.video_file_path.substr(0, job.video_file_path.length() - 3) + "-ranges.csv");
+  }
+  return ret;
+}
+
+int32_t runBatch(const std::string &list_file_path, uint32_t num_threads) {
+  std::ifstream list_file(list_file_path);
+  if (list_file.fail()) {
+    cerr << "Failed to open batch list " << list_file_path << ": " << strerror(errno) << "\n";
+    return -1;
+  }
+  std::vector<ParseJob> jobs;
+  std::vector<size_t> job_sizes;
+  std::string line;
+  size_t line_no = 0;
+  while (std::getline(list_file, line)) {
+    line_no++;
+    std::istringstream tokens(line);
+    std::vector<std::string> args;
+    std::string token;
+    while (tokens >> token) {
+      args.push_back(token);
+    }
+    if (args.empty() || args[0][0] == '#') {
+      continue;
     }
+    ParseJob job;
+    if (parseArguments(args, job) < 0) {
+      cerr << "In batch list line " << line_no << "\n";
+      return -1;
+    }
+    struct stat st{};
+    job_sizes.push_back(stat(job.video_file_path.c_str(), &st) < 0 ? 0 : st.st_size);
+    jobs.push_back(job);
   }
 
-  if (csv_file.is_open()) {
-    csv_file.close();
-    if (csv_file.fail()) {
-      cerr << "csv-file close: " << strerror(errno) << "\n";
+  // Jobs that write the same file, e.g., lines that annotate the representations of one MPD, would replace each
+  // other's output. They form a group that runs in list order on a single worker.
+  std::vector<size_t> group_of(jobs.size());
+  for (size_t i = 0; i < jobs.size(); i++) {
+    group_of[i] = i;
+  }
+  auto findGroup = [&group_of](size_t i) {
+    while (group_of[i] != i) {
+      i = group_of[i] = group_of[group_of[i]];
+    }
+    return i;
+  };
+  std::map<std::string, size_t> output_owners;
+  for (size_t i = 0; i < jobs.size(); i++) {
+    for (const std::string &output : getOutputFiles(jobs[i])) {
+      auto inserted = output_owners.emplace(output, i);
+      if (!inserted.second) {
+        size_t l = findGroup(inserted.first->second);
+        size_t r = findGroup(i);
+        group_of[std::max(l, r)] = std::min(l, r);
+      }
     }
   }
+  std::vector<std::vector<size_t>> groups;
+  std::vector<size_t> group_sizes;
+  std::map<size_t, size_t> group_indices;
+  for (size_t i = 0; i < jobs.size(); i++) {
+    auto inserted = group_indices.emplace(findGroup(i), groups.size());
+    if (inserted.second) {
+      groups.emplace_back();
+      group_sizes.push_back(0);
+    }
+    groups[inserted.first->second].push_back(i);
+    group_sizes[inserted.first->second] += job_sizes[i];
+  }
 
-  if (munmap(file_mmap, file_size) < 0) {
-    cerr << "munmap: " << strerror(errno) << "\n";
+  // Largest groups first, so that a few huge files do not end up as the tail of the run while all other workers idle.
+  std::vector<size_t> order(groups.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
   }
+  std::stable_sort(order.begin(), order.end(), [&group_sizes](size_t l, size_t r) {
+    return group_sizes[l] > group_sizes[r];
+  });
 
-  if (!mpd_file_path.empty()) {
-    flushMPDFile(mpd_file_path, video_file_path, weight_file_prefix);
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  if (num_threads > groups.size()) {
+    num_threads = std::max<size_t>(groups.size(), 1);
   }
-  if (!info_file_prefix.empty()) {
-    flushInfoData(info_file_prefix, weight_file_prefix);
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << "Batch: " << jobs.size() << " videos in " << groups.size() << " groups on " << num_threads << " threads\n";
   }
-  if (flush_ranges) {
-    flushRanges(video_file_path);
+  std::atomic<uint32_t> failed_jobs(0);
+  runParallel(order.size(), num_threads, [&](size_t i) {
+    for (size_t job_index : groups[order[i]]) {
+      const ParseJob &job = jobs[job_index];
+      if (runJob(job) < 0) {
+        cerr << "Failed to process " << job.video_file_path << "\n";
+        failed_jobs++;
+      }
+    }
+  });
+  if (failed_jobs > 0) {
+    cerr << failed_jobs << " of " << jobs.size() << " videos failed\n";
+    return -1;
   }
   return 0;
-}
\ No newline at end of file
+}
+
+int32_t runMPDAll(const std::string &mpd_file_path,
+                  const std::string &weight_file_prefix,
+                  size_t top_frames,
+                  uint32_t num_threads) {
+  std::vector<std::string> base_urls;
+  if (XmlHandler::getBaseURLs(mpd_file_path, base_urls) < 0) {
+    return -1;
+  }
+  // The videos are next to the MPD. BaseURLs that are not local files, e.g., an http:// BaseURL of the MPD, are
+  // skipped.
+  size_t last_slash = mpd_file_path.find_last_of('/');
+  std::string mpd_dir = last_slash == std::string::npos ? "" : mpd_file_path.substr(0, last_slash + 1);
+  std::vector<std::string> video_names;
+  std::vector<size_t> video_sizes;
+  for (const auto &base_url : base_urls) {
+    struct stat st{};
+    if (base_url.empty() || base_url.find("://") != std::string::npos
+        || std::find(video_names.begin(), video_names.end(), base_url) != video_names.end()
+        || stat((mpd_dir + base_url).c_str(), &st) < 0 || !S_ISREG(st.st_mode)) {
+      continue;
+    }
+    video_names.push_back(base_url);
+    video_sizes.push_back(st.st_size);
+  }
+
+  std::vector<size_t> order(video_names.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::stable_sort(order.begin(), order.end(), [&video_sizes](size_t l, size_t r) {
+    return video_sizes[l] > video_sizes[r];
+  });
+  if (num_threads == 0) {
+    num_threads = 1;
+  }
+  if (num_threads > video_names.size()) {
+    num_threads = std::max<size_t>(video_names.size(), 1);
+  }
+  if (isTraceEnabled(TRACE_INFO)) {
+    // Keeps the trace of each video in one piece.
+    num_threads = 1;
+    cout << "MPD: " << video_names.size() << " videos on " << num_threads << " threads\n";
+  }
+  // The weights are loaded while the videos are parsed.
+  WeightFile weights;
+  int32_t weights_res = -1;
+  std::thread weight_loader;
+  if (!weight_file_prefix.empty()) {
+    weight_loader = std::thread([&]() {
+      weights_res = weights.open(weight_file_prefix);
+    });
+  }
+  std::vector<ParserContext> contexts(video_names.size());
+  std::atomic<uint32_t> failed_videos(0);
+  runParallel(order.size(), num_threads, [&](size_t i) {
+    const std::string video_file_path = mpd_dir + video_names[order[i]];
+    contexts[order[i]].slice_fields = SLICE_FIELD_TYPE | SLICE_FIELD_HEADER_SIZE;
+    if (parseVideo(contexts[order[i]], video_file_path) < 0) {
+      cerr << "Failed to process " << video_file_path << "\n";
+      failed_videos++;
+    }
+  });
+  if (weight_loader.joinable()) {
+    weight_loader.join();
+  }
+  if (failed_videos > 0) {
+    cerr << failed_videos << " of " << video_names.size() << " videos failed, " << mpd_file_path << " is unchanged\n";
+    return -1;
+  }
+
+  // All representations are annotated in a single pass over the MPD, in document order.
+  StageTimer timer(STAGE_MPD);
+  XmlHandler xml_handler;
+  if (xml_handler.setFile(mpd_file_path) < 0) {
+    return -1;
+  }
+  while (xml_handler.nextRepresentation()) {
+    auto video_it = std::find(video_names.begin(), video_names.end(), xml_handler.getBaseURL());
+    if (video_it == video_names.end()) {
+      cerr << "No video for BaseURL " << xml_handler.getBaseURL() << "\n";
+      continue;
+    }
+    if (annotateSegments(contexts[video_it - video_names.begin()], xml_handler, weights_res == 0 ? &weights : nullptr,
+                         top_frames) < 0) {
+      return -1;
+    }
+  }
+  return xml_handler.save();
+}
@@ -4,63 +4,352 @@
 #include <cstdint>
 #include <string>
 #include <vector>
+#include "Arena.h"
+#include "BinaryIndex.h"
+#include "BitReader.h"
 #include "Frame.h"
+#include "NALIndex.h"
+#include "OutputBuffer.h"
+#include "Stats.h"
+#include "structs.h"
+#include "WeightFile.h"
+
+/**
+ * Fields of a slice header that parseSliceHeader() determines, see ParserContext::slice_fields. nal_ref_idc and
+ * nal_unit_type come from the NAL unit header and are always known.
+ */
+enum SliceField : uint32_t {
+  /// slice_type in the NAL index. The parser stops right after it.
+  SLICE_FIELD_TYPE = 0x01,
+  /// The slice header size in the NAL index. The whole header is walked, but the syntax elements that do not decide
+  /// the layout of the header are skipped instead of decoded.
+  SLICE_FIELD_HEADER_SIZE = 0x02,
+  /// All syntax elements of the SliceHeader. Implied by keep_slice_headers and by tracing.
+  SLICE_FIELD_ELEMENTS = 0x04,
+  SLICE_FIELDS_ALL = SLICE_FIELD_TYPE | SLICE_FIELD_HEADER_SIZE | SLICE_FIELD_ELEMENTS
+};
+
+/**
+ * Holds all state that is gathered while parsing a single video. Nothing in here is shared between contexts, so
+ * multiple videos can be parsed concurrently as long as each thread uses its own context.
+ */
+struct ParserContext {
+  std::vector<MP4Box> mp4_boxes;
+  NALIndex nal_units;
+  std::vector<SPS> spss;
+  std::vector<PPS> ppss;
+  /// Full slice headers in file order, only filled if keep_slice_headers is set. The headers live in the arena.
+  std::vector<SliceHeader *> slices;
+  /// Tracks and samples from the moov and moof box trees.
+  std::vector<MP4Track> tracks;
+  std::vector<MP4Sample> samples;
+  /// If false, only the MP4 boxes are parsed and the NAL units in mdat are skipped.
+  bool parse_nal_units = true;
+  /// If false, the moov and moof box trees are skipped and tracks and samples stay empty.
+  bool parse_samples = true;
+  /// If true, the full slice headers are kept in slices. The outputs only need the NAL index, which has the slice type
+  /// and header size of every slice.
+  bool keep_slice_headers = false;
+  /// SliceField bits that the slice headers are parsed for. Slices that were parsed without SLICE_FIELD_HEADER_SIZE
+  /// have a slice header size of 0 in the NAL index.
+  uint32_t slice_fields = SLICE_FIELDS_ALL;
+  /// Memory of the kept slice headers.
+  Arena arena;
+  /// Memory of the pred_weight_table() of a slice header that is not kept, reused for every slice.
+  Arena scratch_arena;
+  /// Size of the input, or SIZE_MAX if it is not known in advance, e.g., for a pipe. Needed for boxes of size 0.
+  size_t input_size = SIZE_MAX;
+  /// Parse stage counters, only updated if stats are enabled.
+  ParseStats stats;
+};
+
+/**
+ * How the video file is read.
+ */
+enum InputMode {
+  /// Map the whole file.
+  INPUT_MAP,
+  /// Read the file sequentially in chunks, see parseStream().
+  INPUT_STREAM,
+  /// Read only the headers with pread(), see parseSparse().
+  INPUT_SPARSE
+};
+
+/**
+ * Everything that is needed to process a single video: the input path and the outputs that should be written.
+ */
+struct ParseJob {
+  std::string video_file_path;
+  std::string csv_file_path;
+  std::string mpd_file_path;
+  /// Prefix of the weight text files or path to a packed weight file, see WeightFile.
+  std::string weight_file_prefix;
+  /// Number of frames per segment that are ordered by weight, 0 for all.
+  size_t top_frames = 0;
+  std::string info_file_prefix;
+  bool flush_ranges = false;
+  std::string samples_file_path;
+  /// Prefix of the parameter set CSV files, see flushParameterSets().
+  std::string params_file_prefix;
+  std::string index_file_path;
+  /// Directory of the index cache, see index_cache.h. Empty if the cache is not used.
+  std::string cache_dir;
+  /// If true, the cache key includes a hash of the first and last MiB of the video.
+  bool cache_hash = false;
+  /// If true, the video is a growing file that is followed, see parseFollow().
+  bool follow = false;
+  InputMode input_mode = INPUT_MAP;
+  /// Number of threads that parse the fragments of a mapped video, see parseFragments().
+  uint32_t num_threads = 1;
+};
+
+/**
+ * Tries to parse a NAL unit located at the read position of the reader. Advances the reader in the process. The parsed
+ * NAL unit is placed in the nal_units index of the context.
+ * @param ctx Context that receives the parsed structure.
+ * @param reader Reader positioned at the NAL unit.
+ */
+void parseNALUnit(ParserContext &ctx, BitReader &reader);
+/**
+ * Tries to parse a NAL unit of an Annex B byte stream, i.e., a start code followed by the NAL unit header, located at
+ * the read position of the reader. Advances the reader in the process. The parsed NAL unit is placed in the nal_units
+ * index of the context.
+ * @param ctx Context that receives the parsed structure.
+ * @param reader Reader positioned at the start code.
+ * @param nal_end Offset of the next start code or the end of the stream.
+ */
+void parseAnnexBNALUnit(ParserContext &ctx, BitReader &reader, size_t nal_end);
+/**
+ * Tries to parse a sequence parameter set located at the read position of the reader. Advances the reader in the
+ * process. The parsed SPS is placed in the spss vector of the context.
+ * @param ctx Context that receives the parsed structure.
+ * @param reader Reader positioned at the SPS.
+ */
+void parseSPS(ParserContext &ctx, BitReader &reader);
+/**
+ * Tries to parse a picture parameter set located at the read position of the reader. Advances the reader in the
+ * process. The parsed PPS is placed in the ppss vector of the context. The reader has to end with the NAL unit, so the
+ * fields behind more_rbsp_data() can be detected.
+ * @param ctx Context that receives the parsed structure.
+ * @param reader Reader positioned at the PPS.
+ */
+void parsePPS(ParserContext &ctx, BitReader &reader);
+/**
+ * Tries to parse a slice header located at the read position of the reader. Advances the reader in the process. The
+ * slice type and header size are stored with the last NAL unit of the context. The parsed slice header is placed in the
+ * slices vector of the context if keep_slice_headers is set. Only the slice_fields of the context are determined, so
+ * the reader may stop anywhere in the header.
+ * @param ctx Context that receives the parsed structure.
+ * @param reader Reader positioned at the slice header.
+ */
+void parseSliceHeader(ParserContext &ctx, BitReader &reader);
+/**
+ * Tries to parse a MP4 box located at the read position of the reader. Advances the reader in the process. The parsed
+ * MP4 box is placed in the mp4_boxes vector of the context. Boxes with type other than 'mdat' are consumed completely.
+ * The reader points to the next MP4 box. For 'mdat' boxes, only the MP4 header is consumed and the reader points to the
+ * contained NAL unit. A box of size 0 extends to the end of the input. If the size of the input is unknown, the size of
+ * the box is set such that location_relative + size is SIZE_MAX and the caller has to fix it once the end is reached.
+ * @param ctx Context that receives the parsed structure.
+ * @param reader Reader positioned at the MP4 box.
+ * @return 0 on success. -1 if the size of the box is smaller than its header or exceeds the input.
+ */
+int32_t parseMP4Box(ParserContext &ctx, BitReader &reader);
 /**
- * Tries to parse a NAL unit located at addr + offset. Increments the offset in the process. The parsed NAL unit is
- * placed in the nal_units vector.
- * @param addr Base address of the file.
- * @param offset Offset at which the NAL unit is located.
+ * Checks if the data is an Annex B byte stream (raw .264 file), i.e., starts with a start code, instead of an MP4 file.
+ * @param addr Beginning of the data.
+ * @param size Size of the data.
+ * @return true if the data starts with a start code and a NAL unit header, not with the size and type of an MP4 box.
  */
-void parseNALUnit(const uint8_t *addr, size_t &offset);
+bool isAnnexB(const uint8_t *addr, size_t size);
 /**
- * Tries to parse a sequence parameter set located at addr + offset. Increments the offset in the process. The parsed
- * SPS is placed in the spss vector.
- * @param addr Base address of the file.
- * @param offset Offset at which the SPS is located.
+ * Splits an Annex B byte stream at the start codes and parses all NAL units into the context.
+ * @param ctx Context that receives the parsed structure.
+ * @param addr Beginning of the byte stream.
+ * @param size Size of the byte stream.
+ * @return 0 on success.
  */
-void parseSPS(const uint8_t *addr, size_t &offset);
+int32_t parseAnnexB(ParserContext &ctx, const uint8_t *addr, size_t size);
 /**
- * Tries to parse a picture parameter set located at addr + offset. Increments the offset in the process. The parsed PPS
- * is placed in the ppss vector.
- * @param addr Base address of the file.
- * @param offset Offset at which the PPS is located.
+ * Parses an MP4 file or Annex B byte stream from a file descriptor with bounded memory. The input is read sequentially
+ * in fixed-size chunks and only the headers of the current MP4 box or NAL unit are kept resident, so this works for
+ * pipes and stdin and the memory footprint does not depend on the size of the input. The location pointers of the
+ * parsed structures are only valid while they are parsed.
+ * @param ctx Context that receives the parsed structure.
+ * @param fd File descriptor to read from.
+ * @return 0 on success. -1 if reading failed.
  */
-void parsePPS(const uint8_t *addr, size_t &offset);
+int32_t parseStream(ParserContext &ctx, int32_t fd);
 /**
- * Tries to parse a slice header located at addr + offset. Increments the offset in the process. The parsed slice header
- * is placed in the slices vector.
- * @param addr Base address of the file.
- * @param offset Offset at which the slice header is located.
+ * Parses an MP4 file and reads only the bytes that are needed, i.e., the MP4 box headers and the beginning of every NAL
+ * unit, with pread(). Reads of headers that lie close together are coalesced. The payload is skipped, so only a small
+ * fraction of the file is read. Annex B byte streams are read completely with parseStream().
+ * @param ctx Context that receives the parsed structure.
+ * @param fd File descriptor of a regular file.
+ * @param file_size Size of the file.
+ * @return 0 on success. -1 if reading failed.
  */
-void parseSliceHeader(const uint8_t *addr, size_t &offset);
+int32_t parseSparse(ParserContext &ctx, int32_t fd, size_t file_size);
 /**
- * Tries to parse a MP4 box located at addr + offset. Increments the offset in the process. The parsed MP4 box is placed
- * in the mp4_boxes vector. Boxes with type other than 'mdat' are consumed completely. The offset points to the next MP4
- * box. For 'mdat' boxes, only the MP4 header is consumed and the offset points to the contained NAL unit.
- * @param addr Base address of the file.
- * @param offset Offset at which the MP4 box is located.
+ * Parses a mapped MP4 file in two phases. First, a sequential pass over the top-level MP4 boxes locates the mdat boxes.
+ * Then, the NAL units of each mdat box are parsed on a pool of worker threads. Slice headers depend on the SPS and PPS
+ * that precede them, possibly in an earlier fragment, so the workers first collect the NAL units and parameter sets of
+ * their fragment, and parse the slice headers once the parameter sets at the start of every fragment are known. The
+ * results are merged in file order, so the context is the same as after a sequential parse.
+ * @param ctx Context that receives the parsed structure.
+ * @param addr Beginning of the mapped file.
+ * @param size Size of the file.
+ * @param num_threads Number of worker threads.
+ * @return 0 on success.
  */
-int32_t parseMP4Box(const uint8_t *addr, size_t &offset);
+int32_t parseFragments(ParserContext &ctx, const uint8_t *addr, size_t size, uint32_t num_threads);
+/**
+ * Follows a growing MP4 file, e.g., the output of a live packager that appends moof/mdat pairs. Complete top-level
+ * boxes are parsed with pread() as soon as they are written, continuing with the state of the context, i.e., the
+ * parameter sets, tracks and offset. inotify wakes the parser whenever the file is modified; the file is also checked
+ * every 100 ms. After each new batch of boxes, their CSV rows are appended to the CSV file and the index file is
+ * replaced with a snapshot of the whole index. Following stops once the file is deleted or renamed, or on SIGINT or
+ * SIGTERM, after the complete boxes written so far are parsed.
+ * @param ctx Context that receives the parsed structure.
+ * @param video_file_path Path to the video file.
+ * @param csv_file CSV output, or nullptr.
+ * @param index_file_path Path to the index file, or empty.
+ * @return 0 on success. -1 if the file could not be opened or read, or is not an MP4 file.
+ */
+int32_t parseFollow(ParserContext &ctx,
+                    const std::string &video_file_path,
+                    OutputBuffer *csv_file,
+                    const std::string &index_file_path);
+/**
+ * Maps the video file and parses all MP4 boxes and the NAL units contained in mdat boxes into the context. Annex B byte
+ * streams are detected automatically and parsed with parseAnnexB(). stdin ("-"), pipes and FIFOs are parsed with
+ * parseStream().
+ * @param ctx Context that receives the parsed structure.
+ * @param video_file_path Path to the video file or "-" for stdin.
+ * @param input_mode How regular files are read.
+ * @param num_threads Number of threads for parseFragments(). The fragments are parsed sequentially if this is 1 or if
+ * tracing is enabled, which keeps the trace in file order.
+ * @return 0 on success. -1 if the file could not be opened, mapped or read.
+ */
+int32_t parseVideo(ParserContext &ctx,
+                   const std::string &video_file_path,
+                   InputMode input_mode = INPUT_MAP,
+                   uint32_t num_threads = 1);
 /**
  * Adds the header information that was gathered during the parsing process to the specified MPD file. Note that the
  * XmlHandler class requires a video name that contains *dash somewhere. The reason for this is that our naming suffixes
  * are not always the same, so if the BaseURL element of the MPD has the value
  * bbb_720p_2k35_24f_96sc_300s_dashinit_with_http_header.mp4 it is okay to pass the name
  * bbb_720p_2k35_24f_96sc_300s_dashinit.mp4 to the function, because it compares only up until the *dash keyword.
+ * @param ctx Context of the parsed video.
  * @param file_name Path to the MPD file.
  * @param video_name Video name that should be searched for in the MPD's BaseURL element.
+ * @param weights Weights that order the frames of each segment, or nullptr for file order.
+ * @param top_frames Number of frames per segment that are ordered by weight, 0 for all.
+ * @return 0 on success. -1 if the MPD could not be read, annotated or written, in which case it is left unchanged.
  */
-void flushMPDFile(const std::string &file_name, std::string video_name);
-void flushMPDFile(const std::string &file_name, std::string video_name, const std::string &weight_file_prefix);
+int32_t flushMPDFile(const ParserContext &ctx, const std::string &file_name, std::string video_name);
+int32_t flushMPDFile(const ParserContext &ctx,
+                     const std::string &file_name,
+                     std::string video_name,
+                     const WeightFile *weights,
+                     size_t top_frames = 0);
 
+/**
+ * Writes one line per MP4 box and NAL unit, in file order, with the type, the frame number (slices only) and the size.
+ * @param index Binary index of the parsed video.
+ * @param csv_file Open CSV file.
+ * @param frame_num Frame number of the first slice.
+ * @return Frame number of the slice after the last one.
+ */
+uint32_t flushCSV(const IndexReader &index, OutputBuffer &csv_file, uint32_t frame_num = 1);
 /**
  * Flushes the structure of the bytestream into a CSV file. The file is created at the same location as the video.
+ * @param index Binary index of the parsed video.
  * @param video_name Path to the video file
  */
-void flushRanges(const std::string &video_name);
-void assignWeights(const std::string &weight_file_prefix,
-                   uint32_t segment_no,
-                   std::vector<Frame> &frame_list,
-                   bool skip_i_frame);
-void flushInfoData(const std::string &info_file_prefix, const std::string &weight_file_prefix);
+void flushRanges(const IndexReader &index, const std::string &video_name);
+/**
+ * Writes the samples from the MP4 metadata into a CSV file, one line per sample with the track ID, the byte range, the
+ * decode and composition times in the timescale of the track and whether it is a sync sample.
+ * @param ctx Context of the parsed video.
+ * @param samples_file_path Path to the CSV file.
+ */
+void flushSamples(const ParserContext &ctx, const std::string &samples_file_path);
+/**
+ * Writes the distinct parameter sets of the video into two CSV files, <prefix>-sps.csv and <prefix>-pps.csv, in the
+ * order of their first occurrence. Besides the coded fields, the SPS file has the values that are derived from them,
+ * e.g., the cropped picture size, the sample aspect ratio, the frame rate and the HRD bit rate. Fields of absent syntax
+ * structures are empty.
+ * @param ctx Context of the parsed video.
+ * @param params_file_prefix Prefix of the CSV files.
+ */
+void flushParameterSets(const ParserContext &ctx, const std::string &params_file_prefix);
+/**
+ * Sets the weights of the frames of a segment, in file order. The frames are not reordered, see orderFrames().
+ * @param weights Weights of all segments.
+ * @param segment_no Number of the segment, starting at 1.
+ * @param frame_list Frames of the segment in file order.
+ * @param skip_i_frame True if the I-frame is not in the list, so its weight is skipped.
+ * @return 0 on success. -1 if the segment has no weights or their number does not match the frames.
+ */
+int32_t assignWeights(const WeightFile &weights,
+                      uint32_t segment_no,
+                      std::vector<Frame> &frame_list,
+                      bool skip_i_frame);
+/**
+ * Orders frames by descending weight, see Frame::operator<. If only the first top_frames frames are fetched, only
+ * those are ordered with a partial sort and the other frames follow in unspecified order.
+ * @param frame_list Frames to order.
+ * @param top_frames Number of frames that are ordered, 0 for all.
+ */
+void orderFrames(std::vector<Frame> &frame_list, size_t top_frames);
+/**
+ * Writes the frames of every segment of the index into <prefix>-<segment>.dat, one line per frame with its index, type,
+ * weight and size. Frames are ordered by weight if the index has weights and in file order otherwise.
+ * @param index Binary index of the parsed video.
+ * @param info_file_prefix Prefix of the frame files.
+ * @param top_frames Number of frames per segment that are ordered by weight, 0 for all.
+ */
+void flushInfoData(const IndexReader &index, const std::string &info_file_prefix, size_t top_frames = 0);
+/**
+ * Parses the command line of a single video, i.e., <video> [--csv <csv-file>] [--mpd <MPD-File>] [--weights <prefix>]
+ * [--top-frames <k>] [--info <prefix>] [--ranges] [--samples <samples-file>] [--index <index-file>] [--cache <dir> [--cache-hash]]
+ * [--follow] [--stream|--sparse] [-j <threads>], into a job. A video of "-" is read from stdin.
+ * @param args Arguments, starting with the video path.
+ * @param job Job that receives the parsed options.
+ * @return 0 on success. -1 if an argument is unknown, is missing its value or has an invalid number.
+ */
+int32_t parseArguments(const std::vector<std::string> &args, ParseJob &job);
+/**
+ * Parses the video of the job with a fresh context and writes all requested outputs. With a cache directory, the index
+ * of an unchanged video is loaded from the cache instead, unless samples are requested.
+ * @param job Job to run.
+ * @return 0 on success. -1 if the CSV file or the video could not be opened.
+ */
+int32_t runJob(const ParseJob &job);
+/**
+ * Runs every job of a batch list on a fixed pool of worker threads. Each line of the list has the same syntax as the
+ * single video command line (see parseArguments()). Empty lines and lines starting with # are ignored. Jobs that write
+ * the same file, e.g., two representations of the same MPD or the same CSV file, form a group that runs on a single
+ * worker in the order of the list, so they never write a file concurrently. Groups are handed out by the total size of
+ * their videos, largest first.
+ * @param list_file_path Path to the batch list.
+ * @param num_threads Number of worker threads.
+ * @return 0 if all jobs succeeded. -1 if the list could not be read or at least one job failed.
+ */
+int32_t runBatch(const std::string &list_file_path, uint32_t num_threads);
+/**
+ * Adds the header information of every representation to an MPD file. Every BaseURL element that has a SegmentList is
+ * resolved to a video next to the MPD. The videos are parsed concurrently, largest first, and the MPD is rewritten
+ * once. The MPD is not modified if a video fails to parse.
+ * @param mpd_file_path Path to the MPD file.
+ * @param weight_file_prefix Prefix of the weight files or packed weight file, shared by all representations, or empty.
+ * @param top_frames Number of frames per segment that are ordered by weight, 0 for all.
+ * @param num_threads Number of worker threads.
+ * @return 0 on success. -1 if the MPD could not be read or written or a video failed.
+ */
+int32_t runMPDAll(const std::string &mpd_file_path,
+                  const std::string &weight_file_prefix,
+                  size_t top_frames,
+                  uint32_t num_threads);
 #endif //HEADER_PARSE_H_
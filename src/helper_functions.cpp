@@ -1,171 +1,40 @@
 #include "helper_functions.h"
-#include <cmath>
-#include <assert.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "defines.h"
 
-uint8_t readBit(const uint8_t *addr, size_t &offset, uint8_t &bit_offset) {
-  uint8_t ret = (addr[offset] >> (7 - bit_offset)) & 0x01;
-  bit_offset++;
-  if (bit_offset == 8) {
-    bit_offset = 0;
-    offset++;
-  }
-  return ret;
-}
-
-uint8_t readBit(const uint8_t *addr, size_t &offset, uint8_t &bit_offset, const std::string &message) {
-#ifdef DEBUG
-  std::cout << POSITION << message << ": ";
-#endif
-  uint8_t ret = readBit(addr, offset, bit_offset);
-#ifdef DEBUG
-  std::cout << +ret << "\n";
-#endif
-  return ret;
-}
-
-uint32_t readNBits(const uint8_t *addr, size_t &offset, uint8_t &bit_offset, uint32_t n) {
-  uint32_t ret = 0;
-  assert(n <= 32);
-  for (int32_t i = n; i > 0; i--) {
-    ret += readBit(addr, offset, bit_offset) << (i - 1);
-  }
-  return ret;
-}
-
-uint32_t readNBits(const uint8_t *addr, size_t &offset, uint8_t &bit_offset, uint32_t n, const std::string &message) {
-#ifdef DEBUG
-  std::cout << POSITION << message << ": ";
-#endif
-  uint32_t ret = readNBits(addr, offset, bit_offset, n);
-#ifdef DEBUG
-  std::cout << ret << "\n";
-#endif
-  return ret;
-}
-
-uint8_t readByte(const uint8_t *addr, size_t &offset, uint8_t &bit_offset) {
-  uint8_t ret = 0;
-  if (bit_offset == 0) {
-    ret = addr[offset];
-    offset++;
-  } else {
-    for (int32_t i = 8; i > 0; i--) {
-      ret += readBit(addr, offset, bit_offset) << (i - 1);
-    }
-  }
-  return ret;
-}
-
-uint8_t readByte(const uint8_t *addr, size_t &offset, uint8_t &bit_offset, const std::string &message) {
-#ifdef DEBUG
-  std::cout << POSITION << message << ": ";
-#endif
-  uint8_t ret = readByte(addr, offset, bit_offset);
-#ifdef DEBUG
-  std::cout << +ret << "\n";
-#endif
-  return ret;
-}
-
-uint32_t readUnsignedInt32(const uint8_t *addr, size_t &offset, uint8_t &bit_offset) {
-  uint32_t ret = 0;
-  if (bit_offset == 0) {
-    for (int32_t i = 4; i > 0; i--) {
-      ret += addr[offset] << (8 * (i - 1));
-      offset++;
-    }
+uint32_t getChromaArrayType(const SPS &sps) {
+  if (sps.separate_colour_plane_flag) {
+    return 0;
   } else {
-    uint8_t leading_bits = 8 - bit_offset;
-    uint8_t trailing_bits = bit_offset;
-    // Read bits until stream is byte-aligned
-    for (int32_t i = 0; i < leading_bits; i++) {
-      ret += readBit(addr, offset, bit_offset) << (31 - i);
-    }
-    // Read three full bytes
-    for (int32_t j = 3; j > 0; j--) {
-      ret += readByte(addr, offset, bit_offset) << ((8 * (j - 1)) + trailing_bits);
-    }
-    // Read trailing bits from next byte
-    for (int32_t k = trailing_bits; k > 0; k--) {
-      ret += readBit(addr, offset, bit_offset) << (k - 1);
-    }
-  }
-  return ret;
-}
-
-uint32_t readUnsignedInt32(const uint8_t *addr, size_t &offset, uint8_t &bit_offset, const std::string &message) {
-#ifdef DEBUG
-  std::cout << POSITION << message << ": ";
-#endif
-  uint32_t ret = readUnsignedInt32(addr, offset, bit_offset);
-#ifdef DEBUG
-  std::cout << ret << "\n";
-#endif
-  return ret;
-}
-
-uint32_t decodeUnsignedExpGolomb(const uint8_t *addr, size_t &offset, uint8_t &bit_offset) {
-  uint32_t leading_zero_bits = 0;
-  uint32_t code_num = 0;
-
-  bool one_found = false;
-  while (!one_found) {
-    uint8_t next = readBit(addr, offset, bit_offset);
-    if (next) {
-      one_found = true;
-    } else {
-      leading_zero_bits++;
-    }
-  }
-
-  for (int32_t i = leading_zero_bits; i > 0; i--) {
-    code_num += readBit(addr, offset, bit_offset) << (i - 1);
+    return sps.chroma_format_idc;
   }
-  return code_num + ((1 << leading_zero_bits) - 1);
-}
-
-uint32_t decodeUnsignedExpGolomb(const uint8_t *addr,
-                                 size_t &offset,
-                                 uint8_t &bit_offset,
-                                 const std::string &message) {
-#ifdef DEBUG
-  std::cout << POSITION << message << ": ";
-#endif
-  uint32_t ret = decodeUnsignedExpGolomb(addr, offset, bit_offset);
-#ifdef DEBUG
-  std::cout << ret << "\n";
-#endif
-  return ret;
 }
 
-int32_t decodeSignedExpGolomb(const uint8_t *addr, size_t &offset, uint8_t &bit_offset) {
-  uint32_t code_num = decodeUnsignedExpGolomb(addr, offset, bit_offset);
-  int32_t syntax_element_value = ceil(((double) code_num) / 2.0);
-  if (code_num % 2 == 0) {
-    syntax_element_value *= -1;
+uint32_t getFrameWidth(const SPS &sps) {
+  uint32_t width = (sps.pic_width_in_mbs_minus1 + 1) * 16;
+  if (!sps.frame_cropping_flag) {
+    return width;
   }
-  return syntax_element_value;
-}
-
-int32_t decodeSignedExpGolomb(const uint8_t *addr, size_t &offset, uint8_t &bit_offset, const std::string &message) {
-#ifdef DEBUG
-  std::cout << POSITION << message << ": ";
-#endif
-  int32_t ret = decodeSignedExpGolomb(addr, offset, bit_offset);
-#ifdef DEBUG
-  std::cout << ret << "\n";
-#endif
-  return ret;
+  // SubWidthC is 1 for 4:4:4 only, see Table 6-1.
+  uint32_t crop_unit_x = getChromaArrayType(sps) == 0 || sps.chroma_format_idc == 3 ? 1 : 2;
+  return width - crop_unit_x * (sps.frame_crop_left_offset + sps.frame_crop_right_offset);
 }
 
-uint32_t getChromaArrayType(const SPS &sps) {
-  if (sps.separate_colour_plane_flag) {
-    return 0;
-  } else {
-    return sps.chroma_format_idc;
+uint32_t getFrameHeight(const SPS &sps) {
+  uint32_t field_factor = sps.frame_mbs_only_flag ? 1 : 2;
+  uint32_t height = field_factor * (sps.pic_height_in_map_units_minus1 + 1) * 16;
+  if (!sps.frame_cropping_flag) {
+    return height;
   }
+  // SubHeightC is 2 for 4:2:0 only, see Table 6-1.
+  uint32_t crop_unit_y = (getChromaArrayType(sps) == 1 ? 2 : 1) * field_factor;
+  return height - crop_unit_y * (sps.frame_crop_top_offset + sps.frame_crop_bottom_offset);
 }
 
 std::string getNALUnitTypeString(uint8_t nal_unit_type) {
@@ -271,6 +140,11 @@ std::string getSliceTypeString(uint8_t slice_type) {
   }
 }
 
+char getSliceTypeChar(uint8_t slice_type) {
+  static const char slice_type_chars[] = "PBISSPBISS";
+  return slice_type < 10 ? slice_type_chars[slice_type] : getSliceTypeString(slice_type)[0];
+}
+
 std::string getNameString(uint32_t type) {
   std::string ret;
   for (int32_t i = 4; i > 0; i--) {
@@ -279,3 +153,111 @@ std::string getNameString(uint32_t type) {
   }
   return ret;
 }
+
+size_t formatUnsigned(char *dst, uint64_t value) {
+  static const char digit_pairs[] =
+      "0001020304050607080910111213141516171819202122232425262728293031323334353637383940414243444546474849"
+      "5051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+  char digits[MAX_NUMBER_LENGTH];
+  char *pos = digits + MAX_NUMBER_LENGTH;
+  while (value >= 100) {
+    pos -= 2;
+    memcpy(pos, digit_pairs + value % 100 * 2, 2);
+    value /= 100;
+  }
+  if (value >= 10) {
+    pos -= 2;
+    memcpy(pos, digit_pairs + value * 2, 2);
+  } else {
+    *--pos = static_cast<char>('0' + value);
+  }
+  size_t length = digits + MAX_NUMBER_LENGTH - pos;
+  memcpy(dst, pos, length);
+  return length;
+}
+
+size_t formatSigned(char *dst, int64_t value) {
+  if (value >= 0) {
+    return formatUnsigned(dst, value);
+  }
+  *dst = '-';
+  // Negating in unsigned arithmetic also works for INT64_MIN.
+  return 1 + formatUnsigned(dst + 1, 0 - static_cast<uint64_t>(value));
+}
+
+void appendUnsigned(std::string &str, uint64_t value) {
+  char digits[MAX_NUMBER_LENGTH];
+  str.append(digits, formatUnsigned(digits, value));
+}
+
+void appendSigned(std::string &str, int64_t value) {
+  char digits[MAX_NUMBER_LENGTH];
+  str.append(digits, formatSigned(digits, value));
+}
+
+int32_t parseNumber(const std::string &value, uint64_t min, uint64_t max, uint64_t &number) {
+  // strtoull() skips leading white space and accepts a sign.
+  if (value.empty() || value[0] < '0' || value[0] > '9') {
+    return -1;
+  }
+  char *end;
+  errno = 0;
+  unsigned long long parsed = strtoull(value.c_str(), &end, 10);
+  if (*end != '\0' || errno != 0 || parsed < min || parsed > max) {
+    return -1;
+  }
+  number = parsed;
+  return 0;
+}
+
+TraceLevel trace_level = TRACE_NONE;
+
+void traceElement(size_t offset, uint8_t bit_offset, const char *name, uint32_t value) {
+  std::cout << POSITION << name << ": " << value << "\n";
+}
+
+void traceElement(size_t offset, uint8_t bit_offset, const char *name, int32_t value) {
+  std::cout << POSITION << name << ": " << value << "\n";
+}
+
+void traceElement(size_t offset, uint8_t bit_offset, const char *name, uint64_t value) {
+  std::cout << POSITION << name << ": " << value << "\n";
+}
+
+void traceElement(size_t offset, uint8_t bit_offset, const char *name, const std::string &value) {
+  std::cout << POSITION << name << ": " << value << "\n";
+}
+
+int32_t writeFileAtomically(const std::string &path, const std::vector<std::pair<const void *, size_t>> &parts) {
+  std::string tmp_path = path + ".XXXXXX";
+  int32_t fd = mkstemp(&tmp_path[0]);
+  if (fd < 0) {
+    std::cerr << "Failed to create " << path << ": " << strerror(errno) << "\n";
+    return -1;
+  }
+  // mkstemp() creates the file for the owner only.
+  fchmod(fd, 0644);
+  bool write_ok = true;
+  for (const auto &part : parts) {
+    const auto *data = static_cast<const uint8_t *>(part.first);
+    size_t remaining = part.second;
+    while (write_ok && remaining > 0) {
+      ssize_t res = write(fd, data, remaining);
+      if (res < 0 && errno == EINTR) {
+        continue;
+      }
+      if (res <= 0) {
+        write_ok = false;
+        break;
+      }
+      data += res;
+      remaining -= res;
+    }
+  }
+  if (close(fd) < 0 || !write_ok || rename(tmp_path.c_str(), path.c_str()) < 0) {
+    std::cerr << "Failed to write " << path << ": " << strerror(errno) << "\n";
+    unlink(tmp_path.c_str());
+    return -1;
+  }
+  return 0;
+}
@@ -3,154 +3,10 @@
 
 #include <cstdint>
 #include <string>
+#include <utility>
+#include <vector>
 #include "structs.h"
 
-/**
- * Reads a single bit from the position addr + offset + bit_offset. Increments bit_offset. If a byte border is reached,
- * i.e., bit_offset reaches 8, offset is incremented and bit_offset reset to 0.
- *
- * @param addr Base address.
- * @param offset Byte offset from base address.
- * @param bit_offset Bit offset inside byte.
- * @return The read value.
- */
-uint8_t readBit(const uint8_t *addr, size_t &offset, uint8_t &bit_offset);
-/**
- * Reads a single bit from the position addr + offset + bit_offset. Increments bit_offset. If a byte border is reached,
- * i.e., bit_offset reaches 8, offset is incremented and bit_offset reset to 0. Additionally, prints a debug message to
- * stdout if DEBUG is defined.
- *
- * @param addr Base address.
- * @param offset Byte offset from base address.
- * @param bit_offset Bit offset inside byte.
- * @param message Parameter name that is printed together with the read value.
- * @return The read value.
- */
-uint8_t readBit(const uint8_t *addr, size_t &offset, uint8_t &bit_offset, const std::string &message);
-/**
- * Reads n bits from the position addr + offset + bit_offset. Increments bit_offset. If a byte border is reached,
- * i.e., bit_offset reaches 8, offset is incremented and bit_offset reset to 0.
- *
- * @warning Do not pass a n value greater than 32.
- *
- * @param addr Base address.
- * @param offset Byte offset from base address.
- * @param bit_offset Bit offset inside byte.
- * @param n Number of bits to read.
- * @return The read value.
- */
-uint32_t readNBits(const uint8_t *addr, size_t &offset, uint8_t &bit_offset, uint32_t n);
-/**
- * Reads n bits from the position addr + offset + bit_offset. Increments bit_offset. If a byte border is reached,
- * i.e., bit_offset reaches 8, offset is incremented and bit_offset reset to 0. Additionally, prints a debug message to
- * stdout if DEBUG is defined.
- *
- * @warning Do not pass a n value greater than 32.
- *
- * @param addr Base address.
- * @param offset Byte offset from base address.
- * @param bit_offset Bit offset inside byte.
- * @param n Number of bits to read.
- * @param message Parameter name that is printed together with the read value.
- * @return The read value.
- */
-uint32_t readNBits(const uint8_t *addr, size_t &offset, uint8_t &bit_offset, uint32_t n, const std::string &message);
-/**
- * Reads a byte from the position addr + offset + bit_offset. Increments offset.
- *
- * @param addr Base address.
- * @param offset Byte offset from base address.
- * @param bit_offset Bit offset inside byte.
- * @return The read value.
- */
-uint8_t readByte(const uint8_t *addr, size_t &offset, uint8_t &bit_offset);
-/**
- * Reads a byte from the position addr + offset + bit_offset. Increments offset. Additionally, prints a debug message to
- * stdout if DEBUG is defined.
- *
- * @param addr Base address.
- * @param offset Byte offset from base address.
- * @param bit_offset Bit offset inside byte.
- * @param message Parameter name that is printed together with the read value.
- * @return The read value.
- */
-uint8_t readByte(const uint8_t *addr, size_t &offset, uint8_t &bit_offset, const std::string &message);
-/**
- * Reads four bytes from the position addr + offset + bit_offset and interprets them as a unsigned integer. Increments
- * offset.
- *
- * @param addr Base address.
- * @param offset Byte offset from base address.
- * @param bit_offset Bit offset inside byte.
- * @return The read value as an unsigned integer.
- */
-uint32_t readUnsignedInt32(const uint8_t *addr, size_t &offset, uint8_t &bit_offset);
-/**
- * Reads four bytes from the position addr + offset + bit_offset and interprets them as a unsigned integer. Increments
- * offset. Additionally, prints a debug message to stdout if DEBUG is defined.
- *
- * @param addr Base address.
- * @param offset Byte offset from base address.
- * @param bit_offset Bit offset inside byte.
- * @param message Parameter name that is printed together with the read value.
- * @return The read value as an unsigned integer.
- */
-uint32_t readUnsignedInt32(const uint8_t *addr, size_t &offset, uint8_t &bit_offset, const std::string &message);
-/**
- * Reads a variable number of bits from the position addr + offset + bit_offset as a Exp-Golomb code. Increments
- * bit_offset. If a byte border is reached, i.e., bit_offset reaches 8, offset is incremented and bit_offset reset to 0
- * .
- * Details about the parsing process can be found in ISO/IEC 14496-10:2014 Chapter 9.1.
- *
- * @param addr Base address.
- * @param offset Byte offset from base address.
- * @param bit_offset Bit offset inside byte.
- * @return The code number.
- */
-uint32_t decodeUnsignedExpGolomb(const uint8_t *addr, size_t &offset, uint8_t &bit_offset);
-/**
- * Reads a variable number of bits from the position addr + offset + bit_offset as a Exp-Golomb code. Increments
- * bit_offset. If a byte border is reached, i.e., bit_offset reaches 8, offset is incremented and bit_offset reset to 0.
- * Additionally, prints a debug message to stdout if DEBUG is defined.
- *
- * Details about the parsing process can be found in ISO/IEC 14496-10:2014 Chapter 9.1.
- *
- * @param addr Base address.
- * @param offset Byte offset from base address.
- * @param bit_offset Bit offset inside byte.
- * @param message Parameter name that is printed together with the read value.
- * @return The code number.
- */
-uint32_t decodeUnsignedExpGolomb(const uint8_t *addr, size_t &offset, uint8_t &bit_offset, const std::string &message);
-/**
- * Reads a variable number of bits from the position addr + offset + bit_offset as a Exp-Golomb code. Increments
- * bit_offset. If a byte border is reached, i.e., bit_offset reaches 8, offset is incremented and bit_offset reset to 0.
- * The unsigned code number is then mapped to a signed syntax element value as specified in ISO/IEC 14496-10:2014
- * Chapter 9.1.1.
- *
- * Details about the parsing process can be found in ISO/IEC 14496-10:2014 Chapter 9.1.
- *
- * @param addr Base address.
- * @param offset Byte offset from base address.
- * @param bit_offset Bit offset inside byte.
- * @return The read value.
- */
-int32_t decodeSignedExpGolomb(const uint8_t *addr, size_t &offset, uint8_t &bit_offset);
-/**
- * Reads a variable number of bits from the position addr + offset + bit_offset as a Exp-Golomb code. Increments
- * bit_offset. If a byte border is reached, i.e., bit_offset reaches 8, offset is incremented and bit_offset reset to 0.
- * The unsigned code number is then mapped to a signed syntax element value as specified in ISO/IEC 14496-10:2014
- * Chapter 9.1.1. Additionally, prints a debug message to stdout if DEBUG is defined.
- *
- * Details about the parsing process can be found in ISO/IEC 14496-10:2014 Chapter 9.1.
- *
- * @param addr Base address.
- * @param offset Byte offset from base address.
- * @param bit_offset Bit offset inside byte.
- * @param message Parameter name that is printed together with the read value.
- * @return The read value.
- */
-int32_t decodeSignedExpGolomb(const uint8_t *addr, size_t &offset, uint8_t &bit_offset, const std::string &message);
 /**
  * Returns the value of the ChromaArrayType pseudo variable. The variable is derived from the contents of the SPS as
  * follows (taken from the semantic description of the separate_colour_plane_flag field in ISO/IEC 14496-10:2014 Chapter
@@ -167,6 +23,22 @@ int32_t decodeSignedExpGolomb(const uint8_t *addr, size_t &offset, uint8_t &bit_
  * @return Value of the variable.
  */
 uint32_t getChromaArrayType(const SPS &sps);
+/**
+ * Returns the width of the decoded frames after cropping, i.e., PicWidthInMbs * 16 minus the horizontal crop offsets
+ * in units of CropUnitX as specified in ISO/IEC 14496-10:2014 Chapter 7.4.2.1.1.
+ *
+ * @param sps SPS from which to derive the value.
+ * @return Width in luma samples.
+ */
+uint32_t getFrameWidth(const SPS &sps);
+/**
+ * Returns the height of the decoded frames after cropping, i.e., FrameHeightInMbs * 16 minus the vertical crop offsets
+ * in units of CropUnitY as specified in ISO/IEC 14496-10:2014 Chapter 7.4.2.1.1.
+ *
+ * @param sps SPS from which to derive the value.
+ * @return Height in luma samples.
+ */
+uint32_t getFrameHeight(const SPS &sps);
 /**
  * Returns the string representation of a NAL unit type code as specified in ISO/IEC 14496-10:2014 Table 7-1.
  *
@@ -182,6 +54,14 @@ std::string getShortNALUnitTypeString(uint8_t nal_unit_type);
  * @return String representation.
  */
 std::string getSliceTypeString(uint8_t slice_type);
+/**
+ * Returns the first character of getSliceTypeString() without constructing the string, e.g., 'P' or 'S' for SP and SI
+ * slices.
+ *
+ * @param slice_type Slice type code.
+ * @return First character of the string representation.
+ */
+char getSliceTypeChar(uint8_t slice_type);
 /**
  * Interprets the four byte integer as a four character string and returns the value. Used to get the name of a MP4 box
  * as a string representation.
@@ -190,5 +70,45 @@ std::string getSliceTypeString(uint8_t slice_type);
  * @return String representation.
  */
 std::string getNameString(uint32_t type);
+/// Maximum number of characters that formatUnsigned() and formatSigned() write.
+const size_t MAX_NUMBER_LENGTH = 20;
+/**
+ * Formats an integer in decimal, two digits at a time. The output is not null terminated.
+ *
+ * @param dst Destination with room for MAX_NUMBER_LENGTH characters.
+ * @param value Value to format.
+ * @return Number of characters written.
+ */
+size_t formatUnsigned(char *dst, uint64_t value);
+size_t formatSigned(char *dst, int64_t value);
+/**
+ * Appends the decimal representation of an integer to a string. Unlike std::to_string(), this does not create a
+ * temporary string, so a reused string does not allocate.
+ *
+ * @param str String to append to.
+ * @param value Value to append.
+ */
+void appendUnsigned(std::string &str, uint64_t value);
+void appendSigned(std::string &str, int64_t value);
+/**
+ * Parses a decimal number from the command line. Unlike std::stoul(), a value with other characters, e.g., a sign or a
+ * unit, or out of range is rejected instead of throwing, being truncated or wrapping around.
+ *
+ * @param value Value to parse.
+ * @param min Smallest allowed number.
+ * @param max Largest allowed number.
+ * @param number Receives the number.
+ * @return 0 on success. -1 if the value is not a number in [min, max].
+ */
+int32_t parseNumber(const std::string &value, uint64_t min, uint64_t max, uint64_t &number);
+/**
+ * Writes a file through a temporary file in the same directory and rename(), so readers see either the complete old or
+ * the complete new file, never a partial one.
+ *
+ * @param path Path of the file.
+ * @param parts Buffers that are written one after the other.
+ * @return 0 on success. -1 if the file could not be written.
+ */
+int32_t writeFileAtomically(const std::string &path, const std::vector<std::pair<const void *, size_t>> &parts);
 
 #endif //HELPER_FUNCTIONS_H_
@@ -0,0 +1,156 @@
+#include "index_cache.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <memory>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "BinaryIndex.h"
+#include "defines.h"
+#include "helper_functions.h"
+#include "Stats.h"
+
+using std::cout;
+using std::cerr;
+
+static const char CACHE_MAGIC[4] = {'H', 'P', 'C', 'C'};
+/// Incremented if the parser produces different indexes for the same video, which invalidates all entries.
+static const uint32_t CACHE_VERSION = 1;
+/// Number of bytes at the beginning and the end of the file that are hashed.
+static const size_t HASH_SIZE = 1 << 20;
+
+/**
+ * Header of a cache entry, followed by the binary index.
+ */
+struct CacheHeader {
+  char magic[4];
+  uint32_t version;
+  CacheKey key;
+};
+
+static_assert(sizeof(CacheHeader) % 8 == 0, "The index after the header must stay aligned");
+
+/**
+ * Updates a 64 bit FNV-1a hash.
+ */
+static uint64_t hashBytes(uint64_t hash, const uint8_t *data, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ data[i]) * 0x100000001b3;
+  }
+  return hash;
+}
+
+static bool operator==(const CacheKey &l, const CacheKey &r) {
+  return l.device == r.device && l.inode == r.inode && l.size == r.size && l.mtime_sec == r.mtime_sec
+      && l.mtime_nsec == r.mtime_nsec && l.content_hash == r.content_hash;
+}
+
+/**
+ * Reads exactly size bytes at offset.
+ * @return true on success.
+ */
+static bool preadFully(int32_t fd, void *buf, size_t size, off_t offset) {
+  auto *dst = static_cast<uint8_t *>(buf);
+  while (size > 0) {
+    ssize_t res = pread(fd, dst, size, offset);
+    if (res < 0 && errno == EINTR) {
+      continue;
+    }
+    if (res <= 0) {
+      return false;
+    }
+    dst += res;
+    size -= res;
+    offset += res;
+  }
+  return true;
+}
+
+/**
+ * Path of the cache entry of a file.
+ */
+static std::string getEntryPath(const std::string &cache_dir, const CacheKey &key) {
+  return cache_dir + "/" + std::to_string(key.device) + "-" + std::to_string(key.inode) + ".hpix";
+}
+
+int32_t getCacheKey(const std::string &video_file_path, bool hash_content, CacheKey &key) {
+  int32_t fd = open(video_file_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st{};
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+    close(fd);
+    return -1;
+  }
+  key = {};
+  key.device = st.st_dev;
+  key.inode = st.st_ino;
+  key.size = st.st_size;
+  key.mtime_sec = st.st_mtim.tv_sec;
+  key.mtime_nsec = st.st_mtim.tv_nsec;
+  if (hash_content) {
+    size_t head_size = std::min<size_t>(key.size, HASH_SIZE);
+    size_t tail_size = std::min<size_t>(key.size - head_size, HASH_SIZE);
+    std::unique_ptr<uint8_t[]> buf(new uint8_t[HASH_SIZE]);
+    uint64_t hash = 0xcbf29ce484222325;
+    if (!preadFully(fd, buf.get(), head_size, 0)) {
+      close(fd);
+      return -1;
+    }
+    hash = hashBytes(hash, buf.get(), head_size);
+    if (!preadFully(fd, buf.get(), tail_size, key.size - tail_size)) {
+      close(fd);
+      return -1;
+    }
+    key.content_hash = hashBytes(hash, buf.get(), tail_size);
+  }
+  close(fd);
+  return 0;
+}
+
+int32_t loadCachedIndex(const std::string &cache_dir, const CacheKey &key, std::vector<uint64_t> &index) {
+  StageTimer timer(STAGE_CACHE);
+  std::string entry_path = getEntryPath(cache_dir, key);
+  int32_t fd = open(entry_path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  struct stat st{};
+  CacheHeader header{};
+  if (fstat(fd, &st) < 0 || static_cast<size_t>(st.st_size) < sizeof(CacheHeader)
+      || (st.st_size - sizeof(CacheHeader)) % sizeof(uint64_t) != 0
+      || !preadFully(fd, &header, sizeof(header), 0) || memcmp(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) != 0
+      || header.version != CACHE_VERSION || !(header.key == key)) {
+    close(fd);
+    return -1;
+  }
+  index.resize((st.st_size - sizeof(CacheHeader)) / sizeof(uint64_t));
+  bool read_ok = preadFully(fd, index.data(), index.size() * sizeof(uint64_t), sizeof(CacheHeader));
+  timer.addBytes(st.st_size);
+  close(fd);
+  IndexReader reader;
+  if (!read_ok
+      || reader.setData(reinterpret_cast<const uint8_t *>(index.data()), index.size() * sizeof(uint64_t)) < 0) {
+    cerr << "Ignoring corrupt cache entry " << entry_path << "\n";
+    index.clear();
+    return -1;
+  }
+  if (isTraceEnabled(TRACE_INFO)) {
+    cout << "Using cached index " << entry_path << "\n";
+  }
+  return 0;
+}
+
+int32_t storeCachedIndex(const std::string &cache_dir, const CacheKey &key, const std::vector<uint64_t> &index) {
+  StageTimer timer(STAGE_CACHE);
+  CacheHeader header{};
+  memcpy(header.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+  header.version = CACHE_VERSION;
+  header.key = key;
+  timer.addBytes(sizeof(header) + index.size() * sizeof(uint64_t));
+  return writeFileAtomically(getEntryPath(cache_dir, key),
+                             {{&header, sizeof(header)}, {index.data(), index.size() * sizeof(uint64_t)}});
+}
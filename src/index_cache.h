@@ -0,0 +1,50 @@
+#ifndef INDEX_CACHE_H_
+#define INDEX_CACHE_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/**
+ * Identity of a video file. A cached index is only used if all fields match, so a file that is replaced, truncated or
+ * touched is parsed again.
+ */
+struct CacheKey {
+  uint64_t device;
+  uint64_t inode;
+  uint64_t size;
+  int64_t mtime_sec;
+  int64_t mtime_nsec;
+  /// Hash of the first and last MiB of the file, 0 if content hashing is disabled.
+  uint64_t content_hash;
+};
+
+/**
+ * Determines the identity of a video file.
+ * @param video_file_path Path to the video file.
+ * @param hash_content If true, the first and last MiB of the file are hashed as well. This catches files that are
+ * rewritten in place without changing their size and mtime, at the cost of reading 2 MiB.
+ * @param key Key that receives the identity.
+ * @return 0 on success. -1 if the video is not a regular file, e.g., a pipe, or could not be read.
+ */
+int32_t getCacheKey(const std::string &video_file_path, bool hash_content, CacheKey &key);
+/**
+ * Loads the binary index of a video from the cache directory. There is one entry per device and inode, so an outdated
+ * entry is overwritten by the next storeCachedIndex() for the same file.
+ * @param cache_dir Cache directory.
+ * @param key Identity of the video.
+ * @param index Receives the index without weights, see buildIndex().
+ * @return 0 on a hit. -1 if there is no valid entry for the key.
+ */
+int32_t loadCachedIndex(const std::string &cache_dir, const CacheKey &key, std::vector<uint64_t> &index);
+/**
+ * Stores the binary index of a video in the cache directory. The entry is written to a temporary file and renamed, so
+ * concurrent readers never see a partial entry.
+ * @param cache_dir Cache directory. It has to exist.
+ * @param key Identity of the video.
+ * @param index Index without weights.
+ * @return 0 on success. -1 if the entry could not be written.
+ */
+int32_t storeCachedIndex(const std::string &cache_dir, const CacheKey &key, const std::vector<uint64_t> &index);
+
+#endif //INDEX_CACHE_H_
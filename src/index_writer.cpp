@@ -0,0 +1,177 @@
+#include "index_writer.h"
+#include <algorithm>
+#include <cstring>
+#include "Frame.h"
+#include "helper_functions.h"
+#include "Stats.h"
+
+/**
+ * Returns a table of an index that is stored in 64 bit words.
+ * @param index The index.
+ * @param offset Offset of the table in bytes.
+ */
+template<class T>
+static T *getTable(std::vector<uint64_t> &index, uint64_t offset) {
+  return reinterpret_cast<T *>(reinterpret_cast<uint8_t *>(index.data()) + offset);
+}
+
+static bool isFrame(char slice_type) {
+  return slice_type == 'I' || slice_type == 'P' || slice_type == 'B';
+}
+
+std::vector<uint64_t> buildIndex(const ParserContext &ctx, size_t first_box, size_t first_nal_unit) {
+  StageTimer timer(STAGE_BUILD_INDEX);
+  IndexHeader header{};
+  memcpy(header.magic, INDEX_MAGIC, sizeof(INDEX_MAGIC));
+  header.version = INDEX_VERSION;
+  // The first sidx box indexes the segments, every following one starts a segment.
+  std::vector<size_t> segment_starts{0};
+  size_t video_end = 0;
+  auto boxes_begin = ctx.mp4_boxes.begin() + first_box;
+  NALIndex::const_iterator nal_units_begin(&ctx.nal_units, first_nal_unit);
+  for (auto mp4_box_it = boxes_begin; mp4_box_it != ctx.mp4_boxes.end(); mp4_box_it++) {
+    const MP4Box &mp4_box = *mp4_box_it;
+    if (mp4_box.type == fourCC("sidx")) {
+      if (header.flags & INDEX_FLAG_SIDX_SEGMENTS) {
+        segment_starts.push_back(mp4_box.location_relative);
+      }
+      header.flags |= INDEX_FLAG_SIDX_SEGMENTS;
+    }
+    video_end = std::max(video_end, mp4_box.location_relative + mp4_box.size);
+  }
+  for (auto nal_unit_it = nal_units_begin; nal_unit_it != ctx.nal_units.end(); nal_unit_it++) {
+    NALUnit nal_unit = *nal_unit_it;
+    header.frame_count += isFrame(nal_unit.slice_type);
+    video_end = std::max(video_end, nal_unit.location_relative + nal_unit.size);
+  }
+  header.video_size = ctx.input_size == SIZE_MAX ? video_end : ctx.input_size;
+  header.box_count = ctx.mp4_boxes.size() - first_box;
+  header.segment_count = segment_starts.size();
+  header.nal_unit_count = ctx.nal_units.size() - first_nal_unit;
+  header.boxes_offset = sizeof(IndexHeader);
+  header.segments_offset = header.boxes_offset + header.box_count * sizeof(IndexBox);
+  header.frames_offset = header.segments_offset + header.segment_count * sizeof(IndexSegment);
+  header.nal_units_offset = header.frames_offset + header.frame_count * sizeof(IndexFrame);
+  // All records are multiples of 8 bytes, so the tables stay aligned.
+  std::vector<uint64_t> index((header.nal_units_offset + header.nal_unit_count * sizeof(IndexNALUnit)) / 8);
+  *getTable<IndexHeader>(index, 0) = header;
+
+  auto *boxes = getTable<IndexBox>(index, header.boxes_offset);
+  for (auto mp4_box_it = boxes_begin; mp4_box_it != ctx.mp4_boxes.end(); mp4_box_it++) {
+    const MP4Box &mp4_box = *mp4_box_it;
+    *boxes++ = {mp4_box.location_relative, mp4_box.size, mp4_box.type, mp4_box.header_size};
+  }
+
+  auto *segments = getTable<IndexSegment>(index, header.segments_offset);
+  for (size_t i = 0; i < segment_starts.size(); i++) {
+    segments[i].start = segment_starts[i];
+    segments[i].end = i + 1 < segment_starts.size() ? segment_starts[i + 1] : header.video_size;
+  }
+  auto *frames = getTable<IndexFrame>(index, header.frames_offset);
+  auto *nal_units = getTable<IndexNALUnit>(index, header.nal_units_offset);
+  uint32_t frame_count = 0;
+  uint32_t nal_unit_count = 0;
+  size_t segment = 0;
+  for (auto nal_unit_it = nal_units_begin; nal_unit_it != ctx.nal_units.end(); nal_unit_it++) {
+    NALUnit nal_unit = *nal_unit_it;
+    while (segment + 1 < segment_starts.size() && nal_unit.location_relative >= segment_starts[segment + 1]) {
+      segment++;
+      segments[segment].first_frame = frame_count;
+      segments[segment].first_nal_unit = nal_unit_count;
+    }
+    IndexNALUnit &record = nal_units[nal_unit_count++];
+    record.location = nal_unit.location_relative;
+    record.size = static_cast<uint32_t>(std::min<size_t>(nal_unit.size, UINT32_MAX));
+    record.slice_header_size = static_cast<uint16_t>(nal_unit.slice_header_size);
+    record.header = static_cast<uint8_t>((nal_unit.prefix_size == 3 ? 0x80 : 0) | (nal_unit.nal_ref_idc & 0x3) << 5
+                                             | (nal_unit.nal_unit_type & 0x1f));
+    record.slice_type = nal_unit.raw_slice_type;
+    segments[segment].nal_unit_count++;
+    if (isFrame(nal_unit.slice_type)) {
+      IndexFrame &frame = frames[frame_count++];
+      frame.location = nal_unit.location_relative;
+      frame.size = record.size;
+      frame.type = nal_unit.slice_type;
+      frame.nal_unit_type = nal_unit.nal_unit_type;
+      frame.header_size = static_cast<uint16_t>(std::min<size_t>(
+          nal_unit.prefix_size + 1 + nal_unit.slice_header_size, UINT16_MAX));
+      segments[segment].frame_count++;
+    }
+  }
+  for (segment++; segment < segment_starts.size(); segment++) {
+    segments[segment].first_frame = frame_count;
+    segments[segment].first_nal_unit = nal_unit_count;
+  }
+  return index;
+}
+
+void assignIndexWeights(std::vector<uint64_t> &index, const WeightFile &weights) {
+  StageTimer timer(STAGE_ASSIGN_WEIGHTS);
+  auto *header = getTable<IndexHeader>(index, 0);
+  auto *segments = getTable<IndexSegment>(index, header->segments_offset);
+  auto *frames = getTable<IndexFrame>(index, header->frames_offset);
+  std::vector<Frame> frame_list;
+  for (uint64_t i = 0; i < header->segment_count; i++) {
+    if (segments[i].frame_count == 0) {
+      continue;
+    }
+    IndexFrame *segment_frames = frames + segments[i].first_frame;
+    frame_list.clear();
+    for (uint32_t j = 0; j < segments[i].frame_count; j++) {
+      const IndexFrame &frame = segment_frames[j];
+      frame_list.emplace_back(static_cast<char>(frame.type), frame.location, frame.location + frame.size - 1);
+    }
+    // The frames stay in file order.
+    assignWeights(weights, i + 1, frame_list, false);
+    for (uint32_t j = 0; j < segments[i].frame_count; j++) {
+      segment_frames[j].weight = frame_list[j].getWeight();
+    }
+  }
+  header->flags |= INDEX_FLAG_WEIGHTS;
+}
+
+int32_t writeIndex(const std::vector<uint64_t> &index, const std::string &index_file_path) {
+  StageTimer timer(STAGE_INDEX_FILE);
+  timer.addBytes(index.size() * sizeof(uint64_t));
+  return writeFileAtomically(index_file_path, {{index.data(), index.size() * sizeof(uint64_t)}});
+}
+
+void restoreContext(const IndexReader &index, ParserContext &ctx) {
+  ctx.input_size = index.getHeader().video_size;
+  ctx.mp4_boxes.reserve(index.getBoxCount());
+  for (size_t i = 0; i < index.getBoxCount(); i++) {
+    ctx.mp4_boxes.push_back(toMP4Box(index.getBoxes()[i]));
+  }
+  ctx.nal_units.reserve(index.getNALUnitCount());
+  for (size_t i = 0; i < index.getNALUnitCount(); i++) {
+    NALUnit nal_unit = toNALUnit(index.getNALUnits()[i]);
+    ctx.nal_units.push_back(nal_unit);
+    if (nal_unit.nal_unit_type == 1 || nal_unit.nal_unit_type == 5) {
+      ctx.nal_units.setSliceHeader(nal_unit.raw_slice_type, nal_unit.slice_header_size);
+    }
+  }
+}
+
+MP4Box toMP4Box(const IndexBox &box) {
+  MP4Box ret{};
+  ret.location_relative = box.location;
+  ret.size = box.size;
+  ret.type = box.type;
+  ret.header_size = static_cast<uint8_t>(box.header_size);
+  return ret;
+}
+
+NALUnit toNALUnit(const IndexNALUnit &nal_unit) {
+  NALUnit ret{};
+  ret.location_relative = nal_unit.location;
+  ret.size = nal_unit.size;
+  ret.prefix_size = nal_unit.header & 0x80 ? 3 : 4;
+  ret.nal_ref_idc = nal_unit.header >> 5 & 0x3;
+  ret.nal_unit_type = nal_unit.header & 0x1f;
+  ret.slice_header_size = nal_unit.slice_header_size;
+  if (ret.nal_unit_type == 1 || ret.nal_unit_type == 5) {
+    ret.raw_slice_type = nal_unit.slice_type;
+    ret.slice_type = getSliceTypeChar(nal_unit.slice_type);
+  }
+  return ret;
+}
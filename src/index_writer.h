@@ -0,0 +1,47 @@
+#ifndef INDEX_WRITER_H_
+#define INDEX_WRITER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "BinaryIndex.h"
+#include "header_parse.h"
+#include "structs.h"
+#include "WeightFile.h"
+
+/**
+ * Builds the binary index (see BinaryIndex.h) of a parsed video. The frames have no weights yet, see
+ * assignIndexWeights().
+ * @param ctx Context of the parsed video.
+ * @param first_box Index of the first MP4 box in the index. Together with first_nal_unit, this restricts the index to
+ * the end of the video, e.g., the part of a growing file that was parsed last.
+ * @param first_nal_unit Index of the first NAL unit in the index.
+ * @return The index, stored in 64 bit words, so it is aligned for IndexReader::setData().
+ */
+std::vector<uint64_t> buildIndex(const ParserContext &ctx, size_t first_box = 0, size_t first_nal_unit = 0);
+/**
+ * Sets the weights of the frames of every segment that has frames.
+ * @param index Index from buildIndex().
+ * @param weights Weights of all segments.
+ */
+void assignIndexWeights(std::vector<uint64_t> &index, const WeightFile &weights);
+/**
+ * Writes an index into a file. The file is replaced atomically, so a reader that maps it never sees a partial index.
+ * @param index Index from buildIndex().
+ * @param index_file_path Path to the index file.
+ * @return 0 on success. -1 if the file could not be written.
+ */
+int32_t writeIndex(const std::vector<uint64_t> &index, const std::string &index_file_path);
+/**
+ * Fills a context with the MP4 boxes and NAL units of an index, so the outputs can be written without parsing the
+ * video again. The parameter sets, slice headers and samples are not part of the index.
+ * @param index Valid index.
+ * @param ctx Empty context.
+ */
+void restoreContext(const IndexReader &index, ParserContext &ctx);
+/// Unpacks a record of the box table.
+MP4Box toMP4Box(const IndexBox &box);
+/// Unpacks a record of the NAL unit table.
+NALUnit toNALUnit(const IndexNALUnit &nal_unit);
+
+#endif //INDEX_WRITER_H_
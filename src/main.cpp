@@ -0,0 +1,176 @@
+/**
+ * This program analyses a given MP4/H.264 video and outputs the frame and header information into a csv file. More
+ * detailed output in stdout can be selected with --trace=info|debug. Per-stage counters and timings can be written as
+ * JSON with --stats=json.
+ */
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <libxml/parser.h>
+#include "defines.h"
+#include "header_parse.h"
+#include "helper_functions.h"
+#include "Stats.h"
+#include "WeightFile.h"
+
+using std::cout;
+using std::cerr;
+using std::endl;
+
+int32_t parseTraceLevel(const std::string &value) {
+  if (value == "none") {
+    trace_level = TRACE_NONE;
+  } else if (value == "info") {
+    trace_level = TRACE_INFO;
+  } else if (value == "debug") {
+    trace_level = TRACE_DEBUG;
+  } else {
+    cerr << "Unknown trace level: " << value << "\n";
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Parses the value of --stats=, i.e., json for stdout or json:<file>.
+ * @param value The value.
+ * @param stats_file_path Set to the JSON file, empty for stdout.
+ * @return 0 on success, -1 if the format is unknown.
+ */
+int32_t parseStatsFormat(const std::string &value, std::string &stats_file_path) {
+  std::string json_format = "json";
+  if (value == json_format) {
+    stats_file_path.clear();
+  } else if (!value.compare(0, json_format.size() + 1, json_format + ":") && value.size() > json_format.size() + 1) {
+    stats_file_path = value.substr(json_format.size() + 1);
+  } else {
+    cerr << "Unknown stats format: " << value << "\n";
+    return -1;
+  }
+  stats_enabled = true;
+  return 0;
+}
+
+int main(int32_t argc, char **argv) {
+  std::string batch_parameter = "--batch";
+  std::string mpd_all_parameter = "--mpd-all";
+  std::string weights_parameter = "--weights";
+  std::string top_frames_parameter = "--top-frames";
+  std::string pack_weights_parameter = "--pack-weights";
+  std::string threads_parameter = "-j";
+  std::string trace_parameter = "--trace=";
+  std::string stats_parameter = "--stats=";
+  std::string stats_file_path;
+  // The trace level and the stats are global, so they are accepted anywhere on the command line and removed before the
+  // remaining arguments are parsed.
+  std::vector<std::string> args;
+  for (int32_t i = 1; i < argc; i++) {
+    std::string next_arg = argv[i];
+    if (!next_arg.compare(0, trace_parameter.size(), trace_parameter)) {
+      if (parseTraceLevel(next_arg.substr(trace_parameter.size())) < 0) {
+        return 1;
+      }
+    } else if (!next_arg.compare(0, stats_parameter.size(), stats_parameter)) {
+      if (parseStatsFormat(next_arg.substr(stats_parameter.size()), stats_file_path) < 0) {
+        return 1;
+      }
+    } else {
+      args.push_back(next_arg);
+    }
+  }
+  if (args.empty()) {
+    cout << "usage: " << argv[0]
+         << " <video> [--csv <csv-file>] [--mpd <MPD-File>] [--weights <weight-file-prefix>] [--info <info-data-prefix>] [--ranges] [--samples <samples-file>] [--params <params-prefix>] [--index <index-file>] [--cache <cache-dir> [--cache-hash]] [--follow] [--stream|--sparse] [-j <threads>]\n"
+         << "       " << argv[0] << " --batch <list-file> [-j <threads>]\n"
+         << "       " << argv[0] << " --mpd-all <MPD-File> [--weights <weight-file-prefix>] [--top-frames <k>] [-j <threads>]\n"
+         << "       " << argv[0] << " --pack-weights <weight-file-prefix> <weight-file>\n"
+         << "options: [--trace=none|info|debug] [--stats=json[:<file>]]"
+         << endl;
+    return 1;
+  }
+  int32_t res;
+  if (!batch_parameter.compare(args[0])) {
+    std::string list_file_path;
+    uint32_t num_threads = std::thread::hardware_concurrency();
+    uint64_t number;
+    for (size_t i = 0; i < args.size(); i++) {
+      const std::string &next_arg = args[i];
+      if (!next_arg.compare(0, next_arg.size(), batch_parameter) && i + 1 < args.size()) {
+        list_file_path = args[i + 1];
+        i++;
+      } else if (!next_arg.compare(0, next_arg.size(), threads_parameter) && i + 1 < args.size()) {
+        if (parseNumber(args[i + 1], 1, UINT32_MAX, number) < 0) {
+          cerr << "Invalid number of threads: " << args[i + 1] << "\n";
+          return 1;
+        }
+        num_threads = static_cast<uint32_t>(number);
+        i++;
+      } else {
+        cerr << "Unknown parameter or missing argument: " << next_arg << "\n";
+        return 1;
+      }
+    }
+    res = runBatch(list_file_path, num_threads);
+  } else if (!mpd_all_parameter.compare(args[0])) {
+    std::string mpd_file_path;
+    std::string weight_file_prefix;
+    size_t top_frames = 0;
+    uint32_t num_threads = std::thread::hardware_concurrency();
+    uint64_t number;
+    for (size_t i = 0; i < args.size(); i++) {
+      const std::string &next_arg = args[i];
+      if (!next_arg.compare(0, next_arg.size(), mpd_all_parameter) && i + 1 < args.size()) {
+        mpd_file_path = args[i + 1];
+        i++;
+      } else if (!next_arg.compare(0, next_arg.size(), weights_parameter) && i + 1 < args.size()) {
+        weight_file_prefix = args[i + 1];
+        i++;
+      } else if (!next_arg.compare(0, next_arg.size(), top_frames_parameter) && i + 1 < args.size()) {
+        if (parseNumber(args[i + 1], 0, SIZE_MAX, number) < 0) {
+          cerr << "Invalid number of top frames: " << args[i + 1] << "\n";
+          return 1;
+        }
+        top_frames = number;
+        i++;
+      } else if (!next_arg.compare(0, next_arg.size(), threads_parameter) && i + 1 < args.size()) {
+        if (parseNumber(args[i + 1], 1, UINT32_MAX, number) < 0) {
+          cerr << "Invalid number of threads: " << args[i + 1] << "\n";
+          return 1;
+        }
+        num_threads = static_cast<uint32_t>(number);
+        i++;
+      } else {
+        cerr << "Unknown parameter or missing argument: " << next_arg << "\n";
+        return 1;
+      }
+    }
+    res = runMPDAll(mpd_file_path, weight_file_prefix, top_frames, num_threads);
+  } else if (!pack_weights_parameter.compare(args[0])) {
+    if (args.size() != 3) {
+      cerr << "usage: " << argv[0] << " --pack-weights <weight-file-prefix> <weight-file>\n";
+      return 1;
+    }
+    WeightFile weights;
+    res = weights.open(args[1]);
+    if (res == 0) {
+      if (isTraceEnabled(TRACE_INFO)) {
+        cout << "Packing weights of " << weights.getSegmentCount() << " segments\n";
+      }
+      res = weights.pack(args[2]);
+    }
+  } else {
+    ParseJob job;
+    // A single video uses all cores for its fragments unless -j says otherwise. Batch jobs are parallel already.
+    job.num_threads = std::thread::hardware_concurrency();
+    if (parseArguments(args, job) < 0) {
+      return 1;
+    }
+    res = runJob(job);
+  }
+  if (isStatsEnabled() && writeStats(stats_file_path) < 0) {
+    res = -1;
+  }
+  xmlCleanupParser();
+  return res < 0 ? 1 : 0;
+}
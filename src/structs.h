@@ -4,23 +4,71 @@
 #include <cstdint>
 #include <string>
 #include <vector>
+#include "Arena.h"
 
 /**
- * MP4 box header is always 8 bytes:
+ * Returns the integer representation of a MP4 box type, e.g., fourCC("mdat"), as it is stored in the box header.
+ * @param name Four character name of the box.
+ * @return Box type.
+ */
+constexpr uint32_t fourCC(const char (&name)[5]) {
+  return static_cast<uint32_t>(static_cast<uint8_t>(name[0])) << 24
+      | static_cast<uint32_t>(static_cast<uint8_t>(name[1])) << 16
+      | static_cast<uint32_t>(static_cast<uint8_t>(name[2])) << 8 | static_cast<uint8_t>(name[3]);
+}
+
+/**
+ * MP4 box header is 8 bytes:
  * size: 4 bytes
  * name: 4 bytes
- * To get to the data of an mdat box calculate location + 8
+ * If size is 1, a 64 bit largesize follows the name and the header is 16 bytes. If size is 0, the box extends to the end
+ * of the file.
+ * To get to the data of an mdat box calculate location + header_size
  * location + size points to the next MP4 box.
  */
 typedef struct {
-  /// The location of the MP4 box in the current memory mapping.
-  const uint8_t *location;
   /// The location of the MP4 box relative to the beginning of the bytestream.
   size_t location_relative;
   size_t size;
-  std::string name;
+  /// Box type, e.g., fourCC("mdat"). See getNameString() for the name.
+  uint32_t type;
+  /// Size of the box header, i.e., 8 or 16 with largesize.
+  uint8_t header_size;
 } MP4Box;
 
+/**
+ * A track as described by the tkhd, mdhd and hdlr boxes in moov, including the fragment defaults from trex.
+ */
+typedef struct {
+  uint32_t track_id;
+  /// Time units per second of the decode and composition times.
+  uint32_t timescale;
+  /// FourCC of the handler, e.g., 'vide' or 'soun'.
+  uint32_t handler_type;
+  uint32_t default_sample_duration;
+  uint32_t default_sample_size;
+  uint32_t default_sample_flags;
+  /// Decode time of the next sample, used if a track fragment has no tfdt box.
+  uint64_t next_decode_time;
+} MP4Track;
+
+/**
+ * A sample, i.e., an access unit, as described by the sample tables (stbl) in moov or by the track fragment runs (trun)
+ * in moof. With these, the byte ranges of the frames and the sync samples are known without touching mdat.
+ */
+typedef struct {
+  uint32_t track_id;
+  /// The location of the sample relative to the beginning of the bytestream.
+  size_t location_relative;
+  uint32_t size;
+  /// Decode time in the timescale of the track.
+  uint64_t decode_time;
+  /// Difference between composition time and decode time.
+  int32_t composition_offset;
+  /// True for sync samples, i.e., IDR frames in H.264 tracks.
+  bool sync;
+} MP4Sample;
+
 /** NAL unit header is always 5 bytes:
  * size:               4 bytes
  * forbidden_zero_bit: 1 bit
@@ -30,28 +78,99 @@ typedef struct {
  * The size written in the bytestream is EXCLUDING itself, but we include it to make the semantics the same as with
  * the MP4 headers. So location + size points to the end of the NAL unit, i.e., the beginning of the next NAL unit or
  * the next MP4 box.
+ * In an Annex B byte stream, the size field is replaced by a 3 or 4 byte start code (prefix_size) and the size is the
+ * distance to the next start code, i.e., it includes trailing zero bytes. The rbsp is at location + prefix_size + 1.
  */
 typedef struct {
   // IdrPicFlag = ( ( nal_unit_type = = 5 ) ? 1 : 0 )
-  /// The location of the NAL unit in the current memory mapping.
-  const uint8_t *location;
   /// The location of the NAL unit relative to the beginning of the bytestream.
   size_t location_relative;
   size_t size;
+  /// Size of the length field or the start code in front of the NAL unit header.
+  uint8_t prefix_size;
   uint8_t nal_ref_idc;
   uint8_t nal_unit_type;
   /// If this NAL unit contains a slice, this value indicates the size of the slice header.
   size_t slice_header_size;
   /// If this NAL unit contains a slice, this value indicates the slice type.
   char slice_type;
+  /// If this NAL unit contains a slice, this is the slice_type syntax element, see getSliceTypeString().
+  uint8_t raw_slice_type;
 } NALUnit;
 
+/**
+ * Scaling matrix of an SPS or PPS, i.e., the scaling_list() syntax structures (7.3.2.1.1.1 in the standard). Lists 0 to
+ * 5 are the 4x4 lists, lists 6 to 11 the 8x8 lists.
+ */
+typedef struct {
+  /// seq_scaling_list_present_flag or pic_scaling_list_present_flag.
+  bool scaling_list_present_flag[12];
+  /// UseDefaultScalingMatrix4x4Flag and UseDefaultScalingMatrix8x8Flag.
+  bool use_default_scaling_matrix_flag[12];
+  /// The lists in the order in which they are coded, i.e., in zig-zag scan. Only set for present lists that do not use
+  /// the default matrix.
+  uint8_t scaling_list_4x4[6][16];
+  uint8_t scaling_list_8x8[6][64];
+} ScalingMatrix;
+
+/**
+ * HRD parameters struct (E.1.2 in the standard).
+ */
+typedef struct {
+  uint32_t cpb_cnt_minus1;
+  uint8_t bit_rate_scale;
+  uint8_t cpb_size_scale;
+  std::vector<uint32_t> bit_rate_value_minus1;
+  std::vector<uint32_t> cpb_size_value_minus1;
+  std::vector<bool> cbr_flag;
+  uint8_t initial_cpb_removal_delay_length_minus1;
+  uint8_t cpb_removal_delay_length_minus1;
+  uint8_t dpb_output_delay_length_minus1;
+  uint8_t time_offset_length;
+} HRDParameters;
+
+/**
+ * VUI parameters struct (E.1.1 in the standard).
+ */
+typedef struct {
+  bool aspect_ratio_info_present_flag;
+  uint8_t aspect_ratio_idc;
+  uint16_t sar_width;
+  uint16_t sar_height;
+  bool overscan_info_present_flag;
+  bool overscan_appropriate_flag;
+  bool video_signal_type_present_flag;
+  uint8_t video_format;
+  bool video_full_range_flag;
+  bool colour_description_present_flag;
+  uint8_t colour_primaries;
+  uint8_t transfer_characteristics;
+  uint8_t matrix_coefficients;
+  bool chroma_loc_info_present_flag;
+  uint32_t chroma_sample_loc_type_top_field;
+  uint32_t chroma_sample_loc_type_bottom_field;
+  bool timing_info_present_flag;
+  uint32_t num_units_in_tick;
+  uint32_t time_scale;
+  bool fixed_frame_rate_flag;
+  bool nal_hrd_parameters_present_flag;
+  HRDParameters nal_hrd_parameters;
+  bool vcl_hrd_parameters_present_flag;
+  HRDParameters vcl_hrd_parameters;
+  bool low_delay_hrd_flag;
+  bool pic_struct_present_flag;
+  bool bitstream_restriction_flag;
+  bool motion_vectors_over_pic_boundaries_flag;
+  uint32_t max_bytes_per_pic_denom;
+  uint32_t max_bits_per_mb_denom;
+  uint32_t log2_max_mv_length_horizontal;
+  uint32_t log2_max_mv_length_vertical;
+  uint32_t max_num_reorder_frames;
+  uint32_t max_dec_frame_buffering;
+} VUIParameters;
+
 /**
  * Sequence Parameter Set struct.
- * Missing fields:
- *   seq_scaling_list_present_flag and scaling_list() (7.3.2.1.1.1 in the standard)
- *   Everything in the else if( pic_order_cnt_type == 1 ) branch: delta_pic_order_always_zero_flag, ...
- *   vui_parameters() (E.1.1)
  */
 typedef struct {
   uint8_t profile_idc;
@@ -69,11 +188,10 @@ typedef struct {
   uint32_t bit_depth_chroma_minus8;
   bool qpprime_y_zero_transform_bypass_flag;
   bool seq_scaling_matrix_present_flag;
-  // TODO seq_scaling_list_present_flag, ...
+  ScalingMatrix seq_scaling_matrix;
   uint32_t log2_max_frame_num_minus4;
   uint32_t pic_order_cnt_type;
   uint32_t log2_max_pic_order_cnt_lsb_minus4;
-  // TODO delta_pic_order_always_zero_flag, ...
   bool delta_pic_order_always_zero_flag;
   int32_t offset_for_non_ref_pic;
   int32_t offset_for_top_to_bottom_field;
@@ -92,13 +210,11 @@ typedef struct {
   uint32_t frame_crop_top_offset;
   uint32_t frame_crop_bottom_offset;
   bool vui_parameters_present_flag;
-  // TODO vui_parameters()
+  VUIParameters vui_parameters;
 } SPS;
 
 /**
  * Picture Parameter Set struct.
- * Missing fields:
- *   Everything in the if( more_rbsp_data() ) { branch: transform_8x8_mode_flag, scaling_list(), ...
  */
 typedef struct {
   uint32_t pic_parameter_set_id;
@@ -124,9 +240,31 @@ typedef struct {
   bool deblocking_filter_control_present_flag;
   bool constrained_intra_pred_flag;
   bool redundant_pic_cnt_present_flag;
-  // TODO if( more_rbsp_data( ) )
+  // ==== if( more_rbsp_data( ) ) ====
+  bool transform_8x8_mode_flag;
+  bool pic_scaling_matrix_present_flag;
+  ScalingMatrix pic_scaling_matrix;
+  /// Equal to chroma_qp_index_offset if not present.
+  int32_t second_chroma_qp_index_offset;
+  // =================================
 } PPS;
 
+/**
+ * slice_type modulo 5 as specified in ISO/IEC 14496-10:2014 Table 7-6. Values 5..9 only add that all slices of the
+ * picture have the same type.
+ */
+enum SliceType : uint8_t {
+  SLICE_P,
+  SLICE_B,
+  SLICE_I,
+  SLICE_SP,
+  SLICE_SI
+};
+
+/**
+ * Slice header struct. Only kept if ParserContext::keep_slice_headers is set, in which case the header and its
+ * pred_weight_table() live in the arena of the context.
+ */
 typedef struct {
   uint8_t *first_mb_in_slice;
   uint32_t slice_type;
@@ -157,17 +295,17 @@ typedef struct {
   uint32_t luma_log2_weight_denom;
   uint32_t chroma_log2_weight_denom;
   bool luma_weight_l0_flag;
-  std::vector<int32_t> luma_weight_l0;
-  std::vector<int32_t> luma_offset_l0;
+  ArenaVector<int32_t> luma_weight_l0;
+  ArenaVector<int32_t> luma_offset_l0;
   bool chroma_weight_l0_flag;
-  std::vector<std::pair<int32_t, int32_t>> chroma_weight_l0;
-  std::vector<std::pair<int32_t, int32_t>> chroma_offset_l0;
+  ArenaVector<std::pair<int32_t, int32_t>> chroma_weight_l0;
+  ArenaVector<std::pair<int32_t, int32_t>> chroma_offset_l0;
   bool luma_weight_l1_flag;
-  std::vector<int32_t> luma_weight_l1;
-  std::vector<int32_t> luma_offset_l1;
+  ArenaVector<int32_t> luma_weight_l1;
+  ArenaVector<int32_t> luma_offset_l1;
   bool chroma_weight_l1_flag;
-  std::vector<std::pair<int32_t, int32_t>> chroma_weight_l1;
-  std::vector<std::pair<int32_t, int32_t>> chroma_offset_l1;
+  ArenaVector<std::pair<int32_t, int32_t>> chroma_weight_l1;
+  ArenaVector<std::pair<int32_t, int32_t>> chroma_offset_l1;
   // ==============================
   // ==== dec_ref_pic_marking() ====
   bool no_output_of_prior_pics_flag;
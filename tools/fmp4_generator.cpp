@@ -0,0 +1,867 @@
+/**
+ * Generates a synthetic fragmented MP4 file with a single H.264 video track and a matching MPD, for benchmarks and
+ * scaling tests that need large inputs with controlled properties instead of real content.
+ *
+ * The file starts with an initialization segment (ftyp and moov with an avc3 sample entry), followed by one media
+ * segment per GOP (sidx, moof and mdat). Every segment starts with an SPS, a PPS and an IDR picture. The SPS, PPS and
+ * slice headers are syntactically valid High profile headers (1280x720, CABAC, POC type 0 or 1), the slice data is
+ * random filler. The I, P and B pictures average 3, 1 and 1/2 times the frame size, each with up to 25% jitter.
+ *
+ * Options:
+ *   --mpd <file>           MPD to write, defaults to the output with the extension .mpd
+ *   --segments <n>         Number of segments (default 10)
+ *   --size <MB>            Write segments until the file has at least this size, instead of --segments
+ *   --gop <frames>         Frames per segment (default 48)
+ *   --b-frames <n>         Consecutive B pictures between two P pictures (default 2)
+ *   --slices <n>           Slices per picture (default 1)
+ *   --frame-size <bytes>   Average size of a P picture (default 20000)
+ *   --weighted-pred        Enables weighted prediction, i.e., a pred_weight_table() in every P and B slice header
+ *   --mmco                 Adds memory management control operations to the headers of the non-IDR reference slices
+ *   --escape-rate <r>      Number of emulation prevention bytes per 1000 bytes of slice data (default 0)
+ *   --vui                  Adds vui_parameters() with aspect ratio, colour description, timing, NAL HRD and bitstream
+ *                          restriction to the SPS
+ *   --scaling-matrix       Adds scaling lists to the SPS and PPS and enables the 8x8 transform in the PPS
+ *   --poc-type-1           Uses pic_order_cnt_type 1 instead of 0, so the slice headers have no POC fields
+ *   --fps <n>              Frame rate (default 25)
+ *   --seed <n>             Seed of the random generator (default 1)
+ *
+ * Note that flushMPDFile() locates the BaseURL by the part of the file name up to "dash", so the output should be named
+ * like video_dash.mp4 if the MPD is used with --mpd.
+ *
+ * usage: fmp4_generator <output.mp4> [options]
+ */
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+#include "BitWriter.h"
+#include "OutputBuffer.h"
+
+using std::cout;
+using std::cerr;
+
+static const uint32_t TIMESCALE = 90000;
+static const uint32_t TRACK_ID = 1;
+static const uint32_t WIDTH = 1280;
+static const uint32_t HEIGHT = 720;
+static const uint32_t PROFILE_IDC = 100;
+static const uint32_t LEVEL_IDC = 40;
+/// log2_max_frame_num_minus4 + 4 and log2_max_pic_order_cnt_lsb_minus4 + 4 of the SPS.
+static const uint32_t LOG2_MAX_FRAME_NUM = 8;
+static const uint32_t LOG2_MAX_POC_LSB = 8;
+static const uint32_t MAX_NUM_REF_FRAMES = 4;
+/// Slice type values 5 to 9 signal that all slices of the picture have the same type.
+static const uint32_t SLICE_TYPE_P = 5;
+static const uint32_t SLICE_TYPE_B = 6;
+static const uint32_t SLICE_TYPE_I = 7;
+/// Sample flags of the trun box: sample_depends_on and sample_is_non_sync_sample.
+static const uint32_t SYNC_SAMPLE_FLAGS = 0x02000000;
+static const uint32_t NON_SYNC_SAMPLE_FLAGS = 0x01010000;
+/// Size of the pool of random bytes that the slice data is copied from.
+static const size_t FILLER_POOL_SIZE = 1 << 20;
+
+/**
+ * Properties of the generated video.
+ */
+typedef struct {
+  std::string output_path;
+  std::string mpd_path;
+  uint32_t segments = 10;
+  /// Minimum size of the file in bytes. 0 if the number of segments is given.
+  uint64_t min_size = 0;
+  uint32_t gop_length = 48;
+  uint32_t b_frames = 2;
+  uint32_t slices = 1;
+  uint32_t frame_size = 20000;
+  bool weighted_pred = false;
+  bool mmco = false;
+  bool vui = false;
+  bool scaling_matrix = false;
+  bool poc_type_1 = false;
+  double escape_rate = 0;
+  uint32_t fps = 25;
+  uint32_t seed = 1;
+} GeneratorOptions;
+
+/**
+ * A picture of a GOP, in decoding order.
+ */
+typedef struct {
+  /// Position of the picture in output order.
+  uint32_t display_index;
+  uint32_t slice_type;
+  /// 0 for non-reference pictures.
+  uint8_t nal_ref_idc;
+} Picture;
+
+/**
+ * Random data that is needed while the segments are written.
+ */
+typedef struct {
+  std::mt19937 random;
+  /// Nonzero random bytes, so the slice data contains no start code or escape unless one is inserted on purpose.
+  std::vector<uint8_t> filler_pool;
+} GeneratorState;
+
+/**
+ * Orders the pictures of a GOP for decoding: an IDR picture, then every P picture followed by the B pictures that
+ * precede it in output order. The last picture of the GOP is always a P picture, so the GOP is closed.
+ */
+static std::vector<Picture> planGOP(uint32_t gop_length, uint32_t b_frames) {
+  std::vector<Picture> pictures;
+  pictures.push_back({0, SLICE_TYPE_I, 3});
+  uint32_t previous_anchor = 0;
+  while (previous_anchor + 1 < gop_length) {
+    uint32_t anchor = std::min(previous_anchor + b_frames + 1, gop_length - 1);
+    pictures.push_back({anchor, SLICE_TYPE_P, 2});
+    for (uint32_t i = previous_anchor + 1; i < anchor; i++) {
+      pictures.push_back({i, SLICE_TYPE_B, 0});
+    }
+    previous_anchor = anchor;
+  }
+  return pictures;
+}
+
+/**
+ * Writes the size of a box or another big-endian field into already written data.
+ */
+static void patchUInt32(std::vector<uint8_t> &data, size_t offset, uint32_t value) {
+  for (uint32_t i = 0; i < 4; i++) {
+    data[offset + i] = static_cast<uint8_t>(value >> (24 - 8 * i));
+  }
+}
+
+/**
+ * Writes a box header with a placeholder size.
+ * @return Offset of the box, for endBox().
+ */
+static size_t beginBox(BitWriter &writer, const char *type) {
+  size_t offset = writer.getOffset();
+  writer.writeUnsignedInt32(0);
+  writer.writeBytes(reinterpret_cast<const uint8_t *>(type), 4);
+  return offset;
+}
+
+static size_t beginFullBox(BitWriter &writer, const char *type, uint8_t version, uint32_t flags) {
+  size_t offset = beginBox(writer, type);
+  writer.writeByte(version);
+  writer.writeNBits(24, flags);
+  return offset;
+}
+
+static void endBox(std::vector<uint8_t> &data, size_t offset) {
+  patchUInt32(data, offset, static_cast<uint32_t>(data.size() - offset));
+}
+
+/**
+ * Appends a NAL unit with a 4 byte length field.
+ * @param data Data that the NAL unit is appended to.
+ * @param nal_ref_idc nal_ref_idc of the header.
+ * @param nal_unit_type nal_unit_type of the header.
+ * @param write_rbsp Writes the RBSP to the given writer, which inserts the emulation prevention bytes.
+ * @return Size of the NAL unit, including the length field.
+ */
+template<class WriteRBSP>
+static size_t appendNALUnit(std::vector<uint8_t> &data,
+                            uint8_t nal_ref_idc,
+                            uint8_t nal_unit_type,
+                            WriteRBSP write_rbsp) {
+  size_t offset = data.size();
+  BitWriter writer(data);
+  writer.writeUnsignedInt32(0);
+  writer.writeByte(static_cast<uint8_t>(nal_ref_idc << 5 | nal_unit_type));
+  BitWriter rbsp_writer(data, true);
+  write_rbsp(rbsp_writer);
+  patchUInt32(data, offset, static_cast<uint32_t>(data.size() - offset - 4));
+  return data.size() - offset;
+}
+
+/**
+ * Writes a scaling list with the given delta_scale values, see ISO/IEC 14496-10:2014 Chapter 7.3.2.1.1.1. The list
+ * ends early if a delta makes nextScale 0, i.e., if the remaining entries repeat the last one.
+ */
+static void writeScalingList(BitWriter &writer, const std::vector<int32_t> &delta_scales) {
+  for (int32_t delta_scale : delta_scales) {
+    writer.encodeSignedExpGolomb(delta_scale);
+  }
+}
+
+/**
+ * Writes the scaling_list_present_flag loop of an SPS or PPS: an explicit list that stops after 3 entries, a list that
+ * uses the default matrix and lists that are not present.
+ */
+static void writeScalingMatrix(BitWriter &writer, uint32_t num_lists) {
+  for (uint32_t i = 0; i < num_lists; i++) {
+    bool present = i == 0 || i == 6;
+    writer.writeBit(present);  // scaling_list_present_flag
+    if (i == 0) {
+      // 16, 18, 20, then 20 until the end.
+      writeScalingList(writer, {8, 2, 2, -20});
+    } else if (i == 6) {
+      // UseDefaultScalingMatrix8x8Flag
+      writeScalingList(writer, {-8});
+    }
+  }
+}
+
+/**
+ * Writes hrd_parameters() with a single CPB specification.
+ */
+static void writeHRDParameters(BitWriter &writer, const GeneratorOptions &options) {
+  // Bit rate in units of 2^(6 + bit_rate_scale) and CPB size of one second in units of 2^(4 + cpb_size_scale).
+  uint64_t bit_rate = static_cast<uint64_t>(options.frame_size) * options.fps * 8;
+  auto value = static_cast<uint32_t>(std::max<uint64_t>(bit_rate >> 10, 1));
+  writer.encodeUnsignedExpGolomb(0);  // cpb_cnt_minus1
+  writer.writeNBits(4, 4);  // bit_rate_scale
+  writer.writeNBits(4, 6);  // cpb_size_scale
+  writer.encodeUnsignedExpGolomb(value - 1);  // bit_rate_value_minus1
+  writer.encodeUnsignedExpGolomb(value - 1);  // cpb_size_value_minus1
+  writer.writeBit(0);  // cbr_flag
+  writer.writeNBits(5, 23);  // initial_cpb_removal_delay_length_minus1
+  writer.writeNBits(5, 23);  // cpb_removal_delay_length_minus1
+  writer.writeNBits(5, 23);  // dpb_output_delay_length_minus1
+  writer.writeNBits(5, 24);  // time_offset_length
+}
+
+static void writeVUIParameters(BitWriter &writer, const GeneratorOptions &options) {
+  writer.writeBit(1);  // aspect_ratio_info_present_flag
+  writer.writeByte(1);  // aspect_ratio_idc, 1:1
+  writer.writeBit(0);  // overscan_info_present_flag
+  writer.writeBit(1);  // video_signal_type_present_flag
+  writer.writeNBits(3, 5);  // video_format, unspecified
+  writer.writeBit(0);  // video_full_range_flag
+  writer.writeBit(1);  // colour_description_present_flag
+  writer.writeByte(1);  // colour_primaries, BT.709
+  writer.writeByte(1);  // transfer_characteristics
+  writer.writeByte(1);  // matrix_coefficients
+  writer.writeBit(0);  // chroma_loc_info_present_flag
+  writer.writeBit(1);  // timing_info_present_flag
+  writer.writeUnsignedInt32(1);  // num_units_in_tick
+  writer.writeUnsignedInt32(2 * options.fps);  // time_scale
+  writer.writeBit(1);  // fixed_frame_rate_flag
+  writer.writeBit(1);  // nal_hrd_parameters_present_flag
+  writeHRDParameters(writer, options);
+  writer.writeBit(0);  // vcl_hrd_parameters_present_flag
+  writer.writeBit(0);  // low_delay_hrd_flag
+  writer.writeBit(0);  // pic_struct_present_flag
+  writer.writeBit(1);  // bitstream_restriction_flag
+  writer.writeBit(1);  // motion_vectors_over_pic_boundaries_flag
+  writer.encodeUnsignedExpGolomb(2);  // max_bytes_per_pic_denom
+  writer.encodeUnsignedExpGolomb(1);  // max_bits_per_mb_denom
+  writer.encodeUnsignedExpGolomb(16);  // log2_max_mv_length_horizontal
+  writer.encodeUnsignedExpGolomb(16);  // log2_max_mv_length_vertical
+  writer.encodeUnsignedExpGolomb(options.b_frames > 0 ? 1 : 0);  // max_num_reorder_frames
+  writer.encodeUnsignedExpGolomb(MAX_NUM_REF_FRAMES);  // max_dec_frame_buffering
+}
+
+static void writeSPS(BitWriter &writer, const GeneratorOptions &options) {
+  writer.writeByte(PROFILE_IDC);
+  // constraint_set0_flag to constraint_set5_flag and reserved_zero_2bits
+  writer.writeByte(0);
+  writer.writeByte(LEVEL_IDC);
+  writer.encodeUnsignedExpGolomb(0);  // seq_parameter_set_id
+  writer.encodeUnsignedExpGolomb(1);  // chroma_format_idc
+  writer.encodeUnsignedExpGolomb(0);  // bit_depth_luma_minus8
+  writer.encodeUnsignedExpGolomb(0);  // bit_depth_chroma_minus8
+  writer.writeBit(0);  // qpprime_y_zero_transform_bypass_flag
+  writer.writeBit(options.scaling_matrix);  // seq_scaling_matrix_present_flag
+  if (options.scaling_matrix) {
+    writeScalingMatrix(writer, 8);
+  }
+  writer.encodeUnsignedExpGolomb(LOG2_MAX_FRAME_NUM - 4);
+  if (options.poc_type_1) {
+    writer.encodeUnsignedExpGolomb(1);  // pic_order_cnt_type
+    writer.writeBit(1);  // delta_pic_order_always_zero_flag
+    writer.encodeSignedExpGolomb(-2);  // offset_for_non_ref_pic
+    writer.encodeSignedExpGolomb(1);  // offset_for_top_to_bottom_field
+    writer.encodeUnsignedExpGolomb(2);  // num_ref_frames_in_pic_order_cnt_cycle
+    writer.encodeSignedExpGolomb(2);  // offset_for_ref_frame
+    writer.encodeSignedExpGolomb(4);
+  } else {
+    writer.encodeUnsignedExpGolomb(0);  // pic_order_cnt_type
+    writer.encodeUnsignedExpGolomb(LOG2_MAX_POC_LSB - 4);
+  }
+  writer.encodeUnsignedExpGolomb(MAX_NUM_REF_FRAMES);
+  writer.writeBit(0);  // gaps_in_frame_num_value_allowed_flag
+  writer.encodeUnsignedExpGolomb(WIDTH / 16 - 1);
+  writer.encodeUnsignedExpGolomb(HEIGHT / 16 - 1);
+  writer.writeBit(1);  // frame_mbs_only_flag
+  writer.writeBit(1);  // direct_8x8_inference_flag
+  writer.writeBit(0);  // frame_cropping_flag
+  writer.writeBit(options.vui);  // vui_parameters_present_flag
+  if (options.vui) {
+    writeVUIParameters(writer, options);
+  }
+  writer.writeTrailingBits();
+}
+
+static void writePPS(BitWriter &writer, const GeneratorOptions &options) {
+  writer.encodeUnsignedExpGolomb(0);  // pic_parameter_set_id
+  writer.encodeUnsignedExpGolomb(0);  // seq_parameter_set_id
+  writer.writeBit(1);  // entropy_coding_mode_flag
+  writer.writeBit(0);  // bottom_field_pic_order_in_frame_present_flag
+  writer.encodeUnsignedExpGolomb(0);  // num_slice_groups_minus1
+  writer.encodeUnsignedExpGolomb(0);  // num_ref_idx_l0_default_active_minus1
+  writer.encodeUnsignedExpGolomb(0);  // num_ref_idx_l1_default_active_minus1
+  writer.writeBit(options.weighted_pred);  // weighted_pred_flag
+  writer.writeNBits(2, options.weighted_pred ? 1 : 0);  // weighted_bipred_idc
+  writer.encodeSignedExpGolomb(0);  // pic_init_qp_minus26
+  writer.encodeSignedExpGolomb(0);  // pic_init_qs_minus26
+  writer.encodeSignedExpGolomb(0);  // chroma_qp_index_offset
+  writer.writeBit(1);  // deblocking_filter_control_present_flag
+  writer.writeBit(0);  // constrained_intra_pred_flag
+  writer.writeBit(0);  // redundant_pic_cnt_present_flag
+  if (options.scaling_matrix) {
+    writer.writeBit(1);  // transform_8x8_mode_flag
+    writer.writeBit(1);  // pic_scaling_matrix_present_flag
+    writeScalingMatrix(writer, 8);
+    writer.encodeSignedExpGolomb(-1);  // second_chroma_qp_index_offset
+  }
+  writer.writeTrailingBits();
+}
+
+/**
+ * Writes the weights of one reference picture list of a pred_weight_table().
+ */
+static void writeWeights(BitWriter &writer, std::mt19937 &random, uint32_t num_ref_idx_active) {
+  for (uint32_t i = 0; i < num_ref_idx_active; i++) {
+    bool luma_weight_flag = random() % 2;
+    writer.writeBit(luma_weight_flag);
+    if (luma_weight_flag) {
+      writer.encodeSignedExpGolomb(static_cast<int32_t>(random() % 64) + 32);
+      writer.encodeSignedExpGolomb(static_cast<int32_t>(random() % 21) - 10);
+    }
+    bool chroma_weight_flag = random() % 2;
+    writer.writeBit(chroma_weight_flag);
+    if (chroma_weight_flag) {
+      for (uint32_t j = 0; j < 2; j++) {
+        writer.encodeSignedExpGolomb(static_cast<int32_t>(random() % 64) + 32);
+        writer.encodeSignedExpGolomb(static_cast<int32_t>(random() % 21) - 10);
+      }
+    }
+  }
+}
+
+/**
+ * Writes a slice header in the order of parseSliceHeader().
+ * @param writer RBSP writer.
+ * @param options Properties of the video.
+ * @param state Random generator.
+ * @param picture The picture that the slice belongs to.
+ * @param first_mb_in_slice Address of the first macroblock of the slice.
+ * @param frame_num frame_num of the picture.
+ * @param idr_pic_id Identifies the IDR picture.
+ * @param num_ref_frames Number of reference pictures that precede the picture in the GOP.
+ */
+static void writeSliceHeader(BitWriter &writer,
+                             const GeneratorOptions &options,
+                             GeneratorState &state,
+                             const Picture &picture,
+                             uint32_t first_mb_in_slice,
+                             uint32_t frame_num,
+                             uint32_t idr_pic_id,
+                             uint32_t num_ref_frames) {
+  bool idr = picture.slice_type == SLICE_TYPE_I;
+  writer.encodeUnsignedExpGolomb(first_mb_in_slice);
+  writer.encodeUnsignedExpGolomb(picture.slice_type);
+  writer.encodeUnsignedExpGolomb(0);  // pic_parameter_set_id
+  writer.writeNBits(LOG2_MAX_FRAME_NUM, frame_num);
+  if (idr) {
+    writer.encodeUnsignedExpGolomb(idr_pic_id);
+  }
+  if (!options.poc_type_1) {
+    writer.writeNBits(LOG2_MAX_POC_LSB, 2 * picture.display_index);
+  }
+  if (picture.slice_type == SLICE_TYPE_B) {
+    writer.writeBit(1);  // direct_spatial_mv_pred_flag
+  }
+  // Both P and B pictures predict from up to two pictures in list 0, B pictures from one in list 1.
+  uint32_t num_ref_idx_l0_active = std::min(num_ref_frames, 2u);
+  if (!idr) {
+    writer.writeBit(1);  // num_ref_idx_active_override_flag
+    writer.encodeUnsignedExpGolomb(num_ref_idx_l0_active - 1);
+    if (picture.slice_type == SLICE_TYPE_B) {
+      writer.encodeUnsignedExpGolomb(0);
+    }
+    writer.writeBit(0);  // ref_pic_list_modification_flag_l0
+    if (picture.slice_type == SLICE_TYPE_B) {
+      writer.writeBit(0);  // ref_pic_list_modification_flag_l1
+    }
+  }
+  if (options.weighted_pred && !idr) {
+    writer.encodeUnsignedExpGolomb(5);  // luma_log2_weight_denom
+    writer.encodeUnsignedExpGolomb(5);  // chroma_log2_weight_denom
+    writeWeights(writer, state.random, num_ref_idx_l0_active);
+    if (picture.slice_type == SLICE_TYPE_B) {
+      writeWeights(writer, state.random, 1);
+    }
+  }
+  if (picture.nal_ref_idc != 0) {
+    if (idr) {
+      writer.writeBit(0);  // no_output_of_prior_pics_flag
+      writer.writeBit(0);  // long_term_reference_flag
+    } else {
+      writer.writeBit(options.mmco);  // adaptive_ref_pic_marking_mode_flag
+      if (options.mmco) {
+        // Mark the oldest short-term reference picture as unused, then end the list.
+        writer.encodeUnsignedExpGolomb(1);
+        writer.encodeUnsignedExpGolomb(num_ref_frames - 1);
+        writer.encodeUnsignedExpGolomb(0);
+      }
+    }
+  }
+  if (!idr) {
+    writer.encodeUnsignedExpGolomb(state.random() % 3);  // cabac_init_idc
+  }
+  writer.encodeSignedExpGolomb(static_cast<int32_t>(state.random() % 9) - 4);  // slice_qp_delta
+  writer.encodeUnsignedExpGolomb(0);  // disable_deblocking_filter_idc
+  writer.encodeSignedExpGolomb(0);  // slice_alpha_c0_offset_div2
+  writer.encodeSignedExpGolomb(0);  // slice_beta_offset_div2
+}
+
+/**
+ * Writes the slice data: cabac_alignment_one_bit, random filler and the rbsp_slice_trailing_bits().
+ * @param writer RBSP writer.
+ * @param options Properties of the video.
+ * @param state Random generator and filler pool.
+ * @param size Number of filler bytes.
+ */
+static void writeSliceData(BitWriter &writer, const GeneratorOptions &options, GeneratorState &state, size_t size) {
+  writer.writeAlignmentBits(1);
+  // A 0x000000 to 0x000003 pattern in the RBSP needs an emulation prevention byte.
+  double escape_probability = options.escape_rate > 0 ? std::min(options.escape_rate / 1000, 1.0) : 1.0;
+  std::geometric_distribution<size_t> escape_distance(escape_probability);
+  size_t written = 0;
+  while (written < size) {
+    size_t length = std::min(size - written, FILLER_POOL_SIZE / 2);
+    if (options.escape_rate > 0) {
+      length = std::min(length, escape_distance(state.random));
+    }
+    size_t pool_offset = state.random() % (FILLER_POOL_SIZE - length);
+    writer.writeBytes(state.filler_pool.data() + pool_offset, length);
+    written += length;
+    if (options.escape_rate > 0 && written < size) {
+      const uint8_t escaped[] = {0x00, 0x00, static_cast<uint8_t>(state.random() % 4)};
+      writer.writeBytes(escaped, sizeof(escaped));
+      written += sizeof(escaped);
+    }
+  }
+  writer.writeTrailingBits();
+}
+
+/**
+ * Writes the ftyp and moov boxes.
+ */
+static void writeInitSegment(std::vector<uint8_t> &data, const GeneratorOptions &options) {
+  BitWriter writer(data);
+  size_t ftyp = beginBox(writer, "ftyp");
+  writer.writeBytes(reinterpret_cast<const uint8_t *>("iso6"), 4);
+  writer.writeUnsignedInt32(0);
+  writer.writeBytes(reinterpret_cast<const uint8_t *>("iso6dashavc1"), 12);
+  endBox(data, ftyp);
+
+  const uint32_t matrix[] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+  size_t moov = beginBox(writer, "moov");
+  size_t mvhd = beginFullBox(writer, "mvhd", 0, 0);
+  writer.writeUnsignedInt64(0);  // creation_time, modification_time
+  writer.writeUnsignedInt32(TIMESCALE);
+  writer.writeUnsignedInt32(0);  // duration
+  writer.writeUnsignedInt32(0x00010000);  // rate
+  writer.writeNBits(16, 0x0100);  // volume
+  writer.writeNBits(16, 0);
+  writer.writeUnsignedInt64(0);
+  for (uint32_t value : matrix) {
+    writer.writeUnsignedInt32(value);
+  }
+  for (uint32_t i = 0; i < 6; i++) {
+    writer.writeUnsignedInt32(0);  // pre_defined
+  }
+  writer.writeUnsignedInt32(TRACK_ID + 1);  // next_track_ID
+  endBox(data, mvhd);
+
+  size_t trak = beginBox(writer, "trak");
+  size_t tkhd = beginFullBox(writer, "tkhd", 0, 3);
+  writer.writeUnsignedInt64(0);  // creation_time, modification_time
+  writer.writeUnsignedInt32(TRACK_ID);
+  writer.writeUnsignedInt32(0);
+  writer.writeUnsignedInt32(0);  // duration
+  writer.writeUnsignedInt64(0);
+  writer.writeUnsignedInt32(0);  // layer, alternate_group
+  writer.writeUnsignedInt32(0);  // volume
+  for (uint32_t value : matrix) {
+    writer.writeUnsignedInt32(value);
+  }
+  writer.writeUnsignedInt32(WIDTH << 16);
+  writer.writeUnsignedInt32(HEIGHT << 16);
+  endBox(data, tkhd);
+  size_t mdia = beginBox(writer, "mdia");
+  size_t mdhd = beginFullBox(writer, "mdhd", 0, 0);
+  writer.writeUnsignedInt64(0);  // creation_time, modification_time
+  writer.writeUnsignedInt32(TIMESCALE);
+  writer.writeUnsignedInt32(0);  // duration
+  writer.writeNBits(16, 0x55C4);  // language "und"
+  writer.writeNBits(16, 0);
+  endBox(data, mdhd);
+  size_t hdlr = beginFullBox(writer, "hdlr", 0, 0);
+  writer.writeUnsignedInt32(0);
+  writer.writeBytes(reinterpret_cast<const uint8_t *>("vide"), 4);
+  for (uint32_t i = 0; i < 3; i++) {
+    writer.writeUnsignedInt32(0);
+  }
+  writer.writeBytes(reinterpret_cast<const uint8_t *>("VideoHandler"), 13);
+  endBox(data, hdlr);
+  size_t minf = beginBox(writer, "minf");
+  size_t vmhd = beginFullBox(writer, "vmhd", 0, 1);
+  writer.writeUnsignedInt64(0);  // graphicsmode, opcolor
+  endBox(data, vmhd);
+  size_t dinf = beginBox(writer, "dinf");
+  size_t dref = beginFullBox(writer, "dref", 0, 0);
+  writer.writeUnsignedInt32(1);
+  endBox(data, beginFullBox(writer, "url ", 0, 1));
+  endBox(data, dref);
+  endBox(data, dinf);
+
+  size_t stbl = beginBox(writer, "stbl");
+  size_t stsd = beginFullBox(writer, "stsd", 0, 0);
+  writer.writeUnsignedInt32(1);
+  // The parameter sets are repeated in every segment, so the sample entry is avc3.
+  size_t avc3 = beginBox(writer, "avc3");
+  writer.writeUnsignedInt32(0);
+  writer.writeNBits(16, 0);
+  writer.writeNBits(16, 1);  // data_reference_index
+  for (uint32_t i = 0; i < 4; i++) {
+    writer.writeUnsignedInt32(0);
+  }
+  writer.writeNBits(16, WIDTH);
+  writer.writeNBits(16, HEIGHT);
+  writer.writeUnsignedInt32(0x00480000);  // horizresolution
+  writer.writeUnsignedInt32(0x00480000);  // vertresolution
+  writer.writeUnsignedInt32(0);
+  writer.writeNBits(16, 1);  // frame_count
+  for (uint32_t i = 0; i < 8; i++) {
+    writer.writeUnsignedInt32(0);  // compressorname
+  }
+  writer.writeNBits(16, 0x0018);  // depth
+  writer.writeNBits(16, 0xFFFF);
+  std::vector<uint8_t> sps;
+  appendNALUnit(sps, 3, 7, [&options](BitWriter &rbsp_writer) { writeSPS(rbsp_writer, options); });
+  std::vector<uint8_t> pps;
+  appendNALUnit(pps, 3, 8, [&options](BitWriter &rbsp_writer) { writePPS(rbsp_writer, options); });
+  size_t avcc = beginBox(writer, "avcC");
+  writer.writeByte(1);  // configurationVersion
+  writer.writeByte(PROFILE_IDC);
+  writer.writeByte(0);
+  writer.writeByte(LEVEL_IDC);
+  writer.writeByte(0xFF);  // lengthSizeMinusOne = 3
+  writer.writeByte(0xE1);  // numOfSequenceParameterSets = 1
+  writer.writeNBits(16, static_cast<uint32_t>(sps.size() - 4));
+  writer.writeBytes(sps.data() + 4, sps.size() - 4);
+  writer.writeByte(1);  // numOfPictureParameterSets
+  writer.writeNBits(16, static_cast<uint32_t>(pps.size() - 4));
+  writer.writeBytes(pps.data() + 4, pps.size() - 4);
+  // chroma_format, bit_depth_luma_minus8, bit_depth_chroma_minus8 and numOfSequenceParameterSetExt of High profile.
+  writer.writeByte(0xFD);
+  writer.writeByte(0xF8);
+  writer.writeByte(0xF8);
+  writer.writeByte(0);
+  endBox(data, avcc);
+  endBox(data, avc3);
+  endBox(data, stsd);
+  for (const char *table : {"stts", "stsc", "stco"}) {
+    size_t box = beginFullBox(writer, table, 0, 0);
+    writer.writeUnsignedInt32(0);
+    endBox(data, box);
+  }
+  size_t stsz = beginFullBox(writer, "stsz", 0, 0);
+  writer.writeUnsignedInt64(0);  // sample_size, sample_count
+  endBox(data, stsz);
+  endBox(data, stbl);
+  endBox(data, minf);
+  endBox(data, mdia);
+  endBox(data, trak);
+
+  size_t mvex = beginBox(writer, "mvex");
+  size_t trex = beginFullBox(writer, "trex", 0, 0);
+  writer.writeUnsignedInt32(TRACK_ID);
+  writer.writeUnsignedInt32(1);  // default_sample_description_index
+  writer.writeUnsignedInt32(0);
+  writer.writeUnsignedInt32(0);
+  writer.writeUnsignedInt32(0);
+  endBox(data, trex);
+  endBox(data, mvex);
+  endBox(data, moov);
+}
+
+/**
+ * Writes a media segment: a sidx, a moof and an mdat box with one GOP.
+ * @param data Receives the segment. Cleared first.
+ * @param mdat Reused buffer for the mdat payload.
+ * @param options Properties of the video.
+ * @param state Random generator and filler pool.
+ * @param pictures The pictures of the GOP in decoding order.
+ * @param segment_no Number of the segment, starting at 0.
+ */
+static void writeSegment(std::vector<uint8_t> &data,
+                         std::vector<uint8_t> &mdat,
+                         const GeneratorOptions &options,
+                         GeneratorState &state,
+                         const std::vector<Picture> &pictures,
+                         uint32_t segment_no) {
+  const uint32_t sample_duration = TIMESCALE / options.fps;
+  const uint32_t mbs_per_slice = (WIDTH / 16) * (HEIGHT / 16) / options.slices;
+  std::vector<uint32_t> sample_sizes;
+  mdat.clear();
+  uint32_t frame_num = 0;
+  uint32_t num_ref_frames = 0;
+  std::uniform_real_distribution<double> jitter(0.75, 1.25);
+  for (const Picture &picture : pictures) {
+    size_t sample_size = 0;
+    bool idr = picture.slice_type == SLICE_TYPE_I;
+    if (idr) {
+      sample_size += appendNALUnit(mdat, 3, 7, [&options](BitWriter &writer) { writeSPS(writer, options); });
+      sample_size += appendNALUnit(mdat, 3, 8, [&options](BitWriter &writer) { writePPS(writer, options); });
+    }
+    double scale = idr ? 3 : picture.slice_type == SLICE_TYPE_P ? 1 : 0.5;
+    auto slice_size = static_cast<size_t>(options.frame_size * scale * jitter(state.random) / options.slices);
+    for (uint32_t slice = 0; slice < options.slices; slice++) {
+      sample_size += appendNALUnit(mdat, picture.nal_ref_idc, idr ? 5 : 1, [&](BitWriter &writer) {
+        writeSliceHeader(writer, options, state, picture, slice * mbs_per_slice, frame_num, segment_no % 65536,
+                         num_ref_frames);
+        writeSliceData(writer, options, state, slice_size);
+      });
+    }
+    sample_sizes.push_back(static_cast<uint32_t>(sample_size));
+    // frame_num counts the reference pictures, modulo MaxFrameNum.
+    if (picture.nal_ref_idc != 0) {
+      frame_num = (frame_num + 1) % (1 << LOG2_MAX_FRAME_NUM);
+      num_ref_frames = std::min(num_ref_frames + 1, MAX_NUM_REF_FRAMES);
+    }
+  }
+
+  data.clear();
+  BitWriter writer(data);
+  uint64_t decode_time = static_cast<uint64_t>(segment_no) * pictures.size() * sample_duration;
+  // B pictures are presented before the P picture that is decoded ahead of them, so the composition offsets are
+  // shifted by one frame to keep them positive.
+  uint32_t composition_shift = options.b_frames > 0 && pictures.size() > 2 ? 1 : 0;
+  size_t sidx = beginFullBox(writer, "sidx", 1, 0);
+  writer.writeUnsignedInt32(TRACK_ID);  // reference_ID
+  writer.writeUnsignedInt32(TIMESCALE);
+  writer.writeUnsignedInt64(decode_time + composition_shift * sample_duration);  // earliest_presentation_time
+  writer.writeUnsignedInt64(0);  // first_offset
+  writer.writeNBits(16, 0);
+  writer.writeNBits(16, 1);  // reference_count
+  size_t referenced_size_offset = writer.getOffset();
+  writer.writeUnsignedInt32(0);  // reference_type, referenced_size
+  writer.writeUnsignedInt32(static_cast<uint32_t>(pictures.size() * sample_duration));
+  writer.writeUnsignedInt32(0x90000000);  // starts_with_SAP, SAP_type 1
+  endBox(data, sidx);
+  size_t sidx_end = data.size();
+
+  size_t moof = beginBox(writer, "moof");
+  size_t mfhd = beginFullBox(writer, "mfhd", 0, 0);
+  writer.writeUnsignedInt32(segment_no + 1);
+  endBox(data, mfhd);
+  size_t traf = beginBox(writer, "traf");
+  // default-base-is-moof
+  size_t tfhd = beginFullBox(writer, "tfhd", 0, 0x020000);
+  writer.writeUnsignedInt32(TRACK_ID);
+  endBox(data, tfhd);
+  size_t tfdt = beginFullBox(writer, "tfdt", 1, 0);
+  writer.writeUnsignedInt64(decode_time);
+  endBox(data, tfdt);
+  // data_offset, sample_duration, sample_size, sample_flags and sample_composition_time_offset
+  size_t trun = beginFullBox(writer, "trun", 0, 0x000F01);
+  writer.writeUnsignedInt32(static_cast<uint32_t>(pictures.size()));
+  size_t data_offset_offset = writer.getOffset();
+  writer.writeUnsignedInt32(0);
+  for (size_t i = 0; i < pictures.size(); i++) {
+    writer.writeUnsignedInt32(sample_duration);
+    writer.writeUnsignedInt32(sample_sizes[i]);
+    writer.writeUnsignedInt32(i == 0 ? SYNC_SAMPLE_FLAGS : NON_SYNC_SAMPLE_FLAGS);
+    writer.writeUnsignedInt32((pictures[i].display_index + composition_shift - static_cast<uint32_t>(i))
+                                  * sample_duration);
+  }
+  endBox(data, trun);
+  endBox(data, traf);
+  endBox(data, moof);
+  patchUInt32(data, data_offset_offset, static_cast<uint32_t>(data.size() - moof + 8));
+  size_t mdat_box = beginBox(writer, "mdat");
+  data.insert(data.end(), mdat.begin(), mdat.end());
+  endBox(data, mdat_box);
+  patchUInt32(data, referenced_size_offset, static_cast<uint32_t>(data.size() - sidx_end));
+}
+
+/**
+ * Writes the MPD with one Representation whose SegmentList lists the segments of the file.
+ * @param options Properties of the video.
+ * @param init_size Size of the initialization segment.
+ * @param segment_ends End offsets (exclusive) of the segments.
+ * @return 0 on success. -1 if the MPD could not be written.
+ */
+static int32_t writeMPD(const GeneratorOptions &options, size_t init_size, const std::vector<uint64_t> &segment_ends) {
+  OutputBuffer mpd(1 << 16);
+  if (mpd.open(options.mpd_path) < 0) {
+    cerr << "could not open " << options.mpd_path << ": " << strerror(errno) << "\n";
+    return -1;
+  }
+  uint64_t duration_ms = static_cast<uint64_t>(segment_ends.size()) * options.gop_length * 1000 / options.fps;
+  uint64_t file_size = segment_ends.empty() ? init_size : segment_ends.back();
+  std::string base_url = options.output_path.substr(options.output_path.find_last_of('/') + 1);
+  char codec_suffix[8];
+  snprintf(codec_suffix, sizeof(codec_suffix), "%02X00%02X", PROFILE_IDC, LEVEL_IDC);
+  mpd.append("<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+             "<MPD xmlns=\"urn:mpeg:dash:schema:mpd:2011\" profiles=\"urn:mpeg:dash:profile:full:2011\" "
+             "type=\"static\" minBufferTime=\"PT2S\" mediaPresentationDuration=\"PT")
+      .appendUnsigned(duration_ms / 1000).append('.');
+  std::string milliseconds = std::to_string(duration_ms % 1000);
+  mpd.append(std::string(3 - milliseconds.size(), '0')).append(milliseconds).append("S\">\n  <Period>\n")
+      .append("    <AdaptationSet mimeType=\"video/mp4\" segmentAlignment=\"true\" startWithSAP=\"1\">\n")
+      .append("      <Representation id=\"1\" codecs=\"avc3.")
+      .append(codec_suffix)
+      .append("\" width=\"").appendUnsigned(WIDTH).append("\" height=\"").appendUnsigned(HEIGHT)
+      .append("\" frameRate=\"").appendUnsigned(options.fps).append("\" bandwidth=\"")
+      .appendUnsigned(duration_ms == 0 ? 0 : file_size * 8 * 1000 / duration_ms).append("\">\n")
+      .append("        <BaseURL>").append(base_url).append("</BaseURL>\n")
+      .append("        <SegmentList timescale=\"").appendUnsigned(TIMESCALE).append("\" duration=\"")
+      .appendUnsigned(static_cast<uint64_t>(options.gop_length) * (TIMESCALE / options.fps)).append("\">\n")
+      .append("          <Initialization range=\"0-").appendUnsigned(init_size - 1).append("\"/>\n");
+  uint64_t segment_start = init_size;
+  for (uint64_t segment_end : segment_ends) {
+    mpd.append("          <SegmentURL mediaRange=\"").appendUnsigned(segment_start).append('-')
+        .appendUnsigned(segment_end - 1).append("\"/>\n");
+    segment_start = segment_end;
+  }
+  mpd.append("        </SegmentList>\n      </Representation>\n    </AdaptationSet>\n  </Period>\n</MPD>\n");
+  if (mpd.close() < 0) {
+    cerr << "could not write " << options.mpd_path << ": " << strerror(errno) << "\n";
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Parses a positive number.
+ * @return 0 on success. -1 if the value is not a positive number.
+ */
+static int32_t parseNumber(const char *value, uint32_t &number) {
+  char *end;
+  unsigned long parsed = strtoul(value, &end, 10);
+  if (*value == '\0' || *end != '\0' || parsed == 0 || parsed > UINT32_MAX) {
+    return -1;
+  }
+  number = static_cast<uint32_t>(parsed);
+  return 0;
+}
+
+int main(int32_t argc, char **argv) {
+  if (argc < 2) {
+    cerr << "usage: fmp4_generator <output.mp4> [--mpd <file>] [--segments <n> | --size <MB>] [--gop <frames>] "
+            "[--b-frames <n>] [--slices <n>] [--frame-size <bytes>] [--weighted-pred] [--mmco] [--escape-rate <r>] "
+            "[--vui] [--scaling-matrix] [--poc-type-1] [--fps <n>] [--seed <n>]\n";
+    return 1;
+  }
+  GeneratorOptions options;
+  options.output_path = argv[1];
+  bool ok = true;
+  for (int32_t i = 2; i < argc; i++) {
+    std::string next_arg = argv[i];
+    bool has_value = i + 1 < argc;
+    if (next_arg == "--weighted-pred") {
+      options.weighted_pred = true;
+    } else if (next_arg == "--mmco") {
+      options.mmco = true;
+    } else if (next_arg == "--vui") {
+      options.vui = true;
+    } else if (next_arg == "--scaling-matrix") {
+      options.scaling_matrix = true;
+    } else if (next_arg == "--poc-type-1") {
+      options.poc_type_1 = true;
+    } else if (next_arg == "--mpd" && has_value) {
+      options.mpd_path = argv[++i];
+    } else if (next_arg == "--escape-rate" && has_value) {
+      options.escape_rate = strtod(argv[++i], nullptr);
+      ok = options.escape_rate >= 0;
+    } else if (next_arg == "--b-frames" && has_value) {
+      // 0 is valid here.
+      options.b_frames = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+    } else if (next_arg == "--seed" && has_value) {
+      options.seed = static_cast<uint32_t>(strtoul(argv[++i], nullptr, 10));
+    } else if (next_arg == "--size" && has_value) {
+      uint32_t size_mb;
+      ok = parseNumber(argv[++i], size_mb) == 0;
+      options.min_size = static_cast<uint64_t>(size_mb) << 20;
+    } else if (next_arg == "--segments" && has_value) {
+      ok = parseNumber(argv[++i], options.segments) == 0;
+    } else if (next_arg == "--gop" && has_value) {
+      ok = parseNumber(argv[++i], options.gop_length) == 0;
+    } else if (next_arg == "--slices" && has_value) {
+      ok = parseNumber(argv[++i], options.slices) == 0;
+    } else if (next_arg == "--frame-size" && has_value) {
+      ok = parseNumber(argv[++i], options.frame_size) == 0;
+    } else if (next_arg == "--fps" && has_value) {
+      ok = parseNumber(argv[++i], options.fps) == 0;
+    } else {
+      cerr << "Unknown parameter or missing argument: " << next_arg << "\n";
+      return 1;
+    }
+    if (!ok) {
+      cerr << "Invalid value for " << next_arg << ": " << argv[i] << "\n";
+      return 1;
+    }
+  }
+  if (options.slices > (WIDTH / 16) * (HEIGHT / 16) || options.fps > TIMESCALE) {
+    cerr << "Invalid options: at most " << (WIDTH / 16) * (HEIGHT / 16) << " slices and " << TIMESCALE << " fps\n";
+    return 1;
+  }
+  if (options.mpd_path.empty()) {
+    size_t dot = options.output_path.find_last_of('.');
+    size_t slash = options.output_path.find_last_of('/');
+    bool has_extension = dot != std::string::npos && (slash == std::string::npos || dot > slash);
+    size_t stem_end = has_extension ? dot : options.output_path.size();
+    options.mpd_path = options.output_path.substr(0, stem_end) + ".mpd";
+  }
+
+  GeneratorState state;
+  state.random.seed(options.seed);
+  state.filler_pool.resize(FILLER_POOL_SIZE);
+  for (uint8_t &byte : state.filler_pool) {
+    byte = static_cast<uint8_t>(state.random() % 255 + 1);
+  }
+  OutputBuffer output;
+  if (output.open(options.output_path) < 0) {
+    cerr << "could not open " << options.output_path << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+  std::vector<uint8_t> data;
+  writeInitSegment(data, options);
+  size_t init_size = data.size();
+  output.append(reinterpret_cast<const char *>(data.data()), data.size());
+  std::vector<Picture> pictures = planGOP(options.gop_length, options.b_frames);
+  std::vector<uint8_t> mdat;
+  std::vector<uint64_t> segment_ends;
+  uint64_t file_size = init_size;
+  for (uint32_t segment_no = 0;
+       options.min_size > 0 ? file_size < options.min_size : segment_no < options.segments;
+       segment_no++) {
+    writeSegment(data, mdat, options, state, pictures, segment_no);
+    output.append(reinterpret_cast<const char *>(data.data()), data.size());
+    file_size += data.size();
+    segment_ends.push_back(file_size);
+  }
+  if (output.close() < 0) {
+    cerr << "could not write " << options.output_path << ": " << strerror(errno) << "\n";
+    return 1;
+  }
+  if (writeMPD(options, init_size, segment_ends) < 0) {
+    return 1;
+  }
+  cout << "Wrote " << segment_ends.size() << " segments (" << file_size << " bytes) to " << options.output_path
+       << " and " << options.mpd_path << "\n";
+  return 0;
+}